@@ -0,0 +1,51 @@
+#!/usr/bin/ruby
+
+#
+# Measure the cost of the hash forms of arguments: objects allocated and
+# time per call, for String keys, Symbol keys (keyword arguments) and
+# plain positional arguments.
+#
+# Usage:
+#   ruby bench/hash_args.rb [iterations]
+#
+
+require 'benchmark'
+require 'imlib2'
+
+N = (ARGV.shift || 100_000).to_i
+
+im = Imlib2::Image.new 256, 256
+color = Imlib2::Color::RgbaColor.new 255, 0, 0, 255
+rect = { 'x' => 10, 'y' => 10, 'w' => 100, 'h' => 100 }
+src_rect = { 'x' => 0, 'y' => 0, 'w' => 16, 'h' => 16 }
+dst_rect = { 'x' => 8, 'y' => 8, 'w' => 32, 'h' => 32 }
+src = Imlib2::Image.new 16, 16
+
+CASES = {
+  'draw_rect (positional)'  => lambda { im.draw_rect 10, 10, 100, 100, color },
+  'draw_rect (string keys)' => lambda { im.draw_rect rect, color },
+  'draw_rect (keywords)'    => lambda { im.draw_rect x: 10, y: 10, w: 100, h: 100 },
+  'crop (string keys)'      => lambda { im.crop rect },
+  'blend_image! (string keys)' => lambda { im.blend_image! src, src_rect, dst_rect },
+  'RgbaColor (string keys)' => lambda {
+    Imlib2::Color::RgbaColor.new 'red' => 1, 'green' => 2,
+                                 'blue' => 3, 'alpha' => 4
+  },
+}
+
+def allocations(n)
+  GC.start
+  before = GC.stat(:total_allocated_objects)
+  n.times { yield }
+  GC.stat(:total_allocated_objects) - before
+end
+
+width = CASES.keys.map { |k| k.size }.max
+puts "#{N} iterations"
+puts "%-#{width}s  %12s  %12s" % ['', 'allocs/call', 'us/call']
+CASES.each do |name, fn|
+  fn.call
+  allocs = allocations(N) { fn.call }.to_f / N
+  time = Benchmark.realtime { N.times { fn.call } } * 1_000_000 / N
+  puts "%-#{width}s  %12.2f  %12.3f" % [name, allocs, time]
+end
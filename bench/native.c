@@ -0,0 +1,279 @@
+/************************************************************************/
+/* native.c - run the bench/run.rb cases against Imlib2 directly        */
+/*                                                                      */
+/* The difference between these numbers and those from bench/run.rb is */
+/* the cost of the binding (argument parsing, allocation, locking).     */
+/*                                                                      */
+/* Build and run (from the top of the source tree):                     */
+/*   cc -O2 -o bench/native bench/native.c \                            */
+/*      `pkg-config --cflags --libs imlib2`                             */
+/*   bench/native [-t seconds] [-f fontdir] [size ...]                  */
+/************************************************************************/
+#define X_DISPLAY_MISSING
+#include <Imlib2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+/* bench/run.rb case kinds */
+enum { KIND_IMAGE, KIND_CALL };
+
+typedef struct {
+  int n;
+  Imlib_Image im, src;
+  Imlib_Font font;
+  Imlib_Filter filter;
+  char png[64], jpg[64];
+  long i;
+} Bench;
+
+typedef struct {
+  const char *name;
+  int kind;
+  void (*func)(Bench *b);
+} Case;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* build an n x n test image (see test_image in bench/run.rb) */
+static Imlib_Image test_image(int n) {
+  Imlib_Image im = imlib_create_image(n, n);
+  Imlib_Color_Range range = imlib_create_color_range();
+  int i;
+
+  imlib_context_set_image(im);
+  imlib_context_set_color_range(range);
+  imlib_context_set_color(255, 0, 0, 255);
+  imlib_add_color_to_color_range(0);
+  imlib_context_set_color(0, 0, 255, 255);
+  imlib_add_color_to_color_range(1);
+  imlib_image_fill_color_range_rectangle(0, 0, n, n, 45.0);
+  imlib_free_color_range();
+
+  srand(42);
+  for (i = 0; i < n / 4; i++) {
+    imlib_context_set_color(rand() % 256, rand() % 256, rand() % 256, 255);
+    imlib_image_fill_rectangle(rand() % n, rand() % n,
+                               rand() % 32 + 1, rand() % 32 + 1);
+  }
+
+  return im;
+}
+
+static void load_png(Bench *b) {
+  imlib_context_set_image(imlib_load_image_immediately_without_cache(b->png));
+  imlib_free_image();
+}
+
+static void load_jpg(Bench *b) {
+  imlib_context_set_image(imlib_load_image_immediately_without_cache(b->jpg));
+  imlib_free_image();
+}
+
+static void crop_scaled(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_context_set_image(imlib_create_cropped_scaled_image(0, 0, b->n, b->n,
+                                                            b->n / 4,
+                                                            b->n / 4));
+  imlib_free_image();
+}
+
+static void blend_image(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_blend_image_onto_image(b->src, 0, 0, 0, b->n, b->n,
+                               0, 0, b->n, b->n);
+}
+
+static void draw_text(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_context_set_font(b->font);
+  imlib_context_set_color(255, 255, 255, 255);
+  imlib_text_draw(10, 10, "the blue crow flies at midnight");
+}
+
+static void query_pixel(Bench *b) {
+  Imlib_Color c;
+
+  b->i += 7;
+  imlib_context_set_image(b->im);
+  imlib_image_query_pixel(b->i % b->n, b->i % b->n, &c);
+}
+
+static void data(Bench *b) {
+  size_t len = (size_t) b->n * b->n * sizeof(DATA32);
+  void *copy = malloc(len);
+
+  imlib_context_set_image(b->im);
+  memcpy(copy, imlib_image_get_data_for_reading_only(), len);
+  free(copy);
+}
+
+static void blur(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_image_blur(2);
+}
+
+static void sharpen(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_image_sharpen(1);
+}
+
+static void filter_static(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_context_set_filter(b->filter);
+  imlib_image_filter();
+}
+
+static void filter_script(Bench *b) {
+  char script[128];
+
+  imlib_context_set_image(b->im);
+  snprintf(script, sizeof(script),
+           "tint(x=0, y=0, w=%d, h=%d, red=255, alpha=55);", b->n, b->n);
+  imlib_apply_filter(script, NULL);
+}
+
+static const Case cases[] = {
+  { "load_png",      KIND_IMAGE, load_png },
+  { "load_jpg",      KIND_IMAGE, load_jpg },
+  { "crop_scaled",   KIND_IMAGE, crop_scaled },
+  { "blend_image!",  KIND_IMAGE, blend_image },
+  { "draw_text",     KIND_CALL,  draw_text },
+  { "query_pixel",   KIND_CALL,  query_pixel },
+  { "data",          KIND_IMAGE, data },
+  { "blur!",         KIND_IMAGE, blur },
+  { "sharpen!",      KIND_IMAGE, sharpen },
+  { "filter_static", KIND_IMAGE, filter_static },
+  { "filter_script", KIND_IMAGE, filter_script },
+};
+
+/* iterations per second of c, after a short warmup */
+static double run(const Case *c, Bench *b, double secs) {
+  double start, stop, t;
+  long count = 0;
+
+  for (stop = now() + secs / 4; now() < stop; )
+    c->func(b);
+
+  start = now();
+  stop = start + secs;
+  do {
+    c->func(b);
+    count++;
+  } while ((t = now()) < stop);
+
+  return count / (t - start);
+}
+
+static void setup(Bench *b, int n, const char *dir) {
+  Imlib_Image im;
+  int x, y;
+
+  b->n = n;
+  b->i = 0;
+  b->im = test_image(n);
+  b->src = test_image(n);
+
+  snprintf(b->png, sizeof(b->png), "%s/%d.png", dir, n);
+  snprintf(b->jpg, sizeof(b->jpg), "%s/%d.jpg", dir, n);
+  im = test_image(n);
+  imlib_context_set_image(im);
+  imlib_image_set_format("png");
+  imlib_save_image(b->png);
+  imlib_image_set_format("jpg");
+  imlib_save_image(b->jpg);
+  imlib_free_image();
+
+  /* 3x3 box filter, as in bench/run.rb */
+  b->filter = imlib_create_filter(9);
+  imlib_context_set_filter(b->filter);
+  for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++)
+      imlib_filter_set(x, y, 1, 1, 1, 1);
+  imlib_filter_divisors(9, 9, 9, 9);
+}
+
+static void teardown(Bench *b) {
+  imlib_context_set_image(b->im);
+  imlib_free_image();
+  imlib_context_set_image(b->src);
+  imlib_free_image();
+  imlib_context_set_filter(b->filter);
+  imlib_free_filter();
+  unlink(b->png);
+  unlink(b->jpg);
+}
+
+int main(int argc, char *argv[]) {
+  static const int default_sizes[] = { 256, 1024, 2048 };
+  char dir[] = "/tmp/imlib2-bench-XXXXXX";
+  const char *font_dir = "examples/fonts";
+  double secs = 2.0;
+  Bench b;
+  int opt, i, j;
+
+  while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        secs = atof(optarg);
+        break;
+      case 'f':
+        font_dir = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t seconds] [-f fontdir] [size ...]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  imlib_add_path_to_font_path(font_dir);
+  b.font = imlib_load_font("yudit/24");
+  if (!b.font)
+    fprintf(stderr, "draw_text: skipped (couldn't load yudit/24)\n");
+
+  printf("# Imlib2, %.1fs per case\n", secs);
+  printf("%-22s %6s %12s %10s\n", "case", "size", "ips", "MP/s");
+
+  for (i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+    int num_sizes = optind < argc ? argc - optind : 3;
+
+    for (j = 0; j < num_sizes; j++) {
+      int n = optind < argc ? atoi(argv[optind + j]) : default_sizes[j];
+      double rate;
+
+      if (n <= 0 || (cases[i].func == draw_text && !b.font))
+        continue;
+
+      setup(&b, n, dir);
+      rate = run(&cases[i], &b, secs);
+      if (cases[i].kind == KIND_CALL)
+        printf("%-22s %6d %12.1f %10s\n", cases[i].name, n, rate, "-");
+      else
+        printf("%-22s %6d %12.1f %10.1f\n", cases[i].name, n, rate,
+               rate * n * n / 1e6);
+      fflush(stdout);
+      teardown(&b);
+    }
+  }
+
+  if (b.font) {
+    imlib_context_set_font(b.font);
+    imlib_free_font();
+  }
+  rmdir(dir);
+
+  return EXIT_SUCCESS;
+}
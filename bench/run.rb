@@ -0,0 +1,245 @@
+#!/usr/bin/ruby
+
+########################################################################
+# run.rb - benchmark the hot paths of the Imlib2 binding               #
+#                                                                      #
+# Measures Image.load, crop_scaled, blend_image!, draw_text,           #
+# query_pixel, data and the filter paths over a range of image sizes   #
+# and Imlib2.threads values.  Each case reports iterations per second, #
+# megapixels per second, objects allocated per iteration and the       #
+# process RSS once it's done.                                          #
+#                                                                      #
+# Uses benchmark-ips when it's installed, and a plain timing loop      #
+# otherwise.  bench/native.c runs the same cases against Imlib2        #
+# directly, which shows how much of each call is binding overhead.     #
+########################################################################
+
+require 'optparse'
+require 'stringio'
+require 'tmpdir'
+require 'imlib2'
+
+begin
+  require 'benchmark/ips'
+  HAVE_IPS = true
+rescue LoadError
+  HAVE_IPS = false
+end
+
+opts = {
+  :sizes   => [256, 1024, 2048],
+  :threads => [1, Imlib2.threads].uniq,
+  :only    => nil,
+  :time    => 2.0,
+  :warmup  => 0.5,
+  :gvl     => false,
+  :csv     => false,
+}
+
+OptionParser.new do |o|
+  o.banner = 'Usage: ruby bench/run.rb [options]'
+  o.on('-s', '--sizes LIST', Array, 'image sizes, in pixels (square)') { |v|
+    opts[:sizes] = v.map { |s| s.to_i }
+  }
+  o.on('-t', '--threads LIST', Array, 'values of Imlib2.threads') { |v|
+    opts[:threads] = v.map { |s| s.to_i }
+  }
+  o.on('-o', '--only LIST', Array, 'run only the named cases') { |v|
+    opts[:only] = v
+  }
+  o.on('-T', '--time SECONDS', Float, 'time per case') { |v| opts[:time] = v }
+  o.on('-w', '--warmup SECONDS', Float, 'warmup per case') { |v|
+    opts[:warmup] = v
+  }
+  o.on('-g', '--gvl', 'run with Imlib2.release_gvl = true') { opts[:gvl] = true }
+  o.on('-c', '--csv', 'print CSV instead of a table') { opts[:csv] = true }
+end.parse!
+
+Imlib2.release_gvl = true if opts[:gvl]
+
+FONT_DIR = File.join(File.dirname(__FILE__), '..', 'examples', 'fonts')
+
+# build an n x n test image with some detail in it, so the codecs have
+# real work to do
+def test_image(n)
+  im = Imlib2::Image.new n, n
+  im.fill_gradient Imlib2::Gradient.new([0, Imlib2::Color::RED],
+                                        [1, Imlib2::Color::BLUE]),
+                   [0, 0, n, n], 45.0
+  srand 42
+  (n / 4).times {
+    im.fill_rect [rand(n), rand(n), rand(32) + 1, rand(32) + 1],
+                 Imlib2::Color::RgbaColor.new(rand(256), rand(256),
+                                              rand(256), 255)
+  }
+  im
+end
+
+# Each case is [name, kind, setup], where setup takes the image size and
+# a scratch directory and returns a lambda to time.  The kind is :image
+# for operations on the whole image, :kernel for whole image operations
+# that use Imlib2.threads (run once per value of --threads), or :call for
+# per-call operations (no MP/s).
+CASES = [
+  ['load_png', :image, lambda { |n, dir|
+    path = File.join(dir, "#{n}.png")
+    test_image(n).save path unless File.exist? path
+    lambda { Imlib2::Image.load(path).delete! }
+  }],
+
+  ['load_jpg', :image, lambda { |n, dir|
+    path = File.join(dir, "#{n}.jpg")
+    test_image(n).save path unless File.exist? path
+    lambda { Imlib2::Image.load(path).delete! }
+  }],
+
+  ['crop_scaled', :image, lambda { |n, dir|
+    im = test_image n
+    lambda { im.crop_scaled(0, 0, n, n, n / 4, n / 4).delete! }
+  }],
+
+  ['crop_scaled_lanczos3', :kernel, lambda { |n, dir|
+    im = test_image n
+    lambda {
+      im.crop_scaled(0, 0, n, n, n / 4, n / 4, :filter => :lanczos3).delete!
+    }
+  }],
+
+  ['blend_image!', :image, lambda { |n, dir|
+    dst, src = test_image(n), test_image(n)
+    rect = [0, 0, n, n]
+    lambda { dst.blend_image! src, rect, rect }
+  }],
+
+  ['draw_text', :call, lambda { |n, dir|
+    Imlib2::Font.add_path FONT_DIR
+    font = Imlib2::Font.new 'yudit/24'
+    im = test_image n
+    lambda { im.draw_text font, 'the blue crow flies at midnight', 10, 10,
+                          Imlib2::Color::WHITE }
+  }],
+
+  ['query_pixel', :call, lambda { |n, dir|
+    im = test_image n
+    i = 0
+    lambda { im.query_pixel((i += 7) % n, i % n) }
+  }],
+
+  ['data', :image, lambda { |n, dir|
+    im = test_image n
+    lambda { im.data }
+  }],
+
+  ['blur!', :kernel, lambda { |n, dir|
+    im = test_image n
+    lambda { im.blur! 2 }
+  }],
+
+  ['sharpen!', :kernel, lambda { |n, dir|
+    im = test_image n
+    lambda { im.sharpen! 1 }
+  }],
+
+  ['filter_static', :kernel, lambda { |n, dir|
+    im, filter = test_image(n), Imlib2::Filter.new(9)
+    [-1, 0, 1].each { |y| [-1, 0, 1].each { |x|
+      filter.set x, y, Imlib2::Color::RgbaColor.new(1, 1, 1, 1)
+    } }
+    filter.divisors Imlib2::Color::RgbaColor.new(9, 9, 9, 9)
+    lambda { im.filter filter }
+  }],
+
+  ['filter_script', :image, lambda { |n, dir|
+    im = test_image n
+    tint = Imlib2::ScriptFilter.compile 'tint(x=0, y=0, w=[], h=[], red=255, alpha=55);'
+    lambda { im.filter tint, n, n }
+  }],
+]
+
+# resident and peak resident set size of this process, in MB
+def rss
+  if File.readable? '/proc/self/status'
+    s = File.read '/proc/self/status'
+    %w{VmRSS VmHWM}.map { |k| s[/^#{k}:\s+(\d+)/, 1].to_i / 1024.0 }
+  else
+    kb = `ps -o rss= -p #{Process.pid}`.to_i
+    [kb / 1024.0, kb / 1024.0]
+  end
+end
+
+# objects allocated per call
+def allocations(fn, count = 20)
+  GC.start
+  before = GC.stat(:total_allocated_objects)
+  count.times { fn.call }
+  (GC.stat(:total_allocated_objects) - before) / count.to_f
+end
+
+# iterations per second
+def ips(label, fn, time, warmup)
+  if HAVE_IPS
+    # benchmark-ips prints its own report; keep it out of ours
+    out, $stdout = $stdout, StringIO.new
+    begin
+      report = Benchmark.ips { |x|
+        x.config :time => time, :warmup => warmup
+        x.report(label) { fn.call }
+      }
+    ensure
+      $stdout = out
+    end
+    report.entries.first.ips
+  else
+    stop = Time.now + warmup
+    fn.call while Time.now < stop
+
+    count, start = 0, Time.now
+    stop = start + time
+    while (now = Time.now) < stop
+      fn.call
+      count += 1
+    end
+    count / (now - start)
+  end
+end
+
+cases = CASES
+cases = cases.select { |c| opts[:only].include? c[0] } if opts[:only]
+
+cols = %w{case size threads ips MP/s allocs rss_mb peak_mb}
+if opts[:csv]
+  puts cols.join(',')
+else
+  puts "# #{HAVE_IPS ? 'benchmark-ips' : 'timing loop'}, " <<
+       "#{opts[:time]}s per case, release_gvl = #{Imlib2.release_gvl?}"
+  puts '%-22s %6s %7s %12s %10s %8s %8s %8s' % cols
+end
+
+default_threads = Imlib2.threads
+Dir.mktmpdir('imlib2-bench') do |dir|
+  cases.each do |name, kind, setup|
+    opts[:sizes].each do |n|
+      begin
+        fn = setup.call n, dir
+      rescue => err
+        $stderr.puts "#{name}: skipped (#{err.message})"
+        break
+      end
+
+      (kind == :kernel ? opts[:threads] : [nil]).each do |t|
+        Imlib2.threads = t || default_threads
+        label = "#{name}/#{n}/#{t || '-'}"
+        rate = ips label, fn, opts[:time], opts[:warmup]
+        mps = kind == :call ? '-' : '%.1f' % (rate * n * n / 1_000_000.0)
+        row = [name, n, t || '-', rate, mps, allocations(fn), *rss]
+
+        if opts[:csv]
+          puts row.join(',')
+        else
+          puts '%-22s %6d %7s %12.1f %10s %8.1f %8.1f %8.1f' % row
+        end
+        $stdout.flush
+      end
+    end
+  end
+end
@@ -20,5 +20,42 @@ if have_library("Imlib2", "imlib_create_image")
          'Enabling workaround (see documentation for details).'
   end
 
+  # in-memory loading and saving
+  have_func('imlib_load_image_mem', 'Imlib2.h')
+  have_func('imlib_load_image_fd', 'Imlib2.h')
+  have_func('memfd_create', 'sys/mman.h')
+
+  # zero-copy pixel views (IO::Buffer)
+  if have_header('ruby/io/buffer.h')
+    have_func('rb_io_buffer_new', 'ruby/io/buffer.h')
+  end
+
+  # MemoryView export of pixel data
+  if have_header('ruby/memory_view.h')
+    have_func('rb_memory_view_register', 'ruby/memory_view.h')
+  end
+
+  # DCT-domain downscaling for Imlib2::Image.load_scaled (optional)
+  if have_header('jpeglib.h')
+    have_library('jpeg', 'jpeg_read_header', ['stdio.h', 'jpeglib.h'])
+  end
+
+  # worker threads for the parallel pixel kernels (blur, sharpen)
+  have_func('pthread_create', 'pthread.h')
+
+  # forked workers for Imlib2.batch_thumbnail
+  have_func('fork', 'unistd.h')
+
+  # timing for Imlib2.stats
+  have_func('clock_gettime', 'time.h')
+
+  # report pixel memory to the GC
+  have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
+  # release the GVL around heavy Imlib2 calls, if ruby supports it
+  if have_header('ruby/thread.h') && have_header('ruby/thread_native.h')
+    have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+  end
+
   create_makefile("imlib2")
 end
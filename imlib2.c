@@ -24,7 +24,41 @@
 /* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.               */
 /************************************************************************/
 
+/* for memfd_create() (must come before any system header) */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif /* !_GNU_SOURCE */
+
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif /* HAVE_CLOCK_GETTIME */
+#if defined(HAVE_MEMFD_CREATE) || defined(HAVE_FORK)
+#include <sys/mman.h>
+#include <errno.h>
+#endif /* HAVE_MEMFD_CREATE || HAVE_FORK */
+#ifdef HAVE_FORK
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#endif /* HAVE_FORK */
+#if defined(HAVE_FORK) || defined(HAVE_PTHREAD_CREATE)
+#include <signal.h>
+#endif /* HAVE_FORK || HAVE_PTHREAD_CREATE */
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_CREATE */
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <errno.h>
+#include <jpeglib.h>
+#endif /* HAVE_LIBJPEG */
 
 /* Note: X support is disabled in the Makefile; it currently does not
  * compile */
@@ -34,6 +68,16 @@
 
 #include <Imlib2.h>
 #include <ruby.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#include <ruby/thread_native.h>
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+#ifdef HAVE_RB_IO_BUFFER_NEW
+#include <ruby/io/buffer.h>
+#endif /* HAVE_RB_IO_BUFFER_NEW */
+#ifdef HAVE_RB_MEMORY_VIEW_REGISTER
+#include <ruby/memory_view.h>
+#endif /* HAVE_RB_MEMORY_VIEW_REGISTER */
 
 #define UNUSED(a) ((void) (a))
 #define VERSION "0.5.2"
@@ -56,7 +100,11 @@ static VALUE mImlib2,
              cContext,
              cGradient,
              cImage,
+             cImageInfo,
              cFilter,
+             cScalePlan,
+             cPipeline,
+             cScriptFilter,
              cFont,
              cColorMod,
              cPolygon,
@@ -84,6 +132,580 @@ static char draw_pixel_workaround = 1;
 #endif /* DISABLE_DRAW_PIXEL_WORKAROUND */
 
 
+/**********************/
+/* HASH ARGUMENT KEYS */
+/**********************/
+/* Keys for the hash forms of arguments (eg im.crop('x' => 10, ...)) and
+ * for keyword options.  They're created once in Init_imlib2(), so
+ * looking up an argument doesn't allocate a String per key per call.
+ * Hash arguments may use either String or Symbol keys, which means
+ * keyword arguments (im.crop(x: 10, y: 10, w: 20, h: 20)) work too. */
+enum {
+  KEY_X, KEY_Y, KEY_W, KEY_H,
+  KEY_DX, KEY_DY, KEY_DW, KEY_DH,
+  KEY_S, KEY_SRC, KEY_DST, KEY_CROP, KEY_PLAN,
+  KEY_TOP, KEY_BOTTOM, KEY_LEFT, KEY_RIGHT,
+  KEY_RED, KEY_GREEN, KEY_BLUE, KEY_ALPHA,
+  KEY_HUE, KEY_SATURATION, KEY_LIGHTNESS, KEY_VALUE,
+  KEY_CYAN, KEY_MAGENTA, KEY_YELLOW,
+  KEY_IMAGE, KEY_ERROR,
+  KEY_QUALITY, KEY_FORMAT, KEY_FILTER, KEY_THREADS, KEY_PROCESSES,
+  KEY_BINS, KEY_CHANNEL, KEY_RECT,
+  NUM_KEYS
+};
+
+/* same order as the enum above */
+static const char * const key_names[NUM_KEYS] = {
+  "x", "y", "w", "h",
+  "dx", "dy", "dw", "dh",
+  "s", "src", "dst", "crop", "plan",
+  "top", "bottom", "left", "right",
+  "red", "green", "blue", "alpha",
+  "hue", "saturation", "lightness", "value",
+  "cyan", "magenta", "yellow",
+  "image", "error",
+  "quality", "format", "filter", "threads", "processes",
+  "bins", "channel", "rect",
+};
+
+static VALUE key_strs[NUM_KEYS],
+             key_syms[NUM_KEYS];
+
+static void init_hash_keys(void) {
+  int i;
+
+  for (i = 0; i < NUM_KEYS; i++) {
+    key_strs[i] = rb_obj_freeze(rb_str_new2(key_names[i]));
+    rb_gc_register_mark_object(key_strs[i]);
+    key_syms[i] = ID2SYM(rb_intern(key_names[i]));
+  }
+}
+
+/*
+ * Get the value of key from a hash argument, looking for the String
+ * key and then the Symbol key.  If neither is there, this returns the
+ * hash's default, like rb_hash_aref().
+ */
+static VALUE hash_arg(VALUE hash, int key) {
+  VALUE v;
+
+  if ((v = rb_hash_lookup2(hash, key_strs[key], Qundef)) != Qundef)
+    return v;
+  if ((v = rb_hash_lookup2(hash, key_syms[key], Qundef)) != Qundef)
+    return v;
+  return rb_hash_aref(hash, key_strs[key]);
+}
+
+/*
+ * Get the value of a keyword option (a Symbol key) from opts, which
+ * may be nil.
+ */
+static VALUE hash_opt(VALUE opts, int key) {
+  return NIL_P(opts) ? Qnil : rb_hash_aref(opts, key_syms[key]);
+}
+
+
+/************************/
+/* OPERATION STATISTICS */
+/************************/
+/* Opt-in counters for the hot paths (see Imlib2.stats).  They're only
+ * updated by methods, with the GVL held, so they need no locking, and
+ * while collect_stats is off each call costs one test. */
+enum {
+  STAT_LOAD, STAT_SAVE, STAT_CROP_SCALED, STAT_BLEND, STAT_DRAW_TEXT,
+  STAT_FILTER, STAT_BLUR, STAT_SHARPEN,
+  NUM_STATS
+};
+
+/* same order as the enum above */
+static const char * const stat_names[NUM_STATS] = {
+  "load", "save", "crop_scaled", "blend", "draw_text",
+  "filter", "blur", "sharpen",
+};
+
+typedef struct {
+  unsigned long long calls, ns, bytes, pixels;
+} OpStats;
+
+static OpStats op_stats[NUM_STATS];
+static char collect_stats = 0;
+
+/* monotonic time in nanoseconds */
+static unsigned long long stats_clock(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (unsigned long long) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif /* HAVE_CLOCK_GETTIME */
+}
+
+/*
+ * Count a call to op which started at start, and processed the given
+ * number of bytes and pixels.
+ */
+static void stats_record(int op, unsigned long long start,
+                         unsigned long long bytes,
+                         unsigned long long pixels) {
+  OpStats *s = &op_stats[op];
+
+  s->calls++;
+  s->ns += stats_clock() - start;
+  s->bytes += bytes;
+  s->pixels += pixels;
+}
+
+/* Start timing an operation (0 if stats are off), then count it with
+ * OP_STATS_END(), which only evaluates bytes and pixels if stats are on.
+ * Calls that raise in between aren't counted. */
+#define OP_STATS_BEGIN() (collect_stats ? stats_clock() : 0)
+#define OP_STATS_END(op, start, bytes, pixels) do {  \
+  if (start)                                         \
+    stats_record((op), (start), (bytes), (pixels));  \
+} while (0)
+
+/* size of the file at path, for load and save stats */
+static unsigned long long stats_file_size(const char *path) {
+  struct stat st;
+
+  return stat(path, &st) ? 0 : (unsigned long long) st.st_size;
+}
+
+/*
+ * Are per-operation statistics being collected (see Imlib2::stats)?
+ *
+ * Examples:
+ *   puts 'collecting' if Imlib2::collect_stats?
+ *
+ */
+static VALUE imlib2_collect_stats(VALUE klass) {
+  UNUSED(klass);
+  return collect_stats ? Qtrue : Qfalse;
+}
+
+/*
+ * Start or stop collecting per-operation statistics (see
+ * Imlib2::stats).  Disabled by default; while disabled, the counters
+ * cost one test per call.
+ *
+ * Examples:
+ *   Imlib2::collect_stats = true
+ *
+ */
+static VALUE imlib2_set_collect_stats(VALUE klass, VALUE val) {
+  UNUSED(klass);
+
+  collect_stats = RTEST(val);
+
+  return val;
+}
+
+/*
+ * Get the statistics collected while Imlib2::collect_stats is set, as a
+ * Hash of operation (:load, :save, :crop_scaled, :blend, :draw_text,
+ * :filter, :blur and :sharpen) to a Hash of:
+ *
+ * calls::  number of successful calls
+ * ns::     total time spent in them, in nanoseconds
+ * bytes::  file size for load and save, text length for draw_text, and
+ *          source pixel bytes for the others
+ * pixels:: pixels loaded, saved, or written
+ *
+ * Examples:
+ *   Imlib2::collect_stats = true
+ *   thumbs = paths.map { |path| Imlib2::Image.load(path).crop_scaled(...) }
+ *   Imlib2::stats.each do |op, s|
+ *     next if s[:calls] == 0
+ *     puts "#{op}: #{s[:calls]} calls, #{s[:ns] / s[:calls] / 1000}us each"
+ *   end
+ *
+ */
+static VALUE imlib2_stats(VALUE klass) {
+  VALUE ret = rb_hash_new();
+  int i;
+
+  UNUSED(klass);
+
+  for (i = 0; i < NUM_STATS; i++) {
+    VALUE h = rb_hash_new();
+
+    rb_hash_aset(h, ID2SYM(rb_intern("calls")), ULL2NUM(op_stats[i].calls));
+    rb_hash_aset(h, ID2SYM(rb_intern("ns")), ULL2NUM(op_stats[i].ns));
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes")), ULL2NUM(op_stats[i].bytes));
+    rb_hash_aset(h, ID2SYM(rb_intern("pixels")), ULL2NUM(op_stats[i].pixels));
+    rb_hash_aset(ret, ID2SYM(rb_intern(stat_names[i])), h);
+  }
+
+  return ret;
+}
+
+/*
+ * Zero the statistics returned by Imlib2::stats, returning the old
+ * values, so that periodic reporting doesn't lose counts in between.
+ *
+ * Examples:
+ *   report Imlib2::reset_stats
+ *
+ */
+static VALUE imlib2_reset_stats(VALUE klass) {
+  VALUE ret = imlib2_stats(klass);
+
+  memset(op_stats, 0, sizeof(op_stats));
+
+  return ret;
+}
+
+
+/***********************************************/
+/* GVL RELEASE                                 */
+/* (run heavy Imlib2 calls outside of the GVL) */
+/***********************************************/
+/* Imlib2 keeps all of its state (context stack, image cache, loaders)
+ * in globals, so only one thread may be inside Imlib2 at a time.  Heavy
+ * calls (load, save, scale, blur, etc) are run outside of the GVL while
+ * holding imlib_lock, and everything else waits for them in
+ * enter_imlib() before touching Imlib2. */
+static char release_gvl = 0;
+
+/* give each thread its own Imlib2 context (see switch_thread_context) */
+static char per_thread_context = 0;
+static void switch_thread_context(void);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static rb_nativethread_lock_t imlib_lock;
+static char imlib_busy = 0;
+
+/* set while a heavy call is running outside of the GVL */
+static char imlib_without_gvl = 0;
+
+/* the thread running a Ruby callback (eg a load progress block) from
+ * inside a heavy call; it may re-enter Imlib2 without waiting */
+static VALUE imlib_callback_thread = Qnil;
+#define IN_IMLIB_CALLBACK() \
+  (imlib_busy && imlib_callback_thread == rb_thread_current())
+
+typedef struct {
+  void *(*func)(void *);
+  void *data;
+  char  done;
+} NoGvlCall;
+
+/* block until the current no-GVL Imlib2 call is finished */
+static void *wait_for_imlib_nogvl(void *data) {
+  UNUSED(data);
+  rb_nativethread_lock_lock(&imlib_lock);
+  rb_nativethread_lock_unlock(&imlib_lock);
+  return NULL;
+}
+
+/* run the call, then drop imlib_lock before taking the GVL back */
+static void *call_imlib_nogvl(void *data) {
+  NoGvlCall *call = (NoGvlCall*) data;
+  void *r;
+
+  imlib_without_gvl = 1;
+  r = call->func(call->data);
+  imlib_without_gvl = 0;
+  call->done = 1;
+  rb_nativethread_lock_unlock(&imlib_lock);
+
+  return r;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/* kinds of Imlib2 object a free function may have to put off freeing,
+ * and pixel buffers a MemoryView release may have to put off putting
+ * back */
+enum {
+  FREE_IMAGE,
+  FREE_CMOD,
+  FREE_FONT,
+  FREE_RANGE,
+  FREE_POLYGON,
+  FREE_CONTEXT,
+  PUT_BACK_DATA
+};
+
+typedef struct DeferredFree {
+  int                  kind;
+  void                *obj,
+                      *data;  /* PUT_BACK_DATA: the buffer */
+  struct DeferredFree *next;
+} DeferredFree;
+
+/* work waiting for Imlib2 to be free, oldest first, so a buffer is put
+ * back before its image is freed (only touched with the GVL) */
+static DeferredFree *deferred_frees = NULL,
+                    *deferred_frees_tail = NULL;
+
+static void free_imlib_object_now(int kind, void *obj, void *data) {
+  switch (kind) {
+    case FREE_IMAGE:
+      imlib_context_set_image((Imlib_Image) obj);
+      imlib_free_image();
+      break;
+    case FREE_CMOD:
+      imlib_context_set_color_modifier((Imlib_Color_Modifier) obj);
+      imlib_free_color_modifier();
+      break;
+    case FREE_FONT:
+      imlib_context_set_font((Imlib_Font) obj);
+      imlib_free_font();
+      break;
+    case FREE_RANGE:
+      imlib_context_set_color_range((Imlib_Color_Range) obj);
+      imlib_free_color_range();
+      break;
+    case FREE_POLYGON:
+      imlib_polygon_free((ImlibPolygon) obj);
+      break;
+    case FREE_CONTEXT:
+      imlib_context_free((Imlib_Context) obj);
+      break;
+    case PUT_BACK_DATA:
+      imlib_context_set_image((Imlib_Image) obj);
+      imlib_image_put_back_data((DATA32*) data);
+      break;
+  }
+}
+
+/* free the objects free functions put off (see free_imlib_object) */
+static void free_deferred_objects(void) {
+  while (deferred_frees) {
+    DeferredFree *d = deferred_frees;
+
+    deferred_frees = d->next;
+    free_imlib_object_now(d->kind, d->obj, d->data);
+    free(d);
+  }
+  deferred_frees_tail = NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/* queue work for free_deferred_objects(); returns 0 if out of memory */
+static int defer_imlib_free(int kind, void *obj, void *data) {
+  DeferredFree *d = malloc(sizeof(DeferredFree));
+
+  if (!d)
+    return 0;
+  d->kind = kind;
+  d->obj = obj;
+  d->data = data;
+  d->next = NULL;
+  if (deferred_frees_tail)
+    deferred_frees_tail->next = d;
+  else
+    deferred_frees = d;
+  deferred_frees_tail = d;
+  return 1;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * Free an Imlib2 object from a free function.  Free functions run
+ * during GC, with the GVL, and another thread may be inside Imlib2 at
+ * the time, holding imlib_lock (and, while it runs a progress block,
+ * waiting for the GVL), so they must never wait for the lock.  If
+ * Imlib2 is busy, the object is freed the next time a thread enters
+ * Imlib2 instead.
+ */
+static void free_imlib_object(int kind, void *obj) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  /* if there's no memory for the list entry, leaking the object is
+   * better than a deadlock */
+  if (imlib_busy && !IN_IMLIB_CALLBACK()) {
+    defer_imlib_free(kind, obj, NULL);
+    return;
+  }
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  free_imlib_object_now(kind, obj, NULL);
+}
+
+/*
+ * Put a pixel buffer back into its image from a MemoryView release,
+ * which may run during GC (eg from a Fiddle::MemoryView's free
+ * function), so like free_imlib_object() it must not wait for Imlib2,
+ * or switch contexts (which may allocate): if Imlib2 is busy, the
+ * buffer is put back the next time a thread enters Imlib2.
+ */
+static void put_back_image_data(Imlib_Image im, DATA32 *data) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  /* without memory for the list entry, Imlib2 just keeps the buffer
+   * without knowing it changed */
+  if (imlib_busy && !IN_IMLIB_CALLBACK()) {
+    defer_imlib_free(PUT_BACK_DATA, im, data);
+    return;
+  }
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  free_imlib_object_now(PUT_BACK_DATA, im, data);
+}
+
+/* wait for any Imlib2 call running outside of the GVL (releases the
+ * GVL while waiting), then switch to the calling thread's context */
+static void enter_imlib(void) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  while (imlib_busy && !IN_IMLIB_CALLBACK())
+    rb_thread_call_without_gvl(wait_for_imlib_nogvl, NULL, NULL, NULL);
+
+  if (!imlib_busy && deferred_frees)
+    free_deferred_objects();
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  if (per_thread_context)
+    switch_thread_context();
+}
+
+/*
+ * Run a heavy Imlib2 call, outside of the GVL if release_gvl is set.
+ * If ubf is given, Ruby calls ubf(ubf_data) from another thread to
+ * interrupt the call (eg for Thread#kill or Ctrl-C); it must make func
+ * return soon.
+ */
+static void *call_imlib_ubf(void *(*func)(void *), void *data,
+                            void (*ubf)(void *), void *ubf_data) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  NoGvlCall call;
+  void *r;
+
+  if (release_gvl && !IN_IMLIB_CALLBACK()) {
+    enter_imlib();
+
+    call.func = func;
+    call.data = data;
+    call.done = 0;
+
+    imlib_busy = 1;
+    rb_nativethread_lock_lock(&imlib_lock);
+    r = rb_thread_call_without_gvl2(call_imlib_nogvl, &call, ubf, ubf_data);
+
+    /* without_gvl2 skips the call if an interrupt is pending, and never
+     * raises, so imlib_busy and imlib_lock can't get stuck */
+    if (!call.done) {
+      rb_nativethread_lock_unlock(&imlib_lock);
+      r = func(data);
+    }
+    imlib_busy = 0;
+
+    if (deferred_frees)
+      free_deferred_objects();
+
+    return r;
+  }
+#else
+  UNUSED(ubf);
+  UNUSED(ubf_data);
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  return func(data);
+}
+
+/* run a heavy Imlib2 call, outside of the GVL if release_gvl is set */
+static void *call_imlib(void *(*func)(void *), void *data) {
+  return call_imlib_ubf(func, data, NULL, NULL);
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void *call_without_gvl_nogvl(void *data) {
+  NoGvlCall *call = (NoGvlCall*) data;
+  void *r;
+
+  r = call->func(call->data);
+  call->done = 1;
+
+  return r;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * Run func outside of the GVL *without* holding imlib_lock, for work
+ * that doesn't touch Imlib2 at all (our own pixel kernels working on
+ * raw DATA32 buffers), so several threads can run it in parallel.
+ * Callers must keep the buffers alive (see ImStruct.exports).
+ */
+static void *call_without_gvl(void *(*func)(void *), void *data) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  NoGvlCall call;
+  void *r;
+
+  if (release_gvl && !IN_IMLIB_CALLBACK()) {
+    call.func = func;
+    call.data = data;
+    call.done = 0;
+
+    r = rb_thread_call_without_gvl2(call_without_gvl_nogvl, &call, NULL, NULL);
+    if (!call.done)
+      r = func(data);
+
+    return r;
+  }
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  return func(data);
+}
+
+/*
+ * Call func with the GVL from inside a heavy call (eg from an Imlib2
+ * progress function).  While it runs, the calling thread may re-enter
+ * Imlib2; other threads keep waiting for the heavy call to finish.
+ */
+static void *call_with_gvl(void *(*func)(void *), void *data) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  if (imlib_without_gvl) {
+    void *r;
+
+    imlib_without_gvl = 0;
+    r = rb_thread_call_with_gvl(func, data);
+    imlib_without_gvl = 1;
+
+    return r;
+  }
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  return func(data);
+}
+
+/*
+ * Are heavy Imlib2 calls (load, save, crop_scaled, blur, sharpen,
+ * rotate, and blend) run outside of the GVL?
+ *
+ * Examples:
+ *   puts 'other threads keep running' if Imlib2::release_gvl?
+ *
+ */
+static VALUE imlib2_release_gvl(VALUE klass) {
+  UNUSED(klass);
+  return release_gvl ? Qtrue : Qfalse;
+}
+
+/*
+ * Run heavy Imlib2 calls (load, save, crop_scaled, blur, sharpen,
+ * rotate, and blend) outside of the GVL, so other Ruby threads can run
+ * while an image is being decoded or scaled.  Disabled by default.
+ *
+ * Note: Imlib2 itself is not reentrant, so Imlib2 calls are still
+ * serialized; only Ruby code in other threads runs in parallel.  This
+ * setting has no effect if Ruby lacks rb_thread_call_without_gvl().
+ *
+ * Examples:
+ *   Imlib2::release_gvl = true
+ *
+ */
+static VALUE imlib2_set_release_gvl(VALUE klass, VALUE val) {
+  UNUSED(klass);
+
+  release_gvl = RTEST(val);
+
+  return val;
+}
+
+
 /**********************************/
 /* Imlib2::FileError EXCEPTIONS   */
 /* (exceptions and error strings) */
@@ -112,10 +734,95 @@ static struct {
 
 typedef struct {
   Imlib_Image im;
+  int         exports;  /* live MemoryView exports and no-GVL kernels */
+  int         writers;  /* ... of which writable MemoryView exports */
+  ssize_t     bytes;    /* pixel memory reported to the GC */
+  char        loading;  /* still being loaded (see Image.load) */
 } ImStruct;
 
+/* channels of a filter, in DATA32 byte order */
+#define FILTER_BLUE  0
+#define FILTER_GREEN 1
+#define FILTER_RED   2
+#define FILTER_ALPHA 3
+
+/* one entry of a filter kernel: a source pixel offset, and the weight
+ * of each of that pixel's channels */
+typedef struct {
+  int x, y,
+      w[4];
+} FilterTap;
+
+typedef struct {
+  FilterTap *taps;
+  int        num_taps, max_taps,
+             div,       /* 0 = sum of the weights */
+             cons;
+} FilterChannel;
+
+/*
+ * An Imlib2::Filter.  Imlib2's own filters are opaque, so the kernel is
+ * kept here and applied by our convolution engine (see static_filter).
+ */
+typedef struct {
+  FilterChannel ch[4];  /* one kernel per output channel */
+} FilterStruct;
+
+/*
+ * Typed data for the classes that hold Imlib2 heap memory, so that
+ * ObjectSpace.memsize_of (and the GC) see their real size.
+ */
+static void im_struct_free(void *val);
+static size_t im_struct_memsize(const void *val);
+static void font_free(void *val);
+static size_t font_memsize(const void *val);
+static void filter_free(void *val);
+static size_t filter_memsize(const void *val);
+static void cmod_free(void *val);
+static size_t cmod_memsize(const void *val);
+
+static const rb_data_type_t image_type = {
+  .wrap_struct_name = "Imlib2::Image",
+  .function = {
+    .dfree = im_struct_free,
+    .dsize = im_struct_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t font_type = {
+  .wrap_struct_name = "Imlib2::Font",
+  .function = {
+    .dfree = font_free,
+    .dsize = font_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t filter_type = {
+  .wrap_struct_name = "Imlib2::Filter",
+  .function = {
+    .dfree = filter_free,
+    .dsize = filter_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t cmod_type = {
+  .wrap_struct_name = "Imlib2::ColorModifier",
+  .function = {
+    .dfree = cmod_free,
+    .dsize = cmod_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* hidden ivars linking an image and its Image#data_view buffer */
+static ID id_data_view, id_data_view_image;
+
 #define GET_AND_CHECK_IMAGE(src, image) do { \
-  Data_Get_Struct((src), ImStruct, (image)); \
+  enter_imlib(); \
+  TypedData_Get_Struct((src), ImStruct, &image_type, (image)); \
   if (!(image)->im) { \
     rb_raise(cDeletedError, "image deleted"); \
     return Qnil; \
@@ -152,7 +859,7 @@ typedef struct {
 /* UTILITY FUNCTIONS */
 /*********************/
 /* raise an Imlib2::FileError exception based on an Imlib2 error type */
-static void raise_imlib_error(const char *path, int err) {
+static VALUE imlib_error_new(const char *path, int err) {
   char buf[1024];
 
   /* sanity check on error message */
@@ -162,8 +869,11 @@ static void raise_imlib_error(const char *path, int err) {
   /* add filename and path to buffer */
   snprintf(buf, sizeof(buf), "\"%s\": %s", path, imlib_errors[err].description);
   
-  /* raise exception */
-  rb_raise(imlib_errors[err].exception, "%s", buf);
+  return rb_exc_new2(imlib_errors[err].exception, buf);
+}
+
+static void raise_imlib_error(const char *path, int err) {
+  rb_exc_raise(imlib_error_new(path, err));
 }
 
 /* set the context color -- polymorphic based on color class */
@@ -245,10 +955,10 @@ static VALUE border_init(int argc, VALUE *argv, VALUE self) {
       /* must be either an array or a hash */
       switch (TYPE(argv[0])) {
         case T_HASH:
-          border->left = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("left")));
-          border->top = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("top")));
-          border->right = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("right")));
-          border->bottom = NUM2INT(rb_hash_aref(argv[0],rb_str_new2("bottom")));
+          border->left = NUM2INT(hash_arg(argv[0], KEY_LEFT));
+          border->top = NUM2INT(hash_arg(argv[0], KEY_TOP));
+          border->right = NUM2INT(hash_arg(argv[0], KEY_RIGHT));
+          border->bottom = NUM2INT(hash_arg(argv[0], KEY_BOTTOM));
           break;
         case T_ARRAY:
           border->left = NUM2INT(rb_ary_entry(argv[0], 0));
@@ -396,6 +1106,7 @@ static VALUE border_set_bottom(VALUE self, VALUE val) {
  */
 static VALUE cache_image(VALUE klass) {
   UNUSED(klass);
+  enter_imlib();
   return INT2FIX(imlib_get_cache_size());
 }
 
@@ -414,6 +1125,7 @@ static VALUE cache_image(VALUE klass) {
  */
 static VALUE cache_set_image(VALUE klass, VALUE val) {
   UNUSED(klass);
+  enter_imlib();
   imlib_set_cache_size(NUM2INT(val));
   return Qtrue;
 }
@@ -428,6 +1140,7 @@ static VALUE cache_set_image(VALUE klass, VALUE val) {
  */
 static VALUE cache_font(VALUE klass) {
   UNUSED(klass);
+  enter_imlib();
   return INT2FIX(imlib_get_font_cache_size());
 }
 
@@ -445,6 +1158,7 @@ static VALUE cache_font(VALUE klass) {
  */
 static VALUE cache_set_font(VALUE klass, VALUE val) {
   UNUSED(klass);
+  enter_imlib();
   imlib_set_font_cache_size(NUM2INT(val));
   return Qtrue;
 }
@@ -457,6 +1171,7 @@ static VALUE cache_set_font(VALUE klass, VALUE val) {
  *   new_size = Imlib2::Cache::flush_font_cache
  */
 static VALUE cache_flush_font(VALUE klass) {
+  enter_imlib();
   imlib_flush_font_cache();
   return cache_font(klass);
 }
@@ -502,10 +1217,10 @@ static VALUE rgba_color_init(int argc, VALUE *argv, VALUE self) {
       /* must be either an array or a hash */
       switch (TYPE(argv[0])) {
         case T_HASH:
-          color->red = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("red")));
-          color->green = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("green")));
-          color->blue = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("blue")));
-          color->alpha = NUM2INT(rb_hash_aref(argv[0],rb_str_new2("alpha")));
+          color->red = NUM2INT(hash_arg(argv[0], KEY_RED));
+          color->green = NUM2INT(hash_arg(argv[0], KEY_GREEN));
+          color->blue = NUM2INT(hash_arg(argv[0], KEY_BLUE));
+          color->alpha = NUM2INT(hash_arg(argv[0], KEY_ALPHA));
           break;
         case T_ARRAY:
           color->red = NUM2INT(rb_ary_entry(argv[0], 0));
@@ -683,10 +1398,10 @@ static VALUE hsva_color_init(int argc, VALUE *argv, VALUE self) {
       /* must be either an array or a hash */
       switch (TYPE(argv[0])) {
         case T_HASH:
-          color->hue = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("hue")));
-          color->saturation = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("saturation")));
-          color->value = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("value")));
-          color->alpha = NUM2INT(rb_hash_aref(argv[0],rb_str_new2("alpha")));
+          color->hue = NUM2DBL(hash_arg(argv[0], KEY_HUE));
+          color->saturation = NUM2DBL(hash_arg(argv[0], KEY_SATURATION));
+          color->value = NUM2DBL(hash_arg(argv[0], KEY_VALUE));
+          color->alpha = NUM2INT(hash_arg(argv[0], KEY_ALPHA));
           break;
         case T_ARRAY:
           color->hue = NUM2DBL(rb_ary_entry(argv[0], 0));
@@ -864,10 +1579,10 @@ static VALUE hlsa_color_init(int argc, VALUE *argv, VALUE self) {
       /* must be either an array or a hash */
       switch (TYPE(argv[0])) {
         case T_HASH:
-          color->hue = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("hue")));
-          color->lightness = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("lightness")));
-          color->saturation = NUM2DBL(rb_hash_aref(argv[0], rb_str_new2("saturation")));
-          color->alpha = NUM2INT(rb_hash_aref(argv[0],rb_str_new2("alpha")));
+          color->hue = NUM2DBL(hash_arg(argv[0], KEY_HUE));
+          color->lightness = NUM2DBL(hash_arg(argv[0], KEY_LIGHTNESS));
+          color->saturation = NUM2DBL(hash_arg(argv[0], KEY_SATURATION));
+          color->alpha = NUM2INT(hash_arg(argv[0], KEY_ALPHA));
           break;
         case T_ARRAY:
           color->hue = NUM2DBL(rb_ary_entry(argv[0], 0));
@@ -1045,10 +1760,10 @@ static VALUE cmya_color_init(int argc, VALUE *argv, VALUE self) {
       /* must be either an array or a hash */
       switch (TYPE(argv[0])) {
         case T_HASH:
-          color->cyan = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("cyan")));
-          color->magenta = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("magenta")));
-          color->yellow = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("yellow")));
-          color->alpha = NUM2INT(rb_hash_aref(argv[0],rb_str_new2("alpha")));
+          color->cyan = NUM2INT(hash_arg(argv[0], KEY_CYAN));
+          color->magenta = NUM2INT(hash_arg(argv[0], KEY_MAGENTA));
+          color->yellow = NUM2INT(hash_arg(argv[0], KEY_YELLOW));
+          color->alpha = NUM2INT(hash_arg(argv[0], KEY_ALPHA));
           break;
         case T_ARRAY:
           color->cyan = NUM2INT(rb_ary_entry(argv[0], 0));
@@ -1368,6017 +2083,12038 @@ static void im_struct_free(void *val) {
   ImStruct *im = (ImStruct*) val;
   
   if (im) {
-    if (im->im) {
-      imlib_context_set_image(im->im);
-      imlib_free_image();
-    }
+    if (im->im)
+      free_imlib_object(FREE_IMAGE, im->im);
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    if (im->bytes)
+      rb_gc_adjust_memory_usage(-im->bytes);
+#endif /* HAVE_RB_GC_ADJUST_MEMORY_USAGE */
     free(im);
   }
 }
 
+static size_t im_struct_memsize(const void *val) {
+  const ImStruct *im = (const ImStruct*) val;
+
+  return sizeof(ImStruct) + im->bytes;
+}
+
 /*
- * Returns a new Imlib2::Image with the specified width and height.
- *
- * Examples:
- *   width, height = 640, 480
- *   image = Imlib2::Image.new width, height
- *
- *   width, height = 320, 240
- *   image = Imlib2::Image.create width, height
+ * Tell the GC about the pixel memory held by an image, after it has
+ * been created, replaced or freed.  Imlib2 knows an image's size as
+ * soon as its header is loaded, so lazily-decoded images count too.
  */
-VALUE image_new(VALUE klass, VALUE w, VALUE h) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  VALUE im_o;
+static void image_track_memory(ImStruct *im) {
+  Imlib_Image old;
+  ssize_t bytes = 0;
 
-  im->im = imlib_create_image(NUM2INT(w), NUM2INT(h));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  rb_obj_call_init(im_o, 0, NULL);
+  if (im->im) {
+    old = imlib_context_get_image();
+    imlib_context_set_image(im->im);
+    bytes = (ssize_t) imlib_image_get_width() * imlib_image_get_height() * 4;
+    imlib_context_set_image(old);
+  }
 
-  return im_o;
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  if (bytes != im->bytes)
+    rb_gc_adjust_memory_usage(bytes - im->bytes);
+#endif /* HAVE_RB_GC_ADJUST_MEMORY_USAGE */
+  im->bytes = bytes;
 }
 
-/*********************************/
-/* DRAW PIXEL WORKAROUND METHODS */
-/*********************************/
 /*
- * Are we using the buggy imlib_image_draw_pixel() work-around?
- *
- * Versions of Imlib2 up to and including 1.0.5 had a broken
- * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
- * simulates drawing a pixel with a 1x1 rectangle.  This method allows 
- * you to check whether the work-around behavior is enabled.
- *
- * Examples:
- *   puts 'work-around is enabled' if Imlib2::Image::draw_pixel_workaround?
- *   puts 'work-around is enabled' if Imlib2::Image::bypass_draw_pixel?
- *
+ * Wrap an ImStruct in a new Imlib2::Image (or subclass) object.
  */
-VALUE image_dp_workaround(VALUE klass) {
-  UNUSED(klass);
-  return draw_pixel_workaround ? Qtrue : Qfalse;
+static VALUE image_wrap(VALUE klass, ImStruct *im) {
+  VALUE self = TypedData_Wrap_Struct(klass, &image_type, im);
+
+  image_track_memory(im);
+  return self;
 }
 
 /*
- * Enable or disable imlib_image_draw_pixel() work-around.
- *
- * Versions of Imlib2 up to and including 1.0.5 had a broken
- * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
- * simulates drawing a pixel with a 1x1 rectangle.  This method allows 
- * you to enable or disable the work-around behavior.
- *
- * Examples:
- *   Imlib2::Image::draw_pixel_workaround = false
- *   Imlib2::Image::bypass_draw_pixel = false
- *
+ * Detach the zero-copy view returned by Image#data_view (if any), so it
+ * can't be used to read or write pixels that are about to go away.
+ * Called whenever an image's pixel buffer is freed or replaced.
  */
-VALUE image_set_dp_workaround(VALUE klass, VALUE val) {
-  UNUSED(klass);
+static void release_data_view(VALUE self) {
+#ifdef HAVE_RB_IO_BUFFER_NEW
+  VALUE view = rb_ivar_get(self, id_data_view);
 
-  draw_pixel_workaround = (val == Qtrue);
+  if (!NIL_P(view)) {
+    rb_ivar_set(self, id_data_view, Qnil);
+    rb_io_buffer_free(view);
+  }
+#endif /* HAVE_RB_IO_BUFFER_NEW */
+}
 
-  return val;
+/*
+ * Called before an image's pixel buffer is freed or replaced: refuses
+ * while the image is loading or its buffer is exported through a
+ * MemoryView (or read by a kernel running without the GVL), and
+ * detaches the Image#data_view buffer.
+ */
+static void release_pixels(VALUE self, ImStruct *im) {
+  if (im->loading)
+    rb_raise(rb_eRuntimeError, "image is still loading");
+  if (im->exports > 0)
+    rb_raise(rb_eRuntimeError, "image data is in use (MemoryView or running operation)");
+  release_data_view(self);
 }
 
+#ifdef HAVE_RB_MEMORY_VIEW_REGISTER
 /*
- * Returns a new Imlib2::Image initialized with the specified data.
- *
- * Examples:
- *   other_image = Imlib2::Image.load 'sample_file.png'
- *   width, height = other_image.width, other_image.height
- *   data = other_image.data_for_reading_only
- *   image = Imlib2::Image.create_using_data width, height, data
- *
+ * MemoryView export of the pixel buffer, as a (height, width, 4) array
+ * of bytes in DATA32 memory order (B, G, R, A on little-endian hosts).
  */
-VALUE image_create_using_data(VALUE klass, VALUE w, VALUE h, VALUE data) {
+typedef struct {
+  ssize_t  shape[3],
+           strides[3];
+  DATA32  *data;
+  char     writable;
+} ImageMemoryView;
+
+static bool image_memory_view_get(VALUE self, rb_memory_view_t *view, int flags) {
   ImStruct *im;
-  VALUE im_o;
+  ImageMemoryView *mv;
+  void *data;
+  int w, h;
 
-  im = malloc(sizeof(ImStruct));
-  im->im = imlib_create_image_using_data(NUM2INT(w), NUM2INT(h), (DATA32 *) StringValuePtr (data));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  rb_obj_call_init(im_o, 0, NULL);
+  TypedData_Get_Struct(self, ImStruct, &image_type, im);
+  if (!im->im)
+    return false;
 
-  return im_o;
+  enter_imlib();
+  imlib_context_set_image(im->im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  if (flags & RUBY_MEMORY_VIEW_WRITABLE)
+    data = imlib_image_get_data();
+  else
+    data = imlib_image_get_data_for_reading_only();
+
+  if (!rb_memory_view_init_as_byte_array(view, self, data, (ssize_t) w * h * 4,
+                                         !(flags & RUBY_MEMORY_VIEW_WRITABLE)))
+    return false;
+
+  mv = ALLOC(ImageMemoryView);
+  mv->data = (DATA32*) data;
+  mv->writable = (flags & RUBY_MEMORY_VIEW_WRITABLE) ? 1 : 0;
+  mv->shape[0] = h;
+  mv->shape[1] = w;
+  mv->shape[2] = 4;
+  mv->strides[0] = (ssize_t) w * 4;
+  mv->strides[1] = 4;
+  mv->strides[2] = 1;
+
+  view->format = "C";
+  view->item_size = 1;
+  view->ndim = 3;
+  view->shape = mv->shape;
+  view->strides = mv->strides;
+  view->private_data = mv;
+
+  im->exports++;
+  im->writers += mv->writable;
+  return true;
+}
+
+static bool image_memory_view_release(VALUE self, rb_memory_view_t *view) {
+  ImStruct *im;
+  ImageMemoryView *mv = (ImageMemoryView*) view->private_data;
+
+  TypedData_Get_Struct(self, ImStruct, &image_type, im);
+  im->exports--;
+
+  /* hand the buffer back to Imlib2 (eg so it drops any cached scaled
+   * copies) once nothing can write to it any more */
+  if (mv->writable && --im->writers == 0 && im->im)
+    put_back_image_data(im->im, mv->data);
+  xfree(mv);
+
+  return true;
 }
 
-/*
- * Returns a new Imlib2::Image initialized with the specified data.
- *
- * Examples:
- *   other_image = Imlib2::Image.load 'sample_file.png'
- *   width, height = other_image.width, other_image.height
- *   data = other_image.data
- *   image = Imlib2::Image.create_using_copied_data width, height, data
- *
- */
-VALUE image_create_using_copied_data(VALUE klass, VALUE w, VALUE h, VALUE data) {
+static bool image_memory_view_available_p(VALUE self) {
   ImStruct *im;
-  VALUE im_o;
-
-  im = malloc(sizeof(ImStruct));
-  im->im = imlib_create_image_using_copied_data(NUM2INT(w), NUM2INT(h), (DATA32 *) StringValuePtr (data));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  rb_obj_call_init(im_o, 0, NULL);
 
-  return im_o;
+  TypedData_Get_Struct(self, ImStruct, &image_type, im);
+  return im->im != NULL;
 }
 
-/*
- * Load an Imlib2::Image from a file (throws exceptions).
- *
- * Examples:
- *   image = Imlib2::Image.load 'sample_file.png'
- *
- *   begin 
- *     image = Imlib2::Image.load 'sample_file.png'
- *   rescue Imlib2::FileError
- *     $stderr.puts 'Couldn't load file: ' + $!
- *   end
- *
- */
-static VALUE image_load(VALUE klass, VALUE filename) {
-  ImStruct        *im;
-  Imlib_Image      iim;
-  Imlib_Load_Error err;
-  VALUE            im_o = Qnil;
-  char            *path;
+static const rb_memory_view_entry_t image_memory_view_entry = {
+  image_memory_view_get,
+  image_memory_view_release,
+  image_memory_view_available_p,
+};
+#endif /* HAVE_RB_MEMORY_VIEW_REGISTER */
 
-  /* grab filename */
-  path = StringValuePtr(filename);
-  
-  iim = imlib_load_image_with_error_return(path, &err);
-  if (err == IMLIB_LOAD_ERROR_NONE) {
-    im = malloc(sizeof(ImStruct));
-    im->im = iim;
-    im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
+/*******************************/
+/* HEAVY IMAGE OPERATIONS      */
+/* (callbacks for call_imlib) */
+/*******************************/
+typedef struct {
+  VALUE       klass,
+              block,
+              image;          /* Ruby object for the image being loaded */
+  int         state;          /* rb_protect() state of the block */
+  char        abort;
+  Imlib_Image im;             /* arguments for the current callback */
+  int         percent, x, y, w, h;
+} LoadProgress;
 
-    if (rb_block_given_p())
-      rb_yield(im_o);
-  } else {
-    /* there was an error loading -- throw an exception if we weren't
-     * passed a block */
+typedef struct {
+  Imlib_Image      im,    /* result (or destination) image */
+                   src;   /* source image */
+  const char      *path;
+  const void      *mem;
+  long             size;
+  int              fd;
+  Imlib_Load_Error err;
+  int              x, y, w, h,
+                   dx, dy, dw, dh,
+                   radius;
+  char             merge_alpha,
+                   has_alpha;
+  char            *format;
+  double           angle;
+  LoadProgress    *progress;
+} ImageOp;
+
+static void *load_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  op->im = imlib_load_image_with_error_return(op->path, &op->err);
+  return NULL;
+}
+
+/*
+ * Load progress callbacks.  Imlib2 calls load_progress_function() from
+ * inside the loader (without the GVL); it takes the GVL back and yields
+ * the partially-loaded image to the Ruby block.  Only one load runs at
+ * a time, so the load in progress is kept in a static.
+ */
+static LoadProgress *load_progress = NULL;
+static int load_progress_function(Imlib_Image im, char percent,
+                                  int x, int y, int w, int h);
+
+static VALUE load_progress_yield(VALUE val) {
+  LoadProgress *lp = (LoadProgress*) val;
+  ImStruct *im;
 
-    if (!rb_block_given_p())
-      raise_imlib_error(path, err);
+  if (NIL_P(lp->image)) {
+    im = calloc(1, sizeof(ImStruct));
+    im->im = lp->im;
+    im->loading = 1;
+    lp->image = image_wrap(lp->klass, im);
   }
-  
-  return im_o;
+
+  return rb_funcall(lp->block, rb_intern("call"), 6, lp->image,
+                    INT2FIX(lp->percent), INT2FIX(lp->x), INT2FIX(lp->y),
+                    INT2FIX(lp->w), INT2FIX(lp->h));
 }
 
-/*
- * Load an Imlib2::Image from a file (no exceptions or error).
- *
- * Imlib2::Image::load_image() provides access to the low-level
- * imlib_load_image() function.  You probably want to use 
- * Imlib2::Image::load() instead of Imlib2::Image::load_image().
- *
- * Examples:
- *   image = Imlib2::Image.load_image 'sample_file.png'
- *
- */
-static VALUE image_load_image(VALUE klass, VALUE filename) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  VALUE im_o;
+static void *load_progress_call(void *data) {
+  LoadProgress *lp = (LoadProgress*) data;
+  VALUE r;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  VALUE old_thread = imlib_callback_thread;
 
-  im->im = imlib_load_image(StringValuePtr(filename));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  
-  return im_o;
-}
+  imlib_callback_thread = rb_thread_current();
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
 
-/*
- * Load an Imlib2::Image from a file (no exceptions or error).
- *
- * Imlib2::Image::load_immediately() provides access to the low-level
- * imlib_load_image_immediately() function.  You probably want to use 
- * Imlib2::Image::load() instead of this function.
- *
- * Examples:
- *   image = Imlib2::Image.load_immediately 'sample_file.png'
- *
- */
-static VALUE image_load_immediately(VALUE klass, VALUE filename) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  VALUE im_o;
+  /* don't report progress for loads started by the block itself */
+  load_progress = NULL;
+  imlib_context_set_progress_function(NULL);
+  r = rb_protect(load_progress_yield, (VALUE) lp, &lp->state);
+  imlib_context_set_progress_function(load_progress_function);
+  load_progress = lp;
 
-  im->im = imlib_load_image_immediately(StringValuePtr(filename));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  
-  return im_o;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  imlib_callback_thread = old_thread;
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+  if (lp->state || r == Qfalse)
+    lp->abort = 1;
+
+  return NULL;
 }
 
-/*
- * Load an Imlib2::Image from a file (no caching, exception, or error).
- *
- * Imlib2::Image::load_without_cache() provides access to the low-level
- * imlib_load_image_without_cache() function.  You probably want to use 
- * Imlib2::Image::load() instead of this function.
- *
- * Examples:
- *   image = Imlib2::Image.load_without_cache 'sample_file.png'
- *
- */
-static VALUE image_load_without_cache(VALUE klass, VALUE filename) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  VALUE im_o;
+static int load_progress_function(Imlib_Image im, char percent,
+                                  int x, int y, int w, int h) {
+  LoadProgress *lp = load_progress;
 
-  im->im = imlib_load_image_without_cache(StringValuePtr(filename));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  
-  return im_o;
+  if (!lp || lp->abort)
+    return 0;
+
+  lp->im = im;
+  lp->percent = percent;
+  lp->x = x; lp->y = y; lp->w = w; lp->h = h;
+  call_with_gvl(load_progress_call, lp);
+
+  return !lp->abort;
 }
 
-/*
- * Load an Imlib2::Image from a file (no caching, deferred loading,
- * exceptions, or errors).
- *
- * Imlib2::Image::load_immediately_without_cache() provides access to the
- * low-level imlib_load_image_immediately_without_cache() function.  You
- * probably want to use Imlib2::Image::load() instead of this function.
- *
- * Examples:
- *   image = Imlib2::Image.load_immediately_without_cache 'sample_file.png'
- *
- */
-static VALUE image_load_immediately_without_cache(VALUE klass, VALUE filename) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  VALUE im_o;
+static void *load_progress_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
 
-  im->im = imlib_load_image_immediately_without_cache(StringValuePtr(filename));
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  
-  return im_o;
+  load_progress = op->progress;
+  imlib_context_set_progress_function(load_progress_function);
+  op->im = imlib_load_image_with_error_return(op->path, &op->err);
+  imlib_context_set_progress_function(NULL);
+  load_progress = NULL;
+
+  /* don't leave a partially-loaded image in the cache */
+  if (op->im && op->progress->abort) {
+    imlib_context_set_image(op->im);
+    imlib_free_image_and_decache();
+    op->im = NULL;
+  }
+
+  return NULL;
 }
 
+#ifdef HAVE_MEMFD_CREATE
 /*
- * Load an Imlib2::Image from a file with a hash of the error value and
- * the image.
- *
- * Imlib2::Image::load_with_error_return() provides access to the
- * low-level imlib_load_image_with_error_return() function.  You
- * probably want to use Imlib2::Image::load() instead of this function.
- *
- * Examples:
- *   hash = Imlib2::Image.load_with_error_return 'sample_file.png'
- *   if hash['error'] == 0 # 0 is no error
- *     image = hash['image']
- *   end
- *
+ * Copy data to an anonymous in-memory file, and put its /proc path in
+ * path.  Returns the file descriptor (or -1 on error).
  */
-static VALUE image_load_with_error_return(VALUE klass, VALUE filename) {
-  ImStruct *im = malloc(sizeof(ImStruct));
-  Imlib_Load_Error er;
-  VALUE hash, im_o;
-  
-  im->im = imlib_load_image_with_error_return(StringValuePtr(filename), &er);
-  im_o = Data_Wrap_Struct(klass, 0, im_struct_free, im);
-  
-  hash = rb_hash_new();
-  rb_hash_aset(hash, rb_str_new2("image"), im_o);
-  rb_hash_aset(hash, rb_str_new2("error"), INT2FIX(er));
+static int memfd_from_mem(const void *mem, long size, char *path, size_t path_size) {
+  const char *p;
+  long n, left;
+  int fd, e;
 
-  return hash;
+  if ((fd = memfd_create("imlib2-ruby", 0)) == -1)
+    return -1;
+
+  for (p = mem, left = size; left > 0; p += n, left -= n)
+    if ((n = write(fd, p, left)) <= 0)
+      break;
+
+  if (left > 0) {
+    /* keep write()'s errno for memfd_load_error() */
+    e = n < 0 ? errno : ENOSPC;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+
+  snprintf(path, path_size, "/proc/self/fd/%d", fd);
+  return fd;
 }
 
 /*
- * Save an Imlib2::Image to a file (throws an exception on error).
- * 
- * Examples:
- *   image.save 'output_file.png'
- *
- *   filename = 'output_file.jpg'
- *   begin
- *     image.save filename
- *   rescue Imlib2::FileError
- *     $stderr.puts "Couldn't save file \"#{filename}\": " + $!
- *   end
- *
+ * The Imlib_Load_Error for a failed memfd_from_mem(), from errno: a
+ * memfd lives in memory, so running out of space means out of memory.
  */
-static VALUE image_save(VALUE self, VALUE val) {
-  ImStruct *im;
-  Imlib_Load_Error er;
-  char *path;
-
-  path = StringValuePtr(val);
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_save_image_with_error_return(path, &er);
+static Imlib_Load_Error memfd_load_error(void) {
+  switch (errno) {
+    case EMFILE:
+    case ENFILE:
+      return IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS;
+    case ENOMEM:
+    case ENOSPC:
+    case EFBIG:
+      return IMLIB_LOAD_ERROR_OUT_OF_MEMORY;
+    default:
+      return IMLIB_LOAD_ERROR_UNKNOWN;
+  }
+}
+#endif /* HAVE_MEMFD_CREATE */
+
+static void *load_memory_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+#if !defined(HAVE_IMLIB_LOAD_IMAGE_MEM) && defined(HAVE_MEMFD_CREATE)
+  char path[64];
+  int fd;
+#endif
+
+  op->im = NULL;
+#ifdef HAVE_IMLIB_LOAD_IMAGE_MEM
+  op->im = imlib_load_image_mem(op->path, op->mem, op->size);
+#elif defined(HAVE_MEMFD_CREATE)
+  /* no imlib_load_image_mem(): copy the data to an anonymous in-memory
+   * file and load it without caching (the /proc path gets reused) */
+  if ((fd = memfd_from_mem(op->mem, op->size, path, sizeof(path))) == -1) {
+    op->err = memfd_load_error();
+    return NULL;
+  }
+#ifdef HAVE_IMLIB_LOAD_IMAGE_FD
+  /* op->path is only used as the format hint, and Imlib2 closes fd */
+  lseek(fd, 0, SEEK_SET);
+  op->im = imlib_load_image_fd(fd, op->path);
+#else
+  /* the /proc path has no extension, so there's no format hint */
+  op->im = imlib_load_image_immediately_without_cache(path);
+  close(fd);
+#endif /* HAVE_IMLIB_LOAD_IMAGE_FD */
+#endif /* HAVE_IMLIB_LOAD_IMAGE_MEM */
 
-  if (er == IMLIB_LOAD_ERROR_NONE)
-    return self;
-  if (er > IMLIB_LOAD_ERROR_UNKNOWN)
-    er = IMLIB_LOAD_ERROR_UNKNOWN;
-  raise_imlib_error(path, er);
-  
-  return Qnil;
+  op->err = op->im ? IMLIB_LOAD_ERROR_NONE : IMLIB_LOAD_ERROR_UNKNOWN;
+  return NULL;
 }
 
 /*
- * Save an Imlib2::Image to a file (no exception or error).
- * 
- * Provides access to the low-level imlib_save_image() call.  You
- * probably want to use Imlib2::Image::save() instead.
- *
- * Examples:
- *   image.save_image 'output_file.png'
- *
+ * Read just the header of op->path (or of op->mem, if set), and fill in
+ * op->w, op->h, op->has_alpha and op->format (malloc'd, or NULL).
+ * Imlib2's deferred loads stop after the header, so no pixels are
+ * decoded or allocated.
  */
-static VALUE image_save_image(VALUE self, VALUE val) {
-  ImStruct *im;
+static void *probe_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  Imlib_Image im;
+  const char *format;
+#ifdef HAVE_MEMFD_CREATE
+  char path[64];
+  int fd = -1;
+#endif /* HAVE_MEMFD_CREATE */
+
+  op->im = NULL;
+  op->format = NULL;
+  op->err = IMLIB_LOAD_ERROR_NONE;
+
+  if (op->mem) {
+#ifdef HAVE_MEMFD_CREATE
+    /* a (deferred) load from a memfd only reads the header */
+    if ((fd = memfd_from_mem(op->mem, op->size, path, sizeof(path))) != -1)
+      op->im = imlib_load_image_without_cache(path);
+    else
+      op->err = memfd_load_error();
+#elif defined(HAVE_IMLIB_LOAD_IMAGE_MEM)
+    op->im = imlib_load_image_mem(op->path, op->mem, op->size);
+#endif /* HAVE_MEMFD_CREATE */
+  } else {
+    op->im = imlib_load_image_without_cache(op->path);
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_save_image(StringValuePtr(val));
+    /* deferred loads don't say what went wrong, so ask again (this
+     * fails just as quickly) */
+    if (!op->im && (im = imlib_load_image_with_error_return(op->path, &op->err))) {
+      imlib_context_set_image(im);
+      imlib_free_image_and_decache();
+    }
+  }
 
-  return self;
+  if (op->im) {
+    imlib_context_set_image(op->im);
+    op->w = imlib_image_get_width();
+    op->h = imlib_image_get_height();
+    op->has_alpha = imlib_image_has_alpha() ? 1 : 0;
+    format = imlib_image_format();
+    op->format = format ? strdup(format) : NULL;
+    imlib_free_image_and_decache();
+    op->err = IMLIB_LOAD_ERROR_NONE;
+  } else if (op->err == IMLIB_LOAD_ERROR_NONE) {
+    op->err = IMLIB_LOAD_ERROR_UNKNOWN;
+  }
+
+#ifdef HAVE_MEMFD_CREATE
+  if (fd != -1)
+    close(fd);
+#endif /* HAVE_MEMFD_CREATE */
+
+  return NULL;
 }
 
 /*
- * Save an Imlib2::Image to a file (error returned as number).
- * 
- * Provides access to the low-level imlib_save_image_with_error_return()
- * call.  You probably want to use Imlib2::Image::save() instead.
- *
- * Examples:
- *   error = image.save_with_error_return 'output_file.png'
- *   puts 'an error occurred' unless error == 0
- *
+ * Fit w x h inside max_w x max_h (0 = no limit), keeping the aspect
+ * ratio.  Images are never scaled up.
  */
-static VALUE image_save_with_error_return(VALUE self, VALUE val) {
-  ImStruct *im;
-  Imlib_Load_Error er;
+static void fit_size(int w, int h, int max_w, int max_h, int *fit_w, int *fit_h) {
+  double scale = 1.0;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_save_image_with_error_return(StringValuePtr(val), &er);
+  if (max_w > 0 && w > max_w)
+    scale = (double) max_w / w;
+  if (max_h > 0 && h * scale > max_h)
+    scale = (double) max_h / h;
 
-  if (er > IMLIB_LOAD_ERROR_UNKNOWN)
-    er = IMLIB_LOAD_ERROR_UNKNOWN;
-  
-  return INT2FIX(er);
+  *fit_w = (int) (w * scale + 0.5);
+  *fit_h = (int) (h * scale + 0.5);
+  if (*fit_w < 1) *fit_w = 1;
+  if (*fit_h < 1) *fit_h = 1;
 }
 
-/*
- * Copy an Imlib2::Image
- *
- * Examples:
- *   new_image = old_image.clone
- *   new_image = old_image.dup
- *
- */
-static VALUE image_clone(VALUE self) {
-  ImStruct *old_im, *new_im;
-  VALUE im_o;
+#ifdef HAVE_LIBJPEG
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf               jmp;
+} JpegError;
 
-  new_im = malloc(sizeof(ImStruct));
-  GET_AND_CHECK_IMAGE(self, old_im);
-  imlib_context_set_image(old_im->im);
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  longjmp(((JpegError*) cinfo->err)->jmp, 1);
+}
 
-  return im_o;
+/* keep libjpeg warnings off stderr */
+static void jpeg_output_message(j_common_ptr cinfo) {
+  UNUSED(cinfo);
+}
+
+/* open path for reading if it's a JPEG, or return NULL */
+static FILE *jpeg_fopen(const char *path) {
+  unsigned char magic[3];
+  FILE *fp;
+
+  if (!(fp = fopen(path, "rb")))
+    return NULL;
+  if (fread(magic, 1, 3, fp) != 3 ||
+      magic[0] != 0xff || magic[1] != 0xd8 || magic[2] != 0xff) {
+    fclose(fp);
+    return NULL;
+  }
+  rewind(fp);
+
+  return fp;
+}
+
+/*
+ * Get the EXIF orientation (1-8) of a JPEG from its saved APP1 marker,
+ * or 1 if it has none.
+ */
+static int jpeg_exif_orientation(j_decompress_ptr cinfo) {
+  jpeg_saved_marker_ptr m;
+  const JOCTET *p;
+  unsigned int len, ifd, n, i, big;
+
+#define EXIF_U16(q) (big ? ((q)[0] << 8) | (q)[1] : ((q)[1] << 8) | (q)[0])
+#define EXIF_U32(q) (big ? ((unsigned int) EXIF_U16(q) << 16) | EXIF_U16((q) + 2) \
+                         : ((unsigned int) EXIF_U16((q) + 2) << 16) | EXIF_U16(q))
+
+  for (m = cinfo->marker_list; m; m = m->next) {
+    if (m->marker != JPEG_APP0 + 1 || m->data_length < 14 ||
+        memcmp(m->data, "Exif\0\0", 6))
+      continue;
+
+    /* a TIFF header, then IFD0 */
+    p = m->data + 6;
+    len = m->data_length - 6;
+    if (!memcmp(p, "MM\0*", 4))
+      big = 1;
+    else if (!memcmp(p, "II*\0", 4))
+      big = 0;
+    else
+      continue;
+
+    ifd = EXIF_U32(p + 4);
+    if (ifd > len - 2)
+      continue;
+    n = EXIF_U16(p + ifd);
+    for (i = 0; i < n && ifd + 2 + (i + 1) * 12 <= len; i++) {
+      const JOCTET *e = p + ifd + 2 + i * 12;
+
+      /* Orientation, a SHORT */
+      if (EXIF_U16(e) == 0x0112 && EXIF_U16(e + 2) == 3) {
+        unsigned int o = EXIF_U16(e + 8);
+        return o >= 1 && o <= 8 ? (int) o : 1;
+      }
+    }
+  }
+
+#undef EXIF_U16
+#undef EXIF_U32
+
+  return 1;
 }
 
 /*
- * Imlib2::Image constructor (currently just an empty placeholder).
- *
+ * Turn the context image upright for EXIF orientation o, as Imlib2's
+ * own JPEG loader does.
  */
-static VALUE image_initialize(VALUE self) {
-  return self;
+static void exif_orientate(int o) {
+  switch (o) {
+    case 2: imlib_image_flip_horizontal(); break;
+    case 3: imlib_image_orientate(2); break;
+    case 4: imlib_image_flip_vertical(); break;
+    case 5: imlib_image_flip_diagonal(); break;
+    case 6: imlib_image_orientate(1); break;
+    case 7: imlib_image_flip_diagonal(); imlib_image_orientate(2); break;
+    case 8: imlib_image_orientate(3); break;
+  }
 }
 
 /*
- * Free an Imlib2::Image object, and (optionally) de-cache it as well.
- *
- * Note: Any future operations on this image will raise an exception.
- *
- * Examples:
- *   # free image
- *   im.delete! 
- *
- *   # free image, and de-cache it too
- *   im.delete!(true)
- * 
- */
-static VALUE image_delete(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
+ * Decode a JPEG with libjpeg, letting the IDCT scale it down by 1/2,
+ * 1/4 or 1/8 while it is still at least max_w x max_h (once turned
+ * upright for its EXIF orientation, which is applied afterwards).
+ * Returns NULL (and leaves the image to Imlib2) if the file isn't a
+ * JPEG that we can decode this way.
+ */
+static Imlib_Image load_jpeg_scaled(const char *path, int max_w, int max_h) {
+  struct jpeg_decompress_struct cinfo;
+  JpegError jerr;
+  Imlib_Image volatile im = NULL;
+  unsigned char * volatile row = NULL;
+  JSAMPROW rows[1];
+  DATA32 *data;
+  FILE * volatile fp;
+  int denom, x, orientation;
+
+  if (!(fp = jpeg_fopen(path)))
+    return NULL;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  jerr.pub.output_message = jpeg_output_message;
+  if (setjmp(jerr.jmp)) {
+    /* corrupt or unsupported: let Imlib2 have a go (and report errors) */
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    free(row);
+    if (im) {
+      imlib_context_set_image(im);
+      imlib_free_image();
+    }
+    return NULL;
+  }
 
-  /* get image */
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, fp);
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header(&cinfo, TRUE);
+
+  /* CMYK needs conversion that libjpeg doesn't do */
+  if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+    longjmp(jerr.jmp, 1);
+
+  /* orientations 5-8 swap the width and height */
+  orientation = jpeg_exif_orientation(&cinfo);
+  if (orientation >= 5) {
+    x = max_w;
+    max_w = max_h;
+    max_h = x;
+  }
 
-  /* free image, and possibly de-cache it as well */
-  if (argc > 0 && argv[0] != Qnil && argv[0] != Qfalse)
-    imlib_free_image_and_decache();
-  else
-    imlib_free_image();
+  denom = (max_w > 0 || max_h > 0) ? 8 : 1;
+  for (; denom > 1; denom /= 2)
+    if ((max_w <= 0 || (int) ((cinfo.image_width + denom - 1) / denom) >= max_w) &&
+        (max_h <= 0 || (int) ((cinfo.image_height + denom - 1) / denom) >= max_h))
+      break;
 
-  /* set struct ptr to NULL */
-  im->im = NULL;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_ISLOW;
+  jpeg_start_decompress(&cinfo);
+
+  if (!(row = malloc(cinfo.output_width * 3)) ||
+      !(im = imlib_create_image(cinfo.output_width, cinfo.output_height)))
+    longjmp(jerr.jmp, 1);
+
+  imlib_context_set_image(im);
+  imlib_image_set_has_alpha(0);
+  data = imlib_image_get_data();
+  rows[0] = row;
+  while (cinfo.output_scanline < cinfo.output_height) {
+    DATA32 *p = data + (size_t) cinfo.output_scanline * cinfo.output_width;
+
+    jpeg_read_scanlines(&cinfo, rows, 1);
+    for (x = 0; x < (int) cinfo.output_width; x++)
+      p[x] = 0xff000000 | (row[x * 3] << 16) | (row[x * 3 + 1] << 8) | row[x * 3 + 2];
+  }
+  imlib_image_put_back_data(data);
 
-  return Qnil;
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(fp);
+  free(row);
+
+  exif_orientate(orientation);
+  return im;
 }
+#endif /* HAVE_LIBJPEG */
 
 /*
- * Return the width of an Imlib2::Image.
- *
- * Examples:
- *   w = image.width
- *   w = image.w
- *
+ * Load op->path and scale it to fit inside op->w x op->h.
  */
-static VALUE image_width(VALUE self) {
-  ImStruct *im;
+static void *load_scaled_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  Imlib_Image im = NULL;
+  int w, h, fit_w, fit_h;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  op->im = NULL;
+  op->err = IMLIB_LOAD_ERROR_NONE;
 
-  return INT2FIX(imlib_image_get_width());
+#ifdef HAVE_LIBJPEG
+  im = load_jpeg_scaled(op->path, op->w, op->h);
+#endif /* HAVE_LIBJPEG */
+  if (!im && !(im = imlib_load_image_with_error_return(op->path, &op->err))) {
+    if (op->err == IMLIB_LOAD_ERROR_NONE)
+      op->err = IMLIB_LOAD_ERROR_UNKNOWN;
+    return NULL;
+  }
+
+  imlib_context_set_image(im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  fit_size(w, h, op->w, op->h, &fit_w, &fit_h);
+
+  if (fit_w == w && fit_h == h) {
+    op->im = im;
+  } else {
+    op->im = imlib_create_cropped_scaled_image(0, 0, w, h, fit_w, fit_h);
+    imlib_free_image();
+    if (!op->im)
+      op->err = IMLIB_LOAD_ERROR_OUT_OF_MEMORY;
+  }
+
+  return NULL;
 }
 
-/*
- * Return the height of an Imlib2::Image.
- *
- * Examples:
- *   h = image.height
- *   h = image.h
- *
- */
-static VALUE image_height(VALUE self) {
-  ImStruct *im;
+static void *save_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  imlib_context_set_image(op->src);
+  imlib_save_image_with_error_return(op->path, &op->err);
+  return NULL;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void *save_memory_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  char path[256], *old_format;
 
-  return INT2FIX(imlib_image_get_height());
+#ifdef HAVE_MEMFD_CREATE
+  op->fd = memfd_create("imlib2-ruby", 0);
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", op->fd);
+#else
+  snprintf(path, sizeof(path), "%s/imlib2-rubyXXXXXX", P_tmpdir);
+  op->fd = mkstemp(path);
+#endif /* HAVE_MEMFD_CREATE */
+
+  if (op->fd == -1) {
+    op->err = IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS;
+    return NULL;
+  }
+
+  /* save with the requested format, then put the old one back */
+  imlib_context_set_image(op->src);
+  old_format = imlib_image_format();
+  old_format = old_format ? strdup(old_format) : NULL;
+  imlib_image_set_format(op->path);
+  imlib_save_image_with_error_return(path, &op->err);
+  if (old_format) {
+    imlib_image_set_format(old_format);
+    free(old_format);
+  }
+
+#ifndef HAVE_MEMFD_CREATE
+  unlink(path);
+#endif /* !HAVE_MEMFD_CREATE */
+
+  return NULL;
 }
 
-/*
- * Return the filename of an Imlib2::Image.
- *
- * Examples:
- *   path = image.filename
- *
- */
-static VALUE image_filename(VALUE self) {
-  ImStruct *im;
+static void *crop_scaled_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  imlib_context_set_image(op->src);
+  op->im = imlib_create_cropped_scaled_image(op->x, op->y, op->w, op->h,
+                                             op->dw, op->dh);
+  return NULL;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void *rotate_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  imlib_context_set_image(op->src);
+  op->im = imlib_create_rotated_image(op->angle);
+  return NULL;
+}
 
-  return rb_str_new2(imlib_image_get_filename());
+static void *blend_image_op(void *data) {
+  ImageOp *op = (ImageOp*) data;
+  imlib_context_set_image(op->im);
+  imlib_blend_image_onto_image(op->src, op->merge_alpha,
+                               op->x, op->y, op->w, op->h, 
+                               op->dx, op->dy, op->dw, op->dh);
+  return NULL;
+}
+
+/* Image#draw_pixels, draw_lines and fill_rects */
+enum { DRAW_PIXELS, DRAW_LINES, FILL_RECTS };
+
+typedef struct {
+  Imlib_Image im;
+  const int  *coords;
+  long        count;    /* primitives, not coordinates */
+  int         kind,
+              r, g, b, a,     /* context state to draw with */
+              blend, aa;
+} DrawManyOp;
+
+static void *draw_many_op(void *data) {
+  DrawManyOp *op = (DrawManyOp*) data;
+  const int *c = op->coords;
+  long i;
+
+  imlib_context_set_image(op->im);
+  imlib_context_set_color(op->r, op->g, op->b, op->a);
+  imlib_context_set_blend(op->blend);
+  imlib_context_set_anti_alias(op->aa);
+  switch (op->kind) {
+    case DRAW_PIXELS:
+      if (draw_pixel_workaround) {
+        /* 1x1 rectangles, without blending or anti-aliasing (see
+         * Image#draw_pixel) */
+        int blend = imlib_context_get_blend(),
+             aa = imlib_context_get_anti_alias();
+
+        imlib_context_set_blend(0);
+        imlib_context_set_anti_alias(0);
+        for (i = 0; i < op->count; i++, c += 2)
+          imlib_image_draw_rectangle(c[0], c[1], 1, 1);
+        imlib_context_set_blend(blend);
+        imlib_context_set_anti_alias(aa);
+      } else {
+        for (i = 0; i < op->count; i++, c += 2)
+          (void) imlib_image_draw_pixel(c[0], c[1], 0);
+      }
+      break;
+    case DRAW_LINES:
+      for (i = 0; i < op->count; i++, c += 4)
+        (void) imlib_image_draw_line(c[0], c[1], c[2], c[3], 0);
+      break;
+    case FILL_RECTS:
+      for (i = 0; i < op->count; i++, c += 4)
+        imlib_image_fill_rectangle(c[0], c[1], c[2], c[3]);
+      break;
+  }
+
+  return NULL;
+}
+
+/***************************************/
+/* PARALLEL PIXEL KERNELS              */
+/* (blur, sharpen, filters; raw DATA32 */
+/* buffers, split into bands across    */
+/* threads)                            */
+/***************************************/
+/* rows per band; each band is one task for the worker threads */
+#define KERNEL_BAND 64
+
+/* the most worker threads a kernel will start */
+#define MAX_KERNEL_THREADS 64
+
+/* threads per kernel, 0 = one per CPU (see Imlib2.threads=) */
+static int kernel_threads = 0;
+
+typedef struct {
+  void (*func)(void *, long);
+  void  *data;
+  long   num_tasks,
+         next;          /* next unclaimed task (shared by threads) */
+  int    helpers;       /* pool threads still to join in */
+} ParallelFor;
+
+static void parallel_for_run(ParallelFor *pf) {
+  long i;
+
+  while ((i = __sync_fetch_and_add(&pf->next, 1)) < pf->num_tasks)
+    pf->func(pf->data, i);
+}
+
+static int num_kernel_threads(void) {
+  int n = kernel_threads;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  if (n <= 0)
+    n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif /* _SC_NPROCESSORS_ONLN */
+
+  if (n < 1)
+    n = 1;
+  return n > MAX_KERNEL_THREADS ? MAX_KERNEL_THREADS : n;
 }
 
+#ifdef HAVE_PTHREAD_CREATE
 /*
- * Return a copy of an image's raw 32-bit data.
- *
- * Examples:
- *   raw = image.data
- *
+ * The kernel thread pool: threads are started the first time a kernel
+ * needs them, then sleep on pool_wake between kernels.  One kernel uses
+ * the pool at a time (pool_owned); the job it posts in pool_job is
+ * joined by up to pf->helpers pool threads.
  */
-static VALUE image_data(VALUE self) {
-  ImStruct *im;
-  int       w, h;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_wake = PTHREAD_COND_INITIALIZER,
+                       pool_idle = PTHREAD_COND_INITIALIZER;
+static ParallelFor    *pool_job = NULL;
+static int             pool_size = 0,
+                       pool_working = 0,
+                       pool_owned = 0;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  w = imlib_image_get_width();
-  h = imlib_image_get_height();
+static void *pool_worker(void *data) {
+  ParallelFor *pf;
 
-  return rb_str_new((char*) imlib_image_get_data(), h * w * 4);
+  UNUSED(data);
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (!pool_job || pool_job->helpers == 0)
+      pthread_cond_wait(&pool_wake, &pool_lock);
+
+    pf = pool_job;
+    pf->helpers--;
+    pool_working++;
+    pthread_mutex_unlock(&pool_lock);
+
+    parallel_for_run(pf);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_working == 0)
+      pthread_cond_signal(&pool_idle);
+  }
+
+  return NULL;
+}
+
+/* the pool's threads aren't copied by fork(), so start over */
+static void pool_atfork_child(void) {
+  pthread_mutex_init(&pool_lock, NULL);
+  pthread_cond_init(&pool_wake, NULL);
+  pthread_cond_init(&pool_idle, NULL);
+  pool_job = NULL;
+  pool_size = pool_working = pool_owned = 0;
 }
 
 /*
- * Return a read-only reference to an image's raw 32-bit data.
- *
- * Examples:
- *   RAW_DATA = image.data_for_reading_only
- *   RAW_DATA = image.data!
- *
+ * Grow the pool to n threads (or as many as we can start).  Signals are
+ * blocked in the pool threads, so they're always delivered to Ruby's.
+ * Called with pool_lock held.
  */
-static VALUE image_data_ro(VALUE self) {
-  ImStruct *im;
-  int       w, h;
+static void pool_grow(int n) {
+  static int atfork = 0;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  w = imlib_image_get_width();
-  h = imlib_image_get_height();
+  if (pool_size >= n)
+    return;
+  if (!atfork)
+    atfork = !pthread_atfork(NULL, NULL, pool_atfork_child);
 
-  return rb_str_new((char*) imlib_image_get_data_for_reading_only(), h * w * 4);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  while (pool_size < n && !pthread_create(&thread, &attr, pool_worker, NULL))
+    pool_size++;
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
 }
+#endif /* HAVE_PTHREAD_CREATE */
 
 /*
- * Fill an image using raw 32-bit data.
- *
- * Note: The new data buffer must be the same size (in bytes) as the
- * original data buffer.
- *
- * Examples:
- *   RAW_DATA = other_image.data!
- *   image.put_data RAW_DATA
- *
- *   RAW_DATA = other_image.data!
- *   image.data = RAW_DATA
- *
+ * Call func(data, i) for every i in [0, num_tasks), spread across the
+ * kernel threads (the calling thread is one of them).  The other
+ * threads come from a pool that persists between calls; if another
+ * kernel is already using it, everything runs in the calling thread.
+ * func must not touch Ruby or Imlib2.  Without pthreads, everything
+ * runs in the calling thread.
  */
-static VALUE image_put_data(VALUE self, VALUE str) {
-  ImStruct *im;
-  DATA32 *old_data, *new_data;
-  int w, h, old_size;
-
-  /* get image, check it, then set the context */
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void parallel_for(void (*func)(void *, long), void *data, long num_tasks) {
+  ParallelFor pf;
+#ifdef HAVE_PTHREAD_CREATE
+  int n = num_kernel_threads(), owner = 0;
 
-  /* get old data, calculate buffer size from width and height */
-  old_data = imlib_image_get_data();
-  w = imlib_image_get_width();
-  h = imlib_image_get_height();
-  old_size = w * h * 4;
+  if (n > num_tasks)
+    n = (int) num_tasks;
+#endif /* HAVE_PTHREAD_CREATE */
 
-  /* get new data, check size of buffer */
-  new_data = (DATA32*) StringValuePtr(str);
-  
-  /* check size of new buffer */
-  if (RSTRING_LEN(str) != old_size)
-    rb_raise(rb_eArgError, "invalid buffer size");
-  
-  /* copy new data to old address */
-  if (old_data != new_data)
-    memcpy(old_data, new_data, old_size);
-  
-  /* actual put_back_data() call */
-  imlib_image_put_back_data(old_data);
+  pf.func = func;
+  pf.data = data;
+  pf.num_tasks = num_tasks;
+  pf.next = 0;
+  pf.helpers = 0;
 
-  /* return success */
-  return Qtrue;
+#ifdef HAVE_PTHREAD_CREATE
+  if (n > 1) {
+    pthread_mutex_lock(&pool_lock);
+    if (!pool_owned) {
+      pool_owned = owner = 1;
+      pool_grow(n - 1);
+      pf.helpers = pool_size < n - 1 ? pool_size : n - 1;
+      pool_job = &pf;
+      pthread_cond_broadcast(&pool_wake);
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+#endif /* HAVE_PTHREAD_CREATE */
+
+  parallel_for_run(&pf);
+
+#ifdef HAVE_PTHREAD_CREATE
+  if (owner) {
+    /* stop latecomers from joining in, and wait for the rest */
+    pthread_mutex_lock(&pool_lock);
+    pool_job = NULL;
+    while (pool_working > 0)
+      pthread_cond_wait(&pool_idle, &pool_lock);
+    pool_owned = 0;
+    pthread_mutex_unlock(&pool_lock);
+  }
+#endif /* HAVE_PTHREAD_CREATE */
 }
 
 /*
- * Does this image have transparent or translucent regions?
+ * Number of threads used by the parallel pixel kernels (blur, sharpen,
+ * static filters), or 0 for one per CPU.
  *
  * Examples:
- *   if image.has_alpha? 
- *     puts 'this image has alpha'
- *   end
+ *   puts "kernels use #{Imlib2::threads} threads"
  *
  */
-static VALUE image_has_alpha(VALUE self) {
-  ImStruct *im;
-
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-
-  return imlib_image_has_alpha() ? Qtrue : Qfalse;
+static VALUE imlib2_threads(VALUE klass) {
+  UNUSED(klass);
+  return INT2FIX(kernel_threads);
 }
 
 /*
- * Set image alpha transparency.
+ * Set the number of threads used by the parallel pixel kernels (blur,
+ * sharpen, static filters).  0 (the default) means one per CPU, and 1
+ * keeps them in the calling thread.  The kernels run outside of the GVL when
+ * Imlib2::release_gvl is set.
  *
  * Examples:
- *   image.set_has_alpha true 
- *   image.has_alpha = true 
+ *   Imlib2::threads = 4
  *
  */
-static VALUE image_set_has_alpha(VALUE self, VALUE val) {
-  ImStruct *im;
+static VALUE imlib2_set_threads(VALUE klass, VALUE val) {
+  UNUSED(klass);
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_set_has_alpha(val == Qtrue);
+  kernel_threads = NUM2INT(val);
+  if (kernel_threads < 0)
+    kernel_threads = 0;
 
   return val;
 }
 
+typedef struct {
+  const DATA32 *src;
+  DATA32       *dst;
+  int           w, h,
+                radius;
+  const void   *arg;    /* kernel specific (eg a compiled filter) */
+  void        (*band)(void *, long);
+} PixelKernel;
+
+static void *pixel_kernel_op(void *data) {
+  PixelKernel *k = (PixelKernel*) data;
+
+  parallel_for(k->band, k, (k->h + KERNEL_BAND - 1) / KERNEL_BAND);
+  return NULL;
+}
+
 /*
- * Flag this image as changing on disk
- *
- * Examples:
- *   image.changes_on_disk
- *
+ * Run k->band over every band of im, writing into dst: either a copy of
+ * im, or im itself (in which case the kernel reads from a snapshot).
+ * Writing im in place marks Imlib2 busy for the whole kernel, so other
+ * threads can't use (or draw on) the image until it is put back.
+ * Must be called after GET_AND_CHECK_IMAGE (ie after enter_imlib()).
  */
-static VALUE image_changes_on_disk(VALUE self) {
-  ImStruct *im;
+static void run_pixel_kernel(ImStruct *im, Imlib_Image dst, PixelKernel *k) {
+  DATA32 *copy = NULL;
+  size_t size;
 
-  GET_AND_CHECK_IMAGE(self, im);
   imlib_context_set_image(im->im);
-  imlib_image_set_changes_on_disk();
+  k->w = imlib_image_get_width();
+  k->h = imlib_image_get_height();
+  k->src = imlib_image_get_data_for_reading_only();
+  if (dst == im->im) {
+    size = (size_t) k->w * k->h;
+    copy = ALLOC_N(DATA32, size);
+    memcpy(copy, k->src, size * sizeof(DATA32));
+    k->src = copy;
+  }
 
-  return Qtrue;
-}
+  imlib_context_set_image(dst);
+  k->dst = imlib_image_get_data();
+
+  im->exports++;
+  if (copy)
+    call_imlib(pixel_kernel_op, k);
+  else
+    call_without_gvl(pixel_kernel_op, k);
+  im->exports--;
+
+  imlib_context_set_image(dst);
+  imlib_image_put_back_data(k->dst);
+  xfree(copy);
+}
 
 /*
- * Get the Imlib2::Border of an Imlib2::Image
- *
- * Examples:
- *   border = image.get_border
- *   border = image.border
- *
+ * Add (sign > 0) or subtract a row of w pixels to or from the column
+ * sums of a box blur.
  */
-static VALUE image_get_border(VALUE self) {
-  ImStruct *im;
-  Imlib_Border *border;
-  VALUE argv[4];
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-
-  border = malloc(sizeof(Imlib_Border));
-  imlib_image_get_border(border);
-  argv[0] = INT2NUM(border->left);
-  argv[1] = INT2NUM(border->top);
-  argv[2] = INT2NUM(border->right);
-  argv[3] = INT2NUM(border->bottom);
-  free(border);
+static void box_blur_sum_row(int *vs, const DATA32 *s, int w, int sign) {
+  int x, i;
 
-  return border_new(4, argv, cBorder);
+  if (sign > 0) {
+    for (x = 0; x < w; x++)
+      for (i = 0; i < 4; i++)
+        vs[x * 4 + i] += (s[x] >> (i * 8)) & 0xff;
+  } else {
+    for (x = 0; x < w; x++)
+      for (i = 0; i < 4; i++)
+        vs[x * 4 + i] -= (s[x] >> (i * 8)) & 0xff;
+  }
 }
 
 /*
- * Set the Imlib2::Border of an Imlib2::Image
- *
- * Examples:
- *   image.set_border border
- *   image.border = border
- *
+ * Write a row of a box blur from the column sums of the rows rows in its
+ * box, sliding the box sum along the row.
  */
-static VALUE image_set_border(VALUE self, VALUE border) {
-  ImStruct *im;
-  Imlib_Border *b;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  Data_Get_Struct(border, Imlib_Border, b);
-  imlib_image_set_border(b);
+static void box_blur_row(const int *vs, DATA32 *d, int w, int r, int rows) {
+  long long sum[4] = { 0, 0, 0, 0 };
+  int x, i;
 
-  return border;
+  for (x = 0; x <= r && x < w; x++)
+    for (i = 0; i < 4; i++)
+      sum[i] += vs[x * 4 + i];
+
+  for (x = 0; x < w; x++) {
+    int left = x - r < 0 ? 0 : x - r,
+        right = x + r > w - 1 ? w - 1 : x + r;
+    long long n = (long long) (right - left + 1) * rows;
+    DATA32 p = 0;
+
+    if (x > 0) {
+      if (x + r < w)
+        for (i = 0; i < 4; i++)
+          sum[i] += vs[(x + r) * 4 + i];
+      if (x - r - 1 >= 0)
+        for (i = 0; i < 4; i++)
+          sum[i] -= vs[(x - r - 1) * 4 + i];
+    }
+
+    for (i = 0; i < 4; i++)
+      p |= (DATA32) (sum[i] / n) << (i * 8);
+    d[x] = p;
+  }
 }
 
 /*
- * Get the on-disk format of an Imlib2::Image
- *
- * Examples:
- *   format = image.get_format
- *   format = image.format
- *
+ * Box blur, as imlib_image_blur() does it: each pixel becomes the mean
+ * of the (2 * radius + 1)^2 box around it, clipped to the image.  The
+ * box sums are kept as running sums (down each column, then along each
+ * row), so the cost doesn't depend on the radius.
  */
-static VALUE image_get_format(VALUE self) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void box_blur_band(void *data, long band) {
+  PixelKernel *k = (PixelKernel*) data;
+  int w = k->w, h = k->h, r = k->radius,
+      y0 = (int) band * KERNEL_BAND,
+      y1 = y0 + KERNEL_BAND > h ? h : y0 + KERNEL_BAND,
+      y;
+  int *vs = malloc(sizeof(int) * 4 * w);
 
-  return rb_str_new2(imlib_image_format());
+  if (!vs) {
+    memcpy(k->dst + (size_t) y0 * w, k->src + (size_t) y0 * w,
+           sizeof(DATA32) * w * (y1 - y0));
+    return;
+  }
+
+  /* column sums for the first row of the band */
+  memset(vs, 0, sizeof(int) * 4 * w);
+  for (y = (y0 - r < 0 ? 0 : y0 - r); y <= y0 + r && y < h; y++)
+    box_blur_sum_row(vs, k->src + (size_t) y * w, w, 1);
+
+  for (y = y0; y < y1; y++) {
+    int top = y - r < 0 ? 0 : y - r,
+        bottom = y + r > h - 1 ? h - 1 : y + r;
+
+    /* slide the column sums down a row */
+    if (y > y0) {
+      if (y + r < h)
+        box_blur_sum_row(vs, k->src + (size_t) (y + r) * w, w, 1);
+      if (y - r - 1 >= 0)
+        box_blur_sum_row(vs, k->src + (size_t) (y - r - 1) * w, w, -1);
+    }
+
+    box_blur_row(vs, k->dst + (size_t) y * w, w, r, bottom - top + 1);
+  }
+
+  free(vs);
 }
 
 /*
- * Set the on-disk format of an Imlib2::Image
- *
- * Examples:
- *   image.get_format 'png'
- *   image.format = 'png'
- *
+ * Sharpen a row s (with the rows up and down around it) into d: 5 * the
+ * pixel minus its four neighbours, per channel.  The first and last
+ * pixels are left as they are.
  */
-static VALUE image_set_format(VALUE self, VALUE format) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_set_format(StringValuePtr(format));
+static void sharpen_row(const DATA32 *up, const DATA32 *s,
+                        const DATA32 *down, DATA32 *d, int w) {
+  int x, i;
 
-  return format;
+  if (w < 3) {
+    memcpy(d, s, sizeof(DATA32) * w);
+    return;
+  }
+
+  d[0] = s[0];
+  d[w - 1] = s[w - 1];
+  for (x = 1; x < w - 1; x++) {
+    DATA32 p = 0;
+
+    for (i = 0; i < 32; i += 8) {
+      int c = 5 * (int) ((s[x] >> i) & 0xff) -
+              (int) ((s[x - 1] >> i) & 0xff) -
+              (int) ((s[x + 1] >> i) & 0xff) -
+              (int) ((up[x] >> i) & 0xff) -
+              (int) ((down[x] >> i) & 0xff);
+
+      p |= (DATA32) (c < 0 ? 0 : (c > 255 ? 255 : c)) << i;
+    }
+    d[x] = p;
+  }
 }
 
 /*
- * Set the irrelevant_format flag of an Imlib2::Image
- *
- * Examples:
- *   image.set_irrelevant_format true
- *   image.irrelevant_format = true
- *
+ * Sharpen, as imlib_image_sharpen() does it: 5 * the pixel minus its
+ * four neighbours, per channel.  Edge pixels are left as they are.
  */
-static VALUE image_irrelevant_format(VALUE self, VALUE val) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_set_irrelevant_format(val != Qfalse);
+static void sharpen_band(void *data, long band) {
+  PixelKernel *k = (PixelKernel*) data;
+  int w = k->w, h = k->h,
+      y0 = (int) band * KERNEL_BAND,
+      y1 = y0 + KERNEL_BAND > h ? h : y0 + KERNEL_BAND,
+      y;
 
-  return val;
+  for (y = y0; y < y1; y++) {
+    const DATA32 *s = k->src + (size_t) y * w;
+    DATA32 *d = k->dst + (size_t) y * w;
+
+    if (y == 0 || y == h - 1)
+      memcpy(d, s, sizeof(DATA32) * w);
+    else
+      sharpen_row(s - w, s, s + w, d, w);
+  }
 }
 
 /*
- * Set the irrelevant_border flag of an Imlib2::Image
- *
- * Examples:
- *   image.set_irrelevant_border true
- *   image.irrelevant_border = true
- *
+ * Blur im into dst (a copy of im, or im itself).  Radii below 1, and
+ * boxes at least as wide as the image, leave the image alone, like
+ * imlib_image_blur().
  */
-static VALUE image_irrelevant_border(VALUE self, VALUE val) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
+static void blur_image(ImStruct *im, Imlib_Image dst, int radius) {
+  PixelKernel k;
+  int w;
+  unsigned long long start = OP_STATS_BEGIN();
+
+  if (radius < 1)
+    return;
+
+  /* w <= 2 * radius + 1, without overflowing */
   imlib_context_set_image(im->im);
-  imlib_image_set_irrelevant_border(val != Qfalse);
+  w = imlib_image_get_width();
+  if (radius >= w / 2)
+    return;
 
-  return val;
+  k.radius = radius;
+  k.band = box_blur_band;
+  run_pixel_kernel(im, dst, &k);
+  OP_STATS_END(STAT_BLUR, start, im->bytes, im->bytes / 4);
 }
 
 /*
- * Set the irrelevant_alpha flag of an Imlib2::Image
- *
- * Examples:
- *   image.set_irrelevant_alpha true
- *   image.irrelevant_alpha = true
- *
+ * Sharpen im into dst (a copy of im, or im itself).  Like
+ * imlib_image_sharpen(), the radius only matters if it's 0 (no-op).
  */
-static VALUE image_irrelevant_alpha(VALUE self, VALUE val) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_set_irrelevant_alpha(val != Qfalse);
+static void sharpen_image(ImStruct *im, Imlib_Image dst, int radius) {
+  PixelKernel k;
+  unsigned long long start = OP_STATS_BEGIN();
 
-  return val;
+  if (radius == 0)
+    return;
+
+  k.radius = radius;
+  k.band = sharpen_band;
+  run_pixel_kernel(im, dst, &k);
+  OP_STATS_END(STAT_SHARPEN, start, im->bytes, im->bytes / 4);
 }
 
 /*
- * Get the Imlib2::Color::RgbaColor value of the pixel at x, y
- *
- * Examples:
- *   color = image.query_pixel 320, 240
- *   color = image.pixel 320, 240
- *
+ * A filter channel compiled for the convolution engine: either a list
+ * of taps with precomputed pixel offsets, or, when the kernel only reads
+ * one source channel and is rank-1 (eg box, Gaussian and Sobel kernels),
+ * a row kernel and a column kernel applied in two passes.
  */
-static VALUE image_query_pixel(VALUE self, VALUE x, VALUE y) {
-  ImStruct *im;
-  Imlib_Color color;
-  VALUE argv[4];
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+typedef struct {
+  int        div, cons,
+             min_x, max_x, min_y, max_y;  /* extent of the kernel */
+  FilterTap *taps;                        /* NULL = leave channel alone */
+  long      *offsets;                     /* of each tap, in pixels */
+  int        num_taps,
+             src,                         /* separable: source channel */
+            *row, *col;                   /* separable: 1-D kernels */
+  long long  pivot;                       /* separable: row x col / pivot */
+} ConvChannel;
 
-  imlib_image_query_pixel(NUM2INT(x), NUM2INT(y), &color);
-  argv[0] = INT2NUM(color.red);
-  argv[1] = INT2NUM(color.green);
-  argv[2] = INT2NUM(color.blue);
-  argv[3] = INT2NUM(color.alpha);
+typedef struct {
+  ConvChannel ch[4];
+} Convolution;
 
-  return rgba_color_new(4, argv, cRgbaColor);
+static void conv_free(Convolution *cv) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    xfree(cv->ch[i].taps);
+    xfree(cv->ch[i].offsets);
+    xfree(cv->ch[i].row);
+    xfree(cv->ch[i].col);
+  }
 }
 
 /*
- * Get the Imlib2::Color::HsvaColor value of the pixel at x, y
- *
- * Examples:
- *   color = image.query_pixel_hsva 320, 240
- *   color = image.pixel_hsva 320, 240
- *
+ * Split a one-source-channel kernel into row and column kernels, if it
+ * is rank-1: k(x, y) = col(y) * row(x) / pivot, all in integers, with
+ * pivot the first non-zero weight.
  */
-static VALUE image_query_pixel_hsva(VALUE self, VALUE x, VALUE y) {
-  ImStruct *im;
-  float hue, saturation, value;
-  int alpha;
-  VALUE argv[4];
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void conv_separate(ConvChannel *cc, int src) {
+  int kw = cc->max_x - cc->min_x + 1, kh = cc->max_y - cc->min_y + 1,
+      i, x, y, px = -1, py = -1;
+  int *k;
 
-  imlib_image_query_pixel_hsva(NUM2INT(x), NUM2INT(y), &hue, &saturation, &value, &alpha);
-  argv[0] = rb_float_new(hue);
-  argv[1] = rb_float_new(saturation);
-  argv[2] = rb_float_new(value);
-  argv[3] = INT2NUM(alpha);
+  /* a dense kernel is only worth it if it's not mostly empty */
+  if ((long) kw * kh > 4L * cc->num_taps + 16)
+    return;
 
-  return hsva_color_new(4, argv, cHsvaColor);
+  k = ALLOC_N(int, (size_t) kw * kh);
+  memset(k, 0, sizeof(int) * kw * kh);
+  for (i = 0; i < cc->num_taps; i++)
+    k[(cc->taps[i].y - cc->min_y) * kw + cc->taps[i].x - cc->min_x] =
+      cc->taps[i].w[src];
+
+  for (i = 0; i < kw * kh && px < 0; i++)
+    if (k[i]) {
+      px = i % kw;
+      py = i / kw;
+    }
+
+  if (px >= 0) {
+    for (y = 0; y < kh; y++)
+      for (x = 0; x < kw; x++)
+        if ((long long) k[y * kw + x] * k[py * kw + px] !=
+            (long long) k[y * kw + px] * k[py * kw + x])
+          goto done;
+
+    cc->src = src;
+    cc->pivot = k[py * kw + px];
+    cc->row = ALLOC_N(int, kw);
+    cc->col = ALLOC_N(int, kh);
+    for (x = 0; x < kw; x++)
+      cc->row[x] = k[py * kw + x];
+    for (y = 0; y < kh; y++)
+      cc->col[y] = k[y * kw + px];
+  }
+
+done:
+  xfree(k);
+}
+
+/*
+ * Compile a filter for an image w pixels wide.  The taps are copied, so
+ * the filter may change while the kernel runs.
+ */
+static void conv_compile(Convolution *cv, const FilterStruct *f, int w) {
+  int c, i, j, src;
+
+  memset(cv, 0, sizeof(Convolution));
+  for (c = 0; c < 4; c++) {
+    const FilterChannel *fc = &f->ch[c];
+    ConvChannel *cc = &cv->ch[c];
+    int div = fc->div;
+
+    /* like Imlib2, a divisor of 0 means the sum of all the weights, and
+     * a channel whose divisor is still 0 is left as it is */
+    if (!div)
+      for (i = 0; i < fc->num_taps; i++)
+        for (j = 0; j < 4; j++)
+          div += fc->taps[i].w[j];
+    if (!div || !fc->num_taps)
+      continue;
+
+    cc->div = div;
+    cc->cons = fc->cons;
+    cc->num_taps = fc->num_taps;
+    cc->taps = ALLOC_N(FilterTap, fc->num_taps);
+    cc->offsets = ALLOC_N(long, fc->num_taps);
+    memcpy(cc->taps, fc->taps, sizeof(FilterTap) * fc->num_taps);
+
+    cc->min_x = cc->max_x = cc->taps[0].x;
+    cc->min_y = cc->max_y = cc->taps[0].y;
+    for (i = 0; i < cc->num_taps; i++) {
+      FilterTap *t = &cc->taps[i];
+
+      if (t->x < cc->min_x) cc->min_x = t->x;
+      if (t->x > cc->max_x) cc->max_x = t->x;
+      if (t->y < cc->min_y) cc->min_y = t->y;
+      if (t->y > cc->max_y) cc->max_y = t->y;
+      cc->offsets[i] = (long) t->y * w + t->x;
+    }
+
+    /* separable only if every tap reads the same single channel */
+    for (src = -1, i = 0; i < cc->num_taps && src != -2; i++)
+      for (j = 0; j < 4; j++)
+        if (cc->taps[i].w[j])
+          src = (src == -1 || src == j) ? j : -2;
+    if (src >= 0)
+      conv_separate(cc, src);
+  }
 }
 
+/* finish a channel's sum, as Imlib2 does, and store it in *d */
+#define CONV_STORE(d, cc, c, sum) do { \
+  int v_ = (int) ((sum) / (cc)->div) + (cc)->cons; \
+  v_ = v_ < 0 ? 0 : (v_ > 255 ? 255 : v_); \
+  *(d) = (*(d) & ~((DATA32) 0xff << ((c) * 8))) | ((DATA32) v_ << ((c) * 8)); \
+} while (0)
+
+#define CLAMP_TO(v, n) ((v) < 0 ? 0 : ((v) >= (n) ? (n) - 1 : (v)))
+
 /*
- * Get the Imlib2::Color::HlsaColor value of the pixel at x, y
- *
- * Examples:
- *   color = image.query_pixel_hlsa 320, 240
- *   color = image.pixel_hlsa 320, 240
- *
+ * Direct convolution of channel c over rows [y0, y1).  Pixels whose
+ * whole kernel is inside the image use the precomputed offsets; the
+ * rest clamp each tap to the edge, like Imlib2.
  */
-static VALUE image_query_pixel_hlsa(VALUE self, VALUE x, VALUE y) {
-  ImStruct *im;
-  float hue, lightness, saturation;
-  int alpha;
-  VALUE argv[4];
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void conv_taps(const PixelKernel *k, const ConvChannel *cc, int c,
+                      int y0, int y1) {
+  int w = k->w, h = k->h, x, y, i, j;
 
-  imlib_image_query_pixel_hsva(NUM2INT(x), NUM2INT(y), &hue, &lightness, &saturation, &alpha);
-  argv[0] = rb_float_new(hue);
-  argv[1] = rb_float_new(lightness);
-  argv[2] = rb_float_new(saturation);
-  argv[3] = INT2NUM(alpha);
+  for (y = y0; y < y1; y++) {
+    DATA32 *d = k->dst + (size_t) y * w;
+    int inside_y = y + cc->min_y >= 0 && y + cc->max_y < h;
 
-  return hlsa_color_new(4, argv, cHlsaColor);
+    for (x = 0; x < w; x++) {
+      int sum = 0;
+
+      if (inside_y && x + cc->min_x >= 0 && x + cc->max_x < w) {
+        const DATA32 *s = k->src + (size_t) y * w + x;
+
+        for (i = 0; i < cc->num_taps; i++) {
+          DATA32 p = s[cc->offsets[i]];
+          const int *tw = cc->taps[i].w;
+
+          sum += tw[0] * (int) (p & 0xff) + tw[1] * (int) ((p >> 8) & 0xff) +
+                 tw[2] * (int) ((p >> 16) & 0xff) + tw[3] * (int) (p >> 24);
+        }
+      } else {
+        for (i = 0; i < cc->num_taps; i++) {
+          const FilterTap *t = &cc->taps[i];
+          int sx = CLAMP_TO(x + t->x, w), sy = CLAMP_TO(y + t->y, h);
+          DATA32 p = k->src[(size_t) sy * w + sx];
+
+          for (j = 0; j < 4; j++)
+            sum += t->w[j] * (int) ((p >> (j * 8)) & 0xff);
+        }
+      }
+
+      CONV_STORE(&d[x], cc, c, sum);
+    }
+  }
 }
 
 /*
- * Get the Imlib2::Color::CmyaColor value of the pixel at x, y
- *
- * Examples:
- *   color = image.query_pixel_cmya 320, 240
- *   color = image.pixel_cmya 320, 240
- *
- */
-static VALUE image_query_pixel_cmya(VALUE self, VALUE x, VALUE y) {
-  ImStruct *im;
-  CmyaColor color;
-  VALUE argv[4];
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+ * Separable convolution of channel c over rows [y0, y1): filter the
+ * source rows the band needs with the row kernel, then combine them
+ * down each column.  Both inner loops are plain integer multiply-adds
+ * over contiguous memory, which the compiler vectorizes.
+ */
+static void conv_separable(const PixelKernel *k, const ConvChannel *cc, int c,
+                           int y0, int y1) {
+  int w = k->w, h = k->h, kw = cc->max_x - cc->min_x + 1,
+      kh = cc->max_y - cc->min_y + 1, shift = cc->src * 8,
+      r0 = CLAMP_TO(y0 + cc->min_y, h), r1 = CLAMP_TO(y1 - 1 + cc->max_y, h),
+      x, y, i;
+  int *rows = malloc(sizeof(int) * w * (size_t) (r1 - r0 + 1)),
+      *line = malloc(sizeof(int) * (w + kw));
+  long long *acc = malloc(sizeof(long long) * w);
+
+  if (!rows || !line || !acc) {
+    free(rows);
+    free(line);
+    free(acc);
+    conv_taps(k, cc, c, y0, y1);
+    return;
+  }
 
-  imlib_image_query_pixel_cmya(NUM2INT(x), NUM2INT(y), &color.cyan, &color.magenta, &color.yellow, &color.alpha);
-  argv[0] = INT2NUM(color.cyan);
-  argv[1] = INT2NUM(color.magenta);
-  argv[2] = INT2NUM(color.yellow);
-  argv[3] = INT2NUM(color.alpha);
+  for (y = r0; y <= r1; y++) {
+    const DATA32 *s = k->src + (size_t) y * w;
+    int *out = rows + (size_t) (y - r0) * w;
 
-  return cmya_color_new(4, argv, cCmyaColor);
+    /* the row's channel, padded by repeating the edge pixels */
+    for (x = 0; x < w + kw - 1; x++) {
+      int sx = CLAMP_TO(x + cc->min_x, w);
+      line[x] = (s[sx] >> shift) & 0xff;
+    }
+    for (x = 0; x < w; x++)
+      out[x] = 0;
+    for (i = 0; i < kw; i++) {
+      int wt = cc->row[i];
+      const int *l = line + i;
+
+      if (wt)
+        for (x = 0; x < w; x++)
+          out[x] += wt * l[x];
+    }
+  }
+
+  for (y = y0; y < y1; y++) {
+    DATA32 *d = k->dst + (size_t) y * w;
+
+    for (x = 0; x < w; x++)
+      acc[x] = 0;
+    for (i = 0; i < kh; i++) {
+      const int *r = rows + (size_t) (CLAMP_TO(y + cc->min_y + i, h) - r0) * w;
+      long long wt = cc->col[i];
+
+      if (wt)
+        for (x = 0; x < w; x++)
+          acc[x] += wt * r[x];
+    }
+    for (x = 0; x < w; x++)
+      CONV_STORE(&d[x], cc, c, acc[x] / cc->pivot);
+  }
+
+  free(rows);
+  free(line);
+  free(acc);
+}
+
+static void convolve_band(void *data, long band) {
+  PixelKernel *k = (PixelKernel*) data;
+  const Convolution *cv = (const Convolution*) k->arg;
+  int y0 = (int) band * KERNEL_BAND,
+      y1 = y0 + KERNEL_BAND > k->h ? k->h : y0 + KERNEL_BAND, c;
+
+  /* channels without a kernel keep their source values */
+  memcpy(k->dst + (size_t) y0 * k->w, k->src + (size_t) y0 * k->w,
+         sizeof(DATA32) * k->w * (y1 - y0));
+
+  for (c = 0; c < 4; c++) {
+    const ConvChannel *cc = &cv->ch[c];
+
+    if (!cc->taps)
+      continue;
+    if (cc->row)
+      conv_separable(k, cc, c, y0, y1);
+    else
+      conv_taps(k, cc, c, y0, y1);
+  }
 }
 
 /*
- * Return a cropped copy of the image
- *
- * Examples:
- *   x, y, w, h = 10, 10, old_image.width - 10, old_image.height - 10
- *   new_image = old_image.crop x, y, w, h
- *
- *   rect = [10, 10, old_image.width - 10, old_image.height - 10]
- *   new_image = old_image.crop rect
- *
- *   x, y, w, h = 10, 10, old_image.width - 10, old_image.height - 10
- *   new_image = old_image.create_cropped x, y, w, h
- *
- *   rect = [10, 10, old_image.width - 10, old_image.height - 10]
- *   new_image = old_image.create_cropped rect
- *
+ * Apply a filter to im in place, as imlib_image_filter() would.
  */
-static VALUE image_crop(int argc, VALUE *argv, VALUE self) {
-  ImStruct *old_im, *new_im;
-  VALUE im_o;
-  int x = 0, y = 0, w = 0, h = 0;
-  
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+static void filter_image(ImStruct *im, const FilterStruct *f) {
+  Convolution cv;
+  PixelKernel k;
+
+  imlib_context_set_image(im->im);
+  conv_compile(&cv, f, imlib_image_get_width());
+
+  k.arg = &cv;
+  k.band = convolve_band;
+  run_pixel_kernel(im, im->im, &k);
+
+  conv_free(&cv);
+}
+
+/* formats for Image#pixels */
+enum {
+  PIXELS_ARGB32,
+  PIXELS_RGBA8,
+  PIXELS_BGRA8,
+  PIXELS_RGB8,
+  PIXELS_CMYA8,
+  PIXELS_HSVA_F32,
+  PIXELS_HLSA_F32
+};
+
+static const struct {
+  const char *name;
+  int         bytes;    /* per pixel */
+} pixel_formats[] = {
+  { "argb32",   4 },
+  { "rgba8",    4 },
+  { "bgra8",    4 },
+  { "rgb8",     3 },
+  { "cmya8",    4 },
+  { "hsva_f32", 16 },
+  { "hlsa_f32", 16 },
+  { NULL,       0 }
+};
+
+typedef struct {
+  const DATA32 *src;      /* first pixel of the region */
+  int           stride,   /* of the image, in pixels */
+                w, h,
+                format;
+  char         *out;
+} PixelsOp;
+
+/* hue in degrees, as imlib_image_query_pixel_hsva() returns it */
+static float pixel_hue(int r, int g, int b, int max, int delta) {
+  float hue;
+
+  if (r == max)
+    hue = (float) (g - b) / delta;
+  else if (g == max)
+    hue = 2.0f + (float) (b - r) / delta;
+  else
+    hue = 4.0f + (float) (r - g) / delta;
+
+  hue *= 60.0f;
+  return hue < 0.0f ? hue + 360.0f : hue;
+}
+
+static void pixels_band(void *data, long band) {
+  PixelsOp *op = (PixelsOp*) data;
+  int y0 = (int) band * KERNEL_BAND,
+      y1 = y0 + KERNEL_BAND > op->h ? op->h : y0 + KERNEL_BAND,
+      bytes = pixel_formats[op->format].bytes, x, y;
+
+  for (y = y0; y < y1; y++) {
+    const DATA32 *s = op->src + (size_t) y * op->stride;
+    unsigned char *o = (unsigned char*) op->out + (size_t) y * op->w * bytes;
+
+    if (op->format == PIXELS_ARGB32) {
+      memcpy(o, s, sizeof(DATA32) * op->w);
+      continue;
+    }
+
+    for (x = 0; x < op->w; x++, o += bytes) {
+      int a = s[x] >> 24, r = (s[x] >> 16) & 0xff,
+          g = (s[x] >> 8) & 0xff, b = s[x] & 0xff,
+          max, min, delta;
+      float f[4];
+
+      switch (op->format) {
+        case PIXELS_RGBA8:
+          o[0] = r; o[1] = g; o[2] = b; o[3] = a;
+          continue;
+        case PIXELS_BGRA8:
+          o[0] = b; o[1] = g; o[2] = r; o[3] = a;
+          continue;
+        case PIXELS_RGB8:
+          o[0] = r; o[1] = g; o[2] = b;
+          continue;
+        case PIXELS_CMYA8:
+          o[0] = 255 - r; o[1] = 255 - g; o[2] = 255 - b; o[3] = a;
+          continue;
       }
-      break;
-    case 4:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 4)");
+
+      max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+      min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+      delta = max - min;
+      f[0] = delta ? pixel_hue(r, g, b, max, delta) : 0.0f;
+      f[3] = (float) a;
+      if (op->format == PIXELS_HSVA_F32) {
+        f[1] = max ? (float) delta / max : 0.0f;
+        f[2] = max / 255.0f;
+      } else {
+        /* lightness, then saturation */
+        f[1] = (max + min) / 510.0f;
+        f[2] = !delta ? 0.0f : (max + min < 255 ?
+                                (float) delta / (max + min) :
+                                (float) delta / (510 - max - min));
+      }
+      memcpy(o, f, sizeof(f));
+    }
   }
-  
-  GET_AND_CHECK_IMAGE(self, old_im);
-  imlib_context_set_image(old_im->im);
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_create_cropped_image(x, y, w, h);
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
-  
-  return im_o;
+}
+
+static void *pixels_op(void *data) {
+  PixelsOp *op = (PixelsOp*) data;
+
+  parallel_for(pixels_band, op, (op->h + KERNEL_BAND - 1) / KERNEL_BAND);
+  return NULL;
+}
+
+/* channels counted by the statistics kernel; the first four are in
+ * DATA32 byte order */
+#define STATS_LUMA     4
+#define STATS_CHANNELS 5
+
+typedef struct {
+  const DATA32 *src;      /* first pixel of the region */
+  int           stride,   /* of the image, in pixels */
+                w, h;
+  unsigned long hist[STATS_CHANNELS][256];
+} StatsOp;
+
+/*
+ * Count one band of the region into local histograms, then add them to
+ * the shared ones.  Histograms are scattered increments, which don't
+ * vectorize, so the work is split across threads by band instead.
+ */
+static void stats_band(void *data, long band) {
+  StatsOp *op = (StatsOp*) data;
+  int y0 = (int) band * KERNEL_BAND,
+      y1 = y0 + KERNEL_BAND > op->h ? op->h : y0 + KERNEL_BAND,
+      x, y, c, v;
+  unsigned long (*hist)[256] = calloc(STATS_CHANNELS, sizeof(op->hist[0]));
+  int local = hist != NULL;
+
+  /* without memory for local counts, add to the shared ones directly */
+  if (!local)
+    hist = op->hist;
+
+  for (y = y0; y < y1; y++) {
+    const DATA32 *s = op->src + (size_t) y * op->stride;
+
+    for (x = 0; x < op->w; x++) {
+      DATA32 p = s[x];
+      int r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+
+      if (local) {
+        hist[0][b]++;
+        hist[1][g]++;
+        hist[2][r]++;
+        hist[3][p >> 24]++;
+        hist[STATS_LUMA][(77 * r + 150 * g + 29 * b + 128) >> 8]++;
+      } else {
+        __sync_fetch_and_add(&hist[0][b], 1);
+        __sync_fetch_and_add(&hist[1][g], 1);
+        __sync_fetch_and_add(&hist[2][r], 1);
+        __sync_fetch_and_add(&hist[3][p >> 24], 1);
+        __sync_fetch_and_add(&hist[STATS_LUMA][(77 * r + 150 * g + 29 * b + 128) >> 8], 1);
+      }
+    }
+  }
+
+  if (local) {
+    for (c = 0; c < STATS_CHANNELS; c++)
+      for (v = 0; v < 256; v++)
+        if (hist[c][v])
+          __sync_fetch_and_add(&op->hist[c][v], hist[c][v]);
+    free(hist);
+  }
+}
+
+static void *stats_op(void *data) {
+  StatsOp *op = (StatsOp*) data;
+
+  parallel_for(stats_band, op, (op->h + KERNEL_BAND - 1) / KERNEL_BAND);
+  return NULL;
+}
+
+/***************************************/
+/* RESAMPLING (selectable filters)     */
+/* (runs on raw DATA32 buffers, no GVL */
+/* and no Imlib2 calls)                */
+/***************************************/
+/* Separable two-pass resampler used by crop_scaled(..., filter:).  The
+ * weights for each output pixel are computed once per axis, and pixels
+ * are accumulated as 4 floats (premultiplied RGBA), which maps directly
+ * onto one SSE2 or NEON register. */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128 vec4;
+#define VEC4_ZERO()          _mm_setzero_ps()
+#define VEC4_LOAD(p)         _mm_loadu_ps(p)
+#define VEC4_STORE(p, v)     _mm_storeu_ps((p), (v))
+#define VEC4_MADD(a, w, v)   _mm_add_ps((a), _mm_mul_ps(_mm_set1_ps(w), (v)))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+typedef float32x4_t vec4;
+#define VEC4_ZERO()          vdupq_n_f32(0.0f)
+#define VEC4_LOAD(p)         vld1q_f32(p)
+#define VEC4_STORE(p, v)     vst1q_f32((p), (v))
+#define VEC4_MADD(a, w, v)   vmlaq_n_f32((a), (v), (w))
+#else
+typedef struct { float f[4]; } vec4;
+static vec4 vec4_zero(void) {
+  vec4 v = { { 0.0f, 0.0f, 0.0f, 0.0f } };
+  return v;
+}
+static vec4 vec4_load(const float *p) {
+  vec4 v = { { p[0], p[1], p[2], p[3] } };
+  return v;
+}
+static vec4 vec4_madd(vec4 a, float w, vec4 v) {
+  a.f[0] += w * v.f[0]; a.f[1] += w * v.f[1];
+  a.f[2] += w * v.f[2]; a.f[3] += w * v.f[3];
+  return a;
+}
+#define VEC4_ZERO()          vec4_zero()
+#define VEC4_LOAD(p)         vec4_load(p)
+#define VEC4_STORE(p, v)     memcpy((p), (v).f, sizeof((v).f))
+#define VEC4_MADD(a, w, v)   vec4_madd((a), (w), (v))
+#endif
+
+typedef struct {
+  const char *name;
+  double      support;
+  double    (*func)(double);
+} ResampleFilter;
+
+static double filter_box(double x) {
+  return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double filter_bilinear(double x) {
+  x = fabs(x);
+  return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+/* Mitchell-Netravali, B = C = 1/3 */
+static double filter_mitchell(double x) {
+  const double b = 1.0 / 3.0, c = 1.0 / 3.0;
+
+  x = fabs(x);
+  if (x < 1.0)
+    return ((12 - 9 * b - 6 * c) * x * x * x +
+            (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6.0;
+  if (x < 2.0)
+    return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x +
+            (-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6.0;
+  return 0.0;
+}
+
+static double sinc(double x) {
+  if (x == 0.0)
+    return 1.0;
+  x *= M_PI;
+  return sin(x) / x;
+}
+
+static double filter_lanczos3(double x) {
+  return (x > -3.0 && x < 3.0) ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+static const ResampleFilter resample_filters[] = {
+  { "box",      0.5, filter_box },
+  { "bilinear", 1.0, filter_bilinear },
+  { "mitchell", 2.0, filter_mitchell },
+  { "lanczos3", 3.0, filter_lanczos3 },
+  { NULL,       0.0, NULL }
+};
+
+/* contributions of source pixels to each output pixel, along one axis */
+typedef struct {
+  int   *start,     /* first source pixel */
+        *count;     /* number of source pixels */
+  float *weights;   /* count weights, at a stride of taps */
+  int    taps;
+} Contrib;
+
+/*
+ * Build the contributions for scaling src_len pixels starting at
+ * src_off down (or up) to dst_len pixels.  Only source pixels in
+ * [lo, hi) are used; the weights are renormalized at the edges.
+ */
+static void contrib_build(Contrib *c, const ResampleFilter *f, int src_off,
+                          int src_len, int dst_len, int lo, int hi) {
+  double scale = (double) src_len / dst_len,
+         fscale = scale > 1.0 ? scale : 1.0,
+         support = f->support * fscale;
+  int i, j;
+
+  c->taps = (int) ceil(support) * 2 + 1;
+  c->start = ALLOC_N(int, dst_len);
+  c->count = ALLOC_N(int, dst_len);
+  c->weights = ALLOC_N(float, (size_t) dst_len * c->taps);
+
+  for (i = 0; i < dst_len; i++) {
+    double center = src_off + (i + 0.5) * scale - 0.5, sum = 0.0;
+    int left = (int) ceil(center - support),
+        right = (int) floor(center + support);
+    float *w = c->weights + (size_t) i * c->taps;
+
+    if (left < lo) left = lo;
+    if (right > hi - 1) right = hi - 1;
+    if (right - left + 1 > c->taps) right = left + c->taps - 1;
+
+    for (j = left; j <= right; j++)
+      sum += (w[j - left] = (float) f->func((j - center) / fscale));
+
+    /* no weight at all (box filter between samples): take the nearest */
+    if (sum == 0.0) {
+      j = (int) floor(center + 0.5);
+      left = right = j < lo ? lo : (j > hi - 1 ? hi - 1 : j);
+      w[0] = 1.0f;
+      sum = 1.0;
+    }
+
+    for (j = 0; j <= right - left; j++)
+      w[j] = (float) (w[j] / sum);
+    c->start[i] = left;
+    c->count[i] = right - left + 1;
+  }
+}
+
+static void contrib_free(Contrib *c) {
+  xfree(c->start);
+  xfree(c->count);
+  xfree(c->weights);
 }
 
 /*
- * Crop an image
- *
- * Examples:
- *   x, y, w, h = 10, 10, image.width - 10, image.height - 10
- *   image.crop! x, y, w, h
- *
- *   rect = [10, 10, image.width - 10, image.height - 10]
- *   image.crop! rect
- *
- *   x, y, w, h = 10, 10, image.width - 10, image.height - 10
- *   image.create_cropped! x, y, w, h
- *
- *   rect = [10, 10, image.width - 10, image.height - 10]
- *   image.create_cropped! rect
- *
+ * Everything about a resample that depends only on the geometry: the
+ * source region and the per-axis contributions.  Built per call by
+ * crop_scaled(..., filter:), or once by Imlib2::ScalePlan.
  */
-static VALUE image_crop_inline(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  Imlib_Image old_im;
-  int x = 0, y = 0, w = 0, h = 0;
-  
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 4:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 4)");
+typedef struct {
+  const ResampleFilter *filter;
+  int     src_w, src_h,   /* size of the source image */
+          dst_w, dst_h,
+          y_lo, y_hi,     /* source rows used */
+          x_lo, x_hi;     /* source columns used */
+  Contrib cx, cy;
+} ScalePlan;
+
+typedef struct {
+  const DATA32    *src;
+  DATA32          *dst;
+  int              has_alpha;
+  const ScalePlan *plan;
+  char             failed;  /* out of memory; dst wasn't written */
+} Resample;
+
+/*
+ * Horizontal pass: filter a source row (p->src_w pixels) into dst_w
+ * premultiplied pixels.
+ */
+static void resample_hrow(const ScalePlan *p, int has_alpha,
+                          const DATA32 *row, float *line, float *out) {
+  const DATA32 *s = row + p->x_lo;
+  int cols = p->x_hi - p->x_lo, x, k;
+
+  for (x = 0; x < cols; x++) {
+    DATA32 px = s[x];
+    float a = has_alpha ? (float) (px >> 24) : 255.0f,
+          m = a / 255.0f;
+
+    line[x * 4 + 0] = ((px >> 16) & 0xff) * m;
+    line[x * 4 + 1] = ((px >> 8) & 0xff) * m;
+    line[x * 4 + 2] = (px & 0xff) * m;
+    line[x * 4 + 3] = a;
   }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  old_im = im->im;
-  imlib_context_set_image(old_im);
-  im->im = imlib_create_cropped_image(x, y, w, h);
-  imlib_context_set_image(old_im);
-  imlib_free_image();
 
-  return self;
+  for (x = 0; x < p->dst_w; x++) {
+    const float *w = p->cx.weights + (size_t) x * p->cx.taps;
+    const float *l = line + (size_t) (p->cx.start[x] - p->x_lo) * 4;
+    vec4 sum = VEC4_ZERO();
+
+    for (k = 0; k < p->cx.count[x]; k++)
+      sum = VEC4_MADD(sum, w[k], VEC4_LOAD(l + k * 4));
+    VEC4_STORE(out + x * 4, sum);
+  }
 }
 
+static void resample_row(Resample *rs, int y, float *line, float *out) {
+  resample_hrow(rs->plan, rs->has_alpha,
+                rs->src + (size_t) y * rs->plan->src_w, line, out);
+}
 
 /*
- * Create a cropped and scaled copy of an image
- *
- * Examples:
- *   iw, ih = old_image.width, old_image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   x, y, w, h = 10, 10, iw - 10, ih - 10
- *   new_image = old_image.crop_scaled x, y, w, h, new_w, new_h
- *
- *   iw, ih = old_image.width, old_image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
- *   new_image = old_image.crop_scaled values
- *
- *   iw, ih = old_image.width, old_image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   x, y, w, h = 10, 10, iw - 10, ih - 10
- *   new_image = old_image.create_crop_scaled x, y, w, h, new_w, new_h
- *
- *   iw, ih = old_image.width, old_image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
- *   new_image = old_image.create_crop_scaled values
- *
+ * Convert w accumulated premultiplied pixels back to (unpremultiplied)
+ * DATA32, rounded and clamped.
  */
-static VALUE image_crop_scaled(int argc, VALUE *argv, VALUE self) {
-  ImStruct *old_im, *new_im;
-  VALUE im_o;
-  int x = 0, y = 0, w = 0, h = 0, dw = 0, dh = 0;
-  
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          dw = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dw")));
-          dh = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dh")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          dw = NUM2INT(rb_ary_entry(argv[0], 4));
-          dh = NUM2INT(rb_ary_entry(argv[0], 5));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 6:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      dw = NUM2INT(argv[4]);
-      dh = NUM2INT(argv[5]);
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 6)");
+static void resample_store(const float *acc, DATA32 *d, int w) {
+  int x;
+
+  for (x = 0; x < w; x++) {
+    const float *v = acc + x * 4;
+    float a = v[3], m;
+    int c[4], i;
+
+    if (a < 0.5f) {
+      d[x] = 0;
+      continue;
+    }
+    m = a >= 254.5f ? 1.0f : 255.0f / a;
+    for (i = 0; i < 3; i++)
+      c[i] = (int) (v[i] * m + 0.5f);
+    c[3] = (int) (a + 0.5f);
+    for (i = 0; i < 4; i++)
+      c[i] = c[i] < 0 ? 0 : (c[i] > 255 ? 255 : c[i]);
+
+    d[x] = ((DATA32) c[3] << 24) | (c[0] << 16) | (c[1] << 8) | c[2];
   }
-  
-  GET_AND_CHECK_IMAGE(self, old_im);
-  imlib_context_set_image(old_im->im);
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_create_cropped_scaled_image(x, y, w, h, dw, dh);
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+}
 
-  return im_o;
+static void *resample_op(void *data) {
+  Resample *rs = (Resample*) data;
+  const ScalePlan *p = rs->plan;
+  int x, y, k, next_row = p->y_lo, taps = p->cy.taps;
+  float *line, *ring, *acc;
+
+  /* the rows needed by each output row slide down the image, so only
+   * the last taps horizontally-filtered rows are kept, in a ring */
+  line = malloc(sizeof(float) * 4 * (p->x_hi - p->x_lo));
+  ring = malloc(sizeof(float) * 4 * p->dst_w * taps);
+  acc = malloc(sizeof(float) * 4 * p->dst_w);
+  rs->failed = !line || !ring || !acc;
+  if (rs->failed)
+    goto done;
+
+  for (y = 0; y < p->dst_h; y++) {
+    const float *w = p->cy.weights + (size_t) y * p->cy.taps;
+    int first = p->cy.start[y], last = first + p->cy.count[y] - 1;
+    DATA32 *d = rs->dst + (size_t) y * p->dst_w;
+
+    for (; next_row <= last; next_row++)
+      resample_row(rs, next_row, line,
+                   ring + (size_t) ((next_row - p->y_lo) % taps) * p->dst_w * 4);
+
+    /* vertical pass: combine the filtered rows into this output row */
+    for (x = 0; x < p->dst_w; x++)
+      VEC4_STORE(acc + x * 4, VEC4_ZERO());
+    for (k = 0; k < p->cy.count[y]; k++) {
+      const float *t = ring + (size_t) ((first + k - p->y_lo) % taps) * p->dst_w * 4;
+
+      for (x = 0; x < p->dst_w; x++)
+        VEC4_STORE(acc + x * 4, VEC4_MADD(VEC4_LOAD(acc + x * 4), w[k], VEC4_LOAD(t + x * 4)));
+    }
+
+    resample_store(acc, d, p->dst_w);
+  }
+
+done:
+  free(line);
+  free(ring);
+  free(acc);
+  return NULL;
 }
 
 /*
- * Crop and scale an image
- *
- * Examples:
- *   iw, ih = image.width, image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   x, y, w, h = 10, 10, iw - 10, ih - 10
- *   image.crop_scaled! x, y, w, h, new_w, new_h
- *
- *   iw, ih = image.width, image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
- *   image.crop_scaled! values
- *
- *   iw, ih = image.width, image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   x, y, w, h = 10, 10, iw - 10, ih - 10
- *   image.create_crop_scaled! x, y, w, h, new_w, new_h
- *
- *   iw, ih = image.width, image.height
- *   new_w, new_h = iw - 20, ih - 20
- *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
- *   image.create_crop_scaled! values
- *
+ * Look up a resampling filter by name (a String or Symbol).
  */
-static VALUE image_crop_scaled_inline(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  Imlib_Image old_im;
-  int x = 0, y = 0, w = 0, h = 0, dw = 0, dh = 0;
-  
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          dw = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dw")));
-          dh = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dh")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          dw = NUM2INT(rb_ary_entry(argv[0], 4));
-          dh = NUM2INT(rb_ary_entry(argv[0], 5));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 6:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      dw = NUM2INT(argv[4]);
-      dh = NUM2INT(argv[5]);
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 6)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  old_im = im->im;
-  imlib_context_set_image(old_im);
-  im->im = imlib_create_cropped_scaled_image(x, y, w, h, dw, dh);
-  imlib_context_set_image(old_im);
-  imlib_free_image();
+static const ResampleFilter *resample_filter_get(VALUE filter) {
+  const ResampleFilter *f;
+  const char *name;
 
-  return self;
+  if (SYMBOL_P(filter))
+    filter = rb_sym_to_s(filter);
+  name = StringValueCStr(filter);
+  for (f = resample_filters; f->name; f++)
+    if (!strcmp(f->name, name))
+      return f;
+
+  rb_raise(rb_eArgError, "unknown filter: %s", name);
+  return NULL;
 }
 
-/* 
- * Create a horizontally-flipped copy of an image
- *
- * Examples:
- *   backwards_image = old_image.flip_horizontal
- *
+/*
+ * Get the resampling filter from the trailing options hash of
+ * crop_scaled(..., filter: name), or from the lone hash argument of
+ * crop_scaled('x' => ..., 'filter' => name), if there is one.  Returns
+ * NULL for Imlib2's own scaler.
  */
-static VALUE image_flip_horizontal(VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE im_o;
-
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static const ResampleFilter *resample_filter_opt(int *argc, VALUE *argv) {
+  VALUE filter;
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  if (*argc == 1 && TYPE(argv[0]) == T_HASH)
+    filter = hash_arg(argv[0], KEY_FILTER);
+  else if (*argc >= 2 && TYPE(argv[*argc - 1]) == T_HASH)
+    filter = rb_hash_aref(argv[--(*argc)], key_syms[KEY_FILTER]);
+  else
+    return NULL;
 
-  imlib_context_set_image(new_im->im);
-  imlib_image_flip_horizontal();
+  if (NIL_P(filter))
+    return NULL;
 
-  return im_o;
+  return resample_filter_get(filter);
 }
 
-/* 
- * Flip an image horizontally
- *
- * Examples:
- *   image.flip_horizontal!
- *
+/*
+ * Fill in a plan for cropping x, y, w, h out of an iw x ih image and
+ * scaling it to dw x dh.  Raises before allocating anything if the
+ * geometry is invalid; free the tables with scale_plan_free_tables().
  */
-static VALUE image_flip_horizontal_inline(VALUE self) {
-  ImStruct *im;
+static void scale_plan_init(ScalePlan *p, const ResampleFilter *f,
+                            int iw, int ih, int x, int y, int w, int h,
+                            int dw, int dh) {
+  if (iw <= 0 || ih <= 0 || w <= 0 || h <= 0 || dw <= 0 || dh <= 0)
+    rb_raise(rb_eArgError, "invalid size");
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_flip_horizontal();
+  /* only sample the part of the crop region that's inside the image */
+  p->x_lo = x < 0 ? 0 : x;
+  p->x_hi = x + w > iw ? iw : x + w;
+  p->y_lo = y < 0 ? 0 : y;
+  p->y_hi = y + h > ih ? ih : y + h;
+  if (p->x_lo >= p->x_hi || p->y_lo >= p->y_hi)
+    rb_raise(rb_eArgError, "crop region is outside of the image");
 
-  return self;
+  p->filter = f;
+  p->src_w = iw;
+  p->src_h = ih;
+  p->dst_w = dw;
+  p->dst_h = dh;
+  contrib_build(&p->cx, f, x, w, dw, p->x_lo, p->x_hi);
+  contrib_build(&p->cy, f, y, h, dh, p->y_lo, p->y_hi);
 }
 
-/* 
- * Create a vertically-flipped copy of an image
- *
- * Examples:
- *   upside_down_image = old_image.flip_vertical
- *
+static void scale_plan_free_tables(ScalePlan *p) {
+  contrib_free(&p->cx);
+  contrib_free(&p->cy);
+}
+
+/*
+ * Run a plan on src (which must be plan->src_w x plan->src_h) and return
+ * the result as a new Imlib2 image, or NULL if we ran out of memory.
+ * The kernel runs without the GVL while im (src's wrapper) is pinned.
  */
-static VALUE image_flip_vertical(VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE im_o;
+static Imlib_Image resample_run(Imlib_Image src, ImStruct *im,
+                                const ScalePlan *p) {
+  Resample rs;
+  Imlib_Image dst;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  imlib_context_set_image(src);
+  rs.has_alpha = imlib_image_has_alpha() ? 1 : 0;
+  rs.src = imlib_image_get_data_for_reading_only();
+  rs.plan = p;
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  if (!(dst = imlib_create_image(p->dst_w, p->dst_h)))
+    return NULL;
+  imlib_context_set_image(dst);
+  imlib_image_set_has_alpha(rs.has_alpha);
+  rs.dst = imlib_image_get_data();
 
-  imlib_context_set_image(new_im->im);
-  imlib_image_flip_vertical();
+  /* the kernel doesn't touch Imlib2, so it doesn't need imlib_lock;
+   * just keep the source from being freed under it */
+  im->exports++;
+  call_without_gvl(resample_op, &rs);
+  im->exports--;
 
-  return im_o;
+  imlib_context_set_image(dst);
+  imlib_image_put_back_data(rs.dst);
+  if (rs.failed) {
+    imlib_free_image();
+    return NULL;
+  }
+
+  return dst;
 }
 
-/* 
- * Flip an image vertically
- *
- * Examples:
- *   image.flip_vertical!
- *
+/*
+ * Crop and scale src with the given filter, into a new Imlib2 image.
+ * Must be called after GET_AND_CHECK_IMAGE (ie after enter_imlib()).
  */
-static VALUE image_flip_vertical_inline(VALUE self) {
-  ImStruct *im;
+static Imlib_Image resample_image(ImStruct *im, const ResampleFilter *f,
+                                  int x, int y, int w, int h, int dw, int dh) {
+  ScalePlan plan;
+  Imlib_Image dst;
 
-  GET_AND_CHECK_IMAGE(self, im);
   imlib_context_set_image(im->im);
-  imlib_image_flip_vertical();
+  scale_plan_init(&plan, f, imlib_image_get_width(), imlib_image_get_height(),
+                  x, y, w, h, dw, dh);
+  dst = resample_run(im->im, im, &plan);
+  scale_plan_free_tables(&plan);
 
-  return self;
+  if (!dst)
+    rb_raise(rb_eNoMemError, "couldn't create image");
+  return dst;
 }
 
-/* 
- * Create a copy of an image flipped along it's diagonal axis
- *
- * Examples:
- *   new_image = old_image.flip_diagonal
- *
+/* one level of Image#pyramid */
+typedef struct {
+  int         w, h,
+              index,  /* position in the sizes array */
+              src;    /* level it's scaled from, or -1 for the image */
+  ScalePlan   plan;
+  Resample    rs;
+  Imlib_Image im;
+} PyramidLevel;
+
+typedef struct {
+  PyramidLevel *levels;   /* in the order they're built */
+  int           num_levels;
+} Pyramid;
+
+/*
+ * Build every level of a pyramid in turn, each one from the smallest
+ * already-built level that's at least its size (see Image#pyramid).
  */
-static VALUE image_flip_diagonal(VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE im_o;
+static void *pyramid_op(void *data) {
+  Pyramid *py = (Pyramid*) data;
+  int i;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  for (i = 0; i < py->num_levels; i++)
+    resample_op(&py->levels[i].rs);
+
+  return NULL;
+}
+
+/**************************************/
+/* PIPELINES (Imlib2::Pipeline)       */
+/* (fused operations, a row at a time */
+/* on raw DATA32 buffers, no GVL)     */
+/**************************************/
+/* A pipeline's operations are compiled into a chain of stages, each of
+ * which produces its output a row at a time by pulling rows from the
+ * stage before it.  A stage only keeps the rows its consumer needs at
+ * once (eg 2 * radius + 2 for a blur) in a ring, so no intermediate
+ * image is ever built.  Crops become offsets into the rows of the stage
+ * before them (or part of the next scale), and flips, which commute
+ * with everything else, are applied as the final rows are written. */
+enum {
+  STAGE_SOURCE,   /* rows of the source image */
+  STAGE_READ,     /* rows read in order from a decoder (Imlib2.stream) */
+  STAGE_WINDOW,   /* crop of the previous stage's rows */
+  STAGE_SCALE,
+  STAGE_BLUR,
+  STAGE_SHARPEN,
+  STAGE_CMOD,
+  STAGE_FILTER
+};
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+typedef struct PipeStage {
+  int               kind,
+                    w, h,         /* size of the stage's output */
+                    x, y,         /* source, window: offset into input */
+                    radius,       /* blur */
+                    has_alpha;    /* of the stage's output */
+  const DATA32     *data;         /* source: the pixels */
+  int               stride;       /* source: pixels per row */
+  const ScalePlan  *plan;         /* scale */
+  const DATA8      *tables;       /* cmod: red, green, blue, alpha */
+  const Convolution *conv;        /* filter */
+  int               min_y, max_y; /* filter: rows around y it reads */
+  void            (*read)(void *, DATA32 *);  /* read: next row */
+  void             *reader;
+  struct PipeStage *src;
+
+  /* per-band state: the last keep rows produced, in a ring */
+  DATA32           *ring;
+  int               keep,
+                    next;         /* next row to produce, -1 = none yet */
+  float            *line, *rows,  /* scale: filtered input rows */
+                   *acc;
+  int               next_in;      /* scale: next input row to filter */
+  int              *vs;           /* blur: column sums */
+  const DATA32    **srows;        /* filter: rows min_y to max_y */
+} PipeStage;
 
-  imlib_context_set_image(new_im->im);
-  imlib_image_flip_diagonal();
+typedef struct {
+  const PipeStage *stages;  /* compiled; the last one is the output */
+  int              num_stages,
+                   w, h,
+                   flip_x, flip_y,
+                   num_bands;
+  DATA32          *dst;     /* the output, or NULL to write it in order */
+  void           (*write)(void *, const DATA32 *);
+  void            *writer;
+  int              failed;  /* set if a band couldn't get its buffers */
+} PipeRun;
+
+static const DATA32 *stage_row(PipeStage *s, int y);
+
+/* row y of a scale stage */
+static void scale_stage_row(PipeStage *s, int y, DATA32 *d) {
+  const ScalePlan *p = s->plan;
+  const float *w = p->cy.weights + (size_t) y * p->cy.taps;
+  int first = p->cy.start[y], last = first + p->cy.count[y] - 1,
+      taps = p->cy.taps, x, k;
+
+  /* input rows only ever move down, so each is filtered once */
+  if (s->next_in < first)
+    s->next_in = first;
+  for (; s->next_in <= last; s->next_in++)
+    resample_hrow(p, s->src->has_alpha, stage_row(s->src, s->next_in),
+                  s->line,
+                  s->rows + (size_t) (s->next_in % taps) * p->dst_w * 4);
+
+  for (x = 0; x < p->dst_w; x++)
+    VEC4_STORE(s->acc + x * 4, VEC4_ZERO());
+  for (k = 0; k < p->cy.count[y]; k++) {
+    const float *t = s->rows + (size_t) ((first + k) % taps) * p->dst_w * 4;
+
+    for (x = 0; x < p->dst_w; x++)
+      VEC4_STORE(s->acc + x * 4, VEC4_MADD(VEC4_LOAD(s->acc + x * 4), w[k],
+                                           VEC4_LOAD(t + x * 4)));
+  }
 
-  return im_o;
+  resample_store(s->acc, d, p->dst_w);
 }
 
-/* 
- * Flip an image along it's diagonal axis
- *
- * Examples:
- *   image.flip_diagonal!
- *
- */
-static VALUE image_flip_diagonal_inline(VALUE self) {
-  ImStruct *im;
+/* row y of a blur stage; the column sums slide down from the row before */
+static void blur_stage_row(PipeStage *s, int y, DATA32 *d) {
+  int r = s->radius, w = s->w, h = s->h,
+      top = y - r < 0 ? 0 : y - r,
+      bottom = y + r > h - 1 ? h - 1 : y + r,
+      i;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_flip_diagonal();
+  if (s->next < 0) {
+    memset(s->vs, 0, sizeof(int) * 4 * w);
+    for (i = top; i <= bottom; i++)
+      box_blur_sum_row(s->vs, stage_row(s->src, i), w, 1);
+  } else {
+    if (y - r - 1 >= 0)
+      box_blur_sum_row(s->vs, stage_row(s->src, y - r - 1), w, -1);
+    if (y + r < h)
+      box_blur_sum_row(s->vs, stage_row(s->src, y + r), w, 1);
+  }
 
-  return self;
+  box_blur_row(s->vs, d, w, r, bottom - top + 1);
 }
 
-/*
- * Return a copy of an image rotated in 90 degree increments
- *
- * Examples:
- *   increments = 3 # 90 * 3 degrees (eg 270 degrees)
- *   new_image = old_image.orientate increments
- *
- */
-static VALUE image_orientate(VALUE self, VALUE val) {
-  ImStruct *im, *new_im;
+/* row y of a sharpen stage */
+static void sharpen_stage_row(PipeStage *s, int y, DATA32 *d) {
+  const DATA32 *up;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  if (y == 0 || y == s->h - 1) {
+    memcpy(d, stage_row(s->src, y), sizeof(DATA32) * s->w);
+    return;
+  }
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  imlib_context_set_image(new_im->im);
-  imlib_image_orientate(NUM2INT(val));
-  return Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  up = stage_row(s->src, y - 1);
+  sharpen_row(up, stage_row(s->src, y), stage_row(s->src, y + 1), d, s->w);
 }
 
-/*
- * Rotate an image in 90 degree increments
- *
- * Examples:
- *   increments = 3 # 90 * 3 degrees (eg 270 degrees)
- *   image.orientate! increments
- *
- */
-static VALUE image_orientate_inline(VALUE self, VALUE val) {
-  ImStruct *im;
+/* row y of a color modifier stage (see imlib_apply_color_modifier()) */
+static void cmod_stage_row(PipeStage *s, int y, DATA32 *d) {
+  const DATA32 *in = stage_row(s->src, y);
+  const DATA8 *t = s->tables;
+  int x;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_orientate(NUM2INT(val));
+  for (x = 0; x < s->w; x++) {
+    DATA32 p = in[x],
+           a = t[768 + (s->src->has_alpha ? p >> 24 : 255)];
 
-  return self;
+    d[x] = (a << 24) | ((DATA32) t[(p >> 16) & 0xff] << 16) |
+           ((DATA32) t[256 + ((p >> 8) & 0xff)] << 8) |
+           t[512 + (p & 0xff)];
+  }
 }
 
-/* 
- * Return a blurred copy of an image
- * 
- * Examples:
- *   radius = 20 # radius of blur, in pixels
- *   new_image = old_image.blur radius
- *
- */
-static VALUE image_blur(VALUE self, VALUE val) {
-  ImStruct *im, *new_im;
+/* row y of a static filter stage (see conv_taps()) */
+static void filter_stage_row(PipeStage *s, int y, DATA32 *d) {
+  int w = s->w, c, i, j, x;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  for (i = s->min_y; i <= s->max_y; i++)
+    s->srows[i - s->min_y] = stage_row(s->src, CLAMP_TO(y + i, s->h));
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  imlib_context_set_image(new_im->im);
-  imlib_image_blur(NUM2INT(val));
-  return Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
-}
+  /* channels without a kernel keep their source values */
+  memcpy(d, s->srows[-s->min_y], sizeof(DATA32) * w);
 
-/* 
- * Blur an image
- * 
- * Examples:
- *   radius = 20 # radius of blur, in pixels
- *   image.blur! radius
- *
- */
-static VALUE image_blur_inline(VALUE self, VALUE val) {
-  ImStruct *im;
+  for (c = 0; c < 4; c++) {
+    const ConvChannel *cc = &s->conv->ch[c];
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_blur(NUM2INT(val));
+    if (!cc->taps)
+      continue;
+    for (x = 0; x < w; x++) {
+      int sum = 0;
 
-  return self;
+      for (i = 0; i < cc->num_taps; i++) {
+        const FilterTap *t = &cc->taps[i];
+        DATA32 p = s->srows[t->y - s->min_y][CLAMP_TO(x + t->x, w)];
+
+        for (j = 0; j < 4; j++)
+          sum += t->w[j] * (int) ((p >> (j * 8)) & 0xff);
+      }
+
+      CONV_STORE(&d[x], cc, c, sum);
+    }
+  }
 }
 
-/* 
- * Return a sharpened copy of an image
- * 
- * Examples:
- *   radius = 15 # radius of sharpen, in pixels
- *   new_image = old_image.sharpen radius
- *
+/*
+ * Get row y of a stage's output, producing it (and any rows between it
+ * and the last row produced) if need be.  Rows must be asked for in
+ * order, give or take the keep rows the stage holds on to.
  */
-static VALUE image_sharpen(VALUE self, VALUE val) {
-  ImStruct *im, *new_im;
+static const DATA32 *stage_row(PipeStage *s, int y) {
+  switch (s->kind) {
+    case STAGE_SOURCE:
+      return s->data + (size_t) (s->y + y) * s->stride + s->x;
+    case STAGE_WINDOW:
+      return stage_row(s->src, s->y + y) + s->x;
+  }
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  if (s->next < 0 || s->next <= y) {
+    int row = s->next < 0 ? y : s->next;
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  imlib_context_set_image(new_im->im);
-  imlib_image_sharpen(NUM2INT(val));
-  return Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
-}
+    for (; row <= y; row++) {
+      DATA32 *d = s->ring + (size_t) (row % s->keep) * s->w;
 
-/* 
- * Sharpened an image
- * 
- * Examples:
- *   radius = 15 # radius of sharpen, in pixels
- *   image.sharpen! radius
- *
- */
-static VALUE image_sharpen_inline(VALUE self, VALUE val) {
-  ImStruct *im;
+      switch (s->kind) {
+        case STAGE_SCALE:
+          scale_stage_row(s, row, d);
+          break;
+        case STAGE_BLUR:
+          blur_stage_row(s, row, d);
+          break;
+        case STAGE_SHARPEN:
+          sharpen_stage_row(s, row, d);
+          break;
+        case STAGE_CMOD:
+          cmod_stage_row(s, row, d);
+          break;
+        case STAGE_FILTER:
+          filter_stage_row(s, row, d);
+          break;
+        case STAGE_READ:
+          s->read(s->reader, d);
+          break;
+      }
+      s->next = row + 1;
+    }
+  }
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_sharpen(NUM2INT(val));
+  return s->ring + (size_t) (y % s->keep) * s->w;
+}
 
-  return self;
+static void pipe_free_stages(PipeStage *st, int num_stages) {
+  int i;
+
+  for (i = 0; i < num_stages; i++) {
+    free(st[i].ring);
+    free(st[i].line);
+    free(st[i].rows);
+    free(st[i].acc);
+    free(st[i].vs);
+    free((void*) st[i].srows);
+  }
+  free(st);
 }
 
-/* 
- * Return a copy of an image suitable for seamless horizontal tiling
- * 
- * Examples:
- *   horiz_tile = old_image.tile_horizontal
- *
+/*
+ * Copy the compiled stages, with their own buffers, so that each band
+ * has its own rings.  Returns NULL if it runs out of memory.
  */
-static VALUE image_tile_horizontal(VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE im_o;
+static PipeStage *pipe_band_stages(const PipeRun *run) {
+  PipeStage *st = calloc(run->num_stages, sizeof(PipeStage));
+  int i, ok = 1;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  if (!st)
+    return NULL;
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  for (i = 0; i < run->num_stages; i++) {
+    PipeStage *s = &st[i];
 
-  imlib_context_set_image(new_im->im);
-  imlib_image_tile_horizontal();
+    *s = run->stages[i];
+    if (s->src)
+      s->src = st + (s->src - run->stages);
+    /* a decoder can only start at the top */
+    s->next = s->kind == STAGE_READ ? 0 : -1;
+    s->next_in = -1;
 
-  return im_o;
+    if (s->kind == STAGE_SOURCE || s->kind == STAGE_WINDOW)
+      continue;
+    ok = ok && (s->ring = malloc(sizeof(DATA32) * s->keep * s->w));
+
+    if (s->kind == STAGE_SCALE) {
+      const ScalePlan *p = s->plan;
+
+      ok = ok && (s->line = malloc(sizeof(float) * 4 * (p->x_hi - p->x_lo)));
+      ok = ok && (s->rows = malloc(sizeof(float) * 4 * p->dst_w * p->cy.taps));
+      ok = ok && (s->acc = malloc(sizeof(float) * 4 * p->dst_w));
+    } else if (s->kind == STAGE_BLUR) {
+      ok = ok && (s->vs = malloc(sizeof(int) * 4 * s->w));
+    } else if (s->kind == STAGE_FILTER) {
+      ok = ok && (s->srows = malloc(sizeof(DATA32*) *
+                                    (s->max_y - s->min_y + 1)));
+    }
+  }
+
+  if (!ok) {
+    pipe_free_stages(st, run->num_stages);
+    return NULL;
+  }
+  return st;
 }
 
-/* 
- * Modify an image so it is suitable for seamless horizontal tiling
- * 
- * Examples:
- *   image.tile_horizontal!
- *
+/*
+ * Run output rows [y0, y1) through a band's stages, into run->dst or
+ * (in order, through tmp if they need flipping) to run->write.
  */
-static VALUE image_tile_horizontal_inline(VALUE self) {
-  ImStruct *im;
+static void pipe_rows(const PipeRun *run, PipeStage *st, int y0, int y1,
+                      DATA32 *tmp) {
+  PipeStage *out = &st[run->num_stages - 1];
+  int x, y;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_tile_horizontal();
+  for (y = y0; y < y1; y++) {
+    const DATA32 *s = stage_row(out, y);
+    DATA32 *d = run->dst ? run->dst + (size_t) (run->flip_y ? run->h - 1 - y
+                                                            : y) * run->w
+                         : tmp;
+
+    if (run->flip_x) {
+      for (x = 0; x < run->w; x++)
+        d[x] = s[run->w - 1 - x];
+      s = d;
+    } else if (run->dst) {
+      memcpy(d, s, sizeof(DATA32) * run->w);
+    }
 
-  return self;
+    if (!run->dst)
+      run->write(run->writer, s);
+  }
 }
 
-/* 
- * Return a copy of an image suitable for seamless vertical tiling
- * 
- * Examples:
- *   vert_tile = old_image.tile_vertical
- *
- */
-static VALUE image_tile_vertical(VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE im_o;
+/* run one band of output rows through the stages */
+static void pipe_band(void *data, long band) {
+  PipeRun *run = (PipeRun*) data;
+  PipeStage *st = pipe_band_stages(run);
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+  if (!st) {
+    run->failed = 1;
+    return;
+  }
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  pipe_rows(run, st, (int) (run->h * band / run->num_bands),
+            (int) (run->h * (band + 1) / run->num_bands), NULL);
+  pipe_free_stages(st, run->num_stages);
+}
 
-  imlib_context_set_image(new_im->im);
-  imlib_image_tile_vertical();
+static void *pipe_op(void *data) {
+  PipeRun *run = (PipeRun*) data;
 
-  return im_o;
+  parallel_for(pipe_band, run, run->num_bands);
+  return NULL;
 }
 
-/* 
- * Modify an image so it is suitable for seamless vertical tiling
- * 
- * Examples:
- *   image.tile_vertical!
- *
- */
-static VALUE image_tile_vertical_inline(VALUE self) {
-  ImStruct *im;
+#ifdef HAVE_LIBJPEG
+/* Imlib2.stream: a pipeline whose source is read from a JPEG a row at
+ * a time, and whose output is written to a JPEG a row at a time (or,
+ * when that isn't possible, into an image that's saved afterwards). */
+typedef struct {
+  const char *src, *dst;      /* paths */
+  PipeStage  *stages;         /* compiled; the first one reads src */
+  PipeRun     run;            /* run.dst set = buffered output */
+  int         src_w, src_h,   /* size of src when it was compiled */
+              quality,
+              err;            /* errno, -1 for a libjpeg error in msg */
+  char        msg[JMSG_LENGTH_MAX];
+} StreamOp;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_tile_vertical();
+typedef struct {
+  struct jpeg_decompress_struct cinfo;
+  JSAMPROW                      row;
+} JpegReader;
 
-  return self;
+typedef struct {
+  struct jpeg_compress_struct cinfo;
+  JSAMPROW                    row;
+} JpegWriter;
+
+static void jpeg_read_row(void *data, DATA32 *d) {
+  JpegReader *r = (JpegReader*) data;
+  int x;
+
+  jpeg_read_scanlines(&r->cinfo, &r->row, 1);
+  for (x = 0; x < (int) r->cinfo.output_width; x++)
+    d[x] = 0xff000000 | (r->row[x * 3] << 16) | (r->row[x * 3 + 1] << 8) |
+           r->row[x * 3 + 2];
 }
 
-/* 
- * Return a copy of an image suitable for seamless tiling
- * 
+static void jpeg_write_row(void *data, const DATA32 *s) {
+  JpegWriter *w = (JpegWriter*) data;
+  int x;
+
+  for (x = 0; x < (int) w->cinfo.image_width; x++) {
+    w->row[x * 3] = (s[x] >> 16) & 0xff;
+    w->row[x * 3 + 1] = (s[x] >> 8) & 0xff;
+    w->row[x * 3 + 2] = s[x] & 0xff;
+  }
+  jpeg_write_scanlines(&w->cinfo, &w->row, 1);
+}
+
+/*
+ * Get the size of a JPEG that stream_op() can read, from its header.
+ * Returns 0 if path isn't one.
+ */
+static int jpeg_stream_size(const char *path, int *w, int *h) {
+  struct jpeg_decompress_struct cinfo;
+  JpegError jerr;
+  volatile int ok = 0;
+  FILE *fp;
+
+  if (!(fp = jpeg_fopen(path)))
+    return 0;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  jerr.pub.output_message = jpeg_output_message;
+  if (!setjmp(jerr.jmp)) {
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    *w = cinfo.image_width;
+    *h = cinfo.image_height;
+
+    /* CMYK needs conversion that libjpeg doesn't do */
+    ok = cinfo.jpeg_color_space != JCS_CMYK &&
+         cinfo.jpeg_color_space != JCS_YCCK;
+  }
+
+  jpeg_destroy_decompress(&cinfo);
+  fclose(fp);
+  return ok;
+}
+
+/*
+ * Run a streamed pipeline: decode op->src a row at a time through the
+ * stages (in one band, since the decoder is sequential), and encode the
+ * output rows to op->dst as they come, or into op->run.dst.
+ */
+static void *stream_op(void *data) {
+  StreamOp *op = (StreamOp*) data;
+  JpegError jerr;
+  JpegReader rd;
+  JpegWriter wr;
+  PipeStage * volatile st = NULL;
+  FILE * volatile in = NULL, * volatile out = NULL;
+  unsigned char * volatile rrow = NULL, * volatile wrow = NULL;
+  DATA32 * volatile tmp = NULL;
+  volatile int reading = 0, writing = 0;
+
+  op->err = 0;
+  op->run.failed = 0;
+  rd.cinfo.err = wr.cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  jerr.pub.output_message = jpeg_output_message;
+  if (setjmp(jerr.jmp)) {
+    jerr.pub.format_message((j_common_ptr) &rd.cinfo, op->msg);
+    op->err = -1;
+    goto done;
+  }
+
+  if (!(in = fopen(op->src, "rb"))) {
+    op->err = errno;
+    goto done;
+  }
+  jpeg_create_decompress(&rd.cinfo);
+  reading = 1;
+  jpeg_stdio_src(&rd.cinfo, in);
+  jpeg_read_header(&rd.cinfo, TRUE);
+  rd.cinfo.out_color_space = JCS_RGB;
+  rd.cinfo.dct_method = JDCT_ISLOW;
+  jpeg_start_decompress(&rd.cinfo);
+  if ((int) rd.cinfo.output_width != op->src_w ||
+      (int) rd.cinfo.output_height != op->src_h) {
+    snprintf(op->msg, sizeof(op->msg), "image changed size");
+    op->err = -1;
+    goto done;
+  }
+
+  if (!op->run.dst) {
+    if (!(out = fopen(op->dst, "wb"))) {
+      op->err = errno;
+      goto done;
+    }
+    jpeg_create_compress(&wr.cinfo);
+    writing = 1;
+    jpeg_stdio_dest(&wr.cinfo, out);
+    wr.cinfo.image_width = op->run.w;
+    wr.cinfo.image_height = op->run.h;
+    wr.cinfo.input_components = 3;
+    wr.cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&wr.cinfo);
+    jpeg_set_quality(&wr.cinfo, op->quality, TRUE);
+    jpeg_start_compress(&wr.cinfo, TRUE);
+
+    op->run.write = jpeg_write_row;
+    op->run.writer = &wr;
+    if (!(wrow = malloc(op->run.w * 3)) ||
+        !(tmp = malloc(sizeof(DATA32) * op->run.w))) {
+      op->run.failed = 1;
+      goto done;
+    }
+    wr.row = wrow;
+  }
+
+  op->stages[0].reader = &rd;
+  if (!(rrow = malloc(op->src_w * 3)) ||
+      !(st = pipe_band_stages(&op->run))) {
+    op->run.failed = 1;
+    goto done;
+  }
+  rd.row = rrow;
+
+  pipe_rows(&op->run, st, 0, op->run.h, tmp);
+  if (writing)
+    jpeg_finish_compress(&wr.cinfo);
+
+done:
+  if (st)
+    pipe_free_stages(st, op->run.num_stages);
+  free(rrow);
+  free(wrow);
+  free(tmp);
+  /* the pipeline may not have read every row, so don't finish */
+  if (reading)
+    jpeg_destroy_decompress(&rd.cinfo);
+  if (writing)
+    jpeg_destroy_compress(&wr.cinfo);
+  if (in)
+    fclose(in);
+  if (out && fclose(out) && !op->err)
+    op->err = errno;
+  if (out && (op->err || op->run.failed))
+    unlink(op->dst);
+
+  return NULL;
+}
+#endif /* HAVE_LIBJPEG */
+
+/*
+ * Returns a new Imlib2::Image with the specified width and height.
+ *
  * Examples:
- *   horiz_tile = old_image.tile
+ *   width, height = 640, 480
+ *   image = Imlib2::Image.new width, height
  *
+ *   width, height = 320, 240
+ *   image = Imlib2::Image.create width, height
  */
-static VALUE image_tile(VALUE self) {
-  ImStruct *im, *new_im;
+VALUE image_new(VALUE klass, VALUE w, VALUE h) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
   VALUE im_o;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  im_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
-
-  imlib_context_set_image(new_im->im);
-  imlib_image_tile();
+  enter_imlib();
+  im->im = imlib_create_image(NUM2INT(w), NUM2INT(h));
+  im_o = image_wrap(klass, im);
+  rb_obj_call_init(im_o, 0, NULL);
 
   return im_o;
 }
 
-/* 
- * Modify an image so it is suitable for seamless tiling
- * 
+/*********************************/
+/* DRAW PIXEL WORKAROUND METHODS */
+/*********************************/
+/*
+ * Are we using the buggy imlib_image_draw_pixel() work-around?
+ *
+ * Versions of Imlib2 up to and including 1.0.5 had a broken
+ * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
+ * simulates drawing a pixel with a 1x1 rectangle.  This method allows 
+ * you to check whether the work-around behavior is enabled.
+ *
  * Examples:
- *   image.tile!
+ *   puts 'work-around is enabled' if Imlib2::Image::draw_pixel_workaround?
+ *   puts 'work-around is enabled' if Imlib2::Image::bypass_draw_pixel?
  *
  */
-static VALUE image_tile_inline(VALUE self) {
-  ImStruct *im;
+VALUE image_dp_workaround(VALUE klass) {
+  UNUSED(klass);
+  return draw_pixel_workaround ? Qtrue : Qfalse;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_tile();
+/*
+ * Enable or disable imlib_image_draw_pixel() work-around.
+ *
+ * Versions of Imlib2 up to and including 1.0.5 had a broken
+ * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
+ * simulates drawing a pixel with a 1x1 rectangle.  This method allows 
+ * you to enable or disable the work-around behavior.
+ *
+ * Examples:
+ *   Imlib2::Image::draw_pixel_workaround = false
+ *   Imlib2::Image::bypass_draw_pixel = false
+ *
+ */
+VALUE image_set_dp_workaround(VALUE klass, VALUE val) {
+  UNUSED(klass);
 
-  return self;
+  draw_pixel_workaround = (val == Qtrue);
+
+  return val;
 }
 
 /*
- * Clear the contents of an image
+ * Returns a new Imlib2::Image initialized with the specified data.
  *
  * Examples:
- *   image.clear
+ *   other_image = Imlib2::Image.load 'sample_file.png'
+ *   width, height = other_image.width, other_image.height
+ *   data = other_image.data_for_reading_only
+ *   image = Imlib2::Image.create_using_data width, height, data
  *
  */
-static VALUE image_clear(VALUE self) {
+VALUE image_create_using_data(VALUE klass, VALUE w, VALUE h, VALUE data) {
   ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_clear();
+  VALUE im_o;
 
-  return self;
+  im = calloc(1, sizeof(ImStruct));
+  enter_imlib();
+  im->im = imlib_create_image_using_data(NUM2INT(w), NUM2INT(h), (DATA32 *) StringValuePtr (data));
+  im_o = image_wrap(klass, im);
+  rb_obj_call_init(im_o, 0, NULL);
+
+  return im_o;
 }
 
 /*
- * I'm honestly not quite sure what this function does, but I wrapped it
- * anyway.
+ * Returns a new Imlib2::Image initialized with the specified data.
+ *
+ * Examples:
+ *   other_image = Imlib2::Image.load 'sample_file.png'
+ *   width, height = other_image.width, other_image.height
+ *   data = other_image.data
+ *   image = Imlib2::Image.create_using_copied_data width, height, data
  *
  */
-static VALUE image_clear_color(VALUE self, VALUE rgba_color) {
-  ImStruct  *im, *new_im;
-  Imlib_Color *color;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  imlib_context_set_image(new_im->im);
+VALUE image_create_using_copied_data(VALUE klass, VALUE w, VALUE h, VALUE data) {
+  ImStruct *im;
+  VALUE im_o;
 
-  Data_Get_Struct(rgba_color, Imlib_Color, color);
-  imlib_image_clear_color(color->red, color->blue, color->green, color->alpha);
+  im = calloc(1, sizeof(ImStruct));
+  enter_imlib();
+  im->im = imlib_create_image_using_copied_data(NUM2INT(w), NUM2INT(h), (DATA32 *) StringValuePtr (data));
+  im_o = image_wrap(klass, im);
+  rb_obj_call_init(im_o, 0, NULL);
 
-  return Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  return im_o;
 }
 
 /*
- * I'm honestly not quite sure what this function does, but I wrapped it
- * anyway.
- *
+ * Load an Imlib2::Image from a file, reporting progress to a block.
  */
-static VALUE image_clear_color_inline(VALUE self, VALUE rgba_color) {
-  ImStruct  *im;
-  Imlib_Color *color;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  Data_Get_Struct(rgba_color, Imlib_Color, color);
-  imlib_context_set_image(im->im);
-  imlib_image_clear_color(color->red, color->blue, color->green, color->alpha);
+static VALUE image_load_with_progress(VALUE klass, VALUE filename, VALUE block) {
+  ImStruct     *im;
+  ImageOp       op;
+  LoadProgress  lp;
+  VALUE         im_o = Qnil;
+  char         *path;
 
-  return self;
+  path = StringValuePtr(filename);
+
+  memset(&lp, 0, sizeof(lp));
+  lp.klass = klass;
+  lp.block = block;
+  lp.image = Qnil;
+
+  op.path = path;
+  op.progress = &lp;
+  call_imlib(load_progress_image_op, &op);
+  RB_GC_GUARD(filename);
+  RB_GC_GUARD(block);
+
+  /* the yielded image becomes the result, or is marked as deleted */
+  if (!NIL_P(lp.image)) {
+    TypedData_Get_Struct(lp.image, ImStruct, &image_type, im);
+    im->loading = 0;
+    if (op.im && op.im == im->im) {
+      im_o = lp.image;
+    } else {
+      im->im = NULL;
+      image_track_memory(im);
+    }
+  }
+  RB_GC_GUARD(lp.image);
+
+  /* re-raise exceptions (or break, etc) from the block */
+  if (lp.state)
+    rb_jump_tag(lp.state);
+  if (lp.abort)
+    return Qnil;
+
+  if (!op.im) {
+    if (op.err == IMLIB_LOAD_ERROR_NONE)
+      op.err = IMLIB_LOAD_ERROR_UNKNOWN;
+    raise_imlib_error(path, op.err);
+  }
+
+  if (NIL_P(im_o)) {
+    im = calloc(1, sizeof(ImStruct));
+    im->im = op.im;
+    im_o = image_wrap(klass, im);
+  }
+
+  return im_o;
 }
 
-/* 
- * Draw a pixel at the specified coordinates.
+/*
+ * Load an Imlib2::Image from a file (throws exceptions).
  *
- * Note: Versions of Imlib2 up to and including 1.0.5 had a broken
- * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
- * simulates drawing a pixel with a 1x1 rectangle.  To disable this
- * behavior, see the Imlib2::Image::draw_pixel_workaround= method.
+ * If a block with one argument is given, it is called with the loaded
+ * image, and errors are ignored (nil is returned instead).
+ *
+ * If a block with two or more arguments is given, it is called as the
+ * image is decoded, with the partially-loaded image, the percent done,
+ * and the x, y, width and height of the region that was just decoded
+ * (see Imlib2::Context#progress_granularity for how often).  Return
+ * false from the block (or raise or break out of it) to stop loading,
+ * in which case nil is returned and the image isn't cached.  The image
+ * can be read, but not deleted or replaced (eg crop!), until it has
+ * finished loading.
+ *
+ * Note: Images that are already in the Imlib2 cache are returned
+ * without calling the progress block.
  *
  * Examples:
- *   im.draw_pixel 10, 10                      # draw using context color
- *   im.draw_pixel 10, 10, Imlib2::Color::BLUE # draw blue pixel
- *   im.draw_pixel [10, 10], Imlib2::Color::RED # draw red pixel
+ *   image = Imlib2::Image.load 'sample_file.png'
+ *
+ *   begin 
+ *     image = Imlib2::Image.load 'sample_file.png'
+ *   rescue Imlib2::FileError
+ *     $stderr.puts 'Couldn't load file: ' + $!
+ *   end
+ *
+ *   # reject huge uploads as soon as the header has been read
+ *   image = Imlib2::Image.load(path) do |img, percent, x, y, w, h|
+ *     img.width * img.height <= 40_000_000
+ *   end
+ *
+ *   # show rows as they're decoded
+ *   Imlib2::Context.current.progress_granularity = 10
+ *   image = Imlib2::Image.load(path) do |img, percent, x, y, w, h|
+ *     preview.blend! img, x, y, w, h, x, y, w, h
+ *     preview.save 'preview.png'
+ *   end
  *
  */
-static VALUE image_draw_pixel(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  VALUE color = Qnil;
-  int x = 0, y = 0;
-  int blend, aa;
+static VALUE image_load(VALUE klass, VALUE filename) {
+  ImStruct        *im;
+  ImageOp          op;
+  VALUE            im_o = Qnil;
+  char            *path;
+  unsigned long long start;
 
-  switch (argc) {
-    case 1:
-      /* one argument is an array or hash of points, with color
-       * defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is either two fixnum points (with color
-       * defaulting to Qnil), or an array or hash of points and a color
-       * */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          color = argv[1];
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          color = argv[1];
-          break;
-        case T_FIXNUM:
-          x = NUM2INT(argv[0]);
-          y = NUM2INT(argv[1]);
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is two fixnum points and a color value */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1, 2, or 3)");
+  /* a block taking two or more arguments is a progress callback */
+  if (rb_block_given_p()) {
+    VALUE block = rb_block_proc();
+    int arity = rb_proc_arity(block);
+
+    if (arity > 1 || arity < -1)
+      return image_load_with_progress(klass, filename, block);
   }
+
+  /* grab filename */
+  path = StringValuePtr(filename);
   
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
+  op.path = path;
+  start = OP_STATS_BEGIN();
+  call_imlib(load_image_op, &op);
+  RB_GC_GUARD(filename);
 
-  if (draw_pixel_workaround) {
-    /* use draw_pixel workaround */
+  if (op.err == IMLIB_LOAD_ERROR_NONE) {
+    im = calloc(1, sizeof(ImStruct));
+    im->im = op.im;
+    im_o = image_wrap(klass, im);
+    OP_STATS_END(STAT_LOAD, start, stats_file_size(path), im->bytes / 4);
 
-    /*********************************************************************/
-    /* WORKAROUND: workaround for borked Imlib2 imlib_image_draw_pixel() */
-    /*********************************************************************/
-  
-    /* save context, then disable blending and aa */
-    blend = imlib_context_get_blend();
-    aa = imlib_context_get_anti_alias();
+    if (rb_block_given_p())
+      rb_yield(im_o);
+  } else {
+    /* there was an error loading -- throw an exception if we weren't
+     * passed a block */
+
+    if (!rb_block_given_p())
+      raise_imlib_error(path, op.err);
+  }
   
-    /* draw 1x1 rectangle */
-    imlib_image_draw_rectangle(x, y, 1, 1);
-    
-    /* restore blend and aa context */
-    imlib_context_set_blend(blend);
-    imlib_context_set_anti_alias(aa);
+  return im_o;
+}
+
+/*
+ * Load an Imlib2::Image from a String of encoded image data (throws
+ * exceptions).  The optional format hint (eg 'png', or a filename like
+ * 'avatar.jpg') picks the loader to try first; without it, Imlib2 tries
+ * each loader in turn.
+ *
+ * The data never touches the filesystem if Imlib2 has
+ * imlib_load_image_mem() (Imlib2 1.8 or newer); otherwise it is copied
+ * to an anonymous memfd.  The format hint is then only used if Imlib2
+ * has imlib_load_image_fd(); without it, Imlib2 tries each loader in
+ * turn.
+ *
+ * Examples:
+ *   image = Imlib2::Image.load_from_memory File.binread('sample_file.png')
+ *
+ *   image = Imlib2::Image.load_from_memory s3_object.body.read, 'jpg'
+ *
+ *   begin
+ *     image = Imlib2::Image.load_from_memory data
+ *   rescue Imlib2::FileError
+ *     $stderr.puts "Couldn't decode image: " + $!
+ *   end
+ *
+ */
+static VALUE image_load_from_memory(int argc, VALUE *argv, VALUE klass) {
+  ImStruct *im;
+  ImageOp   op;
+  VALUE     data, hint, im_o = Qnil;
+  char      path[256];
+
+  rb_scan_args(argc, argv, "11", &data, &hint);
+
+#if !defined(HAVE_IMLIB_LOAD_IMAGE_MEM) && !defined(HAVE_MEMFD_CREATE)
+  rb_raise(rb_eNotImpError, "loading from memory is not supported "
+                            "(needs Imlib2 1.8 or memfd_create())");
+#endif
+
+  /* frozen copy, so other threads can't modify the buffer while the
+   * GVL is released */
+  data = rb_str_new_frozen(StringValue(data));
+
+  /* turn a bare extension into a filename for the loader lookup */
+  if (NIL_P(hint))
+    snprintf(path, sizeof(path), "memory");
+  else if (strchr(StringValueCStr(hint), '.'))
+    snprintf(path, sizeof(path), "%s", StringValueCStr(hint));
+  else
+    snprintf(path, sizeof(path), "memory.%s", StringValueCStr(hint));
+
+  op.path = path;
+  op.mem = RSTRING_PTR(data);
+  op.size = RSTRING_LEN(data);
+  call_imlib(load_memory_image_op, &op);
+  RB_GC_GUARD(data);
+
+  if (op.err == IMLIB_LOAD_ERROR_NONE) {
+    im = calloc(1, sizeof(ImStruct));
+    im->im = op.im;
+    im_o = image_wrap(klass, im);
+
+    if (rb_block_given_p())
+      rb_yield(im_o);
   } else {
-    /* use imlib_image_draw_pixel() (buggy for Imlib2 <= 1.0.5) */
+    /* there was an error loading -- throw an exception if we weren't
+     * passed a block */
 
-    (void) imlib_image_draw_pixel(x, y, 0);
+    if (!rb_block_given_p())
+      raise_imlib_error(path, op.err);
   }
 
-  return self;
+  return im_o;
 }
 
-/* 
- * Draw a line at the specified coordinates.
+/*
+ * Load an Imlib2::Image from an IO (or anything else that responds to
+ * read) without going through a file path (throws exceptions).  The
+ * optional format hint is the same as for
+ * Imlib2::Image::load_from_memory().
  *
  * Examples:
- *   # draw line from 10, 10 to 20, 20 using context color
- *   im.draw_line 10, 10, 20, 20
+ *   image = Imlib2::Image.load_from_io request.body, 'png'
  *
- *   # draw magenta line from 5, 10 to 15, 20
- *   im.draw_line 5, 10, 15, 20, Imlib2::Color::MAGENTA
+ *   File.open('sample_file.png', 'rb') { |io|
+ *     image = Imlib2::Image.load_from_io io
+ *   }
  *
- *   # draw line from 10, 15 to 20, 25 using context color
- *   im.draw_pixel [10, 15], [20, 25]
+ */
+static VALUE image_load_from_io(int argc, VALUE *argv, VALUE klass) {
+  VALUE io, hint, args[2];
+
+  rb_scan_args(argc, argv, "11", &io, &hint);
+
+  args[0] = rb_funcall(io, rb_intern("read"), 0);
+  args[1] = hint;
+  if (NIL_P(args[0]))
+    args[0] = rb_str_new(0, 0);
+
+  return image_load_from_memory(2, args, klass);
+}
+
+/*
+ * Load an Imlib2::Image from a file, scaled down to fit inside
+ * max_w x max_h (0 means no limit) with its aspect ratio kept (throws
+ * exceptions).  Images that already fit are not scaled up.
  *
- *   # draw line from 1000, 2000 to 2100, 4200 with funky color
- *   my_color = Imlib2::Color::CmykColor.new 100, 255, 0, 128
- *   im.draw_line [1000, 2000], [2100, 4200], my_color
+ * If Imlib2-Ruby was built with libjpeg, JPEGs are decoded at 1/2, 1/4
+ * or 1/8 size by libjpeg (DCT-domain scaling) whenever the result is
+ * still at least max_w x max_h, and then finished with
+ * Imlib2::Image#crop_scaled.  This is much faster than decoding every
+ * pixel, and uses up to 64 times less memory.  Like Imlib2's own JPEG
+ * loader, it turns the image upright for its EXIF orientation.  Other
+ * formats (and CMYK JPEGs) are loaded by Imlib2 and then scaled.
+ *
+ * Note: The scaled image isn't added to the Imlib2 image cache.
+ *
+ * Examples:
+ *   thumb = Imlib2::Image.load_scaled 'photo.jpg', 200, 200
+ *   thumb.save 'thumb.jpg'
+ *
+ *   # limit the width only
+ *   banner = Imlib2::Image.load_scaled 'photo.jpg', 1024, 0
  *
  */
-static VALUE image_draw_line(int argc, VALUE *argv, VALUE self) {
+static VALUE image_load_scaled(VALUE klass, VALUE filename, VALUE max_w, VALUE max_h) {
   ImStruct *im;
-  VALUE color = Qnil;
-  int i = 0, x[2] = {0, 0}, y[2] = {0, 0};
+  ImageOp   op;
+  char     *path;
 
-  switch (argc) {
-    case 2:
-      /* two arguments is an array or hash of points, with color
-       * defaulting to Qnil (ie, the context color) */
-      for (i = 0; i < 2; i++) {
-        switch (TYPE(argv[i])) {
-          case T_HASH:
-            x[i] = NUM2INT(rb_hash_aref(argv[i], rb_str_new2("x")));
-            y[i] = NUM2INT(rb_hash_aref(argv[i], rb_str_new2("y")));
-            break;
-          case T_ARRAY:
-            x[i] = NUM2INT(rb_ary_entry(argv[i], 0));
-            y[i] = NUM2INT(rb_ary_entry(argv[i], 1));
-            break;
-          default:
-            rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-        }
-      }
-      break;
-    case 3:
-      /* three arguments is two arrays or hashes of points and a color
-       * */
-      for (i = 0; i < 2; i++) {
-        switch (TYPE(argv[i])) {
-          case T_HASH:
-            x[i] = NUM2INT(rb_hash_aref(argv[i], rb_str_new2("x")));
-            y[i] = NUM2INT(rb_hash_aref(argv[i], rb_str_new2("y")));
-            break;
-          case T_ARRAY:
-            x[i] = NUM2INT(rb_ary_entry(argv[i], 0));
-            y[i] = NUM2INT(rb_ary_entry(argv[i], 1));
-            break;
-          default:
-            rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-        }
-      }
-      color = argv[2];
-      break;
-    case 5:
-      /* 5 arguments is 4 fixnum points and a color value */
-      color = argv[4];
+  path = StringValueCStr(filename);
 
-      /* pass-through */
-    case 4:
-      x[0] = NUM2INT(argv[0]);
-      y[0] = NUM2INT(argv[1]);
-      x[1] = NUM2INT(argv[2]);
-      y[1] = NUM2INT(argv[3]);
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 2, 3, 4, or 5)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
-  (void) imlib_image_draw_line(x[0], y[0], x[1], y[1], 0);
-  
-  return self;
+  op.path = path;
+  op.w = NUM2INT(max_w);
+  op.h = NUM2INT(max_h);
+  call_imlib(load_scaled_image_op, &op);
+  RB_GC_GUARD(filename);
+
+  if (op.err != IMLIB_LOAD_ERROR_NONE)
+    raise_imlib_error(path, op.err);
+
+  im = calloc(1, sizeof(ImStruct));
+  im->im = op.im;
+  return image_wrap(klass, im);
 }
 
+/*
+ * Build an Imlib2::Image::Info from a finished probe_image_op.
+ */
+static VALUE image_info_new(ImageOp *op, const char *path) {
+  VALUE format;
+
+  if (op->err != IMLIB_LOAD_ERROR_NONE)
+    raise_imlib_error(path, op->err);
 
-/* 
- * Draw a rectangle outline at the specified coordinates.
+  format = op->format ? rb_str_new2(op->format) : Qnil;
+  free(op->format);
+
+  return rb_struct_new(cImageInfo, INT2FIX(op->w), INT2FIX(op->h), format,
+                       op->has_alpha ? Qtrue : Qfalse);
+}
+
+/*
+ * Read the width, height, format and alpha flag of an image file
+ * without decoding (or allocating) its pixels, and return them as an
+ * Imlib2::Image::Info (throws exceptions).
+ *
+ * The file is read without the image cache, so probing doesn't keep an
+ * image around (or return stale information for a replaced file).
  *
  * Examples:
- *   # draw rectangle around edge of image using context color
- *   rect = [1, 1, im.width - 2, im.height - 2]
- *   im.draw_rect rect
+ *   info = Imlib2::Image.probe 'upload.jpg'
+ *   raise 'too big' if info.width * info.height > 40_000_000
+ *   puts "#{info.width}x#{info.height} #{info.format}"
  *
- *   # draw magenta rectangle outline in top-left corner of image
- *   color = Imlib2::Color::MAGENTA
- *   im.draw_rect [0, 0], [im.width / 2, im.height / 2], color
+ */
+static VALUE image_probe(VALUE klass, VALUE filename) {
+  ImageOp op;
+  char *path;
+
+  path = StringValueCStr(filename);
+
+  op.path = path;
+  op.mem = NULL;
+  call_imlib(probe_image_op, &op);
+  RB_GC_GUARD(filename);
+
+  UNUSED(klass);
+  return image_info_new(&op, path);
+}
+
+/*
+ * Read the width, height, format and alpha flag of an image in a String
+ * of encoded image data, without decoding its pixels (see
+ * Imlib2::Image::probe).  The optional format hint is the same as for
+ * Imlib2::Image::load_from_memory().
  *
- *   # draw square from 10, 10 to 30, 30 using context color
- *   im.draw_rect [10, 10, 20, 20] 
+ * Note: Without memfd_create(), this has to use imlib_load_image_mem(),
+ * which decodes the whole image.  With it, the format hint isn't used,
+ * and Imlib2 tries each loader in turn.
+ *
+ * Examples:
+ *   info = Imlib2::Image.probe_from_memory request.body.read
  *
  */
-static VALUE image_draw_rect(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  VALUE color = Qnil;
-  int x, y, w, h;
+static VALUE image_probe_from_memory(int argc, VALUE *argv, VALUE klass) {
+  ImageOp op;
+  VALUE data, hint;
+  char path[256];
 
-  x = y = w = h = 0;
-  switch (argc) {
-    case 1:
-      /* 1 argument is an array or hash of x, y, w, h with color
-       * defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of x, y, w, h with a color,
-       * or an array or hash of x, y, and an array or hash of w, h (with
-       * color defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of x, y and a color */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      color = argv[2];
-      break;
-    case 4:
-      /* 4 arguments is x, y, w, y (color to Qnil) */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* 4 arguments is x, y, w, y, color */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      color = argv[4];
-      break;
-    default:
-      rb_raise(rb_eTypeError,"Invalid argument count (not 1, 2, 3, 4, or 5)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
-  imlib_image_draw_rectangle(x, y, w, h);
-  
-  return self;
-}
+  rb_scan_args(argc, argv, "11", &data, &hint);
 
+#if !defined(HAVE_IMLIB_LOAD_IMAGE_MEM) && !defined(HAVE_MEMFD_CREATE)
+  rb_raise(rb_eNotImpError, "loading from memory is not supported "
+                            "(needs Imlib2 1.8 or memfd_create())");
+#endif
 
-/* 
- * Fill a rectangle at the specified coordinates.
- *
- * Examples:
- *   # fill image using context color
- *   rect = [0, 0, im.width, im.height]
- *   im.fill_rect rect
- *
- *   # fill top-left quarter of image with green
- *   color = Imlib2::Color::GREEN
- *   im.fill_rect [0, 0], [im.width / 2, im.height / 2], color
- *
- *   # fill square from 10, 10 to 30, 30 using context color
- *   im.fill_rect [10, 10, 20, 20] 
- *
- */
-static VALUE image_fill_rect(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  VALUE color = Qnil;
-  int x, y, w, h;
+  /* frozen copy, so other threads can't modify the buffer while the
+   * GVL is released */
+  data = rb_str_new_frozen(StringValue(data));
 
-  x = y = w = h = 0;
-  switch (argc) {
-    case 1:
-      /* 1 argument is an array or hash of x, y, w, h with color
-       * defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of x, y, w, h with a color,
-       * or an array or hash of x, y, and an array or hash of w, h (with
-       * color defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of x, y and a color */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      color = argv[2];
-      break;
-    case 4:
-      /* 4 arguments is x, y, w, y (color to Qnil) */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* 4 arguments is x, y, w, y, color */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      color = argv[4];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
-  imlib_image_fill_rectangle(x, y, w, h);
-  
-  return self;
+  /* turn a bare extension into a filename for the loader lookup */
+  if (NIL_P(hint))
+    snprintf(path, sizeof(path), "memory");
+  else if (strchr(StringValueCStr(hint), '.'))
+    snprintf(path, sizeof(path), "%s", StringValueCStr(hint));
+  else
+    snprintf(path, sizeof(path), "memory.%s", StringValueCStr(hint));
+
+  op.path = path;
+  op.mem = RSTRING_PTR(data);
+  op.size = RSTRING_LEN(data);
+  call_imlib(probe_image_op, &op);
+  RB_GC_GUARD(data);
+
+  UNUSED(klass);
+  return image_info_new(&op, path);
 }
 
 /*
- * Copy the alpha channel from the source image to the specified coordinates
+ * Read the width, height, format and alpha flag of an image from an IO
+ * (or anything else that responds to read), without decoding its
+ * pixels (see Imlib2::Image::probe_from_memory).
  *
  * Examples:
- *   image.copy_alpha source_image, 10, 10
- *   image.copy_alpha source_image, [10, 10]
+ *   info = Imlib2::Image.probe_from_io params[:file].tempfile
  *
  */
-static VALUE image_copy_alpha(int argc, VALUE *argv, VALUE self) {
-  ImStruct *src_im, *im;
-  VALUE src;
-  int x, y;
+static VALUE image_probe_from_io(int argc, VALUE *argv, VALUE klass) {
+  VALUE io, hint, args[2];
 
-  src = argv[0];
-  switch (argc) {
-    case 2:
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      x = NUM2INT(argv[1]);
-      y = NUM2INT(argv[2]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+  rb_scan_args(argc, argv, "11", &io, &hint);
 
-  GET_AND_CHECK_IMAGE(src, src_im);
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_copy_alpha_to_image(src_im->im, x, y);
+  args[0] = rb_funcall(io, rb_intern("read"), 0);
+  args[1] = hint;
+  if (NIL_P(args[0]))
+    args[0] = rb_str_new(0, 0);
 
-  return self;
+  return image_probe_from_memory(2, args, klass);
 }
 
 /*
- * Copy the alpha channel from a rectangle of the source image to the
- * specified coordinates
- *
- * Examples:
- *   x, y, w, h = 10, 20, 100, 200
- *   dest_x, dest_y = 5, 10
- *   image.copy_alpha_rect source_image, x, y, w, h, dest_x, dest_y
+ * Load an Imlib2::Image from a file (no exceptions or error).
  *
- *   source_rect = [10, 20, 100, 200]
- *   dest_coords = [5, 10]
- *   image.copy_alpha_rect source_image, source_rect, dest_coords
+ * Imlib2::Image::load_image() provides access to the low-level
+ * imlib_load_image() function.  You probably want to use 
+ * Imlib2::Image::load() instead of Imlib2::Image::load_image().
  *
- *   values = [10, 20, 100, 200, 5, 10]
- *   image.copy_alpha_rect source_image, values
+ * Examples:
+ *   image = Imlib2::Image.load_image 'sample_file.png'
  *
  */
-static VALUE image_copy_alpha_rect(int argc, VALUE *argv, VALUE self) {
-  ImStruct *src_im, *im;
+static VALUE image_load_image(VALUE klass, VALUE filename) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
+  VALUE im_o;
+
+  enter_imlib();
+  im->im = imlib_load_image(StringValuePtr(filename));
+  im_o = image_wrap(klass, im);
+  
+  return im_o;
+}
+
+/*
+ * Load an Imlib2::Image from a file (no exceptions or error).
+ *
+ * Imlib2::Image::load_immediately() provides access to the low-level
+ * imlib_load_image_immediately() function.  You probably want to use 
+ * Imlib2::Image::load() instead of this function.
+ *
+ * Examples:
+ *   image = Imlib2::Image.load_immediately 'sample_file.png'
+ *
+ */
+static VALUE image_load_immediately(VALUE klass, VALUE filename) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
+  VALUE im_o;
+
+  enter_imlib();
+  im->im = imlib_load_image_immediately(StringValuePtr(filename));
+  im_o = image_wrap(klass, im);
+  
+  return im_o;
+}
+
+/*
+ * Load an Imlib2::Image from a file (no caching, exception, or error).
+ *
+ * Imlib2::Image::load_without_cache() provides access to the low-level
+ * imlib_load_image_without_cache() function.  You probably want to use 
+ * Imlib2::Image::load() instead of this function.
+ *
+ * Examples:
+ *   image = Imlib2::Image.load_without_cache 'sample_file.png'
+ *
+ */
+static VALUE image_load_without_cache(VALUE klass, VALUE filename) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
+  VALUE im_o;
+
+  enter_imlib();
+  im->im = imlib_load_image_without_cache(StringValuePtr(filename));
+  im_o = image_wrap(klass, im);
+  
+  return im_o;
+}
+
+/*
+ * Load an Imlib2::Image from a file (no caching, deferred loading,
+ * exceptions, or errors).
+ *
+ * Imlib2::Image::load_immediately_without_cache() provides access to the
+ * low-level imlib_load_image_immediately_without_cache() function.  You
+ * probably want to use Imlib2::Image::load() instead of this function.
+ *
+ * Examples:
+ *   image = Imlib2::Image.load_immediately_without_cache 'sample_file.png'
+ *
+ */
+static VALUE image_load_immediately_without_cache(VALUE klass, VALUE filename) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
+  VALUE im_o;
+
+  enter_imlib();
+  im->im = imlib_load_image_immediately_without_cache(StringValuePtr(filename));
+  im_o = image_wrap(klass, im);
+  
+  return im_o;
+}
+
+/*
+ * Load an Imlib2::Image from a file with a hash of the error value and
+ * the image.
+ *
+ * Imlib2::Image::load_with_error_return() provides access to the
+ * low-level imlib_load_image_with_error_return() function.  You
+ * probably want to use Imlib2::Image::load() instead of this function.
+ *
+ * Examples:
+ *   hash = Imlib2::Image.load_with_error_return 'sample_file.png'
+ *   if hash['error'] == 0 # 0 is no error
+ *     image = hash['image']
+ *   end
+ *
+ */
+static VALUE image_load_with_error_return(VALUE klass, VALUE filename) {
+  ImStruct *im = calloc(1, sizeof(ImStruct));
+  Imlib_Load_Error er;
+  VALUE hash, im_o;
+  
+  enter_imlib();
+  im->im = imlib_load_image_with_error_return(StringValuePtr(filename), &er);
+  im_o = image_wrap(klass, im);
+  
+  hash = rb_hash_new();
+  rb_hash_aset(hash, key_strs[KEY_IMAGE], im_o);
+  rb_hash_aset(hash, key_strs[KEY_ERROR], INT2FIX(er));
+
+  return hash;
+}
+
+/*
+ * Save an Imlib2::Image to a file (throws an exception on error).
+ * 
+ * Examples:
+ *   image.save 'output_file.png'
+ *
+ *   filename = 'output_file.jpg'
+ *   begin
+ *     image.save filename
+ *   rescue Imlib2::FileError
+ *     $stderr.puts "Couldn't save file \"#{filename}\": " + $!
+ *   end
+ *
+ */
+static VALUE image_save(VALUE self, VALUE val) {
+  ImStruct *im;
+  ImageOp op;
+  char *path;
+  unsigned long long start;
+
+  path = StringValuePtr(val);
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  op.src = im->im;
+  op.path = path;
+  start = OP_STATS_BEGIN();
+  call_imlib(save_image_op, &op);
+  RB_GC_GUARD(val);
+
+  if (op.err == IMLIB_LOAD_ERROR_NONE) {
+    OP_STATS_END(STAT_SAVE, start, stats_file_size(path), im->bytes / 4);
+    return self;
+  }
+  if (op.err > IMLIB_LOAD_ERROR_UNKNOWN)
+    op.err = IMLIB_LOAD_ERROR_UNKNOWN;
+  raise_imlib_error(path, op.err);
+  
+  return Qnil;
+}
+
+/*
+ * Encode an Imlib2::Image in the given format (eg 'png' or 'jpeg') and
+ * return the result as a String, instead of saving it to a file
+ * (throws an exception on error).  The optional quality (0-100) is
+ * attached to the image while it's encoded, like image['quality'] = 90,
+ * and the image's own quality (if any) is put back afterwards.
+ *
+ * The image is encoded into an anonymous memfd where available (or an
+ * unlinked temporary file elsewhere), so nothing is left on disk.
+ *
+ * Examples:
+ *   png = image.to_blob 'png'
+ *   jpeg = image.to_blob 'jpeg', quality: 85
+ *   [200, { 'Content-Type' => 'image/jpeg' }, [jpeg]]
+ *
+ *   jpeg = image.save_to_memory 'jpeg'
+ *
+ */
+static VALUE image_to_blob(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  ImageOp op;
+  VALUE format, opts, quality = Qnil, str;
+  long size, n, done;
+  int old_quality = 0;
+
+  rb_scan_args(argc, argv, "1:", &format, &opts);
+  quality = hash_opt(opts, KEY_QUALITY);
+
+  op.path = StringValueCStr(format);
+  GET_AND_CHECK_IMAGE(self, im);
+  if (!NIL_P(quality)) {
+    /* Imlib2 returns 0 for a value that isn't attached */
+    imlib_context_set_image(im->im);
+    old_quality = imlib_image_get_attached_value("quality");
+    imlib_image_attach_data_value("quality", NULL, NUM2INT(quality), NULL);
+  }
+
+  op.src = im->im;
+  call_imlib(save_memory_image_op, &op);
+  RB_GC_GUARD(format);
+
+  if (!NIL_P(quality)) {
+    imlib_context_set_image(im->im);
+    if (old_quality)
+      imlib_image_attach_data_value("quality", NULL, old_quality, NULL);
+    else
+      imlib_image_remove_attached_data_value("quality");
+  }
+
+  if (op.err != IMLIB_LOAD_ERROR_NONE) {
+    if (op.fd != -1)
+      close(op.fd);
+    if (op.err > IMLIB_LOAD_ERROR_UNKNOWN)
+      op.err = IMLIB_LOAD_ERROR_UNKNOWN;
+    raise_imlib_error(StringValueCStr(format), op.err);
+  }
+
+  /* read the encoded image back */
+  size = lseek(op.fd, 0, SEEK_END);
+  str = rb_str_new(NULL, size > 0 ? size : 0);
+  for (done = 0; done < size; done += n)
+    if ((n = pread(op.fd, RSTRING_PTR(str) + done, size - done, done)) <= 0)
+      break;
+  close(op.fd);
+
+  if (size < 0 || done < size)
+    rb_sys_fail("to_blob");
+
+  return str;
+}
+
+/*
+ * Save an Imlib2::Image to a file (no exception or error).
+ * 
+ * Provides access to the low-level imlib_save_image() call.  You
+ * probably want to use Imlib2::Image::save() instead.
+ *
+ * Examples:
+ *   image.save_image 'output_file.png'
+ *
+ */
+static VALUE image_save_image(VALUE self, VALUE val) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_save_image(StringValuePtr(val));
+
+  return self;
+}
+
+/*
+ * Save an Imlib2::Image to a file (error returned as number).
+ * 
+ * Provides access to the low-level imlib_save_image_with_error_return()
+ * call.  You probably want to use Imlib2::Image::save() instead.
+ *
+ * Examples:
+ *   error = image.save_with_error_return 'output_file.png'
+ *   puts 'an error occurred' unless error == 0
+ *
+ */
+static VALUE image_save_with_error_return(VALUE self, VALUE val) {
+  ImStruct *im;
+  ImageOp op;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  op.src = im->im;
+  op.path = StringValuePtr(val);
+  call_imlib(save_image_op, &op);
+  RB_GC_GUARD(val);
+
+  if (op.err > IMLIB_LOAD_ERROR_UNKNOWN)
+    op.err = IMLIB_LOAD_ERROR_UNKNOWN;
+  
+  return INT2FIX(op.err);
+}
+
+/*
+ * Copy an Imlib2::Image
+ *
+ * Examples:
+ *   new_image = old_image.clone
+ *   new_image = old_image.dup
+ *
+ */
+static VALUE image_clone(VALUE self) {
+  ImStruct *old_im, *new_im;
+  VALUE im_o;
+
+  new_im = calloc(1, sizeof(ImStruct));
+  GET_AND_CHECK_IMAGE(self, old_im);
+  imlib_context_set_image(old_im->im);
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  return im_o;
+}
+
+/*
+ * Imlib2::Image constructor (currently just an empty placeholder).
+ *
+ */
+static VALUE image_initialize(VALUE self) {
+  return self;
+}
+
+/*
+ * Free an Imlib2::Image object, and (optionally) de-cache it as well.
+ *
+ * Note: Any future operations on this image will raise an exception.
+ *
+ * Examples:
+ *   # free image
+ *   im.delete! 
+ *
+ *   # free image, and de-cache it too
+ *   im.delete!(true)
+ * 
+ */
+static VALUE image_delete(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+
+  /* get image */
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+
+  /* free image, and possibly de-cache it as well */
+  if (argc > 0 && argv[0] != Qnil && argv[0] != Qfalse)
+    imlib_free_image_and_decache();
+  else
+    imlib_free_image();
+
+  /* set struct ptr to NULL */
+  im->im = NULL;
+  image_track_memory(im);
+
+  return Qnil;
+}
+
+/*
+ * Return the width of an Imlib2::Image.
+ *
+ * Examples:
+ *   w = image.width
+ *   w = image.w
+ *
+ */
+static VALUE image_width(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  return INT2FIX(imlib_image_get_width());
+}
+
+/*
+ * Return the height of an Imlib2::Image.
+ *
+ * Examples:
+ *   h = image.height
+ *   h = image.h
+ *
+ */
+static VALUE image_height(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  return INT2FIX(imlib_image_get_height());
+}
+
+/*
+ * Return the filename of an Imlib2::Image.
+ *
+ * Examples:
+ *   path = image.filename
+ *
+ */
+static VALUE image_filename(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  return rb_str_new2(imlib_image_get_filename());
+}
+
+/*
+ * Return a copy of an image's raw 32-bit data.
+ *
+ * Note: This copies the whole pixel buffer; see Imlib2::Image#data_view
+ * for a zero-copy alternative.
+ *
+ * Examples:
+ *   raw = image.data
+ *
+ */
+static VALUE image_data(VALUE self) {
+  ImStruct *im;
+  int       w, h;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+
+  return rb_str_new((char*) imlib_image_get_data(), h * w * 4);
+}
+
+/*
+ * Return a read-only reference to an image's raw 32-bit data.
+ *
+ * Examples:
+ *   RAW_DATA = image.data_for_reading_only
+ *   RAW_DATA = image.data!
+ *
+ */
+static VALUE image_data_ro(VALUE self) {
+  ImStruct *im;
+  int       w, h;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+
+  return rb_str_new((char*) imlib_image_get_data_for_reading_only(), h * w * 4);
+}
+
+/*
+ * Return a zero-copy IO::Buffer view of an image's raw 32-bit data.
+ * The view is read-only unless writable is true; pixels written
+ * through a writable view should be committed with put_back_data.
+ *
+ * The view is shared with the image (calling data_view again returns
+ * the same buffer), and it stays valid until put_back_data, delete!,
+ * or an in-place operation that replaces the pixel buffer (eg crop!,
+ * crop_scaled! or rotate!).  After that, any access to the old view
+ * raises an exception instead of touching freed memory.
+ *
+ * Note: Requires Ruby 3.1 or newer (IO::Buffer).
+ *
+ * Examples:
+ *   # read pixels without copying them
+ *   view = image.data_view
+ *   argb = view.get_value(:u32, 4 * (y * image.w + x))
+ *
+ *   # write pixels in place, then put them back
+ *   view = image.data_view true
+ *   view.set_value :u32, 0, 0xffff0000
+ *   image.put_back_data view
+ *
+ */
+static VALUE image_data_view(int argc, VALUE *argv, VALUE self) {
+#ifdef HAVE_RB_IO_BUFFER_NEW
+  ImStruct *im;
+  VALUE writable, view;
+  enum rb_io_buffer_flags flags = RB_IO_BUFFER_EXTERNAL;
+  void *data;
+  size_t size;
+
+  rb_scan_args(argc, argv, "01", &writable);
+  if (!RTEST(writable))
+    flags |= RB_IO_BUFFER_READONLY;
+
+  GET_AND_CHECK_IMAGE(self, im);
+
+  /* reuse the existing view, if it has the right access */
+  view = rb_ivar_get(self, id_data_view);
+  if (!NIL_P(view)) {
+    if ((rb_io_buffer_get_bytes(view, &data, &size) & RB_IO_BUFFER_READONLY)
+        == (flags & RB_IO_BUFFER_READONLY))
+      return view;
+    release_data_view(self);
+  }
+
+  imlib_context_set_image(im->im);
+  size = (size_t) imlib_image_get_width() * imlib_image_get_height() * 4;
+  if (RTEST(writable))
+    data = imlib_image_get_data();
+  else
+    data = imlib_image_get_data_for_reading_only();
+
+  /* the view keeps the image alive, and vice versa */
+  view = rb_io_buffer_new(data, size, flags);
+  rb_ivar_set(view, id_data_view_image, self);
+  rb_ivar_set(self, id_data_view, view);
+
+  return view;
+#else
+  rb_raise(rb_eNotImpError, "data_view is not supported (needs IO::Buffer)");
+  return Qnil;
+#endif /* HAVE_RB_IO_BUFFER_NEW */
+}
+
+/*
+ * Fill an image using raw 32-bit data.
+ *
+ * Note: The new data buffer must be the same size (in bytes) as the
+ * original data buffer.  It can be a String or an IO::Buffer (such as
+ * a writable Imlib2::Image#data_view, which is detached afterwards).
+ *
+ * Examples:
+ *   RAW_DATA = other_image.data!
+ *   image.put_data RAW_DATA
+ *
+ *   RAW_DATA = other_image.data!
+ *   image.data = RAW_DATA
+ *
+ */
+static VALUE image_put_data(VALUE self, VALUE str) {
+  ImStruct *im;
+  DATA32 *old_data, *new_data;
+  int w, h, old_size;
+  long new_size;
+
+  /* get image, check it, then set the context */
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  /* get old data, calculate buffer size from width and height */
+  old_data = imlib_image_get_data();
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  old_size = w * h * 4;
+
+  /* get new data, check size of buffer */
+#ifdef HAVE_RB_IO_BUFFER_NEW
+  if (rb_obj_is_kind_of(str, rb_cIOBuffer)) {
+    const void *buf;
+    size_t size;
+
+    rb_io_buffer_get_bytes_for_reading(str, &buf, &size);
+    new_data = (DATA32*) buf;
+    new_size = (long) size;
+  } else
+#endif /* HAVE_RB_IO_BUFFER_NEW */
+  {
+    new_data = (DATA32*) StringValuePtr(str);
+    new_size = RSTRING_LEN(str);
+  }
+  
+  /* check size of new buffer */
+  if (new_size != old_size)
+    rb_raise(rb_eArgError, "invalid buffer size");
+  
+  /* copy new data to old address */
+  if (old_data != new_data)
+    memcpy(old_data, new_data, old_size);
+  
+  /* actual put_back_data() call */
+  imlib_image_put_back_data(old_data);
+  RB_GC_GUARD(str);
+  release_data_view(self);
+
+  /* return success */
+  return Qtrue;
+}
+
+/*
+ * Does this image have transparent or translucent regions?
+ *
+ * Examples:
+ *   if image.has_alpha? 
+ *     puts 'this image has alpha'
+ *   end
+ *
+ */
+static VALUE image_has_alpha(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  return imlib_image_has_alpha() ? Qtrue : Qfalse;
+}
+
+/*
+ * Set image alpha transparency.
+ *
+ * Examples:
+ *   image.set_has_alpha true 
+ *   image.has_alpha = true 
+ *
+ */
+static VALUE image_set_has_alpha(VALUE self, VALUE val) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_has_alpha(val == Qtrue);
+
+  return val;
+}
+
+/*
+ * Flag this image as changing on disk
+ *
+ * Examples:
+ *   image.changes_on_disk
+ *
+ */
+static VALUE image_changes_on_disk(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_changes_on_disk();
+
+  return Qtrue;
+}
+
+/*
+ * Get the Imlib2::Border of an Imlib2::Image
+ *
+ * Examples:
+ *   border = image.get_border
+ *   border = image.border
+ *
+ */
+static VALUE image_get_border(VALUE self) {
+  ImStruct *im;
+  Imlib_Border *border;
+  VALUE argv[4];
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  border = malloc(sizeof(Imlib_Border));
+  imlib_image_get_border(border);
+  argv[0] = INT2NUM(border->left);
+  argv[1] = INT2NUM(border->top);
+  argv[2] = INT2NUM(border->right);
+  argv[3] = INT2NUM(border->bottom);
+  free(border);
+
+  return border_new(4, argv, cBorder);
+}
+
+/*
+ * Set the Imlib2::Border of an Imlib2::Image
+ *
+ * Examples:
+ *   image.set_border border
+ *   image.border = border
+ *
+ */
+static VALUE image_set_border(VALUE self, VALUE border) {
+  ImStruct *im;
+  Imlib_Border *b;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  Data_Get_Struct(border, Imlib_Border, b);
+  imlib_image_set_border(b);
+
+  return border;
+}
+
+/*
+ * Get the on-disk format of an Imlib2::Image
+ *
+ * Examples:
+ *   format = image.get_format
+ *   format = image.format
+ *
+ */
+static VALUE image_get_format(VALUE self) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  return rb_str_new2(imlib_image_format());
+}
+
+/*
+ * Set the on-disk format of an Imlib2::Image
+ *
+ * Examples:
+ *   image.get_format 'png'
+ *   image.format = 'png'
+ *
+ */
+static VALUE image_set_format(VALUE self, VALUE format) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_format(StringValuePtr(format));
+
+  return format;
+}
+
+/*
+ * Set the irrelevant_format flag of an Imlib2::Image
+ *
+ * Examples:
+ *   image.set_irrelevant_format true
+ *   image.irrelevant_format = true
+ *
+ */
+static VALUE image_irrelevant_format(VALUE self, VALUE val) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_irrelevant_format(val != Qfalse);
+
+  return val;
+}
+
+/*
+ * Set the irrelevant_border flag of an Imlib2::Image
+ *
+ * Examples:
+ *   image.set_irrelevant_border true
+ *   image.irrelevant_border = true
+ *
+ */
+static VALUE image_irrelevant_border(VALUE self, VALUE val) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_irrelevant_border(val != Qfalse);
+
+  return val;
+}
+
+/*
+ * Set the irrelevant_alpha flag of an Imlib2::Image
+ *
+ * Examples:
+ *   image.set_irrelevant_alpha true
+ *   image.irrelevant_alpha = true
+ *
+ */
+static VALUE image_irrelevant_alpha(VALUE self, VALUE val) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_set_irrelevant_alpha(val != Qfalse);
+
+  return val;
+}
+
+/*
+ * Get the Imlib2::Color::RgbaColor value of the pixel at x, y
+ *
+ * Examples:
+ *   color = image.query_pixel 320, 240
+ *   color = image.pixel 320, 240
+ *
+ */
+static VALUE image_query_pixel(VALUE self, VALUE x, VALUE y) {
+  ImStruct *im;
+  Imlib_Color color;
+  VALUE argv[4];
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  imlib_image_query_pixel(NUM2INT(x), NUM2INT(y), &color);
+  argv[0] = INT2NUM(color.red);
+  argv[1] = INT2NUM(color.green);
+  argv[2] = INT2NUM(color.blue);
+  argv[3] = INT2NUM(color.alpha);
+
+  return rgba_color_new(4, argv, cRgbaColor);
+}
+
+/*
+ * Get the Imlib2::Color::HsvaColor value of the pixel at x, y
+ *
+ * Examples:
+ *   color = image.query_pixel_hsva 320, 240
+ *   color = image.pixel_hsva 320, 240
+ *
+ */
+static VALUE image_query_pixel_hsva(VALUE self, VALUE x, VALUE y) {
+  ImStruct *im;
+  float hue, saturation, value;
+  int alpha;
+  VALUE argv[4];
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  imlib_image_query_pixel_hsva(NUM2INT(x), NUM2INT(y), &hue, &saturation, &value, &alpha);
+  argv[0] = rb_float_new(hue);
+  argv[1] = rb_float_new(saturation);
+  argv[2] = rb_float_new(value);
+  argv[3] = INT2NUM(alpha);
+
+  return hsva_color_new(4, argv, cHsvaColor);
+}
+
+/*
+ * Get the Imlib2::Color::HlsaColor value of the pixel at x, y
+ *
+ * Examples:
+ *   color = image.query_pixel_hlsa 320, 240
+ *   color = image.pixel_hlsa 320, 240
+ *
+ */
+static VALUE image_query_pixel_hlsa(VALUE self, VALUE x, VALUE y) {
+  ImStruct *im;
+  float hue, lightness, saturation;
+  int alpha;
+  VALUE argv[4];
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  imlib_image_query_pixel_hsva(NUM2INT(x), NUM2INT(y), &hue, &lightness, &saturation, &alpha);
+  argv[0] = rb_float_new(hue);
+  argv[1] = rb_float_new(lightness);
+  argv[2] = rb_float_new(saturation);
+  argv[3] = INT2NUM(alpha);
+
+  return hlsa_color_new(4, argv, cHlsaColor);
+}
+
+/*
+ * Get the Imlib2::Color::CmyaColor value of the pixel at x, y
+ *
+ * Examples:
+ *   color = image.query_pixel_cmya 320, 240
+ *   color = image.pixel_cmya 320, 240
+ *
+ */
+static VALUE image_query_pixel_cmya(VALUE self, VALUE x, VALUE y) {
+  ImStruct *im;
+  CmyaColor color;
+  VALUE argv[4];
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  imlib_image_query_pixel_cmya(NUM2INT(x), NUM2INT(y), &color.cyan, &color.magenta, &color.yellow, &color.alpha);
+  argv[0] = INT2NUM(color.cyan);
+  argv[1] = INT2NUM(color.magenta);
+  argv[2] = INT2NUM(color.yellow);
+  argv[3] = INT2NUM(color.alpha);
+
+  return cmya_color_new(4, argv, cCmyaColor);
+}
+
+/*
+ * Get a region of an image from x, y, w, h arguments: none (the whole
+ * image), an array or hash, or four integers.  Raises ArgumentError if
+ * the region isn't inside the image.
+ */
+static void get_region(int argc, VALUE *argv, int iw, int ih,
+                       int *x, int *y, int *w, int *h) {
+  switch (argc) {
+    case 0:
+      *x = *y = 0;
+      *w = iw;
+      *h = ih;
+      break;
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          *x = NUM2INT(hash_arg(argv[0], KEY_X));
+          *y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          *w = NUM2INT(hash_arg(argv[0], KEY_W));
+          *h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          *x = NUM2INT(rb_ary_entry(argv[0], 0));
+          *y = NUM2INT(rb_ary_entry(argv[0], 1));
+          *w = NUM2INT(rb_ary_entry(argv[0], 2));
+          *h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      *x = NUM2INT(argv[0]);
+      *y = NUM2INT(argv[1]);
+      *w = NUM2INT(argv[2]);
+      *h = NUM2INT(argv[3]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 0, 1, or 4)");
+  }
+
+  if (*x < 0 || *y < 0 || *w < 0 || *h < 0 || *x > iw - *w || *y > ih - *h)
+    rb_raise(rb_eArgError, "region %d, %d, %d, %d is outside of the %dx%d image",
+             *x, *y, *w, *h, iw, ih);
+}
+
+/*
+ * Get the pixels of the image (or the region x, y, w, h of it) in one
+ * call, as a packed binary String rather than a color object per pixel.
+ * The optional format is one of:
+ *
+ * :rgba8::    4 bytes per pixel: red, green, blue, alpha (the default)
+ * :bgra8::    4 bytes per pixel: blue, green, red, alpha
+ * :rgb8::     3 bytes per pixel: red, green, blue
+ * :argb32::   a native-endian 32-bit ARGB integer per pixel (as stored)
+ * :cmya8::    4 bytes per pixel: cyan, magenta, yellow, alpha
+ * :hsva_f32:: 4 native floats per pixel: hue (0-360), saturation and
+ *             value (0-1), alpha (0-255), as Image#query_pixel_hsva
+ * :hlsa_f32:: 4 native floats per pixel: hue (0-360), lightness and
+ *             saturation (0-1), alpha (0-255)
+ *
+ * Rows are packed with no padding, top to bottom.
+ *
+ * Examples:
+ *   rgba = image.pixels
+ *   reds = rgba.unpack('C*').each_slice(4).map(&:first)
+ *
+ *   hsva = image.pixels(10, 10, 64, 64, format: :hsva_f32).unpack('f*')
+ *
+ *   argb = image.pixels([0, 0, 16, 16], format: :argb32).unpack('L*')
+ *
+ */
+static VALUE image_pixels(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  PixelsOp op;
+  VALUE opts, format = Qnil, str;
+  const char *name;
+  int x, y, w, h, iw, ih;
+
+  argc = rb_scan_args(argc, argv, "04:", NULL, NULL, NULL, NULL, &opts);
+  format = hash_opt(opts, KEY_FORMAT);
+
+  op.format = PIXELS_RGBA8;
+  if (!NIL_P(format)) {
+    if (SYMBOL_P(format))
+      format = rb_sym_to_s(format);
+    name = StringValueCStr(format);
+    for (op.format = 0; pixel_formats[op.format].name; op.format++)
+      if (!strcmp(pixel_formats[op.format].name, name))
+        break;
+    if (!pixel_formats[op.format].name)
+      rb_raise(rb_eArgError, "unknown pixel format: %s", name);
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  iw = imlib_image_get_width();
+  ih = imlib_image_get_height();
+  get_region(argc, argv, iw, ih, &x, &y, &w, &h);
+
+  str = rb_str_new(NULL, (long) w * h * pixel_formats[op.format].bytes);
+  op.src = imlib_image_get_data_for_reading_only() + (size_t) y * iw + x;
+  op.stride = iw;
+  op.w = w;
+  op.h = h;
+  op.out = RSTRING_PTR(str);
+
+  im->exports++;
+  call_without_gvl(pixels_op, &op);
+  im->exports--;
+  RB_GC_GUARD(self);
+
+  return str;
+}
+
+/*
+ * Count the histograms of an image region (rect, or nil for the whole
+ * image) into op.  Returns the number of pixels.
+ */
+static long image_stats(VALUE self, VALUE rect, StatsOp *op) {
+  ImStruct *im;
+  int x, y, iw, ih;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  iw = imlib_image_get_width();
+  ih = imlib_image_get_height();
+  get_region(NIL_P(rect) ? 0 : 1, &rect, iw, ih, &x, &y, &op->w, &op->h);
+
+  memset(op->hist, 0, sizeof(op->hist));
+  op->src = imlib_image_get_data_for_reading_only() + (size_t) y * iw + x;
+  op->stride = iw;
+
+  im->exports++;
+  call_without_gvl(stats_op, op);
+  im->exports--;
+  RB_GC_GUARD(self);
+
+  return (long) op->w * op->h;
+}
+
+/*
+ * Get a statistics channel from a name: red, green, blue, alpha, or
+ * luma (Rec. 601 weights).  Returns -1 for rgba.
+ */
+static int stats_channel(VALUE channel) {
+  static const char *names[] = { "blue", "green", "red", "alpha", "luma" };
+  const char *name;
+  int i;
+
+  if (NIL_P(channel))
+    return STATS_LUMA;
+  if (SYMBOL_P(channel))
+    channel = rb_sym_to_s(channel);
+  name = StringValueCStr(channel);
+
+  for (i = 0; i < STATS_CHANNELS; i++)
+    if (!strcmp(names[i], name))
+      return i;
+  if (!strcmp(name, "rgba"))
+    return -1;
+
+  rb_raise(rb_eArgError, "unknown channel: %s", name);
+  return 0;
+}
+
+static VALUE histogram_ary(const unsigned long *hist, int bins) {
+  VALUE ary = rb_ary_new2(bins);
+  unsigned long counts[256];
+  int i;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < 256; i++)
+    counts[i * bins / 256] += hist[i];
+  for (i = 0; i < bins; i++)
+    rb_ary_push(ary, ULONG2NUM(counts[i]));
+
+  return ary;
+}
+
+/*
+ * Count the values of one channel of the image (or of the rect region)
+ * into the given number of equal-width bins (1 to 256, default 256),
+ * returning an array of counts.  The channel is one of :red, :green,
+ * :blue, :alpha, or :luma (the default); :rgba returns an array of the
+ * red, green, blue and alpha histograms.
+ *
+ * The image is scanned once, in parallel bands (see Imlib2.threads=).
+ *
+ * Examples:
+ *   counts = image.histogram
+ *   reds = image.histogram channel: :red, bins: 16
+ *   r, g, b, a = image.histogram channel: :rgba, rect: [0, 0, 100, 100]
+ *
+ */
+static VALUE image_histogram(int argc, VALUE *argv, VALUE self) {
+  StatsOp op;
+  VALUE opts, bins_v, ret;
+  int bins = 256, channel;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  bins_v = hash_opt(opts, KEY_BINS);
+  if (!NIL_P(bins_v))
+    bins = NUM2INT(bins_v);
+  if (bins < 1 || bins > 256)
+    rb_raise(rb_eArgError, "bins must be between 1 and 256");
+  channel = stats_channel(hash_opt(opts, KEY_CHANNEL));
+
+  image_stats(self, hash_opt(opts, KEY_RECT), &op);
+
+  if (channel >= 0)
+    return histogram_ary(op.hist[channel], bins);
+
+  ret = rb_ary_new2(4);
+  rb_ary_push(ret, histogram_ary(op.hist[2], bins));
+  rb_ary_push(ret, histogram_ary(op.hist[1], bins));
+  rb_ary_push(ret, histogram_ary(op.hist[0], bins));
+  rb_ary_push(ret, histogram_ary(op.hist[3], bins));
+  return ret;
+}
+
+/*
+ * Get the average color of the image (or of the rect region), as an
+ * Imlib2::Color::RgbaColor.  Each channel is averaged separately, and
+ * rounded.
+ *
+ * Examples:
+ *   color = image.mean_color
+ *   color = image.mean_color rect: [10, 10, 32, 32]
+ *
+ */
+static VALUE image_mean_color(int argc, VALUE *argv, VALUE self) {
+  StatsOp op;
+  VALUE opts, vals[4];
+  long n;
+  int c, v;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+  n = image_stats(self, hash_opt(opts, KEY_RECT), &op);
+  if (!n)
+    rb_raise(rb_eArgError, "empty region");
+
+  /* RgbaColor.new takes red, green, blue, alpha */
+  for (c = 0; c < 4; c++) {
+    unsigned long long sum = 0;
+
+    for (v = 0; v < 256; v++)
+      sum += (unsigned long long) v * op.hist[c][v];
+    vals[c == 3 ? 3 : 2 - c] = INT2FIX((int) ((sum + n / 2) / n));
+  }
+
+  return rgba_color_new(4, vals, cRgbaColor);
+}
+
+/*
+ * Get percentiles (0 to 100) of one channel of the image (or of the
+ * rect region): for each, the smallest value that at least that
+ * percentage of pixels are less than or equal to.  Takes the same
+ * channel (except :rgba) and rect options as Image#histogram, and
+ * returns an array with a value per percentile (default: the median).
+ *
+ * Examples:
+ *   median = image.percentiles.first
+ *   lo, hi = image.percentiles 1, 99, channel: :luma
+ *   p5, p95 = image.percentiles [5, 95], rect: [0, 0, 64, 64]
+ *
+ */
+static VALUE image_percentiles(int argc, VALUE *argv, VALUE self) {
+  StatsOp op;
+  VALUE opts, ps, ret;
+  const unsigned long *hist;
+  long n, i;
+  int channel;
+
+  rb_scan_args(argc, argv, "*:", &ps, &opts);
+  if (RARRAY_LEN(ps) == 1 && TYPE(rb_ary_entry(ps, 0)) == T_ARRAY)
+    ps = rb_ary_entry(ps, 0);
+  if (!RARRAY_LEN(ps))
+    rb_ary_push(ps, INT2FIX(50));
+  for (i = 0; i < RARRAY_LEN(ps); i++) {
+    double p = NUM2DBL(rb_ary_entry(ps, i));
+    if (p < 0.0 || p > 100.0)
+      rb_raise(rb_eArgError, "percentiles must be between 0 and 100");
+  }
+
+  channel = stats_channel(hash_opt(opts, KEY_CHANNEL));
+  if (channel < 0)
+    rb_raise(rb_eArgError, "percentiles need a single channel");
+
+  n = image_stats(self, hash_opt(opts, KEY_RECT), &op);
+  if (!n)
+    rb_raise(rb_eArgError, "empty region");
+  hist = op.hist[channel];
+
+  ret = rb_ary_new2(RARRAY_LEN(ps));
+  for (i = 0; i < RARRAY_LEN(ps); i++) {
+    double target = NUM2DBL(rb_ary_entry(ps, i)) / 100.0 * n;
+    unsigned long count = 0;
+    int v;
+
+    for (v = 0; v < 255; v++)
+      if ((double) (count += hist[v]) >= target && count > 0)
+        break;
+    rb_ary_push(ret, INT2FIX(v));
+  }
+
+  return ret;
+}
+
+/*
+ * Return a cropped copy of the image
+ *
+ * Examples:
+ *   x, y, w, h = 10, 10, old_image.width - 10, old_image.height - 10
+ *   new_image = old_image.crop x, y, w, h
+ *
+ *   rect = [10, 10, old_image.width - 10, old_image.height - 10]
+ *   new_image = old_image.crop rect
+ *
+ *   new_image = old_image.crop x: 10, y: 10, w: 20, h: 20
+ *
+ *   x, y, w, h = 10, 10, old_image.width - 10, old_image.height - 10
+ *   new_image = old_image.create_cropped x, y, w, h
+ *
+ *   rect = [10, 10, old_image.width - 10, old_image.height - 10]
+ *   new_image = old_image.create_cropped rect
+ *
+ */
+static VALUE image_crop(int argc, VALUE *argv, VALUE self) {
+  ImStruct *old_im, *new_im;
+  VALUE im_o;
+  int x = 0, y = 0, w = 0, h = 0;
+  
+  switch (argc) {
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 4)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, old_im);
+  imlib_context_set_image(old_im->im);
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_create_cropped_image(x, y, w, h);
+  im_o = image_wrap(cImage, new_im);
+  
+  return im_o;
+}
+
+/*
+ * Crop an image
+ *
+ * Examples:
+ *   x, y, w, h = 10, 10, image.width - 10, image.height - 10
+ *   image.crop! x, y, w, h
+ *
+ *   rect = [10, 10, image.width - 10, image.height - 10]
+ *   image.crop! rect
+ *
+ *   x, y, w, h = 10, 10, image.width - 10, image.height - 10
+ *   image.create_cropped! x, y, w, h
+ *
+ *   rect = [10, 10, image.width - 10, image.height - 10]
+ *   image.create_cropped! rect
+ *
+ */
+static VALUE image_crop_inline(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  Imlib_Image old_im;
+  int x = 0, y = 0, w = 0, h = 0;
+  
+  switch (argc) {
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 4)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  old_im = im->im;
+  imlib_context_set_image(old_im);
+  im->im = imlib_create_cropped_image(x, y, w, h);
+  imlib_context_set_image(old_im);
+  imlib_free_image();
+  image_track_memory(im);
+
+  return self;
+}
+
+
+/*
+ * Create a cropped and scaled copy of an image
+ *
+ * By default the image is scaled by Imlib2 (see
+ * Imlib2::Context#anti_alias=).  Pass filter: :box, :bilinear,
+ * :mitchell or :lanczos3 to use the built-in separable resampler
+ * instead, which gives sharper (lanczos3) or smoother (mitchell)
+ * results and runs without holding the GVL or the Imlib2 lock (when
+ * Imlib2::release_gvl is set), so several threads can resample at once.
+ *
+ * Examples:
+ *   iw, ih = old_image.width, old_image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   x, y, w, h = 10, 10, iw - 10, ih - 10
+ *   new_image = old_image.crop_scaled x, y, w, h, new_w, new_h
+ *
+ *   iw, ih = old_image.width, old_image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
+ *   new_image = old_image.crop_scaled values
+ *
+ *   iw, ih = old_image.width, old_image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   x, y, w, h = 10, 10, iw - 10, ih - 10
+ *   new_image = old_image.create_crop_scaled x, y, w, h, new_w, new_h
+ *
+ *   iw, ih = old_image.width, old_image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
+ *   new_image = old_image.create_crop_scaled values
+ *
+ *   thumb = photo.crop_scaled 0, 0, photo.w, photo.h, 200, 150,
+ *                             filter: :lanczos3
+ *
+ *   thumb = photo.crop_scaled x: 0, y: 0, w: photo.w, h: photo.h,
+ *                             dw: 200, dh: 150, filter: :lanczos3
+ *
+ */
+static VALUE image_crop_scaled(int argc, VALUE *argv, VALUE self) {
+  ImStruct *old_im, *new_im;
+  ImageOp op;
+  VALUE im_o;
+  const ResampleFilter *filter;
+  int x = 0, y = 0, w = 0, h = 0, dw = 0, dh = 0;
+  unsigned long long start;
+  
+  filter = resample_filter_opt(&argc, argv);
+
+  switch (argc) {
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          dw = NUM2INT(hash_arg(argv[0], KEY_DW));
+          dh = NUM2INT(hash_arg(argv[0], KEY_DH));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          dw = NUM2INT(rb_ary_entry(argv[0], 4));
+          dh = NUM2INT(rb_ary_entry(argv[0], 5));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 6:
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      dw = NUM2INT(argv[4]);
+      dh = NUM2INT(argv[5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 6)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, old_im);
+  start = OP_STATS_BEGIN();
+  if (filter) {
+    op.im = resample_image(old_im, filter, x, y, w, h, dw, dh);
+  } else {
+    op.src = old_im->im;
+    op.x = x; op.y = y; op.w = w; op.h = h; op.dw = dw; op.dh = dh;
+    call_imlib(crop_scaled_image_op, &op);
+  }
+  RB_GC_GUARD(self);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = op.im;
+  im_o = image_wrap(cImage, new_im);
+  OP_STATS_END(STAT_CROP_SCALED, start, 4ULL * w * h,
+               (unsigned long long) dw * dh);
+
+  return im_o;
+}
+
+/*
+ * Crop and scale an image (see Imlib2::Image#crop_scaled for the
+ * filter option).
+ *
+ * Examples:
+ *   iw, ih = image.width, image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   x, y, w, h = 10, 10, iw - 10, ih - 10
+ *   image.crop_scaled! x, y, w, h, new_w, new_h
+ *
+ *   iw, ih = image.width, image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
+ *   image.crop_scaled! values
+ *
+ *   iw, ih = image.width, image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   x, y, w, h = 10, 10, iw - 10, ih - 10
+ *   image.create_crop_scaled! x, y, w, h, new_w, new_h
+ *
+ *   iw, ih = image.width, image.height
+ *   new_w, new_h = iw - 20, ih - 20
+ *   values = [10, 10, iw - 10, iw - 10, new_w, new_h]
+ *   image.create_crop_scaled! values
+ *
+ *   image.crop_scaled! 0, 0, image.w, image.h, 64, 64, filter: :mitchell
+ *
+ */
+static VALUE image_crop_scaled_inline(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  ImageOp op;
+  const ResampleFilter *filter;
+  int x = 0, y = 0, w = 0, h = 0, dw = 0, dh = 0;
+  unsigned long long start;
+  
+  filter = resample_filter_opt(&argc, argv);
+
+  switch (argc) {
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          dw = NUM2INT(hash_arg(argv[0], KEY_DW));
+          dh = NUM2INT(hash_arg(argv[0], KEY_DH));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          dw = NUM2INT(rb_ary_entry(argv[0], 4));
+          dh = NUM2INT(rb_ary_entry(argv[0], 5));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 6:
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      dw = NUM2INT(argv[4]);
+      dh = NUM2INT(argv[5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 6)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  op.src = im->im;
+  start = OP_STATS_BEGIN();
+  if (filter) {
+    op.im = resample_image(im, filter, x, y, w, h, dw, dh);
+  } else {
+    op.x = x; op.y = y; op.w = w; op.h = h; op.dw = dw; op.dh = dh;
+    call_imlib(crop_scaled_image_op, &op);
+  }
+  RB_GC_GUARD(self);
+
+  im->im = op.im;
+  imlib_context_set_image(op.src);
+  imlib_free_image();
+  image_track_memory(im);
+  OP_STATS_END(STAT_CROP_SCALED, start, 4ULL * w * h,
+               (unsigned long long) dw * dh);
+
+  return self;
+}
+
+/*
+ * Scale an image to several sizes at once, returning an array of new
+ * Imlib2::Image objects in the same order as sizes.
+ *
+ * Each size is either an Integer (the longest edge) or a [max_w, max_h]
+ * pair; the aspect ratio is kept and images are never scaled up.  The
+ * largest rendition is scaled from the image, and each smaller one from
+ * the previous level rather than from the full-size pixels, all in one
+ * call outside of the GVL.  The optional filter is one of the
+ * Image#crop_scaled filters, and defaults to :lanczos3.
+ *
+ * Examples:
+ *   renditions = image.pyramid [2048, 1024, 512, 256, 128]
+ *
+ *   large, thumb = image.pyramid [[800, 600], [160, 120]], filter: :mitchell
+ *
+ */
+static VALUE image_pyramid(int argc, VALUE *argv, VALUE self) {
+  VALUE sizes, opts, filter = Qnil, levels_v, ret;
+  const ResampleFilter *f = &resample_filters[3];
+  ImStruct *im;
+  PyramidLevel *levels, tmp;
+  Pyramid py;
+  const DATA32 *data;
+  int i, j, num, iw, ih, has_alpha;
+
+  rb_scan_args(argc, argv, "1:", &sizes, &opts);
+  Check_Type(sizes, T_ARRAY);
+  filter = hash_opt(opts, KEY_FILTER);
+  if (!NIL_P(filter))
+    f = resample_filter_get(filter);
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  iw = imlib_image_get_width();
+  ih = imlib_image_get_height();
+  has_alpha = imlib_image_has_alpha() ? 1 : 0;
+  data = imlib_image_get_data_for_reading_only();
+
+  num = (int) RARRAY_LEN(sizes);
+  levels = ALLOCV_N(PyramidLevel, levels_v, num);
+  memset(levels, 0, sizeof(PyramidLevel) * num);
+  for (i = 0; i < num; i++) {
+    VALUE size = rb_ary_entry(sizes, i);
+    int max_w, max_h;
+
+    if (TYPE(size) == T_ARRAY) {
+      max_w = NUM2INT(rb_ary_entry(size, 0));
+      max_h = NUM2INT(rb_ary_entry(size, 1));
+    } else {
+      max_w = max_h = NUM2INT(size);
+    }
+    if (max_w <= 0 || max_h <= 0)
+      rb_raise(rb_eArgError, "invalid size");
+
+    fit_size(iw, ih, max_w, max_h, &levels[i].w, &levels[i].h);
+    levels[i].index = i;
+  }
+
+  /* build the biggest levels first, so the rest can be scaled from them */
+  for (i = 1; i < num; i++)
+    for (j = i; j > 0 && (long) levels[j].w * levels[j].h >
+                         (long) levels[j - 1].w * levels[j - 1].h; j--) {
+      tmp = levels[j];
+      levels[j] = levels[j - 1];
+      levels[j - 1] = tmp;
+    }
+
+  for (i = 0; i < num; i++) {
+    PyramidLevel *l = &levels[i];
+    int sw = iw, sh = ih;
+
+    l->src = -1;
+    for (j = i - 1; j >= 0; j--)
+      if (levels[j].w >= l->w && levels[j].h >= l->h) {
+        l->src = j;
+        sw = levels[j].w;
+        sh = levels[j].h;
+        break;
+      }
+
+    if (!(l->im = imlib_create_image(l->w, l->h)))
+      break;
+    imlib_context_set_image(l->im);
+    imlib_image_set_has_alpha(has_alpha);
+    l->rs.dst = imlib_image_get_data();
+    l->rs.src = l->src < 0 ? data : levels[l->src].rs.dst;
+    l->rs.has_alpha = has_alpha;
+    l->rs.plan = &l->plan;
+    scale_plan_init(&l->plan, f, sw, sh, 0, 0, sw, sh, l->w, l->h);
+  }
+
+  if (i < num) {
+    for (j = 0; j < i; j++) {
+      scale_plan_free_tables(&levels[j].plan);
+      imlib_context_set_image(levels[j].im);
+      imlib_image_put_back_data(levels[j].rs.dst);
+      imlib_free_image();
+    }
+    ALLOCV_END(levels_v);
+    rb_raise(rb_eNoMemError, "couldn't create image");
+  }
+
+  py.levels = levels;
+  py.num_levels = num;
+  im->exports++;
+  call_without_gvl(pyramid_op, &py);
+  im->exports--;
+  RB_GC_GUARD(self);
+
+  for (i = 0; i < num; i++)
+    if (levels[i].rs.failed)
+      break;
+  if (i < num) {
+    for (j = 0; j < num; j++) {
+      scale_plan_free_tables(&levels[j].plan);
+      imlib_context_set_image(levels[j].im);
+      imlib_image_put_back_data(levels[j].rs.dst);
+      imlib_free_image();
+    }
+    ALLOCV_END(levels_v);
+    rb_raise(rb_eNoMemError, "couldn't resample image");
+  }
+
+  ret = rb_ary_new2(num);
+  for (i = 0; i < num; i++) {
+    PyramidLevel *l = &levels[i];
+    ImStruct *new_im;
+
+    scale_plan_free_tables(&l->plan);
+    imlib_context_set_image(l->im);
+    imlib_image_put_back_data(l->rs.dst);
+
+    new_im = calloc(1, sizeof(ImStruct));
+    new_im->im = l->im;
+    rb_ary_store(ret, l->index, image_wrap(cImage, new_im));
+  }
+
+  ALLOCV_END(levels_v);
+  return ret;
+}
+
+/* 
+ * Create a horizontally-flipped copy of an image
+ *
+ * Examples:
+ *   backwards_image = old_image.flip_horizontal
+ *
+ */
+static VALUE image_flip_horizontal(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_flip_horizontal();
+
+  return im_o;
+}
+
+/* 
+ * Flip an image horizontally
+ *
+ * Examples:
+ *   image.flip_horizontal!
+ *
+ */
+static VALUE image_flip_horizontal_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_flip_horizontal();
+
+  return self;
+}
+
+/* 
+ * Create a vertically-flipped copy of an image
+ *
+ * Examples:
+ *   upside_down_image = old_image.flip_vertical
+ *
+ */
+static VALUE image_flip_vertical(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_flip_vertical();
+
+  return im_o;
+}
+
+/* 
+ * Flip an image vertically
+ *
+ * Examples:
+ *   image.flip_vertical!
+ *
+ */
+static VALUE image_flip_vertical_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_flip_vertical();
+
+  return self;
+}
+
+/* 
+ * Create a copy of an image flipped along it's diagonal axis
+ *
+ * Examples:
+ *   new_image = old_image.flip_diagonal
+ *
+ */
+static VALUE image_flip_diagonal(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_flip_diagonal();
+
+  return im_o;
+}
+
+/* 
+ * Flip an image along it's diagonal axis
+ *
+ * Examples:
+ *   image.flip_diagonal!
+ *
+ */
+static VALUE image_flip_diagonal_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_flip_diagonal();
+
+  return self;
+}
+
+/*
+ * Return a copy of an image rotated in 90 degree increments
+ *
+ * Examples:
+ *   increments = 3 # 90 * 3 degrees (eg 270 degrees)
+ *   new_image = old_image.orientate increments
+ *
+ */
+static VALUE image_orientate(VALUE self, VALUE val) {
+  ImStruct *im, *new_im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  imlib_context_set_image(new_im->im);
+  imlib_image_orientate(NUM2INT(val));
+  return image_wrap(cImage, new_im);
+}
+
+/*
+ * Rotate an image in 90 degree increments
+ *
+ * Examples:
+ *   increments = 3 # 90 * 3 degrees (eg 270 degrees)
+ *   image.orientate! increments
+ *
+ */
+static VALUE image_orientate_inline(VALUE self, VALUE val) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_orientate(NUM2INT(val));
+
+  return self;
+}
+
+/* 
+ * Return a blurred copy of an image
+ * 
+ * Examples:
+ *   radius = 20 # radius of blur, in pixels
+ *   new_image = old_image.blur radius
+ *
+ */
+static VALUE image_blur(VALUE self, VALUE val) {
+  ImStruct *im, *new_im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+
+  blur_image(im, new_im->im, NUM2INT(val));
+  RB_GC_GUARD(self);
+
+  return image_wrap(cImage, new_im);
+}
+
+/* 
+ * Blur an image
+ * 
+ * Examples:
+ *   radius = 20 # radius of blur, in pixels
+ *   image.blur! radius
+ *
+ */
+static VALUE image_blur_inline(VALUE self, VALUE val) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  blur_image(im, im->im, NUM2INT(val));
+  RB_GC_GUARD(self);
+
+  return self;
+}
+
+/* 
+ * Return a sharpened copy of an image
+ * 
+ * Examples:
+ *   radius = 15 # radius of sharpen, in pixels
+ *   new_image = old_image.sharpen radius
+ *
+ */
+static VALUE image_sharpen(VALUE self, VALUE val) {
+  ImStruct *im, *new_im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+
+  sharpen_image(im, new_im->im, NUM2INT(val));
+  RB_GC_GUARD(self);
+
+  return image_wrap(cImage, new_im);
+}
+
+/* 
+ * Sharpened an image
+ * 
+ * Examples:
+ *   radius = 15 # radius of sharpen, in pixels
+ *   image.sharpen! radius
+ *
+ */
+static VALUE image_sharpen_inline(VALUE self, VALUE val) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  sharpen_image(im, im->im, NUM2INT(val));
+  RB_GC_GUARD(self);
+
+  return self;
+}
+
+/* 
+ * Return a copy of an image suitable for seamless horizontal tiling
+ * 
+ * Examples:
+ *   horiz_tile = old_image.tile_horizontal
+ *
+ */
+static VALUE image_tile_horizontal(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_tile_horizontal();
+
+  return im_o;
+}
+
+/* 
+ * Modify an image so it is suitable for seamless horizontal tiling
+ * 
+ * Examples:
+ *   image.tile_horizontal!
+ *
+ */
+static VALUE image_tile_horizontal_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_tile_horizontal();
+
+  return self;
+}
+
+/* 
+ * Return a copy of an image suitable for seamless vertical tiling
+ * 
+ * Examples:
+ *   vert_tile = old_image.tile_vertical
+ *
+ */
+static VALUE image_tile_vertical(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_tile_vertical();
+
+  return im_o;
+}
+
+/* 
+ * Modify an image so it is suitable for seamless vertical tiling
+ * 
+ * Examples:
+ *   image.tile_vertical!
+ *
+ */
+static VALUE image_tile_vertical_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_tile_vertical();
+
+  return self;
+}
+
+/* 
+ * Return a copy of an image suitable for seamless tiling
+ * 
+ * Examples:
+ *   horiz_tile = old_image.tile
+ *
+ */
+static VALUE image_tile(VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE im_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  im_o = image_wrap(cImage, new_im);
+
+  imlib_context_set_image(new_im->im);
+  imlib_image_tile();
+
+  return im_o;
+}
+
+/* 
+ * Modify an image so it is suitable for seamless tiling
+ * 
+ * Examples:
+ *   image.tile!
+ *
+ */
+static VALUE image_tile_inline(VALUE self) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_tile();
+
+  return self;
+}
+
+/*
+ * Clear the contents of an image
+ *
+ * Examples:
+ *   image.clear
+ *
+ */
+static VALUE image_clear(VALUE self) {
+  ImStruct *im;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_clear();
+
+  return self;
+}
+
+/*
+ * I'm honestly not quite sure what this function does, but I wrapped it
+ * anyway.
+ *
+ */
+static VALUE image_clear_color(VALUE self, VALUE rgba_color) {
+  ImStruct  *im, *new_im;
+  Imlib_Color *color;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  imlib_context_set_image(new_im->im);
+
+  Data_Get_Struct(rgba_color, Imlib_Color, color);
+  imlib_image_clear_color(color->red, color->blue, color->green, color->alpha);
+
+  return image_wrap(cImage, new_im);
+}
+
+/*
+ * I'm honestly not quite sure what this function does, but I wrapped it
+ * anyway.
+ *
+ */
+static VALUE image_clear_color_inline(VALUE self, VALUE rgba_color) {
+  ImStruct  *im;
+  Imlib_Color *color;
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  Data_Get_Struct(rgba_color, Imlib_Color, color);
+  imlib_context_set_image(im->im);
+  imlib_image_clear_color(color->red, color->blue, color->green, color->alpha);
+
+  return self;
+}
+
+/* 
+ * Draw a pixel at the specified coordinates.
+ *
+ * Note: Versions of Imlib2 up to and including 1.0.5 had a broken
+ * imlib_image_draw_pixel() call. Imlib2-Ruby has a work-around, which
+ * simulates drawing a pixel with a 1x1 rectangle.  To disable this
+ * behavior, see the Imlib2::Image::draw_pixel_workaround= method.
+ *
+ * Examples:
+ *   im.draw_pixel 10, 10                      # draw using context color
+ *   im.draw_pixel 10, 10, Imlib2::Color::BLUE # draw blue pixel
+ *   im.draw_pixel [10, 10], Imlib2::Color::RED # draw red pixel
+ *
+ */
+static VALUE image_draw_pixel(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int x = 0, y = 0;
+  int blend, aa;
+
+  switch (argc) {
+    case 1:
+      /* one argument is an array or hash of points, with color
+       * defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is either two fixnum points (with color
+       * defaulting to Qnil), or an array or hash of points and a color
+       * */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          color = argv[1];
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          color = argv[1];
+          break;
+        case T_FIXNUM:
+          x = NUM2INT(argv[0]);
+          y = NUM2INT(argv[1]);
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is two fixnum points and a color value */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1, 2, or 3)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+
+  if (draw_pixel_workaround) {
+    /* use draw_pixel workaround */
+
+    /*********************************************************************/
+    /* WORKAROUND: workaround for borked Imlib2 imlib_image_draw_pixel() */
+    /*********************************************************************/
+  
+    /* save context, then disable blending and aa */
+    blend = imlib_context_get_blend();
+    aa = imlib_context_get_anti_alias();
+  
+    /* draw 1x1 rectangle */
+    imlib_image_draw_rectangle(x, y, 1, 1);
+    
+    /* restore blend and aa context */
+    imlib_context_set_blend(blend);
+    imlib_context_set_anti_alias(aa);
+  } else {
+    /* use imlib_image_draw_pixel() (buggy for Imlib2 <= 1.0.5) */
+
+    (void) imlib_image_draw_pixel(x, y, 0);
+  }
+
+  return self;
+}
+
+/* 
+ * Draw a line at the specified coordinates.
+ *
+ * Examples:
+ *   # draw line from 10, 10 to 20, 20 using context color
+ *   im.draw_line 10, 10, 20, 20
+ *
+ *   # draw magenta line from 5, 10 to 15, 20
+ *   im.draw_line 5, 10, 15, 20, Imlib2::Color::MAGENTA
+ *
+ *   # draw line from 10, 15 to 20, 25 using context color
+ *   im.draw_pixel [10, 15], [20, 25]
+ *
+ *   # draw line from 1000, 2000 to 2100, 4200 with funky color
+ *   my_color = Imlib2::Color::CmykColor.new 100, 255, 0, 128
+ *   im.draw_line [1000, 2000], [2100, 4200], my_color
+ *
+ */
+static VALUE image_draw_line(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int i = 0, x[2] = {0, 0}, y[2] = {0, 0};
+
+  switch (argc) {
+    case 2:
+      /* two arguments is an array or hash of points, with color
+       * defaulting to Qnil (ie, the context color) */
+      for (i = 0; i < 2; i++) {
+        switch (TYPE(argv[i])) {
+          case T_HASH:
+            x[i] = NUM2INT(hash_arg(argv[i], KEY_X));
+            y[i] = NUM2INT(hash_arg(argv[i], KEY_Y));
+            break;
+          case T_ARRAY:
+            x[i] = NUM2INT(rb_ary_entry(argv[i], 0));
+            y[i] = NUM2INT(rb_ary_entry(argv[i], 1));
+            break;
+          default:
+            rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+        }
+      }
+      break;
+    case 3:
+      /* three arguments is two arrays or hashes of points and a color
+       * */
+      for (i = 0; i < 2; i++) {
+        switch (TYPE(argv[i])) {
+          case T_HASH:
+            x[i] = NUM2INT(hash_arg(argv[i], KEY_X));
+            y[i] = NUM2INT(hash_arg(argv[i], KEY_Y));
+            break;
+          case T_ARRAY:
+            x[i] = NUM2INT(rb_ary_entry(argv[i], 0));
+            y[i] = NUM2INT(rb_ary_entry(argv[i], 1));
+            break;
+          default:
+            rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+        }
+      }
+      color = argv[2];
+      break;
+    case 5:
+      /* 5 arguments is 4 fixnum points and a color value */
+      color = argv[4];
+
+      /* pass-through */
+    case 4:
+      x[0] = NUM2INT(argv[0]);
+      y[0] = NUM2INT(argv[1]);
+      x[1] = NUM2INT(argv[2]);
+      y[1] = NUM2INT(argv[3]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 2, 3, 4, or 5)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  (void) imlib_image_draw_line(x[0], y[0], x[1], y[1], 0);
+  
+  return self;
+}
+
+
+/* 
+ * Draw a rectangle outline at the specified coordinates.
+ *
+ * Examples:
+ *   # draw rectangle around edge of image using context color
+ *   rect = [1, 1, im.width - 2, im.height - 2]
+ *   im.draw_rect rect
+ *
+ *   # draw magenta rectangle outline in top-left corner of image
+ *   color = Imlib2::Color::MAGENTA
+ *   im.draw_rect [0, 0], [im.width / 2, im.height / 2], color
+ *
+ *   # draw square from 10, 10 to 30, 30 using context color
+ *   im.draw_rect [10, 10, 20, 20] 
+ *
+ */
+static VALUE image_draw_rect(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int x, y, w, h;
+
+  x = y = w = h = 0;
+  switch (argc) {
+    case 1:
+      /* 1 argument is an array or hash of x, y, w, h with color
+       * defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of x, y, w, h with a color,
+       * or an array or hash of x, y, and an array or hash of w, h (with
+       * color defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              x = NUM2INT(hash_arg(argv[0], KEY_W));
+              y = NUM2INT(hash_arg(argv[0], KEY_H));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of x, y and a color */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      color = argv[2];
+      break;
+    case 4:
+      /* 4 arguments is x, y, w, y (color to Qnil) */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* 4 arguments is x, y, w, y, color */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      color = argv[4];
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1, 2, 3, 4, or 5)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  imlib_image_draw_rectangle(x, y, w, h);
+  
+  return self;
+}
+
+
+/* 
+ * Fill a rectangle at the specified coordinates.
+ *
+ * Examples:
+ *   # fill image using context color
+ *   rect = [0, 0, im.width, im.height]
+ *   im.fill_rect rect
+ *
+ *   # fill top-left quarter of image with green
+ *   color = Imlib2::Color::GREEN
+ *   im.fill_rect [0, 0], [im.width / 2, im.height / 2], color
+ *
+ *   # fill square from 10, 10 to 30, 30 using context color
+ *   im.fill_rect [10, 10, 20, 20] 
+ *
+ */
+static VALUE image_fill_rect(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int x, y, w, h;
+
+  x = y = w = h = 0;
+  switch (argc) {
+    case 1:
+      /* 1 argument is an array or hash of x, y, w, h with color
+       * defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of x, y, w, h with a color,
+       * or an array or hash of x, y, and an array or hash of w, h (with
+       * color defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              x = NUM2INT(hash_arg(argv[0], KEY_W));
+              y = NUM2INT(hash_arg(argv[0], KEY_H));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of x, y and a color */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      color = argv[2];
+      break;
+    case 4:
+      /* 4 arguments is x, y, w, y (color to Qnil) */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* 4 arguments is x, y, w, y, color */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      color = argv[4];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  imlib_image_fill_rectangle(x, y, w, h);
+  
+  return self;
+}
+
+/*
+ * Draw many primitives of one kind, each taking per coordinates from
+ * coords: a String of packed native 32-bit integers (eg from
+ * Array#pack('l*')), or a flat Array of Integers.
+ */
+static VALUE image_draw_many(int argc, VALUE *argv, VALUE self,
+                             int kind, int per) {
+  ImStruct *im;
+  DrawManyOp op;
+  VALUE coords, color, buf_v = 0;
+  int *buf;
+  long i, n;
+
+  rb_scan_args(argc, argv, "11", &coords, &color);
+
+  if (TYPE(coords) == T_STRING) {
+    if (RSTRING_LEN(coords) % (sizeof(int32_t) * per))
+      rb_raise(rb_eArgError, "packed coordinates aren't a multiple of "
+                             "%d 32-bit integers", per);
+    n = RSTRING_LEN(coords) / sizeof(int32_t);
+    buf = ALLOCV_N(int, buf_v, n);
+    for (i = 0; i < n; i++) {
+      int32_t v;
+
+      memcpy(&v, RSTRING_PTR(coords) + i * sizeof(int32_t), sizeof(v));
+      buf[i] = v;
+    }
+  } else {
+    Check_Type(coords, T_ARRAY);
+    n = RARRAY_LEN(coords);
+    if (n % per)
+      rb_raise(rb_eArgError, "coordinates aren't a multiple of %d", per);
+    buf = ALLOCV_N(int, buf_v, n);
+    for (i = 0; i < n; i++)
+      buf[i] = NUM2INT(rb_ary_entry(coords, i));
+  }
+
+  /* resolve the context state now: other threads may change it while
+   * call_imlib() waits for Imlib2 */
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  imlib_context_get_color(&op.r, &op.g, &op.b, &op.a);
+  op.blend = imlib_context_get_blend();
+  op.aa = imlib_context_get_anti_alias();
+
+  op.im = im->im;
+  op.coords = buf;
+  op.count = n / per;
+  op.kind = kind;
+  call_imlib(draw_many_op, &op);
+  RB_GC_GUARD(self);
+
+  ALLOCV_END(buf_v);
+  return self;
+}
+
+/*
+ * Draw many pixels in one call.  Coordinates are x, y pairs, either
+ * packed as native 32-bit integers in a String, or as a flat Array.
+ * The optional color defaults to the context color.
+ *
+ * Examples:
+ *   im.draw_pixels [10, 10, 11, 10, 12, 10]
+ *   im.draw_pixels points.flatten.pack('l*'), Imlib2::Color::RED
+ *
+ */
+static VALUE image_draw_pixels(int argc, VALUE *argv, VALUE self) {
+  return image_draw_many(argc, argv, self, DRAW_PIXELS, 2);
+}
+
+/*
+ * Draw many line segments in one call.  Coordinates are x1, y1, x2, y2
+ * for each segment, either packed as native 32-bit integers in a
+ * String, or as a flat Array.  The optional color defaults to the
+ * context color.
+ *
+ * Examples:
+ *   im.draw_lines [0, 0, 10, 10, 10, 10, 20, 0]
+ *   im.draw_lines segments.pack('l*'), Imlib2::Color::BLUE
+ *
+ */
+static VALUE image_draw_lines(int argc, VALUE *argv, VALUE self) {
+  return image_draw_many(argc, argv, self, DRAW_LINES, 4);
+}
+
+/*
+ * Fill many rectangles in one call.  Coordinates are x, y, w, h for
+ * each rectangle, either packed as native 32-bit integers in a String,
+ * or as a flat Array.  The optional color defaults to the context
+ * color.
+ *
+ * Examples:
+ *   im.fill_rects [0, 0, 10, 10, 20, 20, 5, 5]
+ *   im.fill_rects bars.pack('l*'), Imlib2::Color::GREEN
+ *
+ */
+static VALUE image_fill_rects(int argc, VALUE *argv, VALUE self) {
+  return image_draw_many(argc, argv, self, FILL_RECTS, 4);
+}
+
+/*
+ * Copy the alpha channel from the source image to the specified coordinates
+ *
+ * Examples:
+ *   image.copy_alpha source_image, 10, 10
+ *   image.copy_alpha source_image, [10, 10]
+ *
+ */
+static VALUE image_copy_alpha(int argc, VALUE *argv, VALUE self) {
+  ImStruct *src_im, *im;
+  VALUE src;
+  int x, y;
+
+  src = argv[0];
+  switch (argc) {
+    case 2:
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      x = NUM2INT(argv[1]);
+      y = NUM2INT(argv[2]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
+  }
+
+  GET_AND_CHECK_IMAGE(src, src_im);
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_copy_alpha_to_image(src_im->im, x, y);
+
+  return self;
+}
+
+/*
+ * Copy the alpha channel from a rectangle of the source image to the
+ * specified coordinates
+ *
+ * Examples:
+ *   x, y, w, h = 10, 20, 100, 200
+ *   dest_x, dest_y = 5, 10
+ *   image.copy_alpha_rect source_image, x, y, w, h, dest_x, dest_y
+ *
+ *   source_rect = [10, 20, 100, 200]
+ *   dest_coords = [5, 10]
+ *   image.copy_alpha_rect source_image, source_rect, dest_coords
+ *
+ *   values = [10, 20, 100, 200, 5, 10]
+ *   image.copy_alpha_rect source_image, values
+ *
+ */
+static VALUE image_copy_alpha_rect(int argc, VALUE *argv, VALUE self) {
+  ImStruct *src_im, *im;
   VALUE src;
   int x, y, w, h, dx, dy;
 
-  x = y = w = h = dx = dy = 0;
-  src = argv[0];
-  switch (argc) {
-    case 2:
-      /* 2 arguments is a source image and an array or hash of
-       * x, y, w, h, dx, dy */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          dx = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          w = NUM2INT(rb_ary_entry(argv[1], 2));
-          h = NUM2INT(rb_ary_entry(argv[1], 3));
-          dx = NUM2INT(rb_ary_entry(argv[1], 4));
-          dy = NUM2INT(rb_ary_entry(argv[1], 5));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is a source image, an array or hash of x,y,w,h,
-       * and an array or hash of dx, dy */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          w = NUM2INT(rb_ary_entry(argv[1], 2));
-          h = NUM2INT(rb_ary_entry(argv[1], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          dx = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          dx = NUM2INT(rb_ary_entry(argv[1], 0));
-          dy = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
+  x = y = w = h = dx = dy = 0;
+  src = argv[0];
+  switch (argc) {
+    case 2:
+      /* 2 arguments is a source image and an array or hash of
+       * x, y, w, h, dx, dy */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          dx = NUM2INT(hash_arg(argv[1], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[1], KEY_DY));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          w = NUM2INT(rb_ary_entry(argv[1], 2));
+          h = NUM2INT(rb_ary_entry(argv[1], 3));
+          dx = NUM2INT(rb_ary_entry(argv[1], 4));
+          dy = NUM2INT(rb_ary_entry(argv[1], 5));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is a source image, an array or hash of x,y,w,h,
+       * and an array or hash of dx, dy */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          w = NUM2INT(rb_ary_entry(argv[1], 2));
+          h = NUM2INT(rb_ary_entry(argv[1], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          dx = NUM2INT(hash_arg(argv[1], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[1], KEY_DY));
+          break;
+        case T_ARRAY:
+          dx = NUM2INT(rb_ary_entry(argv[1], 0));
+          dy = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      /* four arguments is a source image, an array or hash of [x, y],
+       * an array or hash of [w, h], and an array or hash of [dx, dy],
+       * or a source image, an array or hash of [x, y, w, h], dx, dy */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+
+          switch (TYPE(argv[2])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[2], KEY_W));
+              h = NUM2INT(hash_arg(argv[2], KEY_H));
+
+              switch (TYPE(argv[3])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[3], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[3], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type " 
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[2], 0));
+              h = NUM2INT(rb_ary_entry(argv[2], 1));
+
+              switch (TYPE(argv[3])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[3], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[3], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type " 
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              dx = NUM2INT(argv[2]);
+              dy = NUM2INT(argv[3]);
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+
+          switch (TYPE(argv[2])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[2], KEY_W));
+              h = NUM2INT(hash_arg(argv[2], KEY_H));
+
+              switch (TYPE(argv[3])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[3], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[3], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type " 
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[2], 0));
+              h = NUM2INT(rb_ary_entry(argv[2], 1));
+
+              switch (TYPE(argv[3])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[3], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[3], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type " 
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              dx = NUM2INT(argv[2]);
+              dy = NUM2INT(argv[3]);
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 5:
+      /* five arguments is a source image, an array or hash of [x, y],
+       * an array or hash of [w, h], dx, dy */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[2], KEY_W));
+          h = NUM2INT(hash_arg(argv[2], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[2], 0));
+          h = NUM2INT(rb_ary_entry(argv[2], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      dx = NUM2INT(argv[3]);
+      dy = NUM2INT(argv[4]);
+    case 6:
+      /* six arguments is a source image, x, y, w, h, and an array or
+       * hash of [dx, dy], or source image, an array or hash of [x, y],
+       * an array or hash of [w, h], dx, dy */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+
+          switch (TYPE(argv[2])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[2], KEY_W));
+              h = NUM2INT(hash_arg(argv[2], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[2], 0));
+              h = NUM2INT(rb_ary_entry(argv[2], 1));
+              break;
+            default:
+              rb_raise(rb_eTypeError, "Invalid argument type "
+                                      "(not array or hash)");
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+
+          switch (TYPE(argv[2])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[2], KEY_W));
+              h = NUM2INT(hash_arg(argv[2], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[2], 0));
+              h = NUM2INT(rb_ary_entry(argv[2], 1));
+              break;
+            default:
+              rb_raise(rb_eTypeError, "Invalid argument type "
+                                      "(not array or hash)");
+          }
+          break;
+        default:
+          x = NUM2INT(argv[1]);
+          y = NUM2INT(argv[2]);
+          w = NUM2INT(argv[3]);
+          h = NUM2INT(argv[4]);
+      }
+      break;
+    case 7:
+      /* seven arguments is a source image, x, y, w, y, dx, dy */
+      x = NUM2INT(argv[1]);
+      y = NUM2INT(argv[2]);
+      w = NUM2INT(argv[3]);
+      h = NUM2INT(argv[4]);
+      dx = NUM2INT(argv[5]);
+      dy = NUM2INT(argv[6]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count "
+                              "(not 2, 3, 4, 5, 6, or 7)");
+  }
+  
+  GET_AND_CHECK_IMAGE(src, src_im);
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_copy_alpha_rectangle_to_image(src_im->im, x, y, w, h, dx, dy);
+  
+  return self;
+}
+
+/*
+ * Scroll a rectangle to the specified coordinates
+ *
+ * Examples:
+ *   x, y, w, h = 10, 20, 100, 200
+ *   dest_x, dest_y = 5, 10
+ *   image.scroll_rect x, y, w, h, dest_x, dest_y
+ *
+ *   source_rect = [10, 20, 100, 200]
+ *   dest_coords = [5, 10]
+ *   image.scroll_rect source_rect, dest_coords
+ *
+ *   values = [10, 20, 100, 200, 5, 10]
+ *   image.scroll_rect values
+ *
+ */
+static VALUE image_scroll_rect(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  int x, y, w, h, dx, dy;
+
+  switch (argc) {
+    case 1:
+      /* one argument is an array or hash of [x, y, w, h, dx, dy] */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          dx = NUM2INT(hash_arg(argv[0], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[0], KEY_DY));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          dx = NUM2INT(rb_ary_entry(argv[0], 4));
+          dy = NUM2INT(rb_ary_entry(argv[0], 5));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of [x, y, w, h] and an array
+       * or hash of [dx, dy] */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          dx = NUM2INT(hash_arg(argv[1], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[1], KEY_DY));
+          break;
+        case T_ARRAY:
+          dx = NUM2INT(rb_ary_entry(argv[1], 0));
+          dy = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of [x, y], an array or hash
+       * of [w, h] and an array or hash of [dx, dy], or an array or hash
+       * of [x, y, w, h], dx, dy */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(hash_arg(argv[0], KEY_W));
+              h = NUM2INT(hash_arg(argv[0], KEY_H));
+              dx = NUM2INT(argv[1]);
+              dy = NUM2INT(argv[2]);
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              dx = NUM2INT(argv[1]);
+              dy = NUM2INT(argv[2]);
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      /* four arguments is an array or hash of [x, y], an array or hash
+       * of [w, h], dx, dy */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      dx = NUM2INT(argv[2]);
+      dy = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* five arguments is x, y, w, h, and an array or hash of
+       * [dx, dy] */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      switch (TYPE(argv[4])) {
+        case T_HASH:
+          dx = NUM2INT(hash_arg(argv[4], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[4], KEY_DY));
+          break;
+        case T_ARRAY:
+          dx = NUM2INT(rb_ary_entry(argv[4], 0));
+          dy = NUM2INT(rb_ary_entry(argv[4], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 6:
+      /* six arguments is x, y, w, h, dx, dy */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      dx = NUM2INT(argv[4]);
+      dy = NUM2INT(argv[5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count "
+                              "(not 2, 3, 4, 5, 6, or 7)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_scroll_rect(x, y, w, h, dx, dy);
+
+  return self;
+}
+
+/*
+ * Copy a rectangle to the specified coordinates
+ *
+ * Examples:
+ *   x, y, w, h = 10, 20, 100, 200
+ *   dest_x, dest_y = 5, 10
+ *   image.copy_rect x, y, w, h, dest_x, dest_y
+ *
+ *   source_rect = [10, 20, 100, 200]
+ *   dest_coords = [5, 10]
+ *   image.copy_rect source_rect, dest_coords
+ *
+ *   values = [10, 20, 100, 200, 5, 10]
+ *   image.copy_rect values
+ *
+ */
+static VALUE image_copy_rect(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  int x, y, w, h, dx, dy;
+
+  switch (argc) {
+    case 1:
+      /* one argument is an array or hash of [x, y, w, h, dx, dy] */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          dx = NUM2INT(hash_arg(argv[0], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[0], KEY_DY));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          dx = NUM2INT(rb_ary_entry(argv[0], 4));
+          dy = NUM2INT(rb_ary_entry(argv[0], 5));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of [x, y, w, h] and an array
+       * or hash of [dx, dy] */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          dx = NUM2INT(hash_arg(argv[1], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[1], KEY_DY));
+          break;
+        case T_ARRAY:
+          dx = NUM2INT(rb_ary_entry(argv[1], 0));
+          dy = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of [x, y], an array or hash
+       * of [w, h] and an array or hash of [dx, dy], or an array or hash
+       * of [x, y, w, h], dx, dy */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(hash_arg(argv[0], KEY_W));
+              h = NUM2INT(hash_arg(argv[0], KEY_H));
+              dx = NUM2INT(argv[1]);
+              dy = NUM2INT(argv[2]);
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+
+              switch (TYPE(argv[2])) {
+                case T_HASH:
+                  dx = NUM2INT(hash_arg(argv[2], KEY_DX));
+                  dy = NUM2INT(hash_arg(argv[2], KEY_DY));
+                  break;
+                case T_ARRAY:
+                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
+                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
+                  break;
+                default:
+                  rb_raise(rb_eTypeError, "Invalid argument type "
+                                          "(not array or hash)");
+              }
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              dx = NUM2INT(argv[1]);
+              dy = NUM2INT(argv[2]);
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 4:
+      /* four arguments is an array or hash of [x, y], an array or hash
+       * of [w, h], dx, dy */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      dx = NUM2INT(argv[2]);
+      dy = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* five arguments is x, y, w, h, and an array or hash of
+       * [dx, dy] */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      switch (TYPE(argv[4])) {
+        case T_HASH:
+          dx = NUM2INT(hash_arg(argv[4], KEY_DX));
+          dy = NUM2INT(hash_arg(argv[4], KEY_DY));
+          break;
+        case T_ARRAY:
+          dx = NUM2INT(rb_ary_entry(argv[4], 0));
+          dy = NUM2INT(rb_ary_entry(argv[4], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 6:
+      /* six arguments is x, y, w, h, dx, dy */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      dx = NUM2INT(argv[4]);
+      dy = NUM2INT(argv[5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count "
+                              "(not 2, 3, 4, 5, 6, or 7)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  imlib_image_copy_rect(x, y, w, h, dx, dy);
+
+  return self;
+}
+
+/*
+ * Draw an ellipse at the specified coordinates with the given color
+ *
+ * Examples:
+ *   # draw an ellipse in the center of the image using the context color
+ *   xc, yc, w, h = image.w / 2, image.h / 2, image.w / 2, image.h / 2
+ *   image.draw_oval xc, yc, w, h
+ *
+ *   # draw a violet circle in the center of the image
+ *   rect = [image.w / 2, image.h / 2, image.w / 2, image.w / 2]
+ *   color = Imlib2::Color::VIOLET
+ *   image.draw_ellipse rect, color
+ *
+ */
+static VALUE image_draw_ellipse(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int x, y, w, h;
+
+  x = y = w = h = 0;
+  switch (argc) {
+    case 1:
+      /* 1 argument is an array or hash of x, y, w, h with color
+       * defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of x, y, w, h with a color,
+       * or an array or hash of x, y, and an array or hash of w, h (with
+       * color defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              x = NUM2INT(hash_arg(argv[0], KEY_W));
+              y = NUM2INT(hash_arg(argv[0], KEY_H));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of x, y and a color */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      color = argv[2];
+      break;
+    case 4:
+      /* 4 arguments is x, y, w, y (color to Qnil) */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* 4 arguments is x, y, w, y, color */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      color = argv[4];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  imlib_image_draw_ellipse(x, y, w, h);
+  
+  return self;
+}
+
+/*
+ * Fill an ellipse at the specified coordinates with the given color
+ *
+ * Examples:
+ *   # fill an ellipse in the center of the image using the context color
+ *   xc, yc, w, h = image.w / 2, image.h / 2, image.w / 2, image.h / 2
+ *   image.draw_oval xc, yc, w, h
+ *
+ *   # fill a violet circle in the center of the image
+ *   rect = [image.w / 2, image.h / 2, image.w / 2, image.w / 2]
+ *   color = Imlib2::Color::VIOLET
+ *   image.draw_ellipse rect, color
+ *
+ */
+static VALUE image_fill_ellipse(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  VALUE color = Qnil;
+  int x, y, w, h;
+
+  x = y = w = h = 0;
+  switch (argc) {
+    case 1:
+      /* 1 argument is an array or hash of x, y, w, h with color
+       * defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 2));
+          h = NUM2INT(rb_ary_entry(argv[0], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 2:
+      /* two arguments is an array or hash of x, y, w, h with a color,
+       * or an array or hash of x, y, and an array or hash of w, h (with
+       * color defaulting to Qnil (ie, the context color) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              x = NUM2INT(hash_arg(argv[0], KEY_W));
+              y = NUM2INT(hash_arg(argv[0], KEY_H));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          switch (TYPE(argv[1])) {
+            case T_HASH:
+              w = NUM2INT(hash_arg(argv[1], KEY_W));
+              h = NUM2INT(hash_arg(argv[1], KEY_H));
+              break;
+            case T_ARRAY:
+              w = NUM2INT(rb_ary_entry(argv[1], 0));
+              h = NUM2INT(rb_ary_entry(argv[1], 1));
+              break;
+            default:
+              w = NUM2INT(rb_ary_entry(argv[0], 2));
+              h = NUM2INT(rb_ary_entry(argv[0], 3));
+              /* we could do a type check here, but if it's invalid
+               * it'll get caught in the set_context_color() call */
+              color = argv[1];
+          }
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three arguments is an array or hash of x, y and a color */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[1], 0));
+          h = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      color = argv[2];
+      break;
+    case 4:
+      /* 4 arguments is x, y, w, y (color to Qnil) */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      break;
+    case 5:
+      /* 4 arguments is x, y, w, y, color */
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      w = NUM2INT(argv[2]);
+      h = NUM2INT(argv[3]);
+      color = argv[4];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
+  }
+  
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  if (color != Qnil)
+    set_context_color(color);
+  imlib_image_fill_ellipse(x, y, w, h);
+  
+  return self;
+}
+
+/*
+ * Blend a source image onto the image
+ *
+ * Examples:
+ *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
+ *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
+ *   image.blend! source_image,
+ *               src_x, src_y, src_w, src_h, 
+ *               dst_x, dst_y, dst_w, dst_h
+ *
+ *   src_rect = [50, 50, 5, 5]
+ *   dst_rect = [0, 0, image.width, image.height]
+ *   merge_alpha = false
+ *   image.blend! source_image, src_rect, dst_rect, merge_alpha
+ *
+ *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
+ *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
+ *   image.blend_image! source_image,
+ *                      src_x, src_y, src_w, src_h, 
+ *                      dst_x, dst_y, dst_w, dst_h
+ *
+ *   src_rect = [50, 50, 5, 5]
+ *   dst_rect = [0, 0, image.width, image.height]
+ *   merge_alpha = false
+ *   image.blend_image! source_image, src_rect, dst_rect, merge_alpha
+ *
+ */
+static VALUE image_blend_image_inline(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im, *src_im;
+  ImageOp op;
+  int i, s[4], d[4];
+  char merge_alpha = 1;
+  unsigned long long start;
+  
+  switch (argc) {
+    case 4:
+      /* four arguments is source image, an array or hash of
+       * [sx, sy, sw, sh], an array or hash of [sx, sy, sw, sh], and
+       * merge_alpha */
+      merge_alpha = (argv[3] == Qtrue) ? 1 : 0;
+    case 3:
+      /* three arguments is source image, an array or hash of
+       * [sx, sy, sw, sh], and an array or hash of [sx, sy, sw, sh], 
+       * with merge_alpha defaulting to true */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          s[0] = NUM2INT(hash_arg(argv[1], KEY_X));
+          s[1] = NUM2INT(hash_arg(argv[1], KEY_Y));
+          s[2] = NUM2INT(hash_arg(argv[1], KEY_W));
+          s[3] = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 4; i++)
+            s[i] = NUM2INT(rb_ary_entry(argv[1], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          d[0] = NUM2INT(hash_arg(argv[2], KEY_X));
+          d[1] = NUM2INT(hash_arg(argv[2], KEY_Y));
+          d[2] = NUM2INT(hash_arg(argv[2], KEY_W));
+          d[3] = NUM2INT(hash_arg(argv[2], KEY_H));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 4; i++)
+            d[i] = NUM2INT(rb_ary_entry(argv[2], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      
+      break;
+    case 6:
+      /* six arguments is source image, an array or hash of [sx, sy], an
+       * array or hash of [sw, sh], an array or hash of [dx, dy], an
+       * array or hash of [dw, dh], and merge_alpha */
+      merge_alpha = (argv[5] == Qtrue) ? 1 : 0;
+    case 5:
+      /* five arguments is source image, an array or hash of [sx, sy], an
+       * array or hash of [sw, sh], an array or hash of [dx, dy], and an
+       * array or hash of [dw, dh], with merge_alpha defaulting to true */
+
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          s[0] = NUM2INT(hash_arg(argv[1], KEY_X));
+          s[1] = NUM2INT(hash_arg(argv[1], KEY_Y));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 2; i++)
+            s[i] = NUM2INT(rb_ary_entry(argv[1], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          s[2] = NUM2INT(hash_arg(argv[2], KEY_S));
+          s[3] = NUM2INT(hash_arg(argv[2], KEY_H));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 2; i++)
+            s[i + 2] = NUM2INT(rb_ary_entry(argv[2], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      switch (TYPE(argv[3])) {
+        case T_HASH:
+          d[0] = NUM2INT(hash_arg(argv[3], KEY_X));
+          d[1] = NUM2INT(hash_arg(argv[3], KEY_Y));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 2; i++)
+            d[i] = NUM2INT(rb_ary_entry(argv[3], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      switch (TYPE(argv[4])) {
+        case T_HASH:
+          d[2] = NUM2INT(hash_arg(argv[4], KEY_S));
+          d[3] = NUM2INT(hash_arg(argv[4], KEY_H));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 2; i++)
+            d[i + 2] = NUM2INT(rb_ary_entry(argv[4], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      break;
+    case 10:
+      /* ten arguments is source image, sx, sy, sw, sh, dx, dy, dw, dh,
+       * and merge_alpha */
+      merge_alpha = (argv[9] == Qtrue) ? 1 : 0;
+    case 9:
+      /* ten arguments is source image, sx, sy, sw, sh, dx, dy, dw, and
+       * dh, with merge_alpha defaulting to true */
+
+      for (i = 0; i < 4; i++)
+        s[i] = NUM2INT(argv[i +  1]);
+      for (i = 0; i < 4; i++)
+        d[i] = NUM2INT(argv[i +  5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count "
+                              "(not 3, 4, 5, 6, 9, or 10)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  GET_AND_CHECK_IMAGE(argv[0], src_im);
+
+  op.im = im->im;
+  op.src = src_im->im;
+  op.merge_alpha = merge_alpha;
+  op.x = s[0]; op.y = s[1]; op.w = s[2]; op.h = s[3];
+  op.dx = d[0]; op.dy = d[1]; op.dw = d[2]; op.dh = d[3];
+  start = OP_STATS_BEGIN();
+  call_imlib(blend_image_op, &op);
+  RB_GC_GUARD(self);
+  RB_GC_GUARD(argv[0]);
+  OP_STATS_END(STAT_BLEND, start, 4ULL * s[2] * s[3],
+               (unsigned long long) d[2] * d[3]);
+  
+  return self;
+}
+
+/*
+ * Return a copy of the image with the a portion of the source image
+ * blended at the specified rectangle.
+ *
+ * Examples:
+ *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
+ *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
+ *   image.blend source_image,
+ *               src_x, src_y, src_w, src_h, 
+ *               dst_x, dst_y, dst_w, dst_h
+ *
+ *   src_rect = [50, 50, 5, 5]
+ *   dst_rect = [0, 0, image.width, image.height]
+ *   merge_alpha = false
+ *   image.blend source_image, src_rect, dst_rect, merge_alpha
+ *
+ *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
+ *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
+ *   image.blend_image source_image,
+ *                     src_x, src_y, src_w, src_h, 
+ *                     dst_x, dst_y, dst_w, dst_h
+ *
+ *   src_rect = [50, 50, 5, 5]
+ *   dst_rect = [0, 0, image.width, image.height]
+ *   merge_alpha = false
+ *   image.blend_image source_image, src_rect, dst_rect, merge_alpha
+ *
+ */
+static VALUE image_blend_image(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im, *new_im;
+  VALUE i_o;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = imlib_clone_image();
+  i_o = image_wrap(cImage, new_im);
+
+  return image_blend_image_inline(argc, argv, i_o);
+}
+
+/*
+ * Return a rotated copy of the image
+ *
+ * Examples:
+ *   new_image = old_image.rotate 37.2
+ *
+ */
+static VALUE image_rotate(VALUE self, VALUE angle) {
+  ImStruct *new_im, *im;
+  ImageOp op;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  op.src = im->im;
+  op.angle = NUM2DBL(angle);
+  call_imlib(rotate_image_op, &op);
+  RB_GC_GUARD(self);
+  
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = op.im;
+  
+  return image_wrap(cImage, new_im);
+}
+
+/*
+ * Rotates the image
+ *
+ * Examples:
+ *   image.rotate! 37.2
+ *
+ */
+static VALUE image_rotate_inline(VALUE self, VALUE angle) {
+  ImStruct *im;
+  ImageOp op;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  release_pixels(self, im);
+  op.src = im->im;
+  op.angle = NUM2DBL(angle);
+  call_imlib(rotate_image_op, &op);
+  RB_GC_GUARD(self);
+  
+  imlib_context_set_image(im->im);
+  imlib_free_image();
+
+  im->im = op.im;
+  image_track_memory(im);
+
+  return self;
+}
+
+/*
+ * Draw a string with the given Imlib2::Font at the specified coordinates
+ *
+ * Examples:
+ *   font = Imlib2::Font.new 'helvetica/12'
+ *   string = 'the blue crow flies at midnight'
+ *   image.draw_text font, string, 10, 10
+ *
+ *   # draw text in a specified color
+ *   font = Imlib2::Font.new 'helvetica/12'
+ *   string = 'the blue crow flies at midnight'
+ *   color = Imlib2::Color::AQUA
+ *   image.draw_text font, string, 10, 10, color
+ *
+ *   # draw text in a specified direction
+ *   font = Imlib2::Font.new 'verdana/24'
+ *   string = 'the blue crow flies at midnight'
+ *   color = Imlib2::Color::YELLOW
+ *   direction = Imlib2::Direction::DOWN
+ *   image.draw_text font, string, 10, 10, color, direction
+ *
+ *   # draw text with return metrics
+ *   font = Imlib2::Font.new 'arial/36'
+ *   string = 'the blue crow flies at midnight'
+ *   color = Imlib2::Color::PURPLE
+ *   direction = Imlib2::Direction::LEFT
+ *   metrics = image.draw_text font, string, 10, 10, color, direction
+ *   ['width', 'height', 'horiz_advance', 'vert_advance'].each_index { |i, v|
+ *     puts v << ' = ' << metrics[i]
+ *   }
+ *
+ */ 
+static VALUE image_draw_text(int argc, VALUE *argv, VALUE self) {
+  ImStruct   *im;
+  Imlib_Font *font;
+  VALUE text, ary, color = Qnil, dir = Qnil;
+  int x, y, i, r[] = { 0, 0, 0, 0 }, old_dir = -1;
+  unsigned long long start;
+
+  switch (argc) {
+    case 3:
+      /* three arguments is a font, a string, and an array or hash of
+       * x, y, with both color and direction defaulting to Qnil (the
+       * context values) */
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[2], KEY_X));
+          y = NUM2INT(hash_arg(argv[2], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[2], 0));
+          y = NUM2INT(rb_ary_entry(argv[2], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
+      }
+      break;
+    case 4:
+      /* four arguments is a font, a string, x, y, with color and
+       * direction defaulting to Qnil, OR a font, a string, an array
+       * or hash of [x, y] and either a color or a direction */
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[2], KEY_X));
+          y = NUM2INT(hash_arg(argv[2], KEY_Y));
+
+          if (FIXNUM_P(argv[3]))
+            dir = argv[3];
+          else 
+            color = argv[3];
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[2], 0));
+          y = NUM2INT(rb_ary_entry(argv[2], 1));
+          break;
+
+          if (FIXNUM_P(argv[3]))
+            dir = argv[3];
+          else 
+            color = argv[3];
+        default:
+          x = NUM2INT(argv[2]);
+          y = NUM2INT(argv[3]);
+      }
+      break;
+    case 5:
+      /* five arguments is a font, a string, x, y, a color, OR a font, a
+       * string, an array or hash of [x, y], a color and a direction */
+      if (FIXNUM_P(argv[2])) {
+        x = NUM2INT(argv[2]);
+        y = NUM2INT(argv[3]);
+        color = argv[4];
+      } else {
+        switch (TYPE(argv[2])) {
+          case T_HASH:
+            x = NUM2INT(hash_arg(argv[2], KEY_X));
+            y = NUM2INT(hash_arg(argv[2], KEY_Y));
+            break;
+          case T_ARRAY:
+            x = NUM2INT(rb_ary_entry(argv[2], 0));
+            y = NUM2INT(rb_ary_entry(argv[2], 1));
+            break;
+          default:
+            rb_raise(rb_eTypeError, "Invalid argument type "
+                                    "(not Array or Hash)");
+        }
+        color = argv[3];
+        dir = argv[4];
+      }
+      break;
+    case 6:
+      x = NUM2INT(argv[2]);
+      y = NUM2INT(argv[3]);
+      color = argv[4];
+      dir = argv[5];
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 5)");
+  }
+
+  TypedData_Get_Struct(argv[0], Imlib_Font, &font_type, font);
+  GET_AND_CHECK_IMAGE(self, im);
+  text = argv[1];
+
+  imlib_context_set_font(*font);
+  imlib_context_set_image(im->im);
+
+  if (color != Qnil) 
+    set_context_color(color);
+  if (dir != Qnil) {
+    old_dir = imlib_context_get_direction();
+    imlib_context_set_direction(NUM2INT(dir));
+  }
+
+  start = OP_STATS_BEGIN();
+  imlib_text_draw_with_return_metrics(x, y, StringValuePtr(text), 
+                                      &r[0], &r[1], &r[2], &r[3]);
+  if (dir != Qnil)
+    imlib_context_set_direction(old_dir);
+  OP_STATS_END(STAT_DRAW_TEXT, start, RSTRING_LEN(text),
+               (unsigned long long) r[0] * r[1]);
+
+  ary = rb_ary_new();
+  for (i = 0; i < 4; i++)
+    rb_ary_push(ary, INT2FIX(r[i]));
+  
+  return ary;
+}
+
+/*
+ * Fill a rectangle with the given Imlib2::Gradient at a given angle
+ *
+ * Examples:
+ *   x, y, w, h = 10, 10, image.width - 20, image.height - 20
+ *   angle = 45.2
+ *   image.fill_gradient gradient, x, y, w, h, angle
+ *
+ *   rect = [5, 5, 500, 20]
+ *   image.gradient gradient, rect, 36.8
+ * 
+ */
+static VALUE image_fill_gradient(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  Imlib_Color_Range *grad;
+  int x, y, w, h;
+  double angle;
+  
+  switch (argc) {
+    case 3:
+      /* three arguments is a gradient, an array or hash of [x,y,w,h],
+       * and an angle */
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          w = NUM2INT(rb_ary_entry(argv[1], 2));
+          h = NUM2INT(rb_ary_entry(argv[1], 3));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      angle = NUM2DBL(argv[2]);
+      break;
+    case 4:
+      switch (TYPE(argv[1])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+
+      switch (TYPE(argv[2])) {
+        case T_HASH:
+          w = NUM2INT(hash_arg(argv[2], KEY_W));
+          h = NUM2INT(hash_arg(argv[2], KEY_H));
+          break;
+        case T_ARRAY:
+          w = NUM2INT(rb_ary_entry(argv[2], 0));
+          h = NUM2INT(rb_ary_entry(argv[2], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      angle = NUM2DBL(argv[3]);
+      break;
+    case 6:
+      x = NUM2INT(argv[1]);
+      y = NUM2INT(argv[2]);
+      w = NUM2INT(argv[3]);
+      h = NUM2INT(argv[4]);
+      angle = NUM2DBL(argv[5]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  Data_Get_Struct(argv[0], Imlib_Color_Range, grad);
+  imlib_context_set_color_range(*grad);
+
+  imlib_image_fill_color_range_rectangle(x, y, w, h, angle);
+
+  return self;
+}
+
+/*
+ * Draw an Imlib2::Polygon with the specified color
+ *
+ * Examples:
+ *   # create a simple blue right triangle
+ *   triangle = Imlib2::Polygon.new [10, 10], [20, 20], [10, 20]
+ *   image.draw_polygon triangle, Imlib2::Color::BLUE
+ *
+ *   # create an open red square polygon
+ *   square = Imlib2.Polygon.new [10, 10], [20, 10], [20, 20], [10, 20]
+ *   image.draw_poly square, false, Imlib2::Color::RED
+ *
+ */
+static VALUE image_draw_poly(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  ImlibPolygon *poly;
+  VALUE color = Qnil;
+  unsigned char closed = Qtrue;
+
+  switch (argc) {
+    case 1:
+      /* one argument is poly.. closed is default (Qtrue) */
+      break;
+    case 2:
+      /* two arguments is poly and closed, or poly and color */
+      if ((rb_obj_is_kind_of(argv[1], cRgbaColor) == Qtrue) ||
+          (rb_obj_is_kind_of(argv[1], cHsvaColor) == Qtrue) ||
+          (rb_obj_is_kind_of(argv[1], cHlsaColor) == Qtrue) ||
+          (rb_obj_is_kind_of(argv[1], cCmyaColor) == Qtrue)) {
+        color = argv[1];
+      } else /* FIXME: do type check here */ {
+        closed = (argv[1] == Qtrue) ? 1 : 0;
+      }
+      break;
+    case 3:
+      /* two arguments is poly, closed, and color */
+      closed = (argv[1] == Qtrue) ? 1 : 0;
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  if (color != Qnil)
+    set_context_color(color);
+  
+  Data_Get_Struct(argv[0], ImlibPolygon, poly);
+  imlib_image_draw_polygon(*poly, closed);
+
+  return self;
+}
+
+/*
+ * Fill an Imlib2::Polygon with the specified color
+ *
+ * Examples:
+ *   # create an filled green diamond polygon
+ *   square = Imlib2.Polygon.new [50, 10], [70, 30], [50, 50], [30, 30]
+ *   image.fill_poly square, false, Imlib2::Color::GREEN
+ *
+ */
+static VALUE image_fill_poly(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  ImlibPolygon *poly;
+  VALUE color = Qnil;
+
+  switch (argc) {
+    case 1:
+      /* one argument is poly.. closed is default (Qtrue) */
+      break;
+    case 2:
+      color = argv[1];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  if (color != Qnil)
+    set_context_color(color);
+  
+  Data_Get_Struct(argv[0], ImlibPolygon, poly);
+  imlib_image_fill_polygon(*poly);
+
+  return self;
+}
+
+/*
+ * Apply an Imlib2::Filter (eg a static filter)
+ *
+ * You should probably using Imlib2::Image#filter() instead, since it is
+ * polymorphic (eg, it can handle both static and scripted filters).
+ * 
+ * Example:
+ *   filter = Imlib2::Filter.new 20
+ *   filter.set 2, 2, Imlib2::Color::GREEN
+ *   image.static_filter filter
+ *
+ */
+static VALUE image_static_filter(VALUE self, VALUE filter) {
+  ImStruct *im;
+  FilterStruct *f;
+
+  unsigned long long start;
+
+  TypedData_Get_Struct(filter, FilterStruct, &filter_type, f);
+  GET_AND_CHECK_IMAGE(self, im);
+  start = OP_STATS_BEGIN();
+  filter_image(im, f);
+  RB_GC_GUARD(self);
+  RB_GC_GUARD(filter);
+  OP_STATS_END(STAT_FILTER, start, im->bytes, im->bytes / 4);
+
+  return self;
+}
+
+/***************************/
+/* SCRIPT FILTER FUNCTIONS */
+/***************************/
+/* most [] placeholders a compiled script may have */
+#define MAX_SCRIPT_ARGS 8
+
+/* a filter script, checked and compacted once (see ScriptFilter.compile) */
+typedef struct {
+  char *script;
+  int   num_args;   /* [] placeholders, filled in when applied */
+} ScriptFilter;
+
+static void script_filter_free(void *val) {
+  ScriptFilter *sf = (ScriptFilter*) val;
+
+  xfree(sf->script);
+  xfree(sf);
+}
+
+static size_t script_filter_memsize(const void *val) {
+  const ScriptFilter *sf = (const ScriptFilter*) val;
+  return sizeof(ScriptFilter) + (sf->script ? strlen(sf->script) + 1 : 0);
+}
+
+static const rb_data_type_t script_filter_type = {
+  .wrap_struct_name = "Imlib2::ScriptFilter",
+  .function = {
+    .dfree = script_filter_free,
+    .dsize = script_filter_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+typedef struct {
+  Imlib_Image im;
+  char       *script;
+  void       *args[MAX_SCRIPT_ARGS];
+} ScriptOp;
+
+static void *script_filter_op(void *data) {
+  ScriptOp *op = (ScriptOp*) data;
+
+  imlib_context_set_image(op->im);
+  imlib_apply_filter(op->script, op->args[0], op->args[1], op->args[2],
+                     op->args[3], op->args[4], op->args[5], op->args[6],
+                     op->args[7]);
+  return NULL;
+}
+
+static int script_ident_char(char c, int first) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (!first && c >= '0' && c <= '9');
+}
+
+/*
+ * Check the syntax of a filter script and write it to out (at least as
+ * long as src) without the whitespace Imlib2 would otherwise strip on
+ * every call.  Statements are name(key=value, ...); values run to the
+ * next comma or parenthesis, unless quoted.  Returns the number of []
+ * placeholders, or raises ArgumentError.
+ */
+static int script_compact(const char *src, char *out) {
+  const char *p = src;
+  int num_args = 0, state = 0;  /* 0 name, 1 key, 2 value, 3 after ')' */
+
+#define SCRIPT_SKIP_SPACE() while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++
+#define SCRIPT_ERROR(msg) rb_raise(rb_eArgError, "invalid filter script at " \
+                                   "offset %ld: %s", (long) (p - src), (msg))
+
+  for (;;) {
+    SCRIPT_SKIP_SPACE();
+    if (!*p)
       break;
-    case 4:
-      /* four arguments is a source image, an array or hash of [x, y],
-       * an array or hash of [w, h], and an array or hash of [dx, dy],
-       * or a source image, an array or hash of [x, y, w, h], dx, dy */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
 
-          switch (TYPE(argv[2])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
+    switch (state) {
+      case 0:
+        if (!script_ident_char(*p, 1))
+          SCRIPT_ERROR("expected a filter name");
+        while (script_ident_char(*p, 0))
+          *out++ = *p++;
+        SCRIPT_SKIP_SPACE();
+        if (*p++ != '(')
+          SCRIPT_ERROR("expected '('");
+        *out++ = '(';
+        SCRIPT_SKIP_SPACE();
+        if (*p == ')') {
+          *out++ = *p++;
+          state = 3;
+        } else {
+          state = 1;
+        }
+        break;
+      case 1:
+        if (!script_ident_char(*p, 1))
+          SCRIPT_ERROR("expected a parameter name");
+        while (script_ident_char(*p, 0))
+          *out++ = *p++;
+        SCRIPT_SKIP_SPACE();
+        if (*p++ != '=')
+          SCRIPT_ERROR("expected '='");
+        *out++ = '=';
+        state = 2;
+        break;
+      case 2:
+        if (*p == '"' || *p == '\'') {
+          char q = *p;
+
+          *out++ = *p++;
+          while (*p && *p != q)
+            *out++ = *p++;
+          if (!*p)
+            SCRIPT_ERROR("unterminated string");
+          *out++ = *p++;
+        } else if (p[0] == '[' && p[1] == ']') {
+          if (++num_args > MAX_SCRIPT_ARGS)
+            SCRIPT_ERROR("too many [] placeholders");
+          *out++ = *p++;
+          *out++ = *p++;
+        } else {
+          const char *start = p;
+
+          while (*p && *p != ',' && *p != ')' && *p != ';')
+            p++;
+          /* trim the value's trailing whitespace */
+          while (p > start && (p[-1] == ' ' || p[-1] == '\t' ||
+                               p[-1] == '\n' || p[-1] == '\r'))
+            p--;
+          if (p == start)
+            SCRIPT_ERROR("expected a value");
+          memcpy(out, start, p - start);
+          out += p - start;
+        }
+        SCRIPT_SKIP_SPACE();
+        if (*p == ',') {
+          *out++ = *p++;
+          state = 1;
+        } else if (*p == ')') {
+          *out++ = *p++;
+          state = 3;
+        } else {
+          SCRIPT_ERROR("expected ',' or ')'");
+        }
+        break;
+      case 3:
+        if (*p++ != ';')
+          SCRIPT_ERROR("expected ';'");
+        *out++ = ';';
+        state = 0;
+        break;
+    }
+  }
 
-              switch (TYPE(argv[3])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type " 
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[2], 0));
-              h = NUM2INT(rb_ary_entry(argv[2], 1));
+  /* end the last statement, if the script didn't */
+  if (state == 3)
+    *out++ = ';';
+  else if (state != 0)
+    SCRIPT_ERROR("unexpected end of script");
+  *out = '\0';
 
-              switch (TYPE(argv[3])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type " 
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              dx = NUM2INT(argv[2]);
-              dy = NUM2INT(argv[3]);
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
+#undef SCRIPT_SKIP_SPACE
+#undef SCRIPT_ERROR
 
-          switch (TYPE(argv[2])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
+  return num_args;
+}
 
-              switch (TYPE(argv[3])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type " 
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[2], 0));
-              h = NUM2INT(rb_ary_entry(argv[2], 1));
+/*
+ * Compile a filter script, for applying many times with
+ * Imlib2::Image#filter or Imlib2::ScriptFilter#apply.  The script is
+ * checked (raising ArgumentError on a syntax error) and compacted here,
+ * rather than being converted and sent as a Ruby string each time.
+ *
+ * A value of [] is a placeholder, filled in from the extra arguments
+ * when the filter is applied: an Integer, or an Imlib2::Image (eg the
+ * map of a bump_map).
+ *
+ * Examples:
+ *   tint = Imlib2::ScriptFilter.compile 'tint(x=10, y=20, red=255, alpha=55);'
+ *   images.each { |image| image.filter tint }
+ *
+ *   tint = Imlib2::ScriptFilter.compile 'tint(x=[], y=[], red=255);'
+ *   image.filter tint, 10, 20
+ *
+ */
+static VALUE script_filter_compile(VALUE klass, VALUE script) {
+  ScriptFilter *sf;
+  VALUE self;
+  const char *src = StringValueCStr(script);
 
-              switch (TYPE(argv[3])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[3], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[3], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type " 
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              dx = NUM2INT(argv[2]);
-              dy = NUM2INT(argv[3]);
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
+  self = TypedData_Make_Struct(klass, ScriptFilter, &script_filter_type, sf);
+  sf->script = ALLOC_N(char, strlen(src) + 2);
+  sf->num_args = script_compact(src, sf->script);
+
+  return self;
+}
+
+/*
+ * Apply a compiled filter to an image, filling in its [] placeholders
+ * from args.  Returns the image.
+ *
+ * Example:
+ *   tint.apply image, 10, 20
+ *
+ */
+static VALUE script_filter_apply(int argc, VALUE *argv, VALUE self) {
+  ScriptFilter *sf;
+  ScriptOp op;
+  ImStruct *im;
+  int i, ints[MAX_SCRIPT_ARGS];
+  unsigned long long start;
+
+  if (argc < 1)
+    rb_raise(rb_eArgError, "wrong number of arguments (0 for 1+)");
+  TypedData_Get_Struct(self, ScriptFilter, &script_filter_type, sf);
+  if (argc - 1 != sf->num_args)
+    rb_raise(rb_eArgError, "filter script has %d [] placeholders, %d given",
+             sf->num_args, argc - 1);
+
+  memset(op.args, 0, sizeof(op.args));
+  for (i = 0; i < sf->num_args; i++) {
+    VALUE arg = argv[i + 1];
+
+    if (rb_obj_is_kind_of(arg, cImage) == Qtrue) {
+      ImStruct *arg_im;
+
+      GET_AND_CHECK_IMAGE(arg, arg_im);
+      op.args[i] = arg_im->im;
+    } else {
+      /* Imlib2 reads integer placeholders through a pointer */
+      ints[i] = NUM2INT(arg);
+      op.args[i] = &ints[i];
+    }
+  }
+
+  GET_AND_CHECK_IMAGE(argv[0], im);
+  op.im = im->im;
+  op.script = sf->script;
+  start = OP_STATS_BEGIN();
+  call_imlib(script_filter_op, &op);
+  RB_GC_GUARD(self);
+  OP_STATS_END(STAT_FILTER, start, im->bytes, im->bytes / 4);
+
+  return argv[0];
+}
+
+/*
+ * The compacted script.
+ *
+ * Example:
+ *   Imlib2::ScriptFilter.compile(' tint( red = 255 ) ; ').to_s
+ *   # => "tint(red=255);"
+ *
+ */
+static VALUE script_filter_to_s(VALUE self) {
+  ScriptFilter *sf;
+
+  TypedData_Get_Struct(self, ScriptFilter, &script_filter_type, sf);
+  return rb_str_new2(sf->script);
+}
+
+/*
+ * Number of [] placeholders in the script.
+ *
+ * Example:
+ *   Imlib2::ScriptFilter.compile('tint(x=[], y=[]);').arity # => 2
+ *
+ */
+static VALUE script_filter_arity(VALUE self) {
+  ScriptFilter *sf;
+
+  TypedData_Get_Struct(self, ScriptFilter, &script_filter_type, sf);
+  return INT2FIX(sf->num_args);
+}
+
+/*
+ * Apply a scripted filter (a String, or an Imlib2::ScriptFilter)
+ *
+ * You should probably using Imlib2::Image#filter() instead, since it is
+ * polymorphic (eg, it can handle both static and scripted filters).
+ * 
+ * Example:
+ *   x, y = 20, 10
+ *   filter_string = "tint( x=#{x}, y=#{y}, red=255, alpha=55 );"
+ *   image.script_filter filter_string
+ *
+ */
+static VALUE image_script_filter(VALUE self, VALUE filter) {
+  ImStruct *im;
+  unsigned long long start;
+  
+  if (rb_typeddata_is_kind_of(filter, &script_filter_type))
+    return script_filter_apply(1, &self, filter);
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+
+  start = OP_STATS_BEGIN();
+  imlib_apply_filter(StringValuePtr(filter));
+  OP_STATS_END(STAT_FILTER, start, im->bytes, im->bytes / 4);
+
+  return self;
+}
+
+/********************/
+/* FILTER FUNCTIONS */
+/********************/
+
+/*
+ * Apply a scripted filter (a String or Imlib2::ScriptFilter) or a static
+ * (eg Imlib2::Filter) filter.  Any extra arguments fill in the []
+ * placeholders of an Imlib2::ScriptFilter.
+ *
+ * Example:
+ *   # apply a static filter
+ *   filter = Imlib2::Filter.new 20
+ *   filter.set 2, 2, Imlib2::Color::GREEN
+ *   image.filter filter
+ *
+ *   # apply a scripted filter
+ *   x, y = 20, 10
+ *   filter_string = "tint( x=#{x}, y=#{y}, red=255, alpha=55 );"
+ *   image.filter filter_string
+ *
+ *   # apply a compiled script, with placeholders
+ *   tint = Imlib2::ScriptFilter.compile 'tint(x=[], y=[], red=255);'
+ *   image.filter tint, x, y
+ *
+ */
+static VALUE image_filter(int argc, VALUE *argv, VALUE self) {
+  VALUE filter, vals[MAX_SCRIPT_ARGS + 1];
+
+  if (argc < 1)
+    rb_raise(rb_eArgError, "wrong number of arguments (0 for 1+)");
+  filter = argv[0];
+
+  if (rb_typeddata_is_kind_of(filter, &script_filter_type)) {
+    if (argc > MAX_SCRIPT_ARGS + 1)
+      rb_raise(rb_eArgError, "too many filter arguments");
+    vals[0] = self;
+    MEMCPY(vals + 1, argv + 1, VALUE, argc - 1);
+    return script_filter_apply(argc, vals, filter);
+  } else if (argc != 1) {
+    rb_raise(rb_eArgError, "wrong number of arguments (%d for 1)", argc);
+  } else if (rb_obj_is_kind_of(filter, rb_cString) == Qtrue) {
+    return image_script_filter(self, filter);
+  } else if (rb_obj_is_kind_of(filter, cFilter) == Qtrue) {
+    return image_static_filter(self, filter);
+  } else {
+    rb_raise(rb_eTypeError, "Invalid argument type "
+                            "(not String or Imlib2::Filter)");
+  }
+  
+  return self;
+}
+
+/*
+ * Apply an Imlib2::ColorModifier to the image
+ *
+ * Examples:
+ *   # modify the contrast of the entire image
+ *   cmod = Imlib2::ColorModifier.new
+ *   cmod.contrast = 1.5
+ *   image.apply_cmod color_mod
+ *
+ *   # adjust the gamma of the given rect
+ *   cmod = Imlib2::ColorModifier.new
+ *   cmod.gamma = 0.5
+ *   rect = [10, 10, 20, 40]
+ *   image.apply_color_modifier cmod, rect
+ *
+ */
+static VALUE image_apply_cmod(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  Imlib_Color_Modifier *cmod;
+  char whole_image = 0;
+  int x, y, w, h;
+
+  x = y = w = h = 0;
+  switch (argc) {
+    case 1:
+      whole_image = 1;
       break;
-    case 5:
-      /* five arguments is a source image, an array or hash of [x, y],
-       * an array or hash of [w, h], dx, dy */
+    case 2:
       switch (TYPE(argv[1])) {
         case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
+          w = NUM2INT(hash_arg(argv[1], KEY_W));
+          h = NUM2INT(hash_arg(argv[1], KEY_H));
           break;
         case T_ARRAY:
           x = NUM2INT(rb_ary_entry(argv[1], 0));
           y = NUM2INT(rb_ary_entry(argv[1], 1));
+          w = NUM2INT(rb_ary_entry(argv[1], 2));
+          h = NUM2INT(rb_ary_entry(argv[1], 3));
           break;
         default:
           rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
       }
-      switch (TYPE(argv[2])) {
+      break;
+    case 5:
+      x = NUM2INT(argv[1]);
+      y = NUM2INT(argv[2]);
+      w = NUM2INT(argv[3]);
+      h = NUM2INT(argv[4]);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, or 5)");
+  }
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  TypedData_Get_Struct(argv[0], Imlib_Color_Modifier, &cmod_type, cmod);
+  imlib_context_set_color_modifier(*cmod);
+
+  if (whole_image)
+    imlib_apply_color_modifier();
+  else
+    imlib_apply_color_modifier_to_rectangle(x, y, w, h);
+  
+  return self;
+}
+
+#ifndef X_DISPLAY_MISSING
+/*
+ * Render a pixmap and mask of an image.
+ *
+ * Note: this method returns an array with the pixmap and mask, not just
+ * the pixmap.
+ *
+ * Examples:
+ *   pmap, mask = image.render_pixmap
+ *   pmap, mask = image.pixmap
+ *
+ *   # render a half-size pixmap and mask of the image
+ *   pmap, mask = image.render_pixmap image.width / 2, image.height / 2
+ *
+ *   # render a half-size pixmap and mask of the image
+ *   pmap, mask = image.pixmap image.width / 2, image.height / 2
+ *
+ */
+static VALUE image_render_pixmap(int argc, VALUE *argv, VALUE self) {
+  ImStruct *im;
+  Imlib_Image old_im;
+  Pixmap *pmap, *mask;
+  VALUE ary;
+  int w, h;
+  char at_size = 0;
+
+  switch (argc) {
+    case 0:
+      at_size = 0;
+      break;
+    case 1:
+      /* one arg is an array or hash of [w, h] */
+
+      at_size = 1;
+      switch (TYPE(argv[0])) {
         case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
+          w = NUM2INT(hash_arg(argv[0], KEY_W));
+          h = NUM2INT(hash_arg(argv[0], KEY_H));
           break;
         case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[2], 0));
-          h = NUM2INT(rb_ary_entry(argv[2], 1));
+          w = NUM2INT(rb_ary_entry(argv[0], 0));
+          h = NUM2INT(rb_ary_entry(argv[0], 1));
           break;
         default:
           rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
       }
-      dx = NUM2INT(argv[3]);
-      dy = NUM2INT(argv[4]);
-    case 6:
-      /* six arguments is a source image, x, y, w, h, and an array or
-       * hash of [dx, dy], or source image, an array or hash of [x, y],
-       * an array or hash of [w, h], dx, dy */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-
-          switch (TYPE(argv[2])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[2], 0));
-              h = NUM2INT(rb_ary_entry(argv[2], 1));
-              break;
-            default:
-              rb_raise(rb_eTypeError, "Invalid argument type "
-                                      "(not array or hash)");
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
 
-          switch (TYPE(argv[2])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[2], 0));
-              h = NUM2INT(rb_ary_entry(argv[2], 1));
-              break;
-            default:
-              rb_raise(rb_eTypeError, "Invalid argument type "
-                                      "(not array or hash)");
-          }
-          break;
-        default:
-          x = NUM2INT(argv[1]);
-          y = NUM2INT(argv[2]);
-          w = NUM2INT(argv[3]);
-          h = NUM2INT(argv[4]);
-      }
       break;
-    case 7:
-      /* seven arguments is a source image, x, y, w, y, dx, dy */
-      x = NUM2INT(argv[1]);
-      y = NUM2INT(argv[2]);
-      w = NUM2INT(argv[3]);
-      h = NUM2INT(argv[4]);
-      dx = NUM2INT(argv[5]);
-      dy = NUM2INT(argv[6]);
+    case 2:
+      /* two args is w, h */
+
+      at_size = 1;
+      w = NUM2INT(argv[0]);
+      h = NUM2INT(argv[1]);
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count "
-                              "(not 2, 3, 4, 5, 6, or 7)");
+      rb_raise(rb_eArgError, "Invalid argument count (not 0, 1, or 2)");
   }
   
-  GET_AND_CHECK_IMAGE(src, src_im);
+  /* save existing context */
+  old_im = imlib_context_get_image();
+
   GET_AND_CHECK_IMAGE(self, im);
   imlib_context_set_image(im->im);
-  imlib_image_copy_alpha_rectangle_to_image(src_im->im, x, y, w, h, dx, dy);
+
+  /* if we were passed width and height, then use them */
+  if (at_size)
+    imlib_render_pixmaps_for_whole_image_at_size(pmap, mask, w, h);
+  else
+    imlib_render_pixmaps_for_whole_image(pmap, mask);
+
+  /* restore existing context */
+  imlib_context_set_image(old_im);
   
-  return self;
+  ary = rb_ary_new();
+  rb_ary_push(ary, Data_Wrap_Struct(cPixmap, 0, free, pmap));
+  rb_ary_push(ary, Data_Wrap_Struct(cPixmap, 0, free, mask));
+
+  return ary;
+}
+#endif /* !X_DISPLAY_MISSING */
+
+/*
+ * Attach an integer value to an Imlib2::Image.
+ * 
+ * Examples:
+ *   image.attach_value('quality', 90)
+ *   image['quality'] = 90
+ */
+static VALUE image_attach_val(VALUE self, VALUE key_o, VALUE val_o) {
+  ImStruct *im;
+  char *key;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  key = StringValuePtr(key_o);
+  /* if (rb_obj_is_kind_of(val_o, rb_cString)) {
+    void *val = (void*) StringValuePtr(val_o);
+    fprintf(stderr, "attaching string\n");
+    imlib_image_attach_data_value(key, val, 0, NULL);
+  } else */ if (rb_obj_is_kind_of(val_o, rb_cNumeric)) {
+    int val = NUM2INT(val_o);
+    imlib_image_attach_data_value(key, NULL, val, NULL);
+  } else {
+    rb_raise(rb_eTypeError, "Invalid argument (not string or integer)");
+  }
+
+  /* return value */
+  return val_o;
+}
+
+/*
+ * Get an integer value attached to an Imlib2::Image.
+ * 
+ * Examples:
+ *   qual = image.get_attached_value('quality')
+ *   qual = image['quality']
+ */
+static VALUE image_get_attach_val(VALUE self, VALUE key_o) {
+  ImStruct *im;
+  VALUE ret;
+  char *key;
+  /* char *data; */
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  key = StringValuePtr(key_o);
+
+  /* if it's got data, retrn that, otherwise return the value */
+/* 
+ *   if ((data = (char*) imlib_image_get_attached_value(key)) != NULL) {
+ *     fprintf(stderr, "it's a string \"%s\": %x\n", key, data);
+ *     ret = rb_str_new2(data);
+ *   } else {
+ *     fprintf(stderr, "it's an integer \"%s\"\n", key);
+ */ 
+    ret = INT2FIX(imlib_image_get_attached_value(key));
+/* 
+ *   }
+ */ 
+  
+  /* return result */
+  return ret;
+}
+
+/*
+ * Remove an integer value attached to an Imlib2::Image.
+ * 
+ * Examples:
+ *   image.remove_attached_value('quality')
+ */
+static VALUE image_rm_attach_val(VALUE self, VALUE key_o) {
+  ImStruct *im;
+  char *key;
+
+  GET_AND_CHECK_IMAGE(self, im);
+  imlib_context_set_image(im->im);
+  key = StringValuePtr(key_o);
+
+  imlib_image_remove_attached_data_value(key);
+
+  return Qnil;
+}
+
+/******************/
+/* CMOD FUNCTIONS */
+/******************/
+static void cmod_free(void *val) {
+  Imlib_Color_Modifier *cmod = (Imlib_Color_Modifier*) val;
+
+  free_imlib_object(FREE_CMOD, *cmod);
+  free(cmod);
+}
+
+static size_t cmod_memsize(const void *val) {
+  UNUSED(val);
+
+  /* four 256-entry channel tables */
+  return sizeof(Imlib_Color_Modifier) + 4 * 256;
 }
 
 /*
- * Scroll a rectangle to the specified coordinates
- *
- * Examples:
- *   x, y, w, h = 10, 20, 100, 200
- *   dest_x, dest_y = 5, 10
- *   image.scroll_rect x, y, w, h, dest_x, dest_y
+ * Returns a new Imlib2::ColorModifier
  *
- *   source_rect = [10, 20, 100, 200]
- *   dest_coords = [5, 10]
- *   image.scroll_rect source_rect, dest_coords
+ * Example:
+ *   cmod = Imlib2::ColorModifier.new
  *
- *   values = [10, 20, 100, 200, 5, 10]
- *   image.scroll_rect values
+ */
+VALUE cmod_new(VALUE klass) {
+  Imlib_Color_Modifier *cmod;
+  VALUE self;
+
+  cmod = malloc(sizeof(Imlib_Color_Modifier));
+  enter_imlib();
+  *cmod = imlib_create_color_modifier();
+  self = TypedData_Wrap_Struct(klass, &cmod_type, cmod);
+
+  rb_obj_call_init(self, 0, NULL);
+
+  return self;
+}
+
+/*
+ * Imlib2::ColorModifier constructor
  *
+ * This method takes no arguments.
+ * 
  */
-static VALUE image_scroll_rect(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  int x, y, w, h, dx, dy;
+static VALUE cmod_init(VALUE self) {
+  return self;
+}
 
-  switch (argc) {
-    case 1:
-      /* one argument is an array or hash of [x, y, w, h, dx, dy] */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          dx = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          dx = NUM2INT(rb_ary_entry(argv[0], 4));
-          dy = NUM2INT(rb_ary_entry(argv[0], 5));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of [x, y, w, h] and an array
-       * or hash of [dx, dy] */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          dx = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          dx = NUM2INT(rb_ary_entry(argv[1], 0));
-          dy = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of [x, y], an array or hash
-       * of [w, h] and an array or hash of [dx, dy], or an array or hash
-       * of [x, y, w, h], dx, dy */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
+/*
+ * Set the gamma value.
+ *
+ * Example:
+ *   cmod.gamma = 0.5
+ *
+ */
+static VALUE cmod_gamma(VALUE self, VALUE gamma) {
+  Imlib_Color_Modifier *cmod;
 
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
+  TypedData_Get_Struct(self, Imlib_Color_Modifier, &cmod_type, cmod);
+  enter_imlib();
+  imlib_context_set_color_modifier(*cmod);
+  imlib_modify_color_modifier_gamma(NUM2DBL(gamma));
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
+  return self;
+}
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              dx = NUM2INT(argv[1]);
-              dy = NUM2INT(argv[2]);
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
+/*
+ * Set the brightness value.
+ *
+ * Example:
+ *   cmod.brightness = 2.0
+ *
+ */
+static VALUE cmod_brightness(VALUE self, VALUE brightness) {
+  Imlib_Color_Modifier *cmod;
 
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
+  TypedData_Get_Struct(self, Imlib_Color_Modifier, &cmod_type, cmod);
+  enter_imlib();
+  imlib_context_set_color_modifier(*cmod);
+  imlib_modify_color_modifier_brightness(NUM2DBL(brightness));
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
+  return self;
+}
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              dx = NUM2INT(argv[1]);
-              dy = NUM2INT(argv[2]);
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 4:
-      /* four arguments is an array or hash of [x, y], an array or hash
-       * of [w, h], dx, dy */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      dx = NUM2INT(argv[2]);
-      dy = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* five arguments is x, y, w, h, and an array or hash of
-       * [dx, dy] */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      switch (TYPE(argv[4])) {
-        case T_HASH:
-          dx = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          dx = NUM2INT(rb_ary_entry(argv[4], 0));
-          dy = NUM2INT(rb_ary_entry(argv[4], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 6:
-      /* six arguments is x, y, w, h, dx, dy */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      dx = NUM2INT(argv[4]);
-      dy = NUM2INT(argv[5]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count "
-                              "(not 2, 3, 4, 5, 6, or 7)");
-  }
+/*
+ * Set the contrast value.
+ *
+ * Example:
+ *   cmod.contrast = 0.8
+ *
+ */
+static VALUE cmod_contrast(VALUE self, VALUE contrast) {
+  Imlib_Color_Modifier *cmod;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_scroll_rect(x, y, w, h, dx, dy);
+  TypedData_Get_Struct(self, Imlib_Color_Modifier, &cmod_type, cmod);
+  enter_imlib();
+  imlib_context_set_color_modifier(*cmod);
+  imlib_modify_color_modifier_contrast(NUM2DBL(contrast));
 
   return self;
 }
 
 /*
- * Copy a rectangle to the specified coordinates
- *
- * Examples:
- *   x, y, w, h = 10, 20, 100, 200
- *   dest_x, dest_y = 5, 10
- *   image.copy_rect x, y, w, h, dest_x, dest_y
- *
- *   source_rect = [10, 20, 100, 200]
- *   dest_coords = [5, 10]
- *   image.copy_rect source_rect, dest_coords
+ * Reset the Imlib2::ColorModifier
  *
- *   values = [10, 20, 100, 200, 5, 10]
- *   image.copy_rect values
+ * Example:
+ *   cmod.reset
  *
  */
-static VALUE image_copy_rect(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  int x, y, w, h, dx, dy;
-
-  switch (argc) {
-    case 1:
-      /* one argument is an array or hash of [x, y, w, h, dx, dy] */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          dx = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          dx = NUM2INT(rb_ary_entry(argv[0], 4));
-          dy = NUM2INT(rb_ary_entry(argv[0], 5));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of [x, y, w, h] and an array
-       * or hash of [dx, dy] */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          dx = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          dx = NUM2INT(rb_ary_entry(argv[1], 0));
-          dy = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of [x, y], an array or hash
-       * of [w, h] and an array or hash of [dx, dy], or an array or hash
-       * of [x, y, w, h], dx, dy */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              dx = NUM2INT(argv[1]);
-              dy = NUM2INT(argv[2]);
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
+static VALUE cmod_reset(VALUE self) {
+  Imlib_Color_Modifier *cmod;
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
+  TypedData_Get_Struct(self, Imlib_Color_Modifier, &cmod_type, cmod);
+  enter_imlib();
+  imlib_context_set_color_modifier(*cmod);
+  imlib_reset_color_modifier();
 
-              switch (TYPE(argv[2])) {
-                case T_HASH:
-                  dx = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dx")));
-                  dy = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("dy")));
-                  break;
-                case T_ARRAY:
-                  dx = NUM2INT(rb_ary_entry(argv[2], 0));
-                  dy = NUM2INT(rb_ary_entry(argv[2], 1));
-                  break;
-                default:
-                  rb_raise(rb_eTypeError, "Invalid argument type "
-                                          "(not array or hash)");
-              }
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              dx = NUM2INT(argv[1]);
-              dy = NUM2INT(argv[2]);
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 4:
-      /* four arguments is an array or hash of [x, y], an array or hash
-       * of [w, h], dx, dy */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      dx = NUM2INT(argv[2]);
-      dy = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* five arguments is x, y, w, h, and an array or hash of
-       * [dx, dy] */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      switch (TYPE(argv[4])) {
-        case T_HASH:
-          dx = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("dx")));
-          dy = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("dy")));
-          break;
-        case T_ARRAY:
-          dx = NUM2INT(rb_ary_entry(argv[4], 0));
-          dy = NUM2INT(rb_ary_entry(argv[4], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 6:
-      /* six arguments is x, y, w, h, dx, dy */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      dx = NUM2INT(argv[4]);
-      dy = NUM2INT(argv[5]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count "
-                              "(not 2, 3, 4, 5, 6, or 7)");
-  }
+  return self;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  imlib_image_copy_rect(x, y, w, h, dx, dy);
+/******************/
+/* FONT FUNCTIONS */
+/******************/
+static void font_free(void *val) {
+  Imlib_Font *font = (Imlib_Font*) val;
+  free_imlib_object(FREE_FONT, *font);
+  free(font);
+}
 
-  return self;
+static size_t font_memsize(const void *val) {
+  UNUSED(val);
+  return sizeof(Imlib_Font);
 }
 
 /*
- * Draw an ellipse at the specified coordinates with the given color
+ * Returns a new Imlib2::Font
+ *
+ * Note: the specified font must be in the font path.  See
+ * Imlib2::Font::list_paths() for a list of font paths, and
+ * Imlib2::Font::list_fonts() for a list of fonts.
  *
  * Examples:
- *   # draw an ellipse in the center of the image using the context color
- *   xc, yc, w, h = image.w / 2, image.h / 2, image.w / 2, image.h / 2
- *   image.draw_oval xc, yc, w, h
+ *   font = Imlib2::Font.new 'helvetica/24'
+ *   font = Imlib2::Font.load 'helvetica/24'
+ *
+ */
+VALUE font_new(VALUE klass, VALUE font_name) {
+  Imlib_Font *font;
+  VALUE f_o;
+  
+  font = malloc(sizeof(Imlib_Font*));
+  enter_imlib();
+  *font = imlib_load_font(StringValuePtr(font_name));
+
+  f_o = TypedData_Wrap_Struct(klass, &font_type, font);
+  rb_obj_call_init(f_o, 0, NULL);
+
+  return f_o;
+}
+
+/* 
+ * Constructor for Imlib2::Font
  *
- *   # draw a violet circle in the center of the image
- *   rect = [image.w / 2, image.h / 2, image.w / 2, image.w / 2]
- *   color = Imlib2::Color::VIOLET
- *   image.draw_ellipse rect, color
+ * Currently just a placeholder.
  *
  */
-static VALUE image_draw_ellipse(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  VALUE color = Qnil;
-  int x, y, w, h;
-
-  x = y = w = h = 0;
-  switch (argc) {
-    case 1:
-      /* 1 argument is an array or hash of x, y, w, h with color
-       * defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of x, y, w, h with a color,
-       * or an array or hash of x, y, and an array or hash of w, h (with
-       * color defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of x, y and a color */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      color = argv[2];
-      break;
-    case 4:
-      /* 4 arguments is x, y, w, y (color to Qnil) */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* 4 arguments is x, y, w, y, color */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      color = argv[4];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
-  imlib_image_draw_ellipse(x, y, w, h);
-  
+static VALUE font_init(VALUE self) {
   return self;
 }
 
 /*
- * Fill an ellipse at the specified coordinates with the given color
- *
- * Examples:
- *   # fill an ellipse in the center of the image using the context color
- *   xc, yc, w, h = image.w / 2, image.h / 2, image.w / 2, image.h / 2
- *   image.draw_oval xc, yc, w, h
+ * Get the width and height of the given string using this font.
  *
- *   # fill a violet circle in the center of the image
- *   rect = [image.w / 2, image.h / 2, image.w / 2, image.w / 2]
- *   color = Imlib2::Color::VIOLET
- *   image.draw_ellipse rect, color
+ * Example:
+ *   font = Imlib2::Font.new 'helvetica/12'
+ *   size = font.size 'how big am i?'
+ *   ['width', 'height'].each_index { |i, v|
+ *     puts 'text ' << v << ' = ' << size[i]
+ *   }
  *
  */
-static VALUE image_fill_ellipse(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  VALUE color = Qnil;
-  int x, y, w, h;
+static VALUE font_text_size(VALUE self, VALUE text) {
+  Imlib_Font *font;
+  int   sw = 0, sh = 0;
 
-  x = y = w = h = 0;
-  switch (argc) {
-    case 1:
-      /* 1 argument is an array or hash of x, y, w, h with color
-       * defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          w = NUM2INT(rb_ary_entry(argv[0], 2));
-          h = NUM2INT(rb_ary_entry(argv[0], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      /* two arguments is an array or hash of x, y, w, h with a color,
-       * or an array or hash of x, y, and an array or hash of w, h (with
-       * color defaulting to Qnil (ie, the context color) */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-              y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          switch (TYPE(argv[1])) {
-            case T_HASH:
-              w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-              h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-              break;
-            case T_ARRAY:
-              w = NUM2INT(rb_ary_entry(argv[1], 0));
-              h = NUM2INT(rb_ary_entry(argv[1], 1));
-              break;
-            default:
-              w = NUM2INT(rb_ary_entry(argv[0], 2));
-              h = NUM2INT(rb_ary_entry(argv[0], 3));
-              /* we could do a type check here, but if it's invalid
-               * it'll get caught in the set_context_color() call */
-              color = argv[1];
-          }
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three arguments is an array or hash of x, y and a color */
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[1], 0));
-          h = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      color = argv[2];
-      break;
-    case 4:
-      /* 4 arguments is x, y, w, y (color to Qnil) */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      break;
-    case 5:
-      /* 4 arguments is x, y, w, y, color */
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      w = NUM2INT(argv[2]);
-      h = NUM2INT(argv[3]);
-      color = argv[4];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, 3, 4, or 5)");
-  }
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  if (color != Qnil)
-    set_context_color(color);
-  imlib_image_fill_ellipse(x, y, w, h);
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+  imlib_get_text_size(StringValuePtr(text), &sw, &sh);
   
-  return self;
+  return rb_ary_new3 (2, INT2FIX(sw), INT2FIX(sh));
 }
+  
+/* 
+ * Get the horizontal and vertical advance of the given string using
+ * this font.
+ *
+ * Example:
+ *   font = Imlib2::Font.new 'verdana/36'
+ *   advances = font.advance "what's my advance?"
+ *   ['horizontal', 'vertical'].each_index { |i, v|
+ *     puts 'text ' << v << ' advance = ' << advances[i]
+ *   }
+ *
+ */
+static VALUE font_text_advance(VALUE self, VALUE text) {
+  Imlib_Font *font;
+  int   sw = 0, sh = 0;
 
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+  imlib_get_text_advance(StringValuePtr(text), &sw, &sh);
+  
+  return rb_ary_new3 (2, INT2FIX(sw), INT2FIX (sh));
+}
+  
 /*
- * Blend a source image onto the image
- *
- * Examples:
- *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
- *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
- *   image.blend! source_image,
- *               src_x, src_y, src_w, src_h, 
- *               dst_x, dst_y, dst_w, dst_h
+ * Get the inset of the given string using this font
  *
- *   src_rect = [50, 50, 5, 5]
- *   dst_rect = [0, 0, image.width, image.height]
- *   merge_alpha = false
- *   image.blend! source_image, src_rect, dst_rect, merge_alpha
+ * Example:
+ *   font = Imlib2::Font.new 'palatino/9'
+ *   inset = font.inset 'wonder what the inset for this string is...'
  *
- *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
- *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
- *   image.blend_image! source_image,
- *                      src_x, src_y, src_w, src_h, 
- *                      dst_x, dst_y, dst_w, dst_h
+ */
+static VALUE font_text_inset(VALUE self, VALUE text) {
+  Imlib_Font *font;
+
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+  
+  return INT2FIX(imlib_get_text_inset(StringValuePtr(text)));
+}
+  
+/*
+ * Get the character index of the pixel at the given coordinates using
+ * this font.
  *
- *   src_rect = [50, 50, 5, 5]
- *   dst_rect = [0, 0, image.width, image.height]
- *   merge_alpha = false
- *   image.blend_image! source_image, src_rect, dst_rect, merge_alpha
+ * Example:
+ *   x, y, char_w, char_h = font.index "index\nstring\n", 5, 5
  *
  */
-static VALUE image_blend_image_inline(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im, *src_im;
-  int i, s[4], d[4];
-  char merge_alpha = 1;
-  
-  switch (argc) {
-    case 4:
-      /* four arguments is source image, an array or hash of
-       * [sx, sy, sw, sh], an array or hash of [sx, sy, sw, sh], and
-       * merge_alpha */
-      merge_alpha = (argv[3] == Qtrue) ? 1 : 0;
-    case 3:
-      /* three arguments is source image, an array or hash of
-       * [sx, sy, sw, sh], and an array or hash of [sx, sy, sw, sh], 
-       * with merge_alpha defaulting to true */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          s[0] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          s[1] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          s[2] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          s[3] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          for (i = 0; i < 4; i++)
-            s[i] = NUM2INT(rb_ary_entry(argv[1], i));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          d[0] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("x")));
-          d[1] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("y")));
-          d[2] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-          d[3] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          for (i = 0; i < 4; i++)
-            d[i] = NUM2INT(rb_ary_entry(argv[2], i));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      
-      break;
-    case 6:
-      /* six arguments is source image, an array or hash of [sx, sy], an
-       * array or hash of [sw, sh], an array or hash of [dx, dy], an
-       * array or hash of [dw, dh], and merge_alpha */
-      merge_alpha = (argv[5] == Qtrue) ? 1 : 0;
-    case 5:
-      /* five arguments is source image, an array or hash of [sx, sy], an
-       * array or hash of [sw, sh], an array or hash of [dx, dy], and an
-       * array or hash of [dw, dh], with merge_alpha defaulting to true */
+static VALUE font_text_index(int argc, VALUE *argv, VALUE self) {
+  Imlib_Font *font;
+  VALUE text, ary;
+  int x, y, i, r[] = { 0, 0, 0, 0 };
 
+  text = argv[0];
+  switch (argc) {
+    case 2:
+      /* two arguments is a string, and an array or hash of x, y */
       switch (TYPE(argv[1])) {
         case T_HASH:
-          s[0] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          s[1] = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          for (i = 0; i < 2; i++)
-            s[i] = NUM2INT(rb_ary_entry(argv[1], i));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          s[2] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("s")));
-          s[3] = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          for (i = 0; i < 2; i++)
-            s[i + 2] = NUM2INT(rb_ary_entry(argv[2], i));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-
-      switch (TYPE(argv[3])) {
-        case T_HASH:
-          d[0] = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("x")));
-          d[1] = NUM2INT(rb_hash_aref(argv[3], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          for (i = 0; i < 2; i++)
-            d[i] = NUM2INT(rb_ary_entry(argv[3], i));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-
-      switch (TYPE(argv[4])) {
-        case T_HASH:
-          d[2] = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("s")));
-          d[3] = NUM2INT(rb_hash_aref(argv[4], rb_str_new2("h")));
+          x = NUM2INT(hash_arg(argv[1], KEY_X));
+          y = NUM2INT(hash_arg(argv[1], KEY_Y));
           break;
         case T_ARRAY:
-          for (i = 0; i < 2; i++)
-            d[i + 2] = NUM2INT(rb_ary_entry(argv[4], i));
+          x = NUM2INT(rb_ary_entry(argv[1], 0));
+          y = NUM2INT(rb_ary_entry(argv[1], 1));
           break;
         default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
       }
-
       break;
-    case 10:
-      /* ten arguments is source image, sx, sy, sw, sh, dx, dy, dw, dh,
-       * and merge_alpha */
-      merge_alpha = (argv[9] == Qtrue) ? 1 : 0;
-    case 9:
-      /* ten arguments is source image, sx, sy, sw, sh, dx, dy, dw, and
-       * dh, with merge_alpha defaulting to true */
-
-      for (i = 0; i < 4; i++)
-        s[i] = NUM2INT(argv[i +  1]);
-      for (i = 0; i < 4; i++)
-        d[i] = NUM2INT(argv[i +  5]);
+    case 3:
+      /* three arguments is a string, x, y */
+      x = NUM2INT(argv[1]);
+      y = NUM2INT(argv[2]);
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count "
-                              "(not 3, 4, 5, 6, 9, or 10)");
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
   }
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-
-  GET_AND_CHECK_IMAGE(argv[0], src_im);
-  imlib_blend_image_onto_image(src_im->im, merge_alpha,
-                               s[0], s[1], s[2], s[3], 
-                               d[0], d[1], d[2], d[3]);
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+  imlib_text_get_index_and_location(StringValuePtr(text), x, y,
+                                    &r[0], &r[1], &r[2], &r[3]);
+  ary = rb_ary_new();
+  for (i = 0; i < 4; i++)
+    rb_ary_push(ary, INT2FIX(r[i]));
   
-  return self;
+  return ary;
 }
+  
+/*
+ * Get the character coordinates of the at the given index using this font.
+ *
+ * Example:
+ *   x, y, char_w, char_h = font.index "index\nstring\n", 8
+ *
+ */
+static VALUE font_text_location(VALUE self, VALUE text, VALUE index) {
+  Imlib_Font *font;
+  VALUE ary;
+  int i, r[] = { 0, 0, 0, 0 };
+
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+  imlib_text_get_location_at_index(StringValuePtr(text), NUM2INT(index), 
+                                   &r[0], &r[1], &r[2], &r[3]);
 
+  ary = rb_ary_new();
+  for (i = 0; i < 4; i++)
+    rb_ary_push(ary, INT2FIX(r[i]));
+  
+  return ary;
+}
+  
 /*
- * Return a copy of the image with the a portion of the source image
- * blended at the specified rectangle.
+ * Get font ascent.
  *
- * Examples:
- *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
- *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
- *   image.blend source_image,
- *               src_x, src_y, src_w, src_h, 
- *               dst_x, dst_y, dst_w, dst_h
+ * Example:
+ *   a = font.ascent
  *
- *   src_rect = [50, 50, 5, 5]
- *   dst_rect = [0, 0, image.width, image.height]
- *   merge_alpha = false
- *   image.blend source_image, src_rect, dst_rect, merge_alpha
+ */
+static VALUE font_ascent(VALUE self) {
+  Imlib_Font *font;
+
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+
+  return INT2FIX(imlib_get_font_ascent());
+}
+
+/*
+ * Get font descent.
  *
- *   src_x, src_y, src_w, src_h = 10, 10, 100, 100
- *   dst_x, dst_y, dst_w, dst_h = 10, 10, 50, 50
- *   image.blend_image source_image,
- *                     src_x, src_y, src_w, src_h, 
- *                     dst_x, dst_y, dst_w, dst_h
+ * Example:
+ *   a = font.descent
+ *
+ */
+static VALUE font_descent(VALUE self) {
+  Imlib_Font *font;
+
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
+
+  return INT2FIX(imlib_get_font_descent());
+}
+  
+/*
+ * Get font maximum ascent.
  *
- *   src_rect = [50, 50, 5, 5]
- *   dst_rect = [0, 0, image.width, image.height]
- *   merge_alpha = false
- *   image.blend_image source_image, src_rect, dst_rect, merge_alpha
+ * Example:
+ *   a = font.maximum_ascent
  *
  */
-static VALUE image_blend_image(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im, *new_im;
-  VALUE i_o;
-
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static VALUE font_maximum_ascent(VALUE self) {
+  Imlib_Font *font;
 
-  new_im = malloc(sizeof(ImStruct));
-  new_im->im = imlib_clone_image();
-  i_o = Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
 
-  return image_blend_image_inline(argc, argv, i_o);
+  return INT2FIX(imlib_get_maximum_font_ascent());
 }
 
 /*
- * Return a rotated copy of the image
+ * Get font maximum descent.
  *
- * Examples:
- *   new_image = old_image.rotate 37.2
+ * Example:
+ *   a = font.maximum_descent
  *
  */
-static VALUE image_rotate(VALUE self, VALUE angle) {
-  ImStruct *new_im, *im;
-  double a;
+static VALUE font_maximum_descent(VALUE self) {
+  Imlib_Font *font;
 
-  new_im = malloc(sizeof(ImStruct));
+  TypedData_Get_Struct(self, Imlib_Font, &font_type, font);
+  enter_imlib();
+  imlib_context_set_font(*font);
 
-  GET_AND_CHECK_IMAGE(self, im);
-  a = rb_float_new(angle);
-  imlib_context_set_image(im->im);
-  
-  new_im->im = imlib_create_rotated_image(a);
-  
-  return Data_Wrap_Struct(cImage, 0, im_struct_free, new_im);
+  return INT2FIX(imlib_get_maximum_font_descent());
 }
 
 /*
- * Rotates the image
+ * Return an array of all known fonts
  *
- * Examples:
- *   image.rotate! 37.2
+ * Example:
+ *   font_list = Imlib2::Font.list_fonts
  *
  */
-static VALUE image_rotate_inline(VALUE self, VALUE angle) {
-  ImStruct *im;
-  Imlib_Image new_im;
-  double a;
+static VALUE font_list_fonts(VALUE klass) {
+  VALUE ary;
+  char **list;
+  int i, len;
+  UNUSED(klass);
 
-  GET_AND_CHECK_IMAGE(self, im);
-  a = rb_float_new(angle);
-  imlib_context_set_image(im->im);
-  
-  new_im = imlib_create_rotated_image(a);
-  
-  imlib_context_set_image(im->im);
-  imlib_free_image();
+  enter_imlib();
+  list = imlib_list_fonts(&len);
 
-  im->im = new_im;
+  ary = rb_ary_new();
+  for (i = 0; i < len; i++)
+    rb_ary_push(ary, rb_str_new2(list[i]));
 
-  return self;
+  /* FIXME: there has got to be a better way to do this: */
+  imlib_free_font_list(list, len);
+  
+  return ary;
 }
 
 /*
- * Draw a string with the given Imlib2::Font at the specified coordinates
- *
- * Examples:
- *   font = Imlib2::Font.new 'helvetica/12'
- *   string = 'the blue crow flies at midnight'
- *   image.draw_text font, string, 10, 10
+ * Add a path to the list of font paths.
  *
- *   # draw text in a specified color
- *   font = Imlib2::Font.new 'helvetica/12'
- *   string = 'the blue crow flies at midnight'
- *   color = Imlib2::Color::AQUA
- *   image.draw_text font, string, 10, 10, color
+ * Example:
+ *   Imlib2::Font.add_path '/usr/lib/X11/fonts/Truetype'
  *
- *   # draw text in a specified direction
- *   font = Imlib2::Font.new 'verdana/24'
- *   string = 'the blue crow flies at midnight'
- *   color = Imlib2::Color::YELLOW
- *   direction = Imlib2::Direction::DOWN
- *   image.draw_text font, string, 10, 10, color, direction
+ */
+static VALUE font_add_path(VALUE klass, VALUE path) {
+  UNUSED(klass);
+  enter_imlib();
+  imlib_add_path_to_font_path(StringValuePtr(path));
+  return Qtrue;
+}
+
+/*
+ * Remove a path from the list of font paths.
  *
- *   # draw text with return metrics
- *   font = Imlib2::Font.new 'arial/36'
- *   string = 'the blue crow flies at midnight'
- *   color = Imlib2::Color::PURPLE
- *   direction = Imlib2::Direction::LEFT
- *   metrics = image.draw_text font, string, 10, 10, color, direction
- *   ['width', 'height', 'horiz_advance', 'vert_advance'].each_index { |i, v|
- *     puts v << ' = ' << metrics[i]
- *   }
+ * Example:
+ *   Imlib2::Font.remove_path '/usr/lib/X11/fonts/Truetype'
  *
- */ 
-static VALUE image_draw_text(int argc, VALUE *argv, VALUE self) {
-  ImStruct   *im;
-  Imlib_Font *font;
-  VALUE text, ary, color = Qnil, dir = Qnil;
-  int x, y, i, r[] = { 0, 0, 0, 0 }, old_dir = -1;
-
-  switch (argc) {
-    case 3:
-      /* three arguments is a font, a string, and an array or hash of
-       * x, y, with both color and direction defaulting to Qnil (the
-       * context values) */
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[2], 0));
-          y = NUM2INT(rb_ary_entry(argv[2], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-      }
-      break;
-    case 4:
-      /* four arguments is a font, a string, x, y, with color and
-       * direction defaulting to Qnil, OR a font, a string, an array
-       * or hash of [x, y] and either a color or a direction */
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("y")));
-
-          if (FIXNUM_P(argv[3]))
-            dir = argv[3];
-          else 
-            color = argv[3];
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[2], 0));
-          y = NUM2INT(rb_ary_entry(argv[2], 1));
-          break;
+ */
+static VALUE font_remove_path(VALUE klass, VALUE path) {
+  UNUSED(klass);
+  enter_imlib();
+  imlib_remove_path_from_font_path(StringValuePtr(path));
+  return Qtrue;
+}
 
-          if (FIXNUM_P(argv[3]))
-            dir = argv[3];
-          else 
-            color = argv[3];
-        default:
-          x = NUM2INT(argv[2]);
-          y = NUM2INT(argv[3]);
-      }
-      break;
-    case 5:
-      /* five arguments is a font, a string, x, y, a color, OR a font, a
-       * string, an array or hash of [x, y], a color and a direction */
-      if (FIXNUM_P(argv[2])) {
-        x = NUM2INT(argv[2]);
-        y = NUM2INT(argv[3]);
-        color = argv[4];
-      } else {
-        switch (TYPE(argv[2])) {
-          case T_HASH:
-            x = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("x")));
-            y = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("y")));
-            break;
-          case T_ARRAY:
-            x = NUM2INT(rb_ary_entry(argv[2], 0));
-            y = NUM2INT(rb_ary_entry(argv[2], 1));
-            break;
-          default:
-            rb_raise(rb_eTypeError, "Invalid argument type "
-                                    "(not Array or Hash)");
-        }
-        color = argv[3];
-        dir = argv[4];
-      }
-      break;
-    case 6:
-      x = NUM2INT(argv[2]);
-      y = NUM2INT(argv[3]);
-      color = argv[4];
-      dir = argv[5];
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 5)");
-  }
+/*
+ * Return an array of font paths.
+ *
+ * Example:
+ *   path_list = Imlib2::Font.list_paths
+ *
+ */
+static VALUE font_list_paths(VALUE klass) {
+  VALUE ary;
+  char **list;
+  int i, len;
+  UNUSED(klass);
 
-  Data_Get_Struct(argv[0], Imlib_Font, font);
-  GET_AND_CHECK_IMAGE(self, im);
-  text = argv[1];
+  enter_imlib();
+  list = imlib_list_font_path(&len);
 
-  imlib_context_set_font(*font);
-  imlib_context_set_image(im->im);
+  ary = rb_ary_new();
+  for (i = 0; i < len; i++)
+    rb_ary_push(ary, rb_str_new2(list[i]));
 
-  if (color != Qnil) 
-    set_context_color(color);
-  if (dir != Qnil) {
-    old_dir = imlib_context_get_direction();
-    imlib_context_set_direction(NUM2INT(dir));
-  }
+  /* FIXME: there has got to be a better way to do this: */
+  imlib_free_font_list(list, len);
+  
+  return ary;
+}
 
-  imlib_text_draw_with_return_metrics(x, y, StringValuePtr(text), 
-                                      &r[0], &r[1], &r[2], &r[3]);
-  if (dir != Qnil)
-    imlib_context_set_direction(old_dir);
+/**********************/
+/* GRADIENT FUNCTIONS */
+/**********************/
+static void gradient_free(void *val) {
+  Imlib_Color_Range *range = (Imlib_Color_Range*) val;
+  free_imlib_object(FREE_RANGE, *range);
+  free(range);
+}
 
-  ary = rb_ary_new();
-  for (i = 0; i < 4; i++)
-    rb_ary_push(ary, INT2FIX(r[i]));
+/*
+ * Return a new Imlib2::Gradient.
+ *
+ * Examples:
+ *   # create a blue to green gradient
+ *   grad = Imlib2::Gradient.new
+ *   grad.add_color 0, Imlib2::Color::BLUE
+ *   grad.add_color 100, Imlib2::Color::GREEN
+ *   
+ *   # create a red to yellow to black gradient
+ *   colors = [ [0,   Imlib2::Color::RED    ], 
+ *              [100, Imlib2::Color::YELLOW ],
+ *              [200, Imlib2::Color::BLACK  ] ]
+ *   grad = Imlib2::Gradient.new *colors
+ *
+ */
+VALUE gradient_new(int argc, VALUE *argv, VALUE klass) {
+  Imlib_Color_Range *range;
+  VALUE g_o;
   
-  return ary;
+  range = malloc(sizeof(Imlib_Color_Range*));
+  enter_imlib();
+  *range = imlib_create_color_range();
+
+  g_o = Data_Wrap_Struct(klass, 0, gradient_free, range);
+  rb_obj_call_init(g_o, argc, argv);
+
+  return g_o;
 }
 
 /*
- * Fill a rectangle with the given Imlib2::Gradient at a given angle
+ * Add a color at the given distance
  *
  * Examples:
- *   x, y, w, h = 10, 10, image.width - 20, image.height - 20
- *   angle = 45.2
- *   image.fill_gradient gradient, x, y, w, h, angle
+ *   # add the context color with a 100 pixel offset
+ *   grad.add_color 100
+ *
+ *   # add white at a 100 pixel offset
+ *   grad.add_color 100, Imlib2::Color::WHITE
  *
- *   rect = [5, 5, 500, 20]
- *   image.gradient gradient, rect, 36.8
- * 
  */
-static VALUE image_fill_gradient(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
+static VALUE gradient_add_color(int argc, VALUE *argv, VALUE self) {
   Imlib_Color_Range *grad;
-  int x, y, w, h;
-  double angle;
-  
-  switch (argc) {
-    case 3:
-      /* three arguments is a gradient, an array or hash of [x,y,w,h],
-       * and an angle */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          w = NUM2INT(rb_ary_entry(argv[1], 2));
-          h = NUM2INT(rb_ary_entry(argv[1], 3));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      angle = NUM2DBL(argv[2]);
-      break;
-    case 4:
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
+  VALUE color = Qnil;
+  int distance;
 
-      switch (TYPE(argv[2])) {
-        case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[2], rb_str_new2("h")));
-          break;
-        case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[2], 0));
-          h = NUM2INT(rb_ary_entry(argv[2], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
-      }
-      angle = NUM2DBL(argv[3]);
+  switch (argc) {
+    case 1:
+      distance = NUM2INT(argv[0]);
       break;
-    case 6:
-      x = NUM2INT(argv[1]);
-      y = NUM2INT(argv[2]);
-      w = NUM2INT(argv[3]);
-      h = NUM2INT(argv[4]);
-      angle = NUM2DBL(argv[5]);
+    case 2:
+      distance = NUM2INT(argv[0]);
+      color = argv[1];
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+      rb_raise(rb_eTypeError, "Invalid argument count (not 1 or 2)");
   }
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  Data_Get_Struct(argv[0], Imlib_Color_Range, grad);
+  Data_Get_Struct(self, Imlib_Color_Range, grad);
+  enter_imlib();
   imlib_context_set_color_range(*grad);
 
-  imlib_image_fill_color_range_rectangle(x, y, w, h, angle);
+  if (color != Qnil)
+    set_context_color(color);
+
+  imlib_add_color_to_color_range(distance);
 
   return self;
 }
 
 /*
- * Draw an Imlib2::Polygon with the specified color
+ * Imlib2::Gradient constructor.
+ *
+ * Accepts an arbitrary number of arrays of offset, and color values
+ * (the same as Imlib2::Gradient.new).
+ *
+ */
+static VALUE gradient_init(int argc, VALUE *argv, VALUE self) {
+  int i;
+
+  for (i = 0; i < argc; i++) {
+    VALUE args[2];
+    args[0]= rb_ary_entry(argv[i], 0);
+    args[1] = rb_ary_entry(argv[i], 1);
+
+    gradient_add_color(2, args, self);
+  }
+  
+  return self;
+}
+
+/*********************/
+/* POLYGON FUNCTIONS */
+/*********************/
+static void poly_free(void *val) {
+  ImlibPolygon *poly = (ImlibPolygon*) val;
+  free_imlib_object(FREE_POLYGON, *poly);
+  free(poly);
+}
+
+/* 
+ * Return a new Imlib2::Polygon
  *
  * Examples:
- *   # create a simple blue right triangle
- *   triangle = Imlib2::Polygon.new [10, 10], [20, 20], [10, 20]
- *   image.draw_polygon triangle, Imlib2::Color::BLUE
+ *   poly = Imlib2::Polygon.new
  *
- *   # create an open red square polygon
- *   square = Imlib2.Polygon.new [10, 10], [20, 10], [20, 20], [10, 20]
- *   image.draw_poly square, false, Imlib2::Color::RED
+ *   points = [[10, 10], [20, 30], [15, 8], [6, 3], [12, 2]]
+ *   poly = Imlib2::Polygon.new *points
  *
  */
-static VALUE image_draw_poly(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
+VALUE poly_new(int argc, VALUE *argv, VALUE klass) {
   ImlibPolygon *poly;
-  VALUE color = Qnil;
-  unsigned char closed = Qtrue;
+  VALUE p_o;
+
+  poly = malloc(sizeof(ImlibPolygon*));
+  enter_imlib();
+  *poly = imlib_polygon_new();
+
+  p_o = Data_Wrap_Struct(klass, 0, poly_free, poly);
+  rb_obj_call_init(p_o, argc, argv);
+
+  return p_o;
+}
+
+/*
+ * Add a point to the polygon
+ *
+ * Example:
+ *   poly.add_point 123, 456
+ *
+ */
+static VALUE poly_add_point(int argc, VALUE *argv, VALUE self) {
+  ImlibPolygon *poly;
+  int x, y;
 
   switch (argc) {
     case 1:
-      /* one argument is poly.. closed is default (Qtrue) */
-      break;
-    case 2:
-      /* two arguments is poly and closed, or poly and color */
-      if ((rb_obj_is_kind_of(argv[1], cRgbaColor) == Qtrue) ||
-          (rb_obj_is_kind_of(argv[1], cHsvaColor) == Qtrue) ||
-          (rb_obj_is_kind_of(argv[1], cHlsaColor) == Qtrue) ||
-          (rb_obj_is_kind_of(argv[1], cCmyaColor) == Qtrue)) {
-        color = argv[1];
-      } else /* FIXME: do type check here */ {
-        closed = (argv[1] == Qtrue) ? 1 : 0;
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
       }
       break;
-    case 3:
-      /* two arguments is poly, closed, and color */
-      closed = (argv[1] == Qtrue) ? 1 : 0;
-      color = argv[2];
+    case 2:
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
   }
+  
+  Data_Get_Struct(self, ImlibPolygon, poly);
+  enter_imlib();
+  imlib_polygon_add_point(*poly, x, y);
+    
+  return self;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+/*
+ * Constructor for Imlib2::Polygon
+ *
+ * Accepts the same arguments as Imlib2::Polygon.new.
+ *
+ */
+static VALUE poly_init(int argc, VALUE *argv, VALUE self) {
+  VALUE args[1];
+  int i;
 
-  if (color != Qnil)
-    set_context_color(color);
-  
-  Data_Get_Struct(argv[0], ImlibPolygon, poly);
-  imlib_image_draw_polygon(*poly, closed);
+  for (i = 0; i < argc; i++) {
+    args[0] = argv[i];
+    poly_add_point(1, args, self);
+  }
 
   return self;
 }
 
 /*
- * Fill an Imlib2::Polygon with the specified color
+ * Return the bounding rectangle of the given polygon.
  *
- * Examples:
- *   # create an filled green diamond polygon
- *   square = Imlib2.Polygon.new [50, 10], [70, 30], [50, 50], [30, 30]
- *   image.fill_poly square, false, Imlib2::Color::GREEN
+ * Example:
+ *   bounds = poly.bounds
+ *   %q(x y w h).each_index { |i, v| puts v << ' = ' << bounds[i] }
  *
  */
-static VALUE image_fill_poly(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
+static VALUE poly_bounds(VALUE self) {
   ImlibPolygon *poly;
-  VALUE color = Qnil;
+  VALUE ary;
+  int i, r[4] = { 0, 0, 0, 0 };
+
+  Data_Get_Struct(self, ImlibPolygon, poly);
+  enter_imlib();
+  imlib_polygon_get_bounds(*poly, &r[0], &r[1], &r[2], &r[3]);
+
+  ary = rb_ary_new();
+  for (i = 0; i < 4; i++)
+    rb_ary_push(ary, INT2FIX(r[i]));
+
+  return ary;
+}
+  
+/*
+ * Does the given point lie within the polygon?
+ *
+ * Example:
+ *   if poly.contains? 12, 5
+ *     puts 'yes'
+ *   else
+ *     puts 'no'
+ *   end
+ *
+ */
+static VALUE poly_contains(int argc, char *argv, VALUE self) {
+  ImlibPolygon *poly;
+  int x, y;
 
   switch (argc) {
     case 1:
-      /* one argument is poly.. closed is default (Qtrue) */
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
       break;
     case 2:
-      color = argv[1];
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 3, 4, or 6)");
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
   }
+  
+  Data_Get_Struct(self, ImlibPolygon, poly);
+  enter_imlib();
+  return imlib_polygon_contains_point(*poly, x, y) ? Qtrue : Qfalse;
+}
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+/***************************/
+/* STATIC FILTER FUNCTIONS */
+/***************************/
+static void filter_free(void *filter) {
+  FilterStruct *f = (FilterStruct*) filter;
+  int i;
 
-  if (color != Qnil)
-    set_context_color(color);
-  
-  Data_Get_Struct(argv[0], ImlibPolygon, poly);
-  imlib_image_fill_polygon(*poly);
+  for (i = 0; i < 4; i++)
+    xfree(f->ch[i].taps);
+  xfree(f);
+}
 
-  return self;
+static size_t filter_memsize(const void *val) {
+  const FilterStruct *f = (const FilterStruct*) val;
+  size_t size = sizeof(FilterStruct);
+  int i;
+
+  for (i = 0; i < 4; i++)
+    size += sizeof(FilterTap) * f->ch[i].max_taps;
+  return size;
 }
 
 /*
- * Apply an Imlib2::Filter (eg a static filter)
- *
- * You should probably using Imlib2::Image#filter() instead, since it is
- * polymorphic (eg, it can handle both static and scripted filters).
- * 
- * Example:
- *   filter = Imlib2::Filter.new 20
- *   filter.set 2, 2, Imlib2::Color::GREEN
- *   image.static_filter filter
- *
+ * Set the weights of the source pixel at x, y in one channel's kernel,
+ * replacing any earlier entry for x, y (as imlib_filter_set_*() do).
  */
-static VALUE image_static_filter(VALUE self, VALUE filter) {
-  ImStruct *im;
-  Imlib_Filter *f;
-
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+static void filter_channel_set(FilterChannel *fc, int x, int y,
+                               int a, int r, int g, int b) {
+  FilterTap *tap = NULL;
+  int i;
 
-  Data_Get_Struct(filter, Imlib_Filter, f);
-  imlib_context_set_filter(*f);
+  for (i = 0; i < fc->num_taps; i++)
+    if (fc->taps[i].x == x && fc->taps[i].y == y) {
+      tap = &fc->taps[i];
+      break;
+    }
 
-  imlib_image_filter();
+  if (!tap) {
+    if (fc->num_taps == fc->max_taps) {
+      fc->max_taps = fc->max_taps ? fc->max_taps * 2 : 8;
+      REALLOC_N(fc->taps, FilterTap, fc->max_taps);
+    }
+    tap = &fc->taps[fc->num_taps++];
+    tap->x = x;
+    tap->y = y;
+  }
 
-  return self;
+  tap->w[FILTER_ALPHA] = a;
+  tap->w[FILTER_RED] = r;
+  tap->w[FILTER_GREEN] = g;
+  tap->w[FILTER_BLUE] = b;
 }
 
-/***************************/
-/* SCRIPT FILTER FUNCTIONS */
-/***************************/
 /*
- * Apply a scripted filter
+ * Return a new Imlib2::Filter
  *
- * You should probably using Imlib2::Image#filter() instead, since it is
- * polymorphic (eg, it can handle both static and scripted filters).
- * 
  * Example:
- *   x, y = 20, 10
- *   filter_string = "tint( x=#{x}, y=#{y}, red=255, alpha=55 );"
- *   image.script_filter filter_string
+ *   filter = Imlib2::Filter.new
  *
  */
-static VALUE image_script_filter(VALUE self, VALUE filter) {
-  ImStruct *im;
-  
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
+VALUE filter_new(VALUE klass, VALUE initsize) {
+  FilterStruct *f;
+  VALUE f_o, vals[1];
+  int i, size = NUM2INT(initsize);
 
-  imlib_apply_filter(StringValuePtr(filter));
+  f_o = TypedData_Make_Struct(klass, FilterStruct, &filter_type, f);
+  if (size > 0)
+    for (i = 0; i < 4; i++) {
+      f->ch[i].taps = ALLOC_N(FilterTap, size);
+      f->ch[i].max_taps = size;
+    }
 
-  return self;
-}
+  vals[0] = initsize;
+  rb_obj_call_init(f_o, 1, vals);
 
-/********************/
-/* FILTER FUNCTIONS */
-/********************/
+  return f_o;
+}
 
 /*
- * Apply a scripted filter or a static (eg Imlib2::Filter) filter 
- *
- * Example:
- *   # apply a static filter
- *   filter = Imlib2::Filter.new 20
- *   filter.set 2, 2, Imlib2::Color::GREEN
- *   image.filter filter
+ * Constructor for Imlib2::Filter
  *
- *   # apply a scripted filter
- *   x, y = 20, 10
- *   filter_string = "tint( x=#{x}, y=#{y}, red=255, alpha=55 );"
- *   image.filter filter_string
+ * Currently just a placeholder.
  *
  */
-static VALUE image_filter(VALUE self, VALUE filter) {
-  if (rb_obj_is_kind_of(self, rb_cString) == Qtrue) {
-    return image_static_filter(self, filter);
-  } else if (rb_obj_is_kind_of(self, cFilter) == Qtrue) {
-    return image_script_filter(self, filter);
-  } else {
-    rb_raise(rb_eTypeError, "Invalid argument type "
-                            "(not String or Imlib2::Filter)");
-  }
-  
+VALUE filter_init(VALUE self, VALUE initsize) {
+  UNUSED(initsize);
+  /* don't do anythign here for now */
   return self;
 }
 
 /*
- * Apply an Imlib2::ColorModifier to the image
- *
- * Examples:
- *   # modify the contrast of the entire image
- *   cmod = Imlib2::ColorModifier.new
- *   cmod.contrast = 1.5
- *   image.apply_cmod color_mod
- *
- *   # adjust the gamma of the given rect
- *   cmod = Imlib2::ColorModifier.new
- *   cmod.gamma = 0.5
- *   rect = [10, 10, 20, 40]
- *   image.apply_color_modifier cmod, rect
+ * Set the filter color value and x, y
+ * 
+ * Example: 
+ *   filter.set x, y, Imlib2::Color::RED
  *
  */
-static VALUE image_apply_cmod(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  Imlib_Color_Modifier *cmod;
-  char whole_image = 0;
-  int x, y, w, h;
+VALUE filter_set(int argc, VALUE *argv, VALUE self) {
+  FilterStruct *f;
+  Imlib_Color *c;
+  int x, y;
+  VALUE color;
 
-  x = y = w = h = 0;
   switch (argc) {
-    case 1:
-      whole_image = 1;
-      break;
     case 2:
-      switch (TYPE(argv[1])) {
+      /* 2 args is an array or hash of x, y, and an RGBAColor */
+
+      color = argv[1];
+      switch (TYPE(argv[0])) {
         case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          w = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("h")));
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
           break;
         case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          w = NUM2INT(rb_ary_entry(argv[1], 2));
-          h = NUM2INT(rb_ary_entry(argv[1], 3));
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
           break;
         default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
       }
       break;
-    case 5:
-      x = NUM2INT(argv[1]);
-      y = NUM2INT(argv[2]);
-      w = NUM2INT(argv[3]);
-      h = NUM2INT(argv[4]);
+    case 3:
+      /* three args is x, y, and color */
+
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
       break;
     default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 1, 2, or 5)");
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
   }
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  Data_Get_Struct(argv[0], Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  filter_channel_set(&f->ch[FILTER_ALPHA], x, y, c->alpha, 0, 0, 0);
+  filter_channel_set(&f->ch[FILTER_RED], x, y, 0, c->red, 0, 0);
+  filter_channel_set(&f->ch[FILTER_GREEN], x, y, 0, 0, c->green, 0);
+  filter_channel_set(&f->ch[FILTER_BLUE], x, y, 0, 0, 0, c->blue);
 
-  if (whole_image)
-    imlib_apply_color_modifier();
-  else
-    imlib_apply_color_modifier_to_rectangle(x, y, w, h);
-  
   return self;
 }
 
-#ifndef X_DISPLAY_MISSING
-/*
- * Render a pixmap and mask of an image.
- *
- * Note: this method returns an array with the pixmap and mask, not just
- * the pixmap.
- *
- * Examples:
- *   pmap, mask = image.render_pixmap
- *   pmap, mask = image.pixmap
- *
- *   # render a half-size pixmap and mask of the image
- *   pmap, mask = image.render_pixmap image.width / 2, image.height / 2
- *
- *   # render a half-size pixmap and mask of the image
- *   pmap, mask = image.pixmap image.width / 2, image.height / 2
- *
- */
-static VALUE image_render_pixmap(int argc, VALUE *argv, VALUE self) {
-  ImStruct *im;
-  Imlib_Image old_im;
-  Pixmap *pmap, *mask;
-  VALUE ary;
-  int w, h;
-  char at_size = 0;
+VALUE filter_set_red(int argc, VALUE *argv, VALUE self) {
+  FilterStruct *f;
+  Imlib_Color *c;
+  int x, y;
+  VALUE color;
 
   switch (argc) {
-    case 0:
-      at_size = 0;
-      break;
-    case 1:
-      /* one arg is an array or hash of [w, h] */
+    case 2:
+      /* 2 args is an array or hash of x, y, and an RGBAColor */
 
-      at_size = 1;
+      color = argv[1];
       switch (TYPE(argv[0])) {
         case T_HASH:
-          w = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("w")));
-          h = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("h")));
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
           break;
         case T_ARRAY:
-          w = NUM2INT(rb_ary_entry(argv[0], 0));
-          h = NUM2INT(rb_ary_entry(argv[0], 1));
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
           break;
         default:
-          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
       }
-
-      break;
-    case 2:
-      /* two args is w, h */
-
-      at_size = 1;
-      w = NUM2INT(argv[0]);
-      h = NUM2INT(argv[1]);
       break;
-    default:
-      rb_raise(rb_eArgError, "Invalid argument count (not 0, 1, or 2)");
-  }
-  
-  /* save existing context */
-  old_im = imlib_context_get_image();
-
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-
-  /* if we were passed width and height, then use them */
-  if (at_size)
-    imlib_render_pixmaps_for_whole_image_at_size(pmap, mask, w, h);
-  else
-    imlib_render_pixmaps_for_whole_image(pmap, mask);
-
-  /* restore existing context */
-  imlib_context_set_image(old_im);
-  
-  ary = rb_ary_new();
-  rb_ary_push(ary, Data_Wrap_Struct(cPixmap, 0, free, pmap));
-  rb_ary_push(ary, Data_Wrap_Struct(cPixmap, 0, free, mask));
-
-  return ary;
-}
-#endif /* !X_DISPLAY_MISSING */
-
-/*
- * Attach an integer value to an Imlib2::Image.
- * 
- * Examples:
- *   image.attach_value('quality', 90)
- *   image['quality'] = 90
- */
-static VALUE image_attach_val(VALUE self, VALUE key_o, VALUE val_o) {
-  ImStruct *im;
-  char *key;
+    case 3:
+      /* three args is x, y, and color */
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  key = StringValuePtr(key_o);
-  /* if (rb_obj_is_kind_of(val_o, rb_cString)) {
-    void *val = (void*) StringValuePtr(val_o);
-    fprintf(stderr, "attaching string\n");
-    imlib_image_attach_data_value(key, val, 0, NULL);
-  } else */ if (rb_obj_is_kind_of(val_o, rb_cNumeric)) {
-    int val = NUM2INT(val_o);
-    imlib_image_attach_data_value(key, NULL, val, NULL);
-  } else {
-    rb_raise(rb_eTypeError, "Invalid argument (not string or integer)");
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
   }
 
-  /* return value */
-  return val_o;
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  filter_channel_set(&f->ch[FILTER_RED], x, y,
+                     c->alpha, c->red, c->green, c->blue);
+
+  return self;
 }
 
 /*
- * Get an integer value attached to an Imlib2::Image.
+ * Set the green filter color value and x, y
  * 
- * Examples:
- *   qual = image.get_attached_value('quality')
- *   qual = image['quality']
+ * Example: 
+ *   filter.set_green x, y, Imlib2::Color::RgbaColor.new 0, 128, 0, 128
+ *
  */
-static VALUE image_get_attach_val(VALUE self, VALUE key_o) {
-  ImStruct *im;
-  VALUE ret;
-  char *key;
-  /* char *data; */
+VALUE filter_set_green(int argc, VALUE *argv, VALUE self) {
+  FilterStruct *f;
+  Imlib_Color *c;
+  int x, y;
+  VALUE color;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  key = StringValuePtr(key_o);
+  switch (argc) {
+    case 2:
+      /* 2 args is an array or hash of x, y, and an RGBAColor */
 
-  /* if it's got data, retrn that, otherwise return the value */
-/* 
- *   if ((data = (char*) imlib_image_get_attached_value(key)) != NULL) {
- *     fprintf(stderr, "it's a string \"%s\": %x\n", key, data);
- *     ret = rb_str_new2(data);
- *   } else {
- *     fprintf(stderr, "it's an integer \"%s\"\n", key);
- */ 
-    ret = INT2FIX(imlib_image_get_attached_value(key));
-/* 
- *   }
- */ 
-  
-  /* return result */
-  return ret;
+      color = argv[1];
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three args is x, y, and color */
+
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
+  }
+
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  filter_channel_set(&f->ch[FILTER_GREEN], x, y,
+                     c->alpha, c->red, c->green, c->blue);
+
+  return self;
 }
 
 /*
- * Remove an integer value attached to an Imlib2::Image.
+ * Set the blue filter color value and x, y
  * 
- * Examples:
- *   image.remove_attached_value('quality')
+ * Example: 
+ *   filter.set_blue x, y, Imlib2::Color::RgbaColor.new 0, 0, 64, 128
+ *
  */
-static VALUE image_rm_attach_val(VALUE self, VALUE key_o) {
-  ImStruct *im;
-  char *key;
+VALUE filter_set_blue(int argc, VALUE *argv, VALUE self) {
+  FilterStruct *f;
+  Imlib_Color *c;
+  int x, y;
+  VALUE color;
 
-  GET_AND_CHECK_IMAGE(self, im);
-  imlib_context_set_image(im->im);
-  key = StringValuePtr(key_o);
+  switch (argc) {
+    case 2:
+      /* 2 args is an array or hash of x, y, and an RGBAColor */
 
-  imlib_image_remove_attached_data_value(key);
+      color = argv[1];
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three args is x, y, and color */
 
-  return Qnil;
-}
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
+  }
 
-/******************/
-/* CMOD FUNCTIONS */
-/******************/
-static void cmod_free(void *val) {
-  Imlib_Color_Modifier *cmod = (Imlib_Color_Modifier*) val;
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  filter_channel_set(&f->ch[FILTER_BLUE], x, y,
+                     c->alpha, c->red, c->green, c->blue);
 
-  imlib_context_set_color_modifier(*cmod);
-  imlib_free_color_modifier();
-  free(cmod);
+  return self;
 }
 
 /*
- * Returns a new Imlib2::ColorModifier
- *
- * Example:
- *   cmod = Imlib2::ColorModifier.new
+ * Set the alpha filter color value and x, y
+ * 
+ * Example: 
+ *   filter.set_alpha x, y, Imlib2::Color::RgbaColor.new 0, 0, 0, 128
  *
  */
-VALUE cmod_new(VALUE klass) {
-  Imlib_Color_Modifier *cmod;
-  VALUE self;
+VALUE filter_set_alpha(int argc, VALUE *argv, VALUE self) {
+  FilterStruct *f;
+  Imlib_Color *c;
+  int x, y;
+  VALUE color;
 
-  cmod = malloc(sizeof(Imlib_Color_Modifier));
-  self = Data_Wrap_Struct(klass, 0, cmod_free, cmod);
+  switch (argc) {
+    case 2:
+      /* 2 args is an array or hash of x, y, and an RGBAColor */
 
-  rb_obj_call_init(self, 0, NULL);
+      color = argv[1];
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          x = NUM2INT(hash_arg(argv[0], KEY_X));
+          y = NUM2INT(hash_arg(argv[0], KEY_Y));
+          break;
+        case T_ARRAY:
+          x = NUM2INT(rb_ary_entry(argv[0], 0));
+          y = NUM2INT(rb_ary_entry(argv[0], 1));
+          break;
+        default:
+          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
+      }
+      break;
+    case 3:
+      /* three args is x, y, and color */
 
-  return self;
-}
+      x = NUM2INT(argv[0]);
+      y = NUM2INT(argv[1]);
+      color = argv[2];
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
+  }
+
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  filter_channel_set(&f->ch[FILTER_ALPHA], x, y,
+                     c->alpha, c->red, c->green, c->blue);
 
-/*
- * Imlib2::ColorModifier constructor
- *
- * This method takes no arguments.
- * 
- */
-static VALUE cmod_init(VALUE self) {
   return self;
 }
 
 /*
- * Set the gamma value.
+ * Set filter constants.
  *
  * Example:
- *   cmod.gamma = 0.5
+ *   filter.set_constants RgbaColor.new 32, 32, 32, 32
  *
  */
-static VALUE cmod_gamma(VALUE self, VALUE gamma) {
-  Imlib_Color_Modifier *cmod;
+VALUE filter_constants(VALUE self, VALUE color) {
+  FilterStruct *f;
+  Imlib_Color *c;
 
-  Data_Get_Struct(self, Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
-  imlib_modify_color_modifier_gamma(NUM2DBL(gamma));
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  f->ch[FILTER_ALPHA].cons = c->alpha;
+  f->ch[FILTER_RED].cons = c->red;
+  f->ch[FILTER_GREEN].cons = c->green;
+  f->ch[FILTER_BLUE].cons = c->blue;
 
   return self;
 }
 
 /*
- * Set the brightness value.
+ * Set filter divisors.
  *
  * Example:
- *   cmod.brightness = 2.0
+ *   filter.set_divisors RgbaColor.new 0, 32, 0, 32
  *
  */
-static VALUE cmod_brightness(VALUE self, VALUE brightness) {
-  Imlib_Color_Modifier *cmod;
+VALUE filter_divisors(VALUE self, VALUE color) {
+  FilterStruct *f;
+  Imlib_Color *c;
 
-  Data_Get_Struct(self, Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
-  imlib_modify_color_modifier_brightness(NUM2DBL(brightness));
+  TypedData_Get_Struct(self, FilterStruct, &filter_type, f);
+  Data_Get_Struct(color, Imlib_Color, c);
+  f->ch[FILTER_ALPHA].div = c->alpha;
+  f->ch[FILTER_RED].div = c->red;
+  f->ch[FILTER_GREEN].div = c->green;
+  f->ch[FILTER_BLUE].div = c->blue;
 
   return self;
 }
 
-/*
- * Set the contrast value.
- *
- * Example:
- *   cmod.contrast = 0.8
- *
- */
-static VALUE cmod_contrast(VALUE self, VALUE contrast) {
-  Imlib_Color_Modifier *cmod;
-
-  Data_Get_Struct(self, Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
-  imlib_modify_color_modifier_contrast(NUM2DBL(contrast));
+/*********************/
+/* CONTEXT FUNCTIONS */
+/*********************/
+static void ctx_free(void *val) {
+  Imlib_Context *ctx = (Imlib_Context *) val;
 
-  return self;
+  free_imlib_object(FREE_CONTEXT, *ctx);
+  free(ctx);
 }
 
-/*
- * Reset the Imlib2::ColorModifier
- *
- * Example:
- *   cmod.reset
- *
- */
-static VALUE cmod_reset(VALUE self) {
-  Imlib_Color_Modifier *cmod;
+/*************************************/
+/* PER-THREAD CONTEXT FUNCTIONS      */
+/* (see Imlib2::Context.per_thread=) */
+/*************************************/
+static Imlib_Context pushed_context = NULL;
+static ID id_context_stack;
 
-  Data_Get_Struct(self, Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
-  imlib_reset_color_modifier();
+/* return the calling thread's stack of Imlib2::Context objects,
+ * creating it (and the thread's base context) on first use */
+static VALUE thread_context_stack(void) {
+  VALUE thread = rb_thread_current(), stack;
+  Imlib_Context *ctx;
 
-  return self;
-}
+  stack = rb_thread_local_aref(thread, id_context_stack);
+  if (NIL_P(stack)) {
+    /* can't use ctx_new() here, since it calls enter_imlib() */
+    ctx = malloc(sizeof(Imlib_Context));
+    *ctx = imlib_context_new();
 
-/******************/
-/* FONT FUNCTIONS */
-/******************/
-static void font_free(void *val) {
-  Imlib_Font *font = (Imlib_Font*) val;
-  imlib_context_set_font(*font);
-  imlib_free_font();
-  free(font);
+    stack = rb_ary_new();
+    rb_ary_push(stack, Data_Wrap_Struct(cContext, 0, ctx_free, ctx));
+    rb_thread_local_aset(thread, id_context_stack, stack);
+  }
+
+  return stack;
 }
 
-/*
- * Returns a new Imlib2::Font
- *
- * Note: the specified font must be in the font path.  See
- * Imlib2::Font::list_paths() for a list of font paths, and
- * Imlib2::Font::list_fonts() for a list of fonts.
- *
- * Examples:
- *   font = Imlib2::Font.new 'helvetica/24'
- *   font = Imlib2::Font.load 'helvetica/24'
- *
- */
-VALUE font_new(VALUE klass, VALUE font_name) {
-  Imlib_Font *font;
-  VALUE f_o;
-  
-  font = malloc(sizeof(Imlib_Font*));
-  *font = imlib_load_font(StringValuePtr(font_name));
+/* make the top of the calling thread's context stack the current
+ * Imlib2 context, replacing the one pushed for the previous thread */
+static void switch_thread_context(void) {
+  Imlib_Context *ctx, cur = imlib_context_get();
+  VALUE stack;
 
-  f_o = Data_Wrap_Struct(klass, 0, font_free, font);
-  rb_obj_call_init(f_o, 0, NULL);
+  stack = thread_context_stack();
+  Data_Get_Struct(rb_ary_entry(stack, -1), Imlib_Context, ctx);
+  if (cur == *ctx)
+    return;
 
-  return f_o;
+  if (pushed_context && cur == pushed_context)
+    imlib_context_pop();
+  imlib_context_push(*ctx);
+  pushed_context = *ctx;
 }
 
-/* 
- * Constructor for Imlib2::Font
+/*
+ * Does each thread have its own Imlib2::Context?
  *
- * Currently just a placeholder.
+ * Example:
+ *   puts 'isolated contexts' if Imlib2::Context.per_thread?
  *
  */
-static VALUE font_init(VALUE self) {
-  return self;
+static VALUE ctx_per_thread(VALUE klass) {
+  UNUSED(klass);
+  return per_thread_context ? Qtrue : Qfalse;
 }
 
 /*
- * Get the width and height of the given string using this font.
+ * Give each thread (or fiber) its own Imlib2::Context.  Disabled by
+ * default.
  *
- * Example:
- *   font = Imlib2::Font.new 'helvetica/12'
- *   size = font.size 'how big am i?'
- *   ['width', 'height'].each_index { |i, v|
- *     puts 'text ' << v << ' = ' << size[i]
- *   }
+ * Imlib2 has a single, process-wide current context, so image methods
+ * called from different threads normally overwrite each other's
+ * context image, color, cliprect, and so on.  When this is enabled,
+ * each thread gets a context of its own (created the first time the
+ * thread calls into Imlib2), and it is switched in whenever that
+ * thread enters Imlib2.  Imlib2::Context#push, Imlib2::Context.pop, and
+ * Imlib2::Context.get then work on a per-thread context stack.
  *
- */
-static VALUE font_text_size(VALUE self, VALUE text) {
-  Imlib_Font *font;
-  int   sw = 0, sh = 0;
-
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
-  imlib_get_text_size(StringValuePtr(text), &sw, &sh);
-  
-  return rb_ary_new3 (2, INT2FIX(sw), INT2FIX(sh));
-}
-  
-/* 
- * Get the horizontal and vertical advance of the given string using
- * this font.
+ * Note: Imlib2 calls are still serialized (see Imlib2::release_gvl=);
+ * this only keeps threads from seeing each other's context state.
  *
  * Example:
- *   font = Imlib2::Font.new 'verdana/36'
- *   advances = font.advance "what's my advance?"
- *   ['horizontal', 'vertical'].each_index { |i, v|
- *     puts 'text ' << v << ' advance = ' << advances[i]
- *   }
+ *   Imlib2::Context.per_thread = true
+ *   Imlib2::Context.get.anti_alias = false # only for this thread
  *
  */
-static VALUE font_text_advance(VALUE self, VALUE text) {
-  Imlib_Font *font;
-  int   sw = 0, sh = 0;
+static VALUE ctx_set_per_thread(VALUE klass, VALUE val) {
+  UNUSED(klass);
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
-  imlib_get_text_advance(StringValuePtr(text), &sw, &sh);
-  
-  return rb_ary_new3 (2, INT2FIX(sw), INT2FIX (sh));
+  enter_imlib();
+  per_thread_context = RTEST(val);
+
+  /* drop the last thread's context when switching back */
+  if (!per_thread_context && pushed_context) {
+    if (imlib_context_get() == pushed_context)
+      imlib_context_pop();
+    pushed_context = NULL;
+  }
+
+  return val;
 }
-  
+
 /*
- * Get the inset of the given string using this font
+ * Return a new Imlib2::Context.
  *
  * Example:
- *   font = Imlib2::Font.new 'palatino/9'
- *   inset = font.inset 'wonder what the inset for this string is...'
+ *   ctx = Imlib2::Context.new
  *
  */
-static VALUE font_text_inset(VALUE self, VALUE text) {
-  Imlib_Font *font;
+VALUE ctx_new(VALUE klass) {
+  VALUE self;
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
+  ctx = malloc(sizeof(Imlib_Context));
+  enter_imlib();
+  *ctx = imlib_context_new();
+
+  self = Data_Wrap_Struct(klass, 0, ctx_free, ctx);
+  rb_obj_call_init(self, 0, NULL);
   
-  return INT2FIX(imlib_get_text_inset(StringValuePtr(text)));
+  return self;
 }
-  
+
 /*
- * Get the character index of the pixel at the given coordinates using
- * this font.
+ * Imlib2::Context constructor.
  *
- * Example:
- *   x, y, char_w, char_h = font.index "index\nstring\n", 5, 5
+ * Currently just a placeholder
  *
  */
-static VALUE font_text_index(int argc, VALUE *argv, VALUE self) {
-  Imlib_Font *font;
-  VALUE text, ary;
-  int x, y, i, r[] = { 0, 0, 0, 0 };
-
-  text = argv[0];
-  switch (argc) {
-    case 2:
-      /* two arguments is a string, and an array or hash of x, y */
-      switch (TYPE(argv[1])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[1], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[1], 0));
-          y = NUM2INT(rb_ary_entry(argv[1], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-      }
-      break;
-    case 3:
-      /* three arguments is a string, x, y */
-      x = NUM2INT(argv[1]);
-      y = NUM2INT(argv[2]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
-
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
-  imlib_text_get_index_and_location(StringValuePtr(text), x, y,
-                                    &r[0], &r[1], &r[2], &r[3]);
-  ary = rb_ary_new();
-  for (i = 0; i < 4; i++)
-    rb_ary_push(ary, INT2FIX(r[i]));
-  
-  return ary;
+static VALUE ctx_init(VALUE self) {
+  return self;
 }
-  
+
 /*
- * Get the character coordinates of the at the given index using this font.
+ * Pop the top context off the context stack.
  *
  * Example:
- *   x, y, char_w, char_h = font.index "index\nstring\n", 8
+ *   ctx = Imlib2::Context.pop
  *
  */
-static VALUE font_text_location(VALUE self, VALUE text, VALUE index) {
-  Imlib_Font *font;
-  VALUE ary;
-  int i, r[] = { 0, 0, 0, 0 };
+VALUE ctx_pop(VALUE klass) {
+  Imlib_Context *ctx;
+  VALUE stack;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
-  imlib_text_get_location_at_index(StringValuePtr(text), NUM2INT(index), 
-                                   &r[0], &r[1], &r[2], &r[3]);
+  if (per_thread_context) {
+    /* never pop the thread's base context */
+    stack = thread_context_stack();
+    if (RARRAY_LEN(stack) > 1)
+      rb_ary_pop(stack);
+    enter_imlib();
 
-  ary = rb_ary_new();
-  for (i = 0; i < 4; i++)
-    rb_ary_push(ary, INT2FIX(r[i]));
-  
-  return ary;
+    return rb_ary_entry(stack, -1);
+  }
+
+  ctx = (Imlib_Context *) malloc(sizeof(Imlib_Context));
+  enter_imlib();
+  imlib_context_pop();
+  *ctx = imlib_context_get();
+
+  return Data_Wrap_Struct(klass, 0, ctx_free, ctx);
 }
-  
+
 /*
- * Get font ascent.
+ * Return the current context.
  *
  * Example:
- *   a = font.ascent
+ *   ctx = Imlib2::Context.get
  *
  */
-static VALUE font_ascent(VALUE self) {
-  Imlib_Font *font;
+VALUE ctx_get(VALUE klass) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
+  if (per_thread_context)
+    return rb_ary_entry(thread_context_stack(), -1);
 
-  return INT2FIX(imlib_get_font_ascent());
+  ctx = (Imlib_Context *) malloc(sizeof(Imlib_Context));
+  enter_imlib();
+  *ctx = imlib_context_get();
+
+  return Data_Wrap_Struct(klass, 0, ctx_free, ctx);
 }
 
 /*
- * Get font descent.
+ * Push this context onto the context stack.
  *
  * Example:
- *   a = font.descent
+ *   ctx.push
  *
  */
-static VALUE font_descent(VALUE self) {
-  Imlib_Font *font;
+static VALUE ctx_push(VALUE self) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
+  Data_Get_Struct(self, Imlib_Context, ctx);
 
-  return INT2FIX(imlib_get_font_descent());
+  if (per_thread_context) {
+    rb_ary_push(thread_context_stack(), self);
+    enter_imlib();
+    return self;
+  }
+
+  enter_imlib();
+  imlib_context_push(*ctx);
+
+  return self;
 }
-  
+
 /*
- * Get font maximum ascent.
+ * Set the dither_mask flag.
  *
  * Example:
- *   a = font.maximum_ascent
+ *   ctx.dither_mask = true
  *
  */
-static VALUE font_maximum_ascent(VALUE self) {
-  Imlib_Font *font;
+static VALUE ctx_set_dither_mask(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_dither_mask(val != Qnil && val != Qfalse);
+  imlib_context_pop();
 
-  return INT2FIX(imlib_get_maximum_font_ascent());
+  return self;
 }
 
 /*
- * Get font maximum descent.
+ * Get the dither_mask flag.
  *
  * Example:
- *   a = font.maximum_descent
+ *   if ctx.dither_mask == true
+ *     puts 'dither_mask enabled'
+ *   end
  *
  */
-static VALUE font_maximum_descent(VALUE self) {
-  Imlib_Font *font;
+static VALUE ctx_dither_mask(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qfalse;
 
-  Data_Get_Struct(self, Imlib_Font, font);
-  imlib_context_set_font(*font);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = imlib_context_get_dither_mask() ? Qtrue : Qfalse;
+  imlib_context_pop();
 
-  return INT2FIX(imlib_get_maximum_font_descent());
+  return r;
 }
 
 /*
- * Return an array of all known fonts
+ * Set the anti_alias flag.
  *
  * Example:
- *   font_list = Imlib2::Font.list_fonts
+ *   ctx.anti_alias = true
  *
  */
-static VALUE font_list_fonts(VALUE klass) {
-  VALUE ary;
-  char **list;
-  int i, len;
-  UNUSED(klass);
-
-  list = imlib_list_fonts(&len);
+static VALUE ctx_set_aa(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  ary = rb_ary_new();
-  for (i = 0; i < len; i++)
-    rb_ary_push(ary, rb_str_new2(list[i]));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_anti_alias(val != Qnil && val != Qfalse);
+  imlib_context_pop();
 
-  /* FIXME: there has got to be a better way to do this: */
-  imlib_free_font_list(list, len);
-  
-  return ary;
+  return self;
 }
 
 /*
- * Add a path to the list of font paths.
+ * Get the anti_alias flag.
  *
  * Example:
- *   Imlib2::Font.add_path '/usr/lib/X11/fonts/Truetype'
+ *   if ctx.anti_alias == true
+ *     puts 'anti_alias enabled.'
+ *   end
  *
  */
-static VALUE font_add_path(VALUE klass, VALUE path) {
-  UNUSED(klass);
-  imlib_add_path_to_font_path(StringValuePtr(path));
-  return Qtrue;
+static VALUE ctx_aa(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qfalse;
+
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = imlib_context_get_anti_alias() ? Qtrue : Qfalse;
+  imlib_context_pop();
+
+  return r;
 }
 
 /*
- * Remove a path from the list of font paths.
+ * Set the dither flag.
  *
  * Example:
- *   Imlib2::Font.remove_path '/usr/lib/X11/fonts/Truetype'
+ *   ctx.dither = true
  *
  */
-static VALUE font_remove_path(VALUE klass, VALUE path) {
-  UNUSED(klass);
-  imlib_remove_path_from_font_path(StringValuePtr(path));
-  return Qtrue;
+static VALUE ctx_set_dither(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_dither(val != Qnil && val != Qfalse);
+  imlib_context_pop();
+
+  return self;
 }
 
 /*
- * Return an array of font paths.
+ * Get the dither flag.
  *
  * Example:
- *   path_list = Imlib2::Font.list_paths
+ *   if ctx.dither
+ *     puts 'dither enabled.'
+ *   end
  *
  */
-static VALUE font_list_paths(VALUE klass) {
-  VALUE ary;
-  char **list;
-  int i, len;
-  UNUSED(klass);
-
-  list = imlib_list_font_path(&len);
-
-  ary = rb_ary_new();
-  for (i = 0; i < len; i++)
-    rb_ary_push(ary, rb_str_new2(list[i]));
+static VALUE ctx_dither(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qfalse;
 
-  /* FIXME: there has got to be a better way to do this: */
-  imlib_free_font_list(list, len);
-  
-  return ary;
-}
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = imlib_context_get_dither() ? Qtrue : Qfalse;
+  imlib_context_pop();
 
-/**********************/
-/* GRADIENT FUNCTIONS */
-/**********************/
-static void gradient_free(void *val) {
-  Imlib_Color_Range *range = (Imlib_Color_Range*) val;
-  imlib_context_set_color_range(*range);
-  imlib_free_color_range();
-  free(range);
+  return r;
 }
 
 /*
- * Return a new Imlib2::Gradient.
+ * Set the blend flag.
  *
- * Examples:
- *   # create a blue to green gradient
- *   grad = Imlib2::Gradient.new
- *   grad.add_color 0, Imlib2::Color::BLUE
- *   grad.add_color 100, Imlib2::Color::GREEN
- *   
- *   # create a red to yellow to black gradient
- *   colors = [ [0,   Imlib2::Color::RED    ], 
- *              [100, Imlib2::Color::YELLOW ],
- *              [200, Imlib2::Color::BLACK  ] ]
- *   grad = Imlib2::Gradient.new *colors
+ * Example:
+ *   ctx.blend = true
  *
  */
-VALUE gradient_new(int argc, VALUE *argv, VALUE klass) {
-  Imlib_Color_Range *range;
-  VALUE g_o;
-  
-  range = malloc(sizeof(Imlib_Color_Range*));
-  *range = imlib_create_color_range();
+static VALUE ctx_set_blend(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  g_o = Data_Wrap_Struct(klass, 0, gradient_free, range);
-  rb_obj_call_init(g_o, argc, argv);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_blend(val != Qnil && val != Qfalse);
+  imlib_context_pop();
 
-  return g_o;
+  return self;
 }
 
 /*
- * Add a color at the given distance
- *
- * Examples:
- *   # add the context color with a 100 pixel offset
- *   grad.add_color 100
+ * Get the blend flag.
  *
- *   # add white at a 100 pixel offset
- *   grad.add_color 100, Imlib2::Color::WHITE
+ * Example:
+ *   if ctx.blend
+ *     puts 'blend enabled.'
+ *   end
  *
  */
-static VALUE gradient_add_color(int argc, VALUE *argv, VALUE self) {
-  Imlib_Color_Range *grad;
-  VALUE color = Qnil;
-  int distance;
+static VALUE ctx_blend(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qfalse;
 
-  switch (argc) {
-    case 1:
-      distance = NUM2INT(argv[0]);
-      break;
-    case 2:
-      distance = NUM2INT(argv[0]);
-      color = argv[1];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 1 or 2)");
-  }
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = imlib_context_get_blend() ? Qtrue : Qfalse;
+  imlib_context_pop();
 
-  Data_Get_Struct(self, Imlib_Color_Range, grad);
-  imlib_context_set_color_range(*grad);
+  return r;
+}
 
-  if (color != Qnil)
-    set_context_color(color);
+/*
+ * Set the current color modifier (Imlib2::ColorModifier).
+ *
+ * Example:
+ *   ctx.cmod = cmod
+ *
+ */
+static VALUE ctx_set_cmod(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+  Imlib_Color_Modifier *cmod;
 
-  imlib_add_color_to_color_range(distance);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  TypedData_Get_Struct(val, Imlib_Color_Modifier, &cmod_type, cmod);
+  imlib_context_set_color_modifier(*cmod);
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Imlib2::Gradient constructor.
+ * Get the current color modifier (Imlib2::ColorModifier).
  *
- * Accepts an arbitrary number of arrays of offset, and color values
- * (the same as Imlib2::Gradient.new).
+ * Example:
+ *   cmod = ctx.cmod
  *
  */
-static VALUE gradient_init(int argc, VALUE *argv, VALUE self) {
-  int i;
-
-  for (i = 0; i < argc; i++) {
-    VALUE args[2];
-    args[0]= rb_ary_entry(argv[i], 0);
-    args[1] = rb_ary_entry(argv[i], 1);
+static VALUE ctx_cmod(VALUE self) {
+  Imlib_Context *ctx;
+  Imlib_Color_Modifier *cmod;
 
-    gradient_add_color(2, args, self);
-  }
-  
-  return self;
-}
+  cmod = malloc(sizeof(Imlib_Color_Modifier));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  *cmod = imlib_context_get_color_modifier();
+  imlib_context_pop();
 
-/*********************/
-/* POLYGON FUNCTIONS */
-/*********************/
-static void poly_free(void *val) {
-  ImlibPolygon *poly = (ImlibPolygon*) val;
-  imlib_polygon_free(*poly);
-  free(poly);
+  return TypedData_Wrap_Struct(cColorMod, &cmod_type, cmod);
 }
 
-/* 
- * Return a new Imlib2::Polygon
- *
- * Examples:
- *   poly = Imlib2::Polygon.new
+/*
+ * Set the current operation (Imlib2::Op or Imlib2::Operation).
  *
- *   points = [[10, 10], [20, 30], [15, 8], [6, 3], [12, 2]]
- *   poly = Imlib2::Polygon.new *points
+ * Example:
+ *   ctx.operation = Imlib2::Op::COPY
  *
  */
-VALUE poly_new(int argc, VALUE *argv, VALUE klass) {
-  ImlibPolygon *poly;
-  VALUE p_o;
-
-  poly = malloc(sizeof(ImlibPolygon*));
-  *poly = imlib_polygon_new();
+static VALUE ctx_set_op(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  p_o = Data_Wrap_Struct(klass, 0, poly_free, poly);
-  rb_obj_call_init(p_o, argc, argv);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_operation(NUM2INT(val));
+  imlib_context_pop();
 
-  return p_o;
+  return self;
 }
 
 /*
- * Add a point to the polygon
+ * Get the current operation (Imlib2::Op or Imlib2::Operation).
  *
  * Example:
- *   poly.add_point 123, 456
+ *   if ctx.op == Imlib2::Op::COPY
+ *     puts 'copy operation'
+ *   end
  *
  */
-static VALUE poly_add_point(int argc, VALUE *argv, VALUE self) {
-  ImlibPolygon *poly;
-  int x, y;
-
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-      }
-      break;
-    case 2:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
-  
-  Data_Get_Struct(self, ImlibPolygon, poly);
-  imlib_polygon_add_point(*poly, x, y);
-    
-  return self;
+static VALUE ctx_op(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
+
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = INT2FIX(imlib_context_get_operation());
+  imlib_context_pop();
+
+  return r;
 }
 
 /*
- * Constructor for Imlib2::Polygon
+ * Set the current font (Imlib2::Font).
  *
- * Accepts the same arguments as Imlib2::Polygon.new.
+ * Example:
+ *   ctx.font = Imlib2::Font.new 'helvetica/12'
  *
  */
-static VALUE poly_init(int argc, VALUE *argv, VALUE self) {
-  VALUE args[1];
-  int i;
+static VALUE ctx_set_font(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+  Imlib_Font *font;
 
-  for (i = 0; i < argc; i++) {
-    args[0] = argv[i];
-    poly_add_point(1, args, self);
-  }
+  font = malloc(sizeof(Imlib_Font));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  TypedData_Get_Struct(val, Imlib_Font, &font_type, font);
+  imlib_context_set_font(*font);
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Return the bounding rectangle of the given polygon.
+ * Get the current font (Imlib2::Font).
  *
  * Example:
- *   bounds = poly.bounds
- *   %q(x y w h).each_index { |i, v| puts v << ' = ' << bounds[i] }
+ *   font = ctx.font
  *
  */
-static VALUE poly_bounds(VALUE self) {
-  ImlibPolygon *poly;
-  VALUE ary;
-  int i, r[4] = { 0, 0, 0, 0 };
-
-  Data_Get_Struct(self, ImlibPolygon, poly);
-  imlib_polygon_get_bounds(*poly, &r[0], &r[1], &r[2], &r[3]);
+static VALUE ctx_font(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  ary = rb_ary_new();
-  for (i = 0; i < 4; i++)
-    rb_ary_push(ary, INT2FIX(r[i]));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = TypedData_Wrap_Struct(cFont, &font_type, imlib_context_get_font());
+  imlib_context_pop();
 
-  return ary;
+  return r;
 }
-  
+
 /*
- * Does the given point lie within the polygon?
+ * Set the current font direction (Imlib2::Dir or Imlib2::Direction).
  *
  * Example:
- *   if poly.contains? 12, 5
- *     puts 'yes'
- *   else
- *     puts 'no'
- *   end
+ *   ctx.direction = Imlib2::Direction::LEFT
  *
  */
-static VALUE poly_contains(int argc, char *argv, VALUE self) {
-  ImlibPolygon *poly;
-  int x, y;
+static VALUE ctx_set_dir(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  switch (argc) {
-    case 1:
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 2:
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
-  
-  Data_Get_Struct(self, ImlibPolygon, poly);
-  return imlib_polygon_contains_point(*poly, x, y) ? Qtrue : Qfalse;
-}
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_direction(NUM2INT(val));
+  imlib_context_pop();
 
-/***************************/
-/* STATIC FILTER FUNCTIONS */
-/***************************/
-static void filter_free(void *filter) {
-  Imlib_Filter *f = (Imlib_Filter*) filter;
-  imlib_context_set_filter(*f);
-  imlib_free_filter();
-  free(f);
+  return self;
 }
 
 /*
- * Return a new Imlib2::Filter
+ * Get the current font direction (Imlib2::Dir or Imlib2::Direction).
  *
  * Example:
- *   filter = Imlib2::Filter.new
+ *   if ctx.direction != Imlib2::Direction::RIGHT
+ *     puts 'drawing funny text'
+ *   end
  *
  */
-VALUE filter_new(VALUE initsize, VALUE klass) {
-  Imlib_Filter *f = malloc(sizeof(Imlib_Filter));
-  VALUE f_o, vals[1];
-
-  *f = imlib_create_filter(NUM2INT(initsize));
-  f_o = Data_Wrap_Struct(klass, 0, filter_free, f);
+static VALUE ctx_dir(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  vals[0] = initsize;
-  rb_obj_call_init(f_o, 1, vals);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = INT2FIX(imlib_context_get_direction());
+  imlib_context_pop();
 
-  return f_o;
+  return r;
 }
 
 /*
- * Constructor for Imlib2::Filter
+ * Set the text drawing angle.
  *
- * Currently just a placeholder.
+ * Example:
+ *   ctx.angle = 76.8
  *
  */
-VALUE filter_init(VALUE self, VALUE initsize) {
-  UNUSED(initsize);
-  /* don't do anythign here for now */
+static VALUE ctx_set_angle(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_angle(NUM2DBL(val));
+  imlib_context_pop();
+
   return self;
 }
 
 /*
- * Set the filter color value and x, y
- * 
- * Example: 
- *   filter.set x, y, Imlib2::Color::RED
+ * Get the text drawing angle.
+ *
+ * Example:
+ *   if ctx.dir == Imlib2::Direction::ANGLE
+ *     puts 'the current font angle is ' << ctx.angle
+ *   end
  *
  */
-VALUE filter_set(int argc, VALUE *argv, VALUE self) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
-  int x, y;
-  VALUE color;
+static VALUE ctx_angle(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  switch (argc) {
-    case 2:
-      /* 2 args is an array or hash of x, y, and an RGBAColor */
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = rb_float_new(imlib_context_get_angle());
+  imlib_context_pop();
 
-      color = argv[1];
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three args is x, y, and color */
+  return r;
+}
 
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+/*
+ * Set the current color (Imlib2::Color).
+ *
+ * Example:
+ *   ctx.color = Imlib2::Color::LIGHTGRAY
+ *
+ */
+static VALUE ctx_set_color(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_set(x, y, c->alpha, c->red, c->green, c->blue);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  set_context_color(val);
+  imlib_context_pop();
 
   return self;
 }
 
-VALUE filter_set_red(int argc, VALUE *argv, VALUE self) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
-  int x, y;
-  VALUE color;
+/*
+ * Get the current color (Imlib2::Color::RgbaColor).
+ *
+ * Example:
+ *   color = ctx.color
+ *
+ */
+static VALUE ctx_color(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE argv[4];
+  int i, r[4];
 
-  switch (argc) {
-    case 2:
-      /* 2 args is an array or hash of x, y, and an RGBAColor */
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_get_color(&(r[0]), &(r[1]), &(r[2]), &(r[3]));
+  imlib_context_pop();
 
-      color = argv[1];
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three args is x, y, and color */
+  for (i = 0; i < 4; i++) 
+    argv[i] = INT2NUM(r[i]);
 
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+  return rgba_color_new(4, argv, cRgbaColor);
+}
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_set_red(x, y, c->alpha, c->red, c->green, c->blue);
+/*
+ * Set the current gradient (Imlib2::Gradient).
+ *
+ * Example:
+ *   ctx.gradient = grad
+ *
+ */
+static VALUE ctx_set_gradient(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+  Imlib_Color_Range *gradient;
+
+  gradient = malloc(sizeof(Imlib_Color_Range));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  Data_Get_Struct(val, Imlib_Color_Range, gradient);
+  imlib_context_set_color_range(*gradient);
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Set the green filter color value and x, y
- * 
- * Example: 
- *   filter.set_green x, y, Imlib2::Color::RgbaColor.new 0, 128, 0, 128
+ * Get the current gradient (Imlib2::Gradient).
+ *
+ * Example:
+ *   grad = ctx.gradient
  *
  */
-VALUE filter_set_green(int argc, VALUE *argv, VALUE self) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
-  int x, y;
-  VALUE color;
+static VALUE ctx_gradient(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  switch (argc) {
-    case 2:
-      /* 2 args is an array or hash of x, y, and an RGBAColor */
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = Data_Wrap_Struct(cGradient, 0, gradient_free, imlib_context_get_color_range());
+  imlib_context_pop();
 
-      color = argv[1];
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three args is x, y, and color */
+  return r;
+}
 
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+/*
+ * Set the progress callback granularity: the percentage of the image
+ * to decode between calls to an Imlib2::Image.load progress block.
+ *
+ * Example:
+ *   ctx.progress_granularity = 10
+ *
+ */
+static VALUE ctx_set_progress_granularity(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_set_green(x, y, c->alpha, c->red, c->green, c->blue);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_progress_granularity(NUM2INT(val));
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Set the blue filter color value and x, y
- * 
- * Example: 
- *   filter.set_blue x, y, Imlib2::Color::RgbaColor.new 0, 0, 64, 128
+ * Get the progress callback granularity (see
+ * Imlib2::Context#progress_granularity=).
+ *
+ * Example:
+ *   granularity = ctx.progress_granularity
  *
  */
-VALUE filter_set_blue(int argc, VALUE *argv, VALUE self) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
-  int x, y;
-  VALUE color;
+static VALUE ctx_progress_granularity(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  switch (argc) {
-    case 2:
-      /* 2 args is an array or hash of x, y, and an RGBAColor */
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = INT2FIX(imlib_context_get_progress_granularity());
+  imlib_context_pop();
 
-      color = argv[1];
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three args is x, y, and color */
+  return r;
+}
 
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+/*
+ * Set the current image (Imlib2::Image).
+ *
+ * Note that this function is not useful at the moment since all image
+ * instance methods blindly blow away the image and color context.  So
+ * you cannot safely mix image context and image instance methods.
+ *
+ * Example:
+ *   ctx.image = image
+ *
+ */
+static VALUE ctx_set_image(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
+  ImStruct *im;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_set_blue(x, y, c->alpha, c->red, c->green, c->blue);
+  im = calloc(1, sizeof(ImStruct));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  imlib_context_push(*ctx);
+  GET_AND_CHECK_IMAGE(val, im);
+  imlib_context_set_image(im->im);
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Set the alpha filter color value and x, y
- * 
- * Example: 
- *   filter.set_alpha x, y, Imlib2::Color::RgbaColor.new 0, 0, 0, 128
+ * Get the current image (Imlib2::Image).
+ *
+ * Note that this function is not useful at the moment since all image
+ * instance methods blindly blow away the image and color context.  So
+ * you cannot safely mix image context and image instance methods.
+ *
+ * Example:
+ *   im = ctx.image
  *
  */
-VALUE filter_set_alpha(int argc, VALUE *argv, VALUE self) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
-  int x, y;
-  VALUE color;
+static VALUE ctx_image(VALUE self) {
+  Imlib_Context *ctx;
+  ImStruct *im;
+  VALUE r = Qnil;
 
-  switch (argc) {
-    case 2:
-      /* 2 args is an array or hash of x, y, and an RGBAColor */
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  im = calloc(1, sizeof(ImStruct));
+  im->im = imlib_context_get_image();
+  r = image_wrap(cImage, im);
+  imlib_context_pop();
 
-      color = argv[1];
-      switch (TYPE(argv[0])) {
-        case T_HASH:
-          x = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("x")));
-          y = NUM2INT(rb_hash_aref(argv[0], rb_str_new2("y")));
-          break;
-        case T_ARRAY:
-          x = NUM2INT(rb_ary_entry(argv[0], 0));
-          y = NUM2INT(rb_ary_entry(argv[0], 1));
-          break;
-        default:
-          rb_raise(rb_eTypeError, "Invalid argument type (not array or hash)");
-      }
-      break;
-    case 3:
-      /* three args is x, y, and color */
+  return r;
+}
 
-      x = NUM2INT(argv[0]);
-      y = NUM2INT(argv[1]);
-      color = argv[2];
-      break;
-    default:
-      rb_raise(rb_eTypeError, "Invalid argument count (not 2 or 3)");
-  }
+/*
+ * Set the cliprect.
+ *
+ * Example:
+ *   ctx.cliprect = [10, 10, 100, 100]
+ *
+ */
+static VALUE ctx_set_cliprect(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_set_alpha(x, y, c->alpha, c->red, c->green, c->blue);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_cliprect(
+    NUM2INT(rb_ary_entry(val, 0)), 
+    NUM2INT(rb_ary_entry(val, 1)), 
+    NUM2INT(rb_ary_entry(val, 2)), 
+    NUM2INT(rb_ary_entry(val, 3))
+  );
+  imlib_context_pop();
 
   return self;
 }
 
 /*
- * Set filter constants.
+ * Get the cliprect.
  *
  * Example:
- *   filter.set_constants RgbaColor.new 32, 32, 32, 32
+ *   x, y, w, h = ctx.cliprect
  *
  */
-VALUE filter_constants(VALUE self, VALUE color) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
+static VALUE ctx_cliprect(VALUE self) {
+  Imlib_Context *ctx;
+  int i, r[4];
+  VALUE ary;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_constants(c->alpha, c->red, c->green, c->blue);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_get_cliprect(&(r[0]), &(r[1]), &(r[2]), &(r[3]));
+  imlib_context_pop();
 
-  return self;
+  ary = rb_ary_new();
+  for (i = 0; i < 4; i++);
+    rb_ary_push(ary, NUM2INT(r[i]));
+
+  return ary;
 }
 
 /*
- * Set filter divisors.
+ * Set the current TrueType Font Encoding.
  *
  * Example:
- *   filter.set_divisors RgbaColor.new 0, 32, 0, 32
+ *   ctx.encoding = Imlib2::Encoding::ISO_8859_5
  *
  */
-VALUE filter_divisors(VALUE self, VALUE color) {
-  Imlib_Filter *f;
-  Imlib_Color *c;
+static VALUE ctx_set_encoding(VALUE self, VALUE val) {
+  Imlib_Context *ctx;
 
-  Data_Get_Struct(self, Imlib_Filter, f);
-  Data_Get_Struct(color, Imlib_Color, c);
-  imlib_context_set_filter(*f);
-  imlib_filter_divisors(c->alpha, c->red, c->green, c->blue);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_TTF_encoding(NUM2INT(val));
+  imlib_context_pop();
 
   return self;
 }
 
-/*********************/
-/* CONTEXT FUNCTIONS */
-/*********************/
-static void ctx_free(void *val) {
-  Imlib_Context *ctx = (Imlib_Context *) val;
+/*
+ * Get the current TrueType Font Encoding.
+ *
+ * Example:
+ *   if ctx.encoding == Imlib2::Encoding::ISO_8859_1
+ *     puts 'using ISO-8859-1 encoding'
+ *   end
+ *
+ */
+static VALUE ctx_encoding(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE r = Qnil;
 
-  imlib_context_free(*ctx);
-  free(ctx);
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  r = INT2FIX(imlib_context_get_TTF_encoding());
+  imlib_context_pop();
+
+  return r;
 }
 
+#ifndef X_DISPLAY_MISSING
+/*************************/
+/* CONTEXT X11 FUNCTIONS */
+/*************************/
 /*
- * Return a new Imlib2::Context.
+ * Set the current X11 Display.
  *
- * Example:
- *   ctx = Imlib2::Context.new
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   context.set_display display
+ *   context.display = display
  *
  */
-VALUE ctx_new(VALUE klass) {
-  VALUE self;
+static VALUE ctx_set_display(VALUE self, VALUE display) {
+  Display *disp;
   Imlib_Context *ctx;
 
-  ctx = malloc(sizeof(Imlib_Context));
-  *ctx = imlib_context_new();
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  Data_Get_Struct(display, Display, disp);
 
-  self = Data_Wrap_Struct(klass, 0, ctx_free, ctx);
-  rb_obj_call_init(self, 0, NULL);
-  
-  return self;
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_display(disp);
+  imlib_context_pop();
+
+  return display;
 }
 
 /*
- * Imlib2::Context constructor.
+ * Get the current X11 Display.
  *
- * Currently just a placeholder
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   display = context.get_display
+ *   display = context.display
  *
  */
-static VALUE ctx_init(VALUE self) {
-  return self;
+static VALUE ctx_display(VALUE self) {
+  Imlib_Context *ctx;
+  VALUE disp;
+
+  Data_Get_Struct(self, Imlib_Context, ctx);
+
+  enter_imlib();
+  imlib_context_push(*ctx);
+  disp = Data_Wrap_Struct(cDisplay, NULL, XFree, imlib_context_get_display());
+  imlib_context_pop();
+
+  return disp;
 }
 
 /*
- * Pop the top context off the context stack.
+ * Set the current X11 Visual.
  *
- * Example:
- *   ctx = Imlib2::Context.pop
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   context.set_visual visual
+ *   context.visual = visual
  *
  */
-VALUE ctx_pop(VALUE klass) {
+static VALUE ctx_set_visual(VALUE self, VALUE visual) {
+  Visual *vis;
   Imlib_Context *ctx;
 
-  ctx = (Imlib_Context *) malloc(sizeof(Imlib_Context));
+  Data_Get_Struct(self, Imlib_Context, ctx);
+  Data_Get_Struct(visual, Visual, vis);
+
+  enter_imlib();
+  imlib_context_push(*ctx);
+  imlib_context_set_visual(vis);
   imlib_context_pop();
-  *ctx = imlib_context_get();
 
-  return Data_Wrap_Struct(klass, 0, ctx_free, ctx);
+  return visual;
 }
 
 /*
- * Return the current context.
+ * Get the current X11 Visual.
  *
- * Example:
- *   ctx = Imlib2::Context.get
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   visual = context.get_visual
+ *   visual = context.visual
  *
  */
-VALUE ctx_get(VALUE klass) {
+static VALUE ctx_visual(VALUE self) {
   Imlib_Context *ctx;
+  VALUE vis;
 
-  ctx = (Imlib_Context *) malloc(sizeof(Imlib_Context));
-  *ctx = imlib_context_get();
+  Data_Get_Struct(self, Imlib_Context, ctx);
 
-  return Data_Wrap_Struct(klass, 0, ctx_free, ctx);
+  enter_imlib();
+  imlib_context_push(*ctx);
+  vis = Data_Wrap_Struct(cVisual, NULL, XFree, imlib_context_get_visual());
+  imlib_context_pop();
+
+  return vis;
 }
 
 /*
- * Push this context onto the context stack.
+ * Set the current X11 Colormap.
  *
- * Example:
- *   ctx.push
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   context.set_colormap colormap
+ *   context.colormap = colormap
  *
  */
-static VALUE ctx_push(VALUE self) {
+static VALUE ctx_set_colormap(VALUE self, VALUE colormap) {
+  Colormap *cmap;
   Imlib_Context *ctx;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  Data_Get_Struct(colormap, Colormap, cmap);
+
+  enter_imlib();
   imlib_context_push(*ctx);
+  imlib_context_set_colormap(*cmap);
+  imlib_context_pop();
 
-  return self;
+  return colormap;
 }
 
 /*
- * Set the dither_mask flag.
+ * Get the current X11 Colormap.
  *
- * Example:
- *   ctx.dither_mask = true
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   colormap = context.get_colormap
+ *   colormap = context.colormap
  *
  */
-static VALUE ctx_set_dither_mask(VALUE self, VALUE val) {
+static VALUE ctx_colormap(VALUE self) {
   Imlib_Context *ctx;
+  Colormap *cmap;
+  VALUE colormap;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  cmap = malloc(sizeof(Colormap));
+
+  enter_imlib();
   imlib_context_push(*ctx);
-  imlib_context_set_dither_mask(val != Qnil && val != Qfalse);
+  *cmap = imlib_context_get_colormap();
+  colormap = Data_Wrap_Struct(cColormap, 0, dont_free, cmap);
   imlib_context_pop();
 
-  return self;
+  return colormap;
 }
 
 /*
- * Get the dither_mask flag.
+ * Set the current X11 Drawable.
  *
- * Example:
- *   if ctx.dither_mask == true
- *     puts 'dither_mask enabled'
- *   end
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   context.set_drawable drawable
+ *   context.drawable = drawable
  *
  */
-static VALUE ctx_dither_mask(VALUE self) {
+static VALUE ctx_set_drawable(VALUE self, VALUE drawable) {
+  Drawable *draw;
   Imlib_Context *ctx;
-  VALUE r = Qfalse;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  Data_Get_Struct(drawable, Drawable, draw);
+
+  enter_imlib();
   imlib_context_push(*ctx);
-  r = imlib_context_get_dither_mask() ? Qtrue : Qfalse;
+  imlib_context_set_drawable(*draw);
   imlib_context_pop();
 
-  return r;
+  return drawable;
 }
 
 /*
- * Set the anti_alias flag.
+ * Get the current X11 Drawable.
  *
- * Example:
- *   ctx.anti_alias = true
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   drawable = context.get_drawable
+ *   drawable = context.drawable
  *
  */
-static VALUE ctx_set_aa(VALUE self, VALUE val) {
+static VALUE ctx_drawable(VALUE self) {
   Imlib_Context *ctx;
+  Drawable *draw;
+  VALUE drawable;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  draw = malloc(sizeof(Drawable));
+
+  enter_imlib();
   imlib_context_push(*ctx);
-  imlib_context_set_anti_alias(val != Qnil && val != Qfalse);
+  *draw = imlib_context_get_drawable();
+  drawable = Data_Wrap_Struct(cDrawable, NULL, dont_free, draw);
   imlib_context_pop();
 
-  return self;
+  return drawable;
 }
 
 /*
- * Get the anti_alias flag.
+ * Set the current X11 Mask.
  *
- * Example:
- *   if ctx.anti_alias == true
- *     puts 'anti_alias enabled.'
- *   end
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
+ *
+ * Examples:
+ *   context.set_mask mask
+ *   context.mask = mask
  *
  */
-static VALUE ctx_aa(VALUE self) {
+static VALUE ctx_set_mask(VALUE self, VALUE mask_o) {
+  Pixmap *mask;
   Imlib_Context *ctx;
-  VALUE r = Qfalse;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  Data_Get_Struct(mask_o, Pixmap, mask);
+
+  enter_imlib();
   imlib_context_push(*ctx);
-  r = imlib_context_get_anti_alias() ? Qtrue : Qfalse;
+  imlib_context_set_mask(*mask);
   imlib_context_pop();
 
-  return r;
+  return mask_o;
 }
 
 /*
- * Set the dither flag.
+ * Get the current X11 Mask.
+ * 
+ * Note: This method is not available unless Imlib2-Ruby was compiled
+ * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
+ * see if X11 support is available.
  *
- * Example:
- *   ctx.dither = true
+ * Examples:
+ *   mask = context.get_mask
+ *   mask = context.mask
  *
  */
-static VALUE ctx_set_dither(VALUE self, VALUE val) {
+static VALUE ctx_mask(VALUE self) {
   Imlib_Context *ctx;
+  Pixmap *pmap;
+  VALUE mask;
 
   Data_Get_Struct(self, Imlib_Context, ctx);
+  pmap = malloc(sizeof(Pixmap));
+
+  enter_imlib();
   imlib_context_push(*ctx);
-  imlib_context_set_dither(val != Qnil && val != Qfalse);
+  *pmap = imlib_context_get_mask();
+  mask = Data_Wrap_Struct(cPixmap, NULL, pmap_free, pmap);
   imlib_context_pop();
 
-  return self;
+  return mask;
+}
+#endif /* !X_DISPLAY_MISSING */
+
+/************************/
+/* SCALE PLAN FUNCTIONS */
+/************************/
+static void scale_plan_free(void *val) {
+  scale_plan_free_tables((ScalePlan*) val);
+  xfree(val);
+}
+
+static size_t scale_plan_memsize(const void *val) {
+  const ScalePlan *p = (const ScalePlan*) val;
+
+  return sizeof(ScalePlan) +
+         sizeof(int) * 2 * ((size_t) p->dst_w + p->dst_h) +
+         sizeof(float) * ((size_t) p->dst_w * p->cx.taps +
+                          (size_t) p->dst_h * p->cy.taps);
+}
+
+static const rb_data_type_t scale_plan_type = {
+  .wrap_struct_name = "Imlib2::ScalePlan",
+  .function = {
+    .dfree = scale_plan_free,
+    .dsize = scale_plan_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static ScalePlan *get_scale_plan(VALUE self) {
+  ScalePlan *p;
+
+  TypedData_Get_Struct(self, ScalePlan, &scale_plan_type, p);
+  return p;
 }
 
 /*
- * Get the dither flag.
+ * Returns a new Imlib2::ScalePlan for scaling src_w x src_h images to
+ * dst_w x dst_h with the given filter (see Imlib2::Image#crop_scaled
+ * for the list; defaults to :lanczos3).
  *
- * Example:
- *   if ctx.dither
- *     puts 'dither enabled.'
- *   end
+ * The filter weights are computed once, here, so a plan can be applied
+ * to any number of images of the same size without any per-image
+ * setup.  Plans are read-only once created, so threads may share one.
+ *
+ * Examples:
+ *   plan = Imlib2::ScalePlan.new 1600, 1200, 400, 300, filter: :mitchell
+ *   thumbs = photos.map { |photo| plan.apply photo }
  *
  */
-static VALUE ctx_dither(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qfalse;
+static VALUE scale_plan_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE src_w, src_h, dst_w, dst_h, opts, filter = Qnil, self;
+  const ResampleFilter *f = &resample_filters[3];
+  ScalePlan *p;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = imlib_context_get_dither() ? Qtrue : Qfalse;
-  imlib_context_pop();
+  rb_scan_args(argc, argv, "4:", &src_w, &src_h, &dst_w, &dst_h, &opts);
+  filter = hash_opt(opts, KEY_FILTER);
+  if (!NIL_P(filter))
+    f = resample_filter_get(filter);
 
-  return r;
+  /* zeroed, so a failed init leaves nothing for the free function */
+  self = TypedData_Make_Struct(klass, ScalePlan, &scale_plan_type, p);
+  scale_plan_init(p, f, NUM2INT(src_w), NUM2INT(src_h),
+                  0, 0, NUM2INT(src_w), NUM2INT(src_h),
+                  NUM2INT(dst_w), NUM2INT(dst_h));
+
+  rb_obj_call_init(self, argc, argv);
+  return self;
 }
 
 /*
- * Set the blend flag.
+ * Constructor for Imlib2::ScalePlan
  *
- * Example:
- *   ctx.blend = true
+ * Currently just a placeholder.
  *
  */
-static VALUE ctx_set_blend(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_blend(val != Qnil && val != Qfalse);
-  imlib_context_pop();
-
+static VALUE scale_plan_init_m(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
   return self;
 }
 
 /*
- * Get the blend flag.
+ * Scale an image with the plan, returning a new Imlib2::Image.  Raises
+ * ArgumentError if the image isn't the size the plan was built for.
  *
- * Example:
- *   if ctx.blend
- *     puts 'blend enabled.'
- *   end
+ * Examples:
+ *   thumb = plan.apply image
+ *   thumb = plan.call image
  *
  */
-static VALUE ctx_blend(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qfalse;
+static VALUE scale_plan_apply(VALUE self, VALUE image) {
+  ScalePlan *p = get_scale_plan(self);
+  ImStruct *im, *new_im;
+  Imlib_Image dst;
+  int w, h;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = imlib_context_get_blend() ? Qtrue : Qfalse;
-  imlib_context_pop();
+  GET_AND_CHECK_IMAGE(image, im);
+  imlib_context_set_image(im->im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  if (w != p->src_w || h != p->src_h)
+    rb_raise(rb_eArgError, "image is %dx%d, plan is for %dx%d",
+             w, h, p->src_w, p->src_h);
 
-  return r;
+  dst = resample_run(im->im, im, p);
+  RB_GC_GUARD(image);
+  RB_GC_GUARD(self);
+  if (!dst)
+    rb_raise(rb_eNoMemError, "couldn't create image");
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = dst;
+  return image_wrap(cImage, new_im);
 }
 
 /*
- * Set the current color modifier (Imlib2::ColorModifier).
+ * Size of the images the plan applies to, as [width, height].
  *
  * Example:
- *   ctx.cmod = cmod
+ *   w, h = plan.src_size
  *
  */
-static VALUE ctx_set_cmod(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-  Imlib_Color_Modifier *cmod;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  Data_Get_Struct(val, Imlib_Color_Modifier, cmod);
-  imlib_context_set_color_modifier(*cmod);
-  imlib_context_pop();
-
-  return self;
+static VALUE scale_plan_src_size(VALUE self) {
+  ScalePlan *p = get_scale_plan(self);
+  return rb_ary_new3(2, INT2FIX(p->src_w), INT2FIX(p->src_h));
 }
 
 /*
- * Get the current color modifier (Imlib2::ColorModifier).
+ * Size of the images the plan produces, as [width, height].
  *
  * Example:
- *   cmod = ctx.cmod
+ *   w, h = plan.dst_size
  *
  */
-static VALUE ctx_cmod(VALUE self) {
-  Imlib_Context *ctx;
-  Imlib_Color_Modifier *cmod;
-
-  cmod = malloc(sizeof(Imlib_Color_Modifier));
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  *cmod = imlib_context_get_color_modifier();
-  imlib_context_pop();
-
-  return Data_Wrap_Struct(cColorMod, 0, cmod_free, cmod);
+static VALUE scale_plan_dst_size(VALUE self) {
+  ScalePlan *p = get_scale_plan(self);
+  return rb_ary_new3(2, INT2FIX(p->dst_w), INT2FIX(p->dst_h));
 }
 
 /*
- * Set the current operation (Imlib2::Op or Imlib2::Operation).
+ * Name of the plan's resampling filter, as a Symbol.
  *
  * Example:
- *   ctx.operation = Imlib2::Op::COPY
+ *   plan.filter # => :lanczos3
  *
  */
-static VALUE ctx_set_op(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
+static VALUE scale_plan_filter(VALUE self) {
+  return ID2SYM(rb_intern(get_scale_plan(self)->filter->name));
+}
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_operation(NUM2INT(val));
-  imlib_context_pop();
+/**********************/
+/* PIPELINE FUNCTIONS */
+/**********************/
+enum {
+  PIPE_CROP,
+  PIPE_SCALE,
+  PIPE_FLIP_H,
+  PIPE_FLIP_V,
+  PIPE_BLUR,
+  PIPE_SHARPEN,
+  PIPE_CMOD,
+  PIPE_FILTER
+};
 
-  return self;
+typedef struct {
+  int                   op,
+                        x, y, w, h,   /* crop, scale: region */
+                        dw, dh,       /* scale */
+                        radius;       /* blur, sharpen */
+  const ResampleFilter *filter;       /* scale */
+  VALUE                 obj;          /* cmod, filter */
+} PipeOp;
+
+typedef struct {
+  VALUE                 image;        /* nil for Imlib2.stream */
+  const ResampleFilter *filter;       /* for scales without one */
+  int                   src_w, src_h, /* size of the image */
+                        w, h;         /* size of the output so far */
+  PipeOp               *ops;
+  int                   num_ops,
+                        max_ops;
+} Pipeline;
+
+static void pipeline_mark(void *val) {
+  Pipeline *pl = (Pipeline*) val;
+  int i;
+
+  rb_gc_mark(pl->image);
+  for (i = 0; i < pl->num_ops; i++)
+    rb_gc_mark(pl->ops[i].obj);
+}
+
+static void pipeline_free(void *val) {
+  Pipeline *pl = (Pipeline*) val;
+
+  xfree(pl->ops);
+  xfree(pl);
+}
+
+static size_t pipeline_memsize(const void *val) {
+  const Pipeline *pl = (const Pipeline*) val;
+
+  return sizeof(Pipeline) + sizeof(PipeOp) * pl->max_ops;
+}
+
+static const rb_data_type_t pipeline_type = {
+  .wrap_struct_name = "Imlib2::Pipeline",
+  .function = {
+    .dmark = pipeline_mark,
+    .dfree = pipeline_free,
+    .dsize = pipeline_memsize,
+  },
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static Pipeline *get_pipeline(VALUE self) {
+  Pipeline *pl;
+
+  TypedData_Get_Struct(self, Pipeline, &pipeline_type, pl);
+  return pl;
+}
+
+/* add an operation to the end of a pipeline */
+static PipeOp *pipeline_push(Pipeline *pl, int op) {
+  PipeOp *o;
+
+  if (pl->num_ops == pl->max_ops) {
+    pl->max_ops = pl->max_ops ? pl->max_ops * 2 : 8;
+    REALLOC_N(pl->ops, PipeOp, pl->max_ops);
+  }
+
+  o = &pl->ops[pl->num_ops];
+  memset(o, 0, sizeof(PipeOp));
+  o->op = op;
+  o->obj = Qnil;
+  pl->num_ops++;
+
+  return o;
+}
+
+/* add a stage after the last one, reading from it */
+static PipeStage *pipe_add_stage(PipeStage *st, int *num_stages, int kind,
+                                 int w, int h) {
+  PipeStage *s = &st[*num_stages];
+
+  s->kind = kind;
+  s->w = w;
+  s->h = h;
+  s->src = &st[*num_stages - 1];
+  s->has_alpha = s->src->has_alpha;
+  (*num_stages)++;
+
+  return s;
 }
 
 /*
- * Get the current operation (Imlib2::Op or Imlib2::Operation).
- *
- * Example:
- *   if ctx.op == Imlib2::Op::COPY
- *     puts 'copy operation'
- *   end
- *
+ * Make the pending crop win (x, y, w, h, relative to the last stage)
+ * the output of the last stage: by narrowing it if it's the source or
+ * a window, and with a window stage otherwise.
  */
-static VALUE ctx_op(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
+static void pipe_apply_window(PipeStage *st, int *num_stages, int *win) {
+  PipeStage *s = &st[*num_stages - 1];
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = INT2FIX(imlib_context_get_operation());
-  imlib_context_pop();
+  if (!win[0] && !win[1] && win[2] == s->w && win[3] == s->h)
+    return;
 
-  return r;
+  if (s->kind != STAGE_SOURCE && s->kind != STAGE_WINDOW)
+    s = pipe_add_stage(st, num_stages, STAGE_WINDOW, s->w, s->h);
+  s->x += win[0];
+  s->y += win[1];
+  s->w = win[2];
+  s->h = win[3];
+  win[0] = win[1] = 0;
+}
+
+/* what a compiled pipeline needs, with room for every op */
+typedef struct {
+  PipeStage   *stages;  /* 2 * num_ops + 2 */
+  ScalePlan   *plans;   /* one per op */
+  Convolution *convs;   /* one per op */
+  DATA8       *tables;  /* 1024 bytes per op */
+  int          num_ops;
+} PipeBuild;
+
+static void pipe_build_alloc(PipeBuild *b, int num_ops) {
+  b->num_ops = num_ops;
+  b->stages = ALLOC_N(PipeStage, 2 * num_ops + 2);
+  MEMZERO(b->stages, PipeStage, 2 * num_ops + 2);
+  b->plans = ALLOC_N(ScalePlan, num_ops + 1);
+  MEMZERO(b->plans, ScalePlan, num_ops + 1);
+  b->convs = ALLOC_N(Convolution, num_ops + 1);
+  MEMZERO(b->convs, Convolution, num_ops + 1);
+  b->tables = ALLOC_N(DATA8, 1024 * (num_ops + 1));
+}
+
+static void pipe_build_free(PipeBuild *b) {
+  int i;
+
+  for (i = 0; i < b->num_ops; i++) {
+    scale_plan_free_tables(&b->plans[i]);
+    conv_free(&b->convs[i]);
+  }
+  xfree(b->stages);
+  xfree(b->plans);
+  xfree(b->convs);
+  xfree(b->tables);
+}
+
+/*
+ * Compile the operations of a pipeline into b, after the source stage
+ * (b->stages[0]), which the caller fills in.  Must be called after
+ * enter_imlib().
+ */
+static void pipe_compile(const Pipeline *pl, PipeRun *run, PipeBuild *b) {
+  PipeStage *st = b->stages, *s = st;
+  int win[4] = { 0, 0, s->w, s->h },
+      num_stages = 1, flip_x = 0, flip_y = 0, i;
+
+  for (i = 0; i < pl->num_ops; i++) {
+    const PipeOp *o = &pl->ops[i];
+    /* flips are done last, so mirror regions through them instead */
+    int x = flip_x ? win[2] - o->x - o->w : o->x,
+        y = flip_y ? win[3] - o->y - o->h : o->y,
+        r = o->radius;
+
+    switch (o->op) {
+      case PIPE_CROP:
+        win[0] += x;
+        win[1] += y;
+        win[2] = o->w;
+        win[3] = o->h;
+        break;
+      case PIPE_FLIP_H:
+        flip_x = !flip_x;
+        break;
+      case PIPE_FLIP_V:
+        flip_y = !flip_y;
+        break;
+      case PIPE_SCALE:
+        /* the crop can be folded into the scale, unless the scale
+         * reaches outside of it */
+        if (x < 0 || y < 0 || x + o->w > win[2] || y + o->h > win[3])
+          pipe_apply_window(st, &num_stages, win);
+        s = &st[num_stages - 1];
+        scale_plan_init(&b->plans[i], o->filter, s->w, s->h,
+                        win[0] + x, win[1] + y, o->w, o->h, o->dw, o->dh);
+        s = pipe_add_stage(st, &num_stages, STAGE_SCALE, o->dw, o->dh);
+        s->plan = &b->plans[i];
+        win[0] = win[1] = 0;
+        win[2] = o->dw;
+        win[3] = o->dh;
+        break;
+      case PIPE_BLUR:
+        pipe_apply_window(st, &num_stages, win);
+        s = &st[num_stages - 1];
+        /* like blur_image(), a box as wide as the image is a no-op */
+        if (r < 1 || r >= s->w / 2)
+          break;
+        s = pipe_add_stage(st, &num_stages, STAGE_BLUR, s->w, s->h);
+        s->radius = r;
+        break;
+      case PIPE_SHARPEN:
+        pipe_apply_window(st, &num_stages, win);
+        s = &st[num_stages - 1];
+        if (r == 0)
+          break;
+        s = pipe_add_stage(st, &num_stages, STAGE_SHARPEN, s->w, s->h);
+        break;
+      case PIPE_CMOD: {
+        Imlib_Color_Modifier *cmod;
+        DATA8 *t = b->tables + 1024 * i;
+
+        pipe_apply_window(st, &num_stages, win);
+        s = &st[num_stages - 1];
+        TypedData_Get_Struct(o->obj, Imlib_Color_Modifier, &cmod_type, cmod);
+        imlib_context_set_color_modifier(*cmod);
+        imlib_get_color_modifier_tables(t, t + 256, t + 512, t + 768);
+
+        s = pipe_add_stage(st, &num_stages, STAGE_CMOD, s->w, s->h);
+        s->tables = t;
+        /* like imlib_apply_color_modifier(), this may add alpha */
+        s->has_alpha = s->has_alpha || t[768 + 255] != 255;
+        break;
+      }
+      case PIPE_FILTER: {
+        FilterStruct *f;
+        Convolution *cv = &b->convs[i];
+        int c, any = 0, min_y = 0, max_y = 0;
+
+        pipe_apply_window(st, &num_stages, win);
+        s = &st[num_stages - 1];
+        TypedData_Get_Struct(o->obj, FilterStruct, &filter_type, f);
+        conv_compile(cv, f, s->w);
+        for (c = 0; c < 4; c++)
+          if (cv->ch[c].taps) {
+            any = 1;
+            if (cv->ch[c].min_y < min_y) min_y = cv->ch[c].min_y;
+            if (cv->ch[c].max_y > max_y) max_y = cv->ch[c].max_y;
+          }
+        if (!any)
+          break;
+
+        s = pipe_add_stage(st, &num_stages, STAGE_FILTER, s->w, s->h);
+        s->conv = cv;
+        s->min_y = min_y;
+        s->max_y = max_y;
+        break;
+      }
+    }
+  }
+  pipe_apply_window(st, &num_stages, win);
+
+  /* each stage keeps as many rows as the stage after it reads at once */
+  st[num_stages - 1].keep = 1;
+  for (i = num_stages - 1; i > 0; i--) {
+    int keep = 1;
+
+    s = &st[i];
+    if (s->kind == STAGE_BLUR)
+      keep = 2 * s->radius + 2;
+    else if (s->kind == STAGE_SHARPEN)
+      keep = 3;
+    else if (s->kind == STAGE_FILTER)
+      keep = s->max_y - s->min_y + 1;
+    else if (s->kind == STAGE_WINDOW)
+      keep = s->keep;
+    s->src->keep = keep < s->src->h ? keep : s->src->h;
+  }
+
+  run->stages = st;
+  run->num_stages = num_stages;
+  run->w = st[num_stages - 1].w;
+  run->h = st[num_stages - 1].h;
+  run->flip_x = flip_x;
+  run->flip_y = flip_y;
+  run->dst = NULL;
+  run->failed = 0;
+}
+
+typedef struct {
+  const Pipeline *pl;
+  PipeRun        *run;
+  PipeBuild      *b;
+} PipeCompile;
+
+static VALUE pipe_compile_body(VALUE data) {
+  PipeCompile *c = (PipeCompile*) data;
+
+  pipe_compile(c->pl, c->run, c->b);
+  return Qnil;
 }
 
 /*
- * Set the current font (Imlib2::Font).
- *
- * Example:
- *   ctx.font = Imlib2::Font.new 'helvetica/12'
- *
+ * pipe_compile(), freeing b before re-raising if it raises (eg for a
+ * scale that reaches outside of its input).
  */
-static VALUE ctx_set_font(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-  Imlib_Font *font;
+static void pipe_compile_or_free(const Pipeline *pl, PipeRun *run,
+                                 PipeBuild *b) {
+  PipeCompile c;
+  int state = 0;
 
-  font = malloc(sizeof(Imlib_Font));
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  Data_Get_Struct(val, Imlib_Font, font);
-  imlib_context_set_font(*font);
-  imlib_context_pop();
+  c.pl = pl;
+  c.run = run;
+  c.b = b;
+  rb_protect(pipe_compile_body, (VALUE) &c, &state);
+  if (state) {
+    pipe_build_free(b);
+    rb_jump_tag(state);
+  }
+}
+
+/* a pipeline for a w x h image (or nil, for Imlib2.stream) */
+static VALUE pipeline_alloc(VALUE klass, VALUE image, int w, int h,
+                            VALUE filter) {
+  Pipeline *pl;
+  VALUE self;
+
+  self = TypedData_Make_Struct(klass, Pipeline, &pipeline_type, pl);
+  pl->image = image;
+  pl->filter = NIL_P(filter) ? &resample_filters[3]
+                             : resample_filter_get(filter);
+  pl->src_w = pl->w = w;
+  pl->src_h = pl->h = h;
 
   return self;
 }
 
+static VALUE pipeline_make(VALUE klass, VALUE image, VALUE filter) {
+  ImStruct *im;
+
+  GET_AND_CHECK_IMAGE(image, im);
+  imlib_context_set_image(im->im);
+  return pipeline_alloc(klass, image, imlib_image_get_width(),
+                        imlib_image_get_height(), filter);
+}
+
 /*
- * Get the current font (Imlib2::Font).
+ * Returns a new Imlib2::Pipeline for image.
  *
- * Example:
- *   font = ctx.font
+ * A pipeline records crop, scale, flip, blur, sharpen and color modifier
+ * operations without running them.  Pipeline#render (or #save) then
+ * runs them all in one pass over the image, a few rows at a time, so no
+ * intermediate images are made: crops cost nothing, flips happen as the
+ * result is written, and each stage only holds the rows the next one
+ * needs.  The pass runs outside of the GVL (when Imlib2::release_gvl is
+ * set) and is split across Imlib2::threads threads.
+ *
+ * Scales use the Image#crop_scaled resampling filters, not Imlib2's own
+ * scaler; the optional filter is the default for the pipeline's scales
+ * (:lanczos3 if it's not given).  The result is the same as running the
+ * operations one at a time, except that a scale after a flip may round
+ * a few pixels differently.
+ *
+ * Examples:
+ *   thumb = Imlib2::Pipeline.new(photo).
+ *             crop(100, 100, 800, 600).
+ *             scale(200, 150).
+ *             sharpen(1).
+ *             render
+ *
+ *   Imlib2::Pipeline.new(photo, filter: :mitchell).
+ *     scale(640, 480).
+ *     flip_horizontal.
+ *     save 'mirrored.jpg'
  *
  */
-static VALUE ctx_font(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
+static VALUE pipeline_new(int argc, VALUE *argv, VALUE klass) {
+  VALUE image, opts, self;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = Data_Wrap_Struct(cFont, 0, font_free, imlib_context_get_font());
-  imlib_context_pop();
+  rb_scan_args(argc, argv, "1:", &image, &opts);
+  self = pipeline_make(klass, image, hash_opt(opts, KEY_FILTER));
 
-  return r;
+  rb_obj_call_init(self, argc, argv);
+  return self;
 }
 
 /*
- * Set the current font direction (Imlib2::Dir or Imlib2::Direction).
+ * Constructor for Imlib2::Pipeline
  *
- * Example:
- *   ctx.direction = Imlib2::Direction::LEFT
+ * Currently just a placeholder.
  *
  */
-static VALUE ctx_set_dir(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_direction(NUM2INT(val));
-  imlib_context_pop();
-
+static VALUE pipeline_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
   return self;
 }
 
 /*
- * Get the current font direction (Imlib2::Dir or Imlib2::Direction).
+ * Returns a new Imlib2::Pipeline for the image, which records operations
+ * and runs them in one fused pass when it's rendered (see
+ * Imlib2::Pipeline.new).
  *
- * Example:
- *   if ctx.direction != Imlib2::Direction::RIGHT
- *     puts 'drawing funny text'
- *   end
+ * Examples:
+ *   thumb = image.lazy.crop(0, 0, 512, 512).scale(128, 128).render
+ *
+ *   image.lazy(filter: :mitchell).scale(64, 64).blur(1).save 'icon.png'
  *
  */
-static VALUE ctx_dir(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = INT2FIX(imlib_context_get_direction());
-  imlib_context_pop();
+static VALUE image_lazy(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
 
-  return r;
+  rb_scan_args(argc, argv, "0:", &opts);
+  return pipeline_make(cPipeline, self, hash_opt(opts, KEY_FILTER));
 }
 
 /*
- * Set the text drawing angle.
+ * Crop the output so far to the region x, y, w, h, which must be inside
+ * of it.  Returns the pipeline.
  *
- * Example:
- *   ctx.angle = 76.8
+ * Examples:
+ *   pipeline.crop 10, 10, 100, 100
+ *   pipeline.crop [10, 10, 100, 100]
+ *   pipeline.crop x: 10, y: 10, w: 100, h: 100
  *
  */
-static VALUE ctx_set_angle(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
+static VALUE pipeline_crop(int argc, VALUE *argv, VALUE self) {
+  Pipeline *pl = get_pipeline(self);
+  PipeOp *o;
+  int x, y, w, h;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_angle(NUM2DBL(val));
-  imlib_context_pop();
+  get_region(argc, argv, pl->w, pl->h, &x, &y, &w, &h);
+  if (w <= 0 || h <= 0)
+    rb_raise(rb_eArgError, "invalid size");
+
+  o = pipeline_push(pl, PIPE_CROP);
+  o->x = x;
+  o->y = y;
+  o->w = pl->w = w;
+  o->h = pl->h = h;
 
   return self;
 }
 
-/*
- * Get the text drawing angle.
- *
- * Example:
- *   if ctx.dir == Imlib2::Direction::ANGLE
- *     puts 'the current font angle is ' << ctx.angle
- *   end
- *
- */
-static VALUE ctx_angle(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
+/* add a scale of the region x, y, w, h of the output so far to dw, dh */
+static void pipeline_push_scale(Pipeline *pl, const ResampleFilter *f,
+                                int x, int y, int w, int h, int dw, int dh) {
+  PipeOp *o;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = rb_float_new(imlib_context_get_angle());
-  imlib_context_pop();
+  if (w <= 0 || h <= 0 || dw <= 0 || dh <= 0)
+    rb_raise(rb_eArgError, "invalid size");
+  if (x >= pl->w || y >= pl->h || x + w <= 0 || y + h <= 0)
+    rb_raise(rb_eArgError, "crop region is outside of the image");
 
-  return r;
+  o = pipeline_push(pl, PIPE_SCALE);
+  o->filter = f ? f : pl->filter;
+  o->x = x;
+  o->y = y;
+  o->w = w;
+  o->h = h;
+  o->dw = pl->w = dw;
+  o->dh = pl->h = dh;
 }
 
 /*
- * Set the current color (Imlib2::Color).
+ * Crop the region x, y, w, h out of the output so far and scale it to
+ * dw x dh, as Imlib2::Image#crop_scaled does with a filter.  The region
+ * may reach outside of the output; only the part inside is sampled.
+ * Returns the pipeline.
  *
- * Example:
- *   ctx.color = Imlib2::Color::LIGHTGRAY
+ * Examples:
+ *   pipeline.crop_scaled 10, 10, 200, 200, 50, 50
+ *   pipeline.crop_scaled [10, 10, 200, 200, 50, 50]
+ *   pipeline.crop_scaled 0, 0, 640, 480, 64, 48, filter: :box
  *
  */
-static VALUE ctx_set_color(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
+static VALUE pipeline_crop_scaled(int argc, VALUE *argv, VALUE self) {
+  Pipeline *pl = get_pipeline(self);
+  const ResampleFilter *filter;
+  int v[6], i;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  set_context_color(val);
-  imlib_context_pop();
+  filter = resample_filter_opt(&argc, argv);
+
+  switch (argc) {
+    case 1:
+      switch (TYPE(argv[0])) {
+        case T_HASH:
+          v[0] = NUM2INT(hash_arg(argv[0], KEY_X));
+          v[1] = NUM2INT(hash_arg(argv[0], KEY_Y));
+          v[2] = NUM2INT(hash_arg(argv[0], KEY_W));
+          v[3] = NUM2INT(hash_arg(argv[0], KEY_H));
+          v[4] = NUM2INT(hash_arg(argv[0], KEY_DW));
+          v[5] = NUM2INT(hash_arg(argv[0], KEY_DH));
+          break;
+        case T_ARRAY:
+          for (i = 0; i < 6; i++)
+            v[i] = NUM2INT(rb_ary_entry(argv[0], i));
+          break;
+        default:
+          rb_raise(rb_eTypeError,"Invalid argument type (not array or hash)");
+      }
+      break;
+    case 6:
+      for (i = 0; i < 6; i++)
+        v[i] = NUM2INT(argv[i]);
+      break;
+    default:
+      rb_raise(rb_eTypeError,"Invalid argument count (not 1 or 6)");
+  }
 
+  pipeline_push_scale(pl, filter, v[0], v[1], v[2], v[3], v[4], v[5]);
   return self;
 }
 
 /*
- * Get the current color (Imlib2::Color::RgbaColor).
+ * Scale the output so far to w x h.  Returns the pipeline.
  *
- * Example:
- *   color = ctx.color
+ * Examples:
+ *   pipeline.scale 320, 240
+ *   pipeline.scale 320, 240, filter: :bilinear
  *
  */
-static VALUE ctx_color(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE argv[4];
-  int i, r[4];
+static VALUE pipeline_scale(int argc, VALUE *argv, VALUE self) {
+  Pipeline *pl = get_pipeline(self);
+  VALUE w, h, opts, filter;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_get_color(&(r[0]), &(r[1]), &(r[2]), &(r[3]));
-  imlib_context_pop();
+  rb_scan_args(argc, argv, "2:", &w, &h, &opts);
+  filter = hash_opt(opts, KEY_FILTER);
+  pipeline_push_scale(pl, NIL_P(filter) ? NULL : resample_filter_get(filter),
+                      0, 0, pl->w, pl->h, NUM2INT(w), NUM2INT(h));
 
-  for (i = 0; i < 4; i++) 
-    argv[i] = INT2NUM(r[i]);
-
-  return rgba_color_new(4, argv, cRgbaColor);
+  return self;
 }
 
 /*
- * Set the current gradient (Imlib2::Gradient).
+ * Flip the output so far horizontally.  Returns the pipeline.
  *
- * Example:
- *   ctx.gradient = grad
+ * Examples:
+ *   pipeline.flip_horizontal
  *
  */
-static VALUE ctx_set_gradient(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-  Imlib_Color_Range *gradient;
-
-  gradient = malloc(sizeof(Imlib_Color_Range));
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  Data_Get_Struct(val, Imlib_Color_Range, gradient);
-  imlib_context_set_color_range(*gradient);
-  imlib_context_pop();
-
+static VALUE pipeline_flip_horizontal(VALUE self) {
+  pipeline_push(get_pipeline(self), PIPE_FLIP_H);
   return self;
 }
 
 /*
- * Get the current gradient (Imlib2::Gradient).
+ * Flip the output so far vertically.  Returns the pipeline.
  *
- * Example:
- *   grad = ctx.gradient
+ * Examples:
+ *   pipeline.flip_vertical
  *
  */
-static VALUE ctx_gradient(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = Data_Wrap_Struct(cGradient, 0, gradient_free, imlib_context_get_color_range());
-  imlib_context_pop();
-
-  return r;
+static VALUE pipeline_flip_vertical(VALUE self) {
+  pipeline_push(get_pipeline(self), PIPE_FLIP_V);
+  return self;
 }
 
 /*
- * Set the progress callback granularity.
- *
- * This function is not useful at the moment since you cannot specify
- * progress callbacks from within ruby (this is a TODO item).
+ * Blur the output so far, as Imlib2::Image#blur does.  Returns the
+ * pipeline.
  *
- * Example:
- *   ctx.progress_granularity = 10
+ * Examples:
+ *   radius = 2 # radius of blur, in pixels
+ *   pipeline.blur radius
  *
  */
-static VALUE ctx_set_progress_granularity(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_progress_granularity(NUM2INT(val));
-  imlib_context_pop();
-
+static VALUE pipeline_blur(VALUE self, VALUE radius) {
+  pipeline_push(get_pipeline(self), PIPE_BLUR)->radius = NUM2INT(radius);
   return self;
 }
 
 /*
- * Get the progress callback granularity.
- *
- * This function is not useful at the moment since you cannot specify
- * progress callbacks from within Ruby (this is a TODO item).
+ * Sharpen the output so far, as Imlib2::Image#sharpen does.  Returns the
+ * pipeline.
  *
- * Example:
- *   granularity = ctx.progress_granularity
+ * Examples:
+ *   pipeline.sharpen 1
  *
  */
-static VALUE ctx_progress_granularity(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = INT2FIX(imlib_context_get_progress_granularity());
-  imlib_context_pop();
-
-  return r;
+static VALUE pipeline_sharpen(VALUE self, VALUE radius) {
+  pipeline_push(get_pipeline(self), PIPE_SHARPEN)->radius = NUM2INT(radius);
+  return self;
 }
 
 /*
- * Set the current image (Imlib2::Image).
- *
- * Note that this function is not useful at the moment since all image
- * instance methods blindly blow away the image and color context.  So
- * you cannot safely mix image context and image instance methods.
+ * Apply an Imlib2::ColorModifier to the output so far.  The modifier's
+ * tables are read when the pipeline is rendered.  Returns the pipeline.
  *
- * Example:
- *   ctx.image = image
+ * Examples:
+ *   cmod = Imlib2::ColorModifier.new
+ *   cmod.gamma = 0.8
+ *   pipeline.apply_cmod cmod
  *
  */
-static VALUE ctx_set_image(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-  ImStruct *im;
+static VALUE pipeline_apply_cmod(VALUE self, VALUE cmod) {
+  Pipeline *pl = get_pipeline(self);
 
-  im = malloc(sizeof(ImStruct));
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  GET_AND_CHECK_IMAGE(val, im);
-  imlib_context_set_image(im->im);
-  imlib_context_pop();
+  rb_check_typeddata(cmod, &cmod_type);
+  pipeline_push(pl, PIPE_CMOD)->obj = cmod;
 
   return self;
 }
 
 /*
- * Get the current image (Imlib2::Image).
- *
- * Note that this function is not useful at the moment since all image
- * instance methods blindly blow away the image and color context.  So
- * you cannot safely mix image context and image instance methods.
+ * Apply an Imlib2::Filter (a static filter) to the output so far, as
+ * Imlib2::Image#static_filter does.  The filter is read when the
+ * pipeline is rendered.  Returns the pipeline.
  *
- * Example:
- *   im = ctx.image
+ * Examples:
+ *   filter = Imlib2::Filter.new 20
+ *   filter.set 2, 2, Imlib2::Color::GREEN
+ *   pipeline.filter filter
  *
  */
-static VALUE ctx_image(VALUE self) {
-  Imlib_Context *ctx;
-  ImStruct *im;
-  VALUE r = Qnil;
+static VALUE pipeline_filter(VALUE self, VALUE filter) {
+  Pipeline *pl = get_pipeline(self);
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  im = malloc(sizeof(ImStruct));
-  im->im = imlib_context_get_image();
-  r = Data_Wrap_Struct(cImage, 0, im_struct_free, im);
-  imlib_context_pop();
+  rb_check_typeddata(filter, &filter_type);
+  pipeline_push(pl, PIPE_FILTER)->obj = filter;
 
-  return r;
+  return self;
 }
 
 /*
- * Set the cliprect.
+ * Width of the image the pipeline will render.
  *
- * Example:
- *   ctx.cliprect = [10, 10, 100, 100]
+ * Examples:
+ *   w = pipeline.width
+ *   w = pipeline.w
  *
  */
-static VALUE ctx_set_cliprect(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_cliprect(
-    NUM2INT(rb_ary_entry(val, 0)), 
-    NUM2INT(rb_ary_entry(val, 1)), 
-    NUM2INT(rb_ary_entry(val, 2)), 
-    NUM2INT(rb_ary_entry(val, 3))
-  );
-  imlib_context_pop();
-
-  return self;
+static VALUE pipeline_width(VALUE self) {
+  return INT2FIX(get_pipeline(self)->w);
 }
 
 /*
- * Get the cliprect.
+ * Height of the image the pipeline will render.
  *
- * Example:
- *   x, y, w, h = ctx.cliprect
+ * Examples:
+ *   h = pipeline.height
+ *   h = pipeline.h
  *
  */
-static VALUE ctx_cliprect(VALUE self) {
-  Imlib_Context *ctx;
-  int i, r[4];
-  VALUE ary;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_get_cliprect(&(r[0]), &(r[1]), &(r[2]), &(r[3]));
-  imlib_context_pop();
-
-  ary = rb_ary_new();
-  for (i = 0; i < 4; i++);
-    rb_ary_push(ary, NUM2INT(r[i]));
-
-  return ary;
+static VALUE pipeline_height(VALUE self) {
+  return INT2FIX(get_pipeline(self)->h);
 }
 
 /*
- * Set the current TrueType Font Encoding.
+ * The image the pipeline reads from.
  *
  * Example:
- *   ctx.encoding = Imlib2::Encoding::ISO_8859_5
+ *   src = pipeline.image
  *
  */
-static VALUE ctx_set_encoding(VALUE self, VALUE val) {
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  imlib_context_set_TTF_encoding(NUM2INT(val));
-  imlib_context_pop();
-
-  return self;
+static VALUE pipeline_image(VALUE self) {
+  return get_pipeline(self)->image;
 }
 
 /*
- * Get the current TrueType Font Encoding.
+ * Run the pipeline, returning the result as a new Imlib2::Image.  The
+ * image isn't changed, so a pipeline can be rendered any number of
+ * times; raises ArgumentError if the image has changed size since the
+ * pipeline was made.
  *
- * Example:
- *   if ctx.encoding == Imlib2::Encoding::ISO_8859_1
- *     puts 'using ISO-8859-1 encoding'
- *   end
+ * Examples:
+ *   thumb = image.lazy.scale(160, 120).sharpen(1).render
  *
  */
-static VALUE ctx_encoding(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE r = Qnil;
+static VALUE pipeline_render(VALUE self) {
+  Pipeline *pl = get_pipeline(self);
+  ImStruct *im, *new_im;
+  PipeBuild b;
+  PipeRun run;
+  Imlib_Image dst = NULL;
+  int w, h, max_bands;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  imlib_context_push(*ctx);
-  r = INT2FIX(imlib_context_get_TTF_encoding());
-  imlib_context_pop();
+  if (NIL_P(pl->image))
+    rb_raise(rb_eArgError, "pipeline has no image (see Imlib2.stream)");
 
-  return r;
+  GET_AND_CHECK_IMAGE(pl->image, im);
+  imlib_context_set_image(im->im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  if (w != pl->src_w || h != pl->src_h)
+    rb_raise(rb_eArgError, "image is %dx%d, pipeline is for %dx%d",
+             w, h, pl->src_w, pl->src_h);
+
+  pipe_build_alloc(&b, pl->num_ops);
+  b.stages[0].kind = STAGE_SOURCE;
+  b.stages[0].w = b.stages[0].stride = w;
+  b.stages[0].h = h;
+  b.stages[0].data = imlib_image_get_data_for_reading_only();
+  b.stages[0].has_alpha = imlib_image_has_alpha() ? 1 : 0;
+  pipe_compile_or_free(pl, &run, &b);
+
+  max_bands = (run.h + KERNEL_BAND - 1) / KERNEL_BAND;
+  run.num_bands = num_kernel_threads();
+  if (run.num_bands > max_bands)
+    run.num_bands = max_bands;
+
+  if ((dst = imlib_create_image(run.w, run.h))) {
+    imlib_context_set_image(dst);
+    imlib_image_set_has_alpha(b.stages[run.num_stages - 1].has_alpha);
+    run.dst = imlib_image_get_data();
+
+    /* the pass doesn't touch Imlib2, so it doesn't need imlib_lock;
+     * just keep the source from being freed under it */
+    im->exports++;
+    call_without_gvl(pipe_op, &run);
+    im->exports--;
+
+    imlib_context_set_image(dst);
+    imlib_image_put_back_data(run.dst);
+    if (run.failed) {
+      imlib_free_image();
+      dst = NULL;
+    }
+  }
+
+  pipe_build_free(&b);
+  RB_GC_GUARD(self);
+
+  if (!dst)
+    rb_raise(rb_eNoMemError, "couldn't create image");
+
+  new_im = calloc(1, sizeof(ImStruct));
+  new_im->im = dst;
+  return image_wrap(cImage, new_im);
+}
+
+static VALUE pipeline_save_image(VALUE args) {
+  return image_save(rb_ary_entry(args, 0), rb_ary_entry(args, 1));
+}
+
+static VALUE pipeline_delete_image(VALUE image) {
+  return image_delete(0, NULL, image);
 }
 
-#ifndef X_DISPLAY_MISSING
-/*************************/
-/* CONTEXT X11 FUNCTIONS */
-/*************************/
 /*
- * Set the current X11 Display.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
+ * Render the pipeline and save the result to path (see
+ * Imlib2::Image#save), without keeping the rendered image around.
+ * Returns the pipeline.
  *
  * Examples:
- *   context.set_display display
- *   context.display = display
+ *   image.lazy.crop_scaled(0, 0, 1024, 768, 320, 240).save 'thumb.jpg'
  *
  */
-static VALUE ctx_set_display(VALUE self, VALUE display) {
-  Display *disp;
-  Imlib_Context *ctx;
+static VALUE pipeline_save(VALUE self, VALUE path) {
+  VALUE image = pipeline_render(self);
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  Data_Get_Struct(display, Display, disp);
+  rb_ensure(pipeline_save_image, rb_assoc_new(image, path),
+            pipeline_delete_image, image);
+  return self;
+}
 
-  imlib_context_push(*ctx);
-  imlib_context_set_display(disp);
-  imlib_context_pop();
+/* Imlib2.stream: save an image, with an optional quality, and free it */
+static VALUE stream_save(VALUE image, VALUE dst, VALUE quality) {
+  ImStruct *im;
 
-  return display;
+  if (!NIL_P(quality)) {
+    GET_AND_CHECK_IMAGE(image, im);
+    imlib_context_set_image(im->im);
+    imlib_image_attach_data_value("quality", NULL, NUM2INT(quality), NULL);
+  }
+
+  return rb_ensure(pipeline_save_image, rb_assoc_new(image, dst),
+                   pipeline_delete_image, image);
+}
+
+/* Imlib2.stream for sources that aren't streamed: args is [pipeline,
+ * dst, quality] */
+static VALUE stream_image(VALUE args) {
+  VALUE pipeline = rb_ary_entry(args, 0), image;
+  Pipeline *pl = get_pipeline(pipeline);
+
+  rb_yield(pipeline);
+  image = pipeline_render(pipeline);
+  stream_save(image, rb_ary_entry(args, 1), rb_ary_entry(args, 2));
+
+  return rb_assoc_new(INT2FIX(pl->w), INT2FIX(pl->h));
+}
+
+#ifdef HAVE_LIBJPEG
+/* is path a JPEG, going by its extension? */
+static int jpeg_path(const char *path) {
+  const char *ext = strrchr(path, '.');
+
+  return ext && (!STRCASECMP(ext, ".jpg") || !STRCASECMP(ext, ".jpeg") ||
+                 !STRCASECMP(ext, ".jpe"));
+}
+
+/* Imlib2.stream for JPEG sources */
+static VALUE stream_jpeg(VALUE pipeline, VALUE src, VALUE dst,
+                         VALUE quality) {
+  Pipeline *pl = get_pipeline(pipeline);
+  ImStruct *new_im;
+  StreamOp op;
+  PipeBuild b;
+  Imlib_Image out = NULL;
+
+  op.src = StringValueCStr(src);
+  op.dst = StringValueCStr(dst);
+  op.src_w = pl->src_w;
+  op.src_h = pl->src_h;
+  op.quality = NIL_P(quality) ? 90 : NUM2INT(quality);
+
+  enter_imlib();
+  pipe_build_alloc(&b, pl->num_ops);
+  b.stages[0].kind = STAGE_READ;
+  b.stages[0].w = pl->src_w;
+  b.stages[0].h = pl->src_h;
+  b.stages[0].read = jpeg_read_row;
+  op.stages = b.stages;
+  pipe_compile_or_free(pl, &op.run, &b);
+  op.run.num_bands = 1;
+
+  /* rows come out bottom up when flipped, so buffer them */
+  if (!jpeg_path(op.dst) || op.run.flip_y) {
+    if (!(out = imlib_create_image(op.run.w, op.run.h))) {
+      pipe_build_free(&b);
+      rb_raise(rb_eNoMemError, "couldn't create image");
+    }
+    imlib_context_set_image(out);
+    imlib_image_set_has_alpha(b.stages[op.run.num_stages - 1].has_alpha);
+    op.run.dst = imlib_image_get_data();
+  }
+
+  call_without_gvl(stream_op, &op);
+  pipe_build_free(&b);
+
+  if (out) {
+    imlib_context_set_image(out);
+    imlib_image_put_back_data(op.run.dst);
+    if (op.err || op.run.failed) {
+      imlib_free_image();
+      out = NULL;
+    }
+  }
+
+  if (op.run.failed)
+    rb_raise(rb_eNoMemError, "couldn't allocate stream buffers");
+  if (op.err > 0)
+    rb_syserr_fail(op.err, op.dst);
+  if (op.err)
+    rb_raise(imlib_errors[IMLIB_LOAD_ERROR_UNKNOWN].exception, "\"%s\": %s",
+             op.src, op.msg);
+
+  if (out) {
+    new_im = calloc(1, sizeof(ImStruct));
+    new_im->im = out;
+    stream_save(image_wrap(cImage, new_im), dst, quality);
+  }
+
+  RB_GC_GUARD(src);
+  RB_GC_GUARD(dst);
+  return rb_assoc_new(INT2FIX(op.run.w), INT2FIX(op.run.h));
 }
+#endif /* HAVE_LIBJPEG */
 
 /*
- * Get the current X11 Display.
+ * Transform the image in the file src and save the result to dst,
+ * without holding all of src in memory.  The block is given an
+ * Imlib2::Pipeline to record the operations on (crop, crop_scaled,
+ * scale, flips, blur, sharpen, apply_cmod and filter), which run in a
+ * single pass once it returns.
  *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
+ * JPEG sources are decoded a few rows at a time, as the pipeline needs
+ * them, so only those rows, the pipeline's own row buffers and the
+ * output are in memory at once.  If dst is a JPEG too, the output is
+ * encoded as it's made as well, unless it's flipped vertically.  Other
+ * sources are loaded whole (as Imlib2::Image.load does), and other
+ * outputs are saved with Imlib2::Image#save.  Note that libjpeg keeps
+ * the whole of a progressive JPEG in memory while it's decoded.
+ *
+ * Unlike Imlib2::Image.load, streamed JPEG sources are read as stored,
+ * ignoring their EXIF orientation (which can't be applied a row at a
+ * time), and the pipeline sees the stored width and height.  Streamed
+ * JPEG outputs don't carry the source's EXIF data either.  Use
+ * Imlib2::Image.load_scaled (or Imlib2::Image.load) for photos that may
+ * be rotated.
+ *
+ * Options:
+ * filter::  resampling filter for the pipeline's scales (:lanczos3)
+ * quality:: quality of dst, 0-100 (90 for streamed JPEGs)
+ *
+ * Returns the size of the output, as [width, height].
  *
  * Examples:
- *   display = context.get_display
- *   display = context.display
+ *   cmod = Imlib2::ColorModifier.new
+ *   cmod.gamma = 0.8
+ *   Imlib2.stream('map.jpg', 'map-small.jpg', quality: 85) { |p|
+ *     p.scale 7500, 7500
+ *     p.apply_cmod cmod
+ *   }
+ *
+ *   w, h = Imlib2.stream('scan.jpg', 'detail.png') { |p|
+ *     p.crop_scaled 10000, 12000, 4000, 3000, 1600, 1200
+ *     p.sharpen 1
+ *   }
  *
  */
-static VALUE ctx_display(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE disp;
+static VALUE imlib2_stream(int argc, VALUE *argv, VALUE klass) {
+  VALUE src, dst, opts, filter, quality, image, pipeline;
+#ifdef HAVE_LIBJPEG
+  int w, h;
+#endif /* HAVE_LIBJPEG */
+  UNUSED(klass);
+
+  rb_scan_args(argc, argv, "2:", &src, &dst, &opts);
+  rb_need_block();
+  filter = hash_opt(opts, KEY_FILTER);
+  quality = hash_opt(opts, KEY_QUALITY);
+
+#ifdef HAVE_LIBJPEG
+  if (jpeg_stream_size(StringValueCStr(src), &w, &h)) {
+    pipeline = pipeline_alloc(cPipeline, Qnil, w, h, filter);
+    rb_yield(pipeline);
+    return stream_jpeg(pipeline, src, dst, quality);
+  }
+#endif /* HAVE_LIBJPEG */
+
+  /* not image_load(), which would take the block */
+  image = rb_funcall(cImage, rb_intern("load"), 1, src);
+  pipeline = pipeline_make(cPipeline, image, filter);
+  return rb_ensure(stream_image, rb_ary_new3(3, pipeline, dst, quality),
+                   pipeline_delete_image, image);
+}
+
+/***************************/
+/* BATCH THUMBNAIL FUNCTIONS */
+/***************************/
+
+typedef struct {
+  char *src, *dst;
+  int   w, h;             /* 0 = keep aspect ratio */
+  int   x, y, cw, ch;     /* crop region, cw/ch 0 = rest of image */
+  int   quality;          /* -1 = saver default */
+  const ScalePlan *plan;  /* resample with this, if the size matches */
+  int   err;              /* Imlib_Load_Error, or one of the below */
+} ThumbJob;
+
+/* ThumbJob.err values besides Imlib_Load_Error */
+#define THUMB_NOT_FINISHED  -1
+#define THUMB_BAD_CROP      -2  /* crop region is outside of the image */
+
+/* default number of worker threads, at most */
+#define MAX_BATCH_WORKERS   8
+
+/* most worker threads (or processes) a batch will start */
+#define MAX_BATCH_THREADS   64
+
+typedef struct {
+  long          next;         /* next unclaimed job (shared by workers) */
+  long          num_jobs;
+  int           num_threads,  /* in-process worker threads */
+                num_procs;    /* forked worker processes, if > 1 */
+  volatile char cancelled;    /* set by batch_thumbnail_ubf() */
+  char          forked;       /* the workers have been started */
+  pid_t        *pids;         /* of the forked workers (parent only) */
+  int           done[2],      /* pipe held open by the forked workers */
+                wake[2];      /* pipe written by batch_thumbnail_ubf() */
+  ThumbJob      jobs[1];
+} ThumbBatch;
+
+#ifdef HAVE_PTHREAD_CREATE
+/* serializes the Imlib2 calls of in-process worker threads, since
+ * Imlib2 keeps its loaders, cache and context in process globals */
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BATCH_LOCK(b) do { \
+  if ((b)->num_threads > 1) \
+    pthread_mutex_lock(&batch_lock); \
+} while (0)
+#define BATCH_UNLOCK(b) do { \
+  if ((b)->num_threads > 1) \
+    pthread_mutex_unlock(&batch_lock); \
+} while (0)
+#else
+#define BATCH_LOCK(b)   UNUSED(b)
+#define BATCH_UNLOCK(b) UNUSED(b)
+#endif /* HAVE_PTHREAD_CREATE */
+
+/*
+ * Load, crop-scale and save a single batch job.  Runs without the GVL,
+ * in a worker thread or a forked worker, so it must not touch any Ruby
+ * objects.  Imlib2 is only called with the batch lock held; jobs with a
+ * matching plan are resampled outside of it, so several workers can
+ * resample at once.
+ */
+static void run_thumb_job(ThumbBatch *batch, ThumbJob *job) {
+  Imlib_Image src, dst = NULL;
+  Imlib_Load_Error err = IMLIB_LOAD_ERROR_NONE;
+  Resample rs;
+  int iw, ih, x, y, cw, ch, w, h;
+
+  BATCH_LOCK(batch);
+  src = imlib_load_image_with_error_return(job->src, &err);
+  if (!src) {
+    BATCH_UNLOCK(batch);
+    job->err = (err != IMLIB_LOAD_ERROR_NONE) ? err : IMLIB_LOAD_ERROR_UNKNOWN;
+    return;
+  }
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
+  imlib_context_set_image(src);
+  iw = imlib_image_get_width();
+  ih = imlib_image_get_height();
+
+  /* default to the rest of the image, clamp to the image, then fill in
+   * the aspect ratio */
+  x = job->x < 0 ? 0 : job->x;
+  y = job->y < 0 ? 0 : job->y;
+  cw = job->cw > 0 ? job->x + job->cw : iw;
+  ch = job->ch > 0 ? job->y + job->ch : ih;
+  cw = (cw > iw ? iw : cw) - x;
+  ch = (ch > ih ? ih : ch) - y;
+  if (cw <= 0 || ch <= 0) {
+    imlib_free_image_and_decache();
+    BATCH_UNLOCK(batch);
+    job->err = THUMB_BAD_CROP;
+    return;
+  }
 
-  imlib_context_push(*ctx);
-  disp = Data_Wrap_Struct(cDisplay, NULL, XFree, imlib_context_get_display());
-  imlib_context_pop();
+  w = job->w;
+  h = job->h;
+  if (w <= 0 && h <= 0) {
+    w = cw;
+    h = ch;
+  } else if (w <= 0) {
+    w = (int) ((double) cw * h / ch + 0.5);
+  } else if (h <= 0) {
+    h = (int) ((double) ch * w / cw + 0.5);
+  }
+  if (w < 1) w = 1;
+  if (h < 1) h = 1;
+
+  if (job->plan && iw == job->plan->src_w && ih == job->plan->src_h) {
+    /* our reference keeps src (and its pixels) alive while unlocked */
+    rs.has_alpha = imlib_image_has_alpha() ? 1 : 0;
+    rs.src = imlib_image_get_data_for_reading_only();
+    rs.plan = job->plan;
+    if ((dst = imlib_create_image(job->plan->dst_w, job->plan->dst_h))) {
+      imlib_context_set_image(dst);
+      imlib_image_set_has_alpha(rs.has_alpha);
+      rs.dst = imlib_image_get_data();
+
+      BATCH_UNLOCK(batch);
+      resample_op(&rs);
+      BATCH_LOCK(batch);
+
+      imlib_context_set_image(dst);
+      imlib_image_put_back_data(rs.dst);
+      if (rs.failed) {
+        imlib_free_image();
+        dst = NULL;
+      }
+    }
+    imlib_context_set_image(src);
+  } else {
+    dst = imlib_create_cropped_scaled_image(x, y, cw, ch, w, h);
+  }
+  imlib_free_image_and_decache();
+  if (!dst) {
+    BATCH_UNLOCK(batch);
+    job->err = IMLIB_LOAD_ERROR_OUT_OF_MEMORY;
+    return;
+  }
 
-  return disp;
+  imlib_context_set_image(dst);
+  if (job->quality >= 0)
+    imlib_image_attach_data_value("quality", NULL, job->quality, NULL);
+  imlib_save_image_with_error_return(job->dst, &err);
+  imlib_free_image();
+  BATCH_UNLOCK(batch);
+
+  job->err = err;
 }
 
 /*
- * Set the current X11 Visual.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   context.set_visual visual
- *   context.visual = visual
- *
+ * Claim and run jobs until there are none left, or the batch is
+ * interrupted.
  */
-static VALUE ctx_set_visual(VALUE self, VALUE visual) {
-  Visual *vis;
-  Imlib_Context *ctx;
-
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  Data_Get_Struct(visual, Visual, vis);
+static void run_thumb_jobs(ThumbBatch *batch) {
+  long i;
 
-  imlib_context_push(*ctx);
-  imlib_context_set_visual(vis);
-  imlib_context_pop();
+  while (!batch->cancelled &&
+         (i = __sync_fetch_and_add(&batch->next, 1)) < batch->num_jobs)
+    run_thumb_job(batch, &batch->jobs[i]);
+}
 
-  return visual;
+#ifdef HAVE_PTHREAD_CREATE
+static void *batch_worker(void *data) {
+  run_thumb_jobs((ThumbBatch*) data);
+  return NULL;
 }
+#endif /* HAVE_PTHREAD_CREATE */
 
+#ifdef HAVE_FORK
 /*
- * Get the current X11 Visual.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   visual = context.get_visual
- *   visual = context.visual
- *
+ * Start the forked workers, then wait for them all to exit (or for the
+ * batch to be interrupted, in which case they're left running).  Each
+ * worker holds the write end of batch->done open until it exits, so
+ * the wait ends when that pipe reads EOF, or when batch->wake does.
  */
-static VALUE ctx_visual(VALUE self) {
-  Imlib_Context *ctx;
-  VALUE vis;
+static void batch_fork_run(ThumbBatch *batch) {
+  struct pollfd fds[2];
+  char buf[16];
+  int i, status;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
+  if (!batch->forked) {
+    batch->forked = 1;
+    for (i = 0; i < batch->num_procs; i++) {
+      pid_t pid = fork();
 
-  imlib_context_push(*ctx);
-  vis = Data_Wrap_Struct(cVisual, NULL, XFree, imlib_context_get_visual());
-  imlib_context_pop();
+      if (pid == 0) {
+        run_thumb_jobs(batch);
+        _exit(0);
+      } else if (pid > 0) {
+        batch->pids[i] = pid;
+      }
+    }
+    close(batch->done[1]);
+    batch->done[1] = -1;
+  }
 
-  return vis;
+  fds[0].fd = batch->done[0];
+  fds[1].fd = batch->wake[0];
+  fds[0].events = fds[1].events = POLLIN;
+  while (!batch->cancelled) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[0].revents && read(batch->done[0], buf, sizeof(buf)) <= 0)
+      break;
+    if (fds[1].revents && read(batch->wake[0], buf, sizeof(buf)) <= 0)
+      break;
+  }
+  if (batch->cancelled)
+    return;
+
+  for (i = 0; i < batch->num_procs; i++)
+    if (batch->pids[i] > 0) {
+      while (waitpid(batch->pids[i], &status, 0) == -1 && errno == EINTR)
+        ;
+      batch->pids[i] = 0;
+    }
+}
+
+/* kill and reap any forked workers that are still running */
+static void batch_kill_workers(ThumbBatch *batch) {
+  int i, status;
+
+  for (i = 0; i < batch->num_procs; i++)
+    if (batch->pids[i] > 0) {
+      kill(batch->pids[i], SIGKILL);
+      while (waitpid(batch->pids[i], &status, 0) == -1 && errno == EINTR)
+        ;
+      batch->pids[i] = 0;
+    }
 }
+#endif /* HAVE_FORK */
 
 /*
- * Set the current X11 Colormap.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   context.set_colormap colormap
- *   context.colormap = colormap
- *
+ * Run a batch (called through call_imlib_ubf).  By default the jobs are
+ * run by worker threads, which take turns calling Imlib2 (see
+ * run_thumb_job()).  With num_procs > 1, each worker is instead a
+ * forked process with its own copy of Imlib2, claiming jobs from a
+ * counter in shared memory.  If the batch is interrupted, this returns
+ * early, and can be called again to carry on.
  */
-static VALUE ctx_set_colormap(VALUE self, VALUE colormap) {
-  Colormap *cmap;
-  Imlib_Context *ctx;
+static void *batch_thumbnail_op(void *data) {
+  ThumbBatch *batch = (ThumbBatch*) data;
+  int i;
+#ifdef HAVE_PTHREAD_CREATE
+  pthread_t threads[MAX_BATCH_THREADS];
+  int num_threads = 0;
+#endif /* HAVE_PTHREAD_CREATE */
+
+#ifdef HAVE_FORK
+  if (batch->num_procs > 1) {
+    batch_fork_run(batch);
+    if (batch->cancelled)
+      return NULL;
+    /* run whatever is left (everything, if fork() failed) in-process */
+  }
+#endif /* HAVE_FORK */
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  Data_Get_Struct(colormap, Colormap, cmap);
+#ifdef HAVE_PTHREAD_CREATE
+  for (i = 1; i < batch->num_threads; i++)
+    if (!pthread_create(&threads[num_threads], NULL, batch_worker, batch))
+      num_threads++;
+#endif /* HAVE_PTHREAD_CREATE */
 
-  imlib_context_push(*ctx);
-  imlib_context_set_colormap(*cmap);
-  imlib_context_pop();
+  run_thumb_jobs(batch);
 
-  return colormap;
+#ifdef HAVE_PTHREAD_CREATE
+  for (i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+#endif /* HAVE_PTHREAD_CREATE */
+
+  UNUSED(i);
+  return NULL;
 }
 
 /*
- * Get the current X11 Colormap.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   colormap = context.get_colormap
- *   colormap = context.colormap
- *
+ * Interrupt a batch: the workers stop claiming jobs (forked ones are
+ * left running until we know the interrupt is going to raise), and
+ * batch_thumbnail_op() returns.  Called by Ruby, with the GVL, for any
+ * pending interrupt, including ones that don't raise (eg for SIGCHLD
+ * when a forked worker exits).
  */
-static VALUE ctx_colormap(VALUE self) {
-  Imlib_Context *ctx;
-  Colormap *cmap;
-  VALUE colormap;
+static void batch_thumbnail_ubf(void *data) {
+  ThumbBatch *batch = (ThumbBatch*) data;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  cmap = malloc(sizeof(Colormap));
+  batch->cancelled = 1;
+#ifdef HAVE_FORK
+  if (batch->wake[1] != -1 && write(batch->wake[1], "", 1) == -1)
+    ; /* the pipe is full, so the wait will end anyway */
+#endif /* HAVE_FORK */
+}
 
-  imlib_context_push(*ctx);
-  *cmap = imlib_context_get_colormap();
-  colormap = Data_Wrap_Struct(cColormap, 0, dont_free, cmap);
-  imlib_context_pop();
+static ThumbBatch *batch_alloc(long num_jobs, int shared, size_t *size) {
+  ThumbBatch *batch;
 
-  return colormap;
+  *size = sizeof(ThumbBatch) + sizeof(ThumbJob) * (num_jobs > 0 ? num_jobs - 1 : 0);
+
+#ifdef HAVE_FORK
+  if (shared) {
+    batch = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (batch == MAP_FAILED)
+      rb_sys_fail("mmap");
+  } else {
+    batch = (ThumbBatch*) xmalloc(*size);
+  }
+#else
+  UNUSED(shared);
+  batch = (ThumbBatch*) xmalloc(*size);
+#endif /* HAVE_FORK */
+
+  memset(batch, 0, *size);
+  batch->done[0] = batch->done[1] = -1;
+  batch->wake[0] = batch->wake[1] = -1;
+  return batch;
 }
 
-/*
- * Set the current X11 Drawable.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   context.set_drawable drawable
- *   context.drawable = drawable
- *
- */
-static VALUE ctx_set_drawable(VALUE self, VALUE drawable) {
-  Drawable *draw;
-  Imlib_Context *ctx;
+static void batch_free(ThumbBatch *batch, int shared, size_t size) {
+  long i;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  Data_Get_Struct(drawable, Drawable, draw);
+  for (i = 0; i < batch->num_jobs; i++) {
+    free(batch->jobs[i].src);
+    free(batch->jobs[i].dst);
+  }
 
-  imlib_context_push(*ctx);
-  imlib_context_set_drawable(*draw);
-  imlib_context_pop();
+#ifdef HAVE_FORK
+  if (batch->pids)
+    batch_kill_workers(batch);
+  for (i = 0; i < 2; i++) {
+    if (batch->done[i] != -1)
+      close(batch->done[i]);
+    if (batch->wake[i] != -1)
+      close(batch->wake[i]);
+  }
+#endif /* HAVE_FORK */
+  free(batch->pids);
 
-  return drawable;
+#ifdef HAVE_FORK
+  if (shared) {
+    munmap(batch, size);
+    return;
+  }
+#endif /* HAVE_FORK */
+
+  UNUSED(shared);
+  UNUSED(size);
+  xfree(batch);
 }
 
 /*
- * Get the current X11 Drawable.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   drawable = context.get_drawable
- *   drawable = context.drawable
- *
+ * Fill in a ThumbJob from a job array or hash.
  */
-static VALUE ctx_drawable(VALUE self) {
-  Imlib_Context *ctx;
-  Drawable *draw;
-  VALUE drawable;
+static void batch_parse_job(ThumbJob *job, VALUE val) {
+  VALUE src, dst, w, h, crop = Qnil, quality = Qnil, plan = Qnil;
+  const char *src_path, *dst_path;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  draw = malloc(sizeof(Drawable));
+  switch (TYPE(val)) {
+    case T_HASH:
+      src = hash_arg(val, KEY_SRC);
+      dst = hash_arg(val, KEY_DST);
+      w = hash_arg(val, KEY_W);
+      h = hash_arg(val, KEY_H);
+      crop = hash_arg(val, KEY_CROP);
+      quality = hash_arg(val, KEY_QUALITY);
+      plan = hash_arg(val, KEY_PLAN);
+      break;
+    case T_ARRAY:
+      src = rb_ary_entry(val, 0);
+      dst = rb_ary_entry(val, 1);
+      w = rb_ary_entry(val, 2);
+      h = rb_ary_entry(val, 3);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "Invalid job type (not array or hash)");
+  }
 
-  imlib_context_push(*ctx);
-  *draw = imlib_context_get_drawable();
-  drawable = Data_Wrap_Struct(cDrawable, NULL, dont_free, draw);
-  imlib_context_pop();
+  job->w = NIL_P(w) ? 0 : NUM2INT(w);
+  job->h = NIL_P(h) ? 0 : NUM2INT(h);
+  job->quality = NIL_P(quality) ? -1 : NUM2INT(quality);
+  if (!NIL_P(crop)) {
+    Check_Type(crop, T_ARRAY);
+    job->x = NUM2INT(rb_ary_entry(crop, 0));
+    job->y = NUM2INT(rb_ary_entry(crop, 1));
+    job->cw = NUM2INT(rb_ary_entry(crop, 2));
+    job->ch = NUM2INT(rb_ary_entry(crop, 3));
+  }
+  if (!NIL_P(plan)) {
+    if (!NIL_P(crop))
+      rb_raise(rb_eArgError, "a job can't have both 'plan' and 'crop'");
+    /* the plan is kept alive by the jobs array for the whole batch */
+    job->plan = get_scale_plan(plan);
+    if (job->w <= 0 && job->h <= 0) {
+      job->w = job->plan->dst_w;
+      job->h = job->plan->dst_h;
+    }
+  }
 
-  return drawable;
+  /* copy the paths (workers run without the GVL, or in another
+   * process), once both have been converted */
+  src_path = StringValueCStr(src);
+  dst_path = StringValueCStr(dst);
+  job->src = strdup(src_path);
+  job->dst = strdup(dst_path);
+  if (!job->src || !job->dst)
+    rb_raise(rb_eNoMemError, "couldn't copy job paths");
+  job->err = THUMB_NOT_FINISHED;
 }
 
-/*
- * Set the current X11 Mask.
- *
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
- *
- * Examples:
- *   context.set_mask mask
- *   context.mask = mask
- *
- */
-static VALUE ctx_set_mask(VALUE self, VALUE mask_o) {
-  Pixmap *mask;
-  Imlib_Context *ctx;
+typedef struct {
+  VALUE       jobs;
+  long        num_jobs;
+  ThumbBatch *batch;
+  size_t      size;
+  int         shared;
+} BatchArgs;
+
+static VALUE batch_thumbnail_run(VALUE val) {
+  BatchArgs *args = (BatchArgs*) val;
+  ThumbBatch *batch = args->batch;
+  VALUE ret;
+  long i, num_jobs = args->num_jobs;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  Data_Get_Struct(mask_o, Pixmap, mask);
+  /* num_jobs only counts the jobs parsed so far (and the one being
+   * parsed, which is zeroed), so batch_free() knows what to free */
+  for (i = 0; i < num_jobs; i++) {
+    batch->num_jobs = i + 1;
+    batch_parse_job(&batch->jobs[i], rb_ary_entry(args->jobs, i));
+  }
 
-  imlib_context_push(*ctx);
-  imlib_context_set_mask(*mask);
-  imlib_context_pop();
+  /* if we were interrupted, raise (which kills any forked workers, in
+   * batch_thumbnail_free()), or carry on where we left off */
+  for (;;) {
+    call_imlib_ubf(batch_thumbnail_op, batch, batch_thumbnail_ubf, batch);
+    if (!batch->cancelled)
+      break;
+    batch->cancelled = 0;
+    rb_thread_check_ints();
+  }
 
-  return mask_o;
+  ret = rb_ary_new2(num_jobs);
+  for (i = 0; i < num_jobs; i++) {
+    ThumbJob *job = &batch->jobs[i];
+
+    if (job->err == IMLIB_LOAD_ERROR_NONE)
+      rb_ary_push(ret, Qtrue);
+    else if (job->err == THUMB_BAD_CROP)
+      rb_ary_push(ret, rb_exc_new_str(rb_eArgError,
+        rb_sprintf("\"%s\": crop region is outside of the image", job->src)));
+    else
+      rb_ary_push(ret, imlib_error_new(job->src, job->err));
+  }
+
+  return ret;
 }
 
-/*
- * Get the current X11 Mask.
- * 
- * Note: This method is not available unless Imlib2-Ruby was compiled
- * with X11 support.  You can check the constant Imlib2::X11_SUPPORT to
- * see if X11 support is available.
+static VALUE batch_thumbnail_free(VALUE val) {
+  BatchArgs *args = (BatchArgs*) val;
+
+  batch_free(args->batch, args->shared, args->size);
+  return Qnil;
+}
+
+/* clamp a number of batch workers to [1, min(num_jobs, MAX_BATCH_THREADS)] */
+static int batch_workers(int n, long num_jobs) {
+  if (n > num_jobs)
+    n = (int) num_jobs;
+  if (n > MAX_BATCH_THREADS)
+    n = MAX_BATCH_THREADS;
+  return n < 1 ? 1 : n;
+}
+
+/*
+ * Load, crop-scale and save many images in one call.
+ *
+ * Each job is either an array of [src, dst, w, h], or a hash with the
+ * keys 'src', 'dst', 'w', 'h', and optionally 'crop' ([x, y, w, h],
+ * defaults to the whole image, and clamped to it) and 'quality'.  If
+ * only one of w and h is given (or non-zero), the other is computed
+ * from the aspect ratio.
+ * A hash job may instead give a 'plan' (an Imlib2::ScalePlan): sources
+ * of the plan's size are resampled with it, and any others fall back to
+ * Imlib2's scaler (at w x h, or the plan's size if neither is given).
+ * Saved images take their format from the destination file extension.
+ *
+ * The whole batch runs without the GVL, and without any Ruby objects
+ * per image.  Jobs are run by a pool of worker threads (the optional
+ * threads, default: number of CPUs, at most 8).  Because Imlib2 keeps
+ * its state in process globals, the workers take turns loading,
+ * scaling and saving; only resampling with a plan runs in parallel.
+ *
+ * Alternatively, pass processes: N (N > 1) to run the jobs in N forked
+ * worker processes instead, each with its own copy of Imlib2, so that
+ * decoding and encoding run in parallel too.  This is opt-in: fork()
+ * only copies the calling thread, so it is only safe if no other
+ * native thread in the process (eg from a threaded web server or
+ * another extension) may be holding locks that Imlib2's loaders or
+ * savers need, such as malloc's.  Without fork(), processes is
+ * ignored.
+ *
+ * Returns an array with one entry per job: true on success, or the
+ * Imlib2::FileError exception describing why the job failed (or an
+ * ArgumentError if its crop region is outside of the image).
+ *
+ * If Imlib2::release_gvl is set, the batch can be interrupted (eg by
+ * Thread#kill, Timeout or Ctrl-C): jobs already running finish, forked
+ * workers are killed, and the remaining jobs are skipped.
+ *
+ * Examples:
+ *   jobs = paths.map { |path| [path, path.sub(/\.jpg$/, '_t.jpg'), 128, 0] }
+ *   results = Imlib2::batch_thumbnail jobs, threads: 4
+ *   results.each_with_index do |r, i|
+ *     warn "#{jobs[i][0]}: #{r.message}" unless r == true
+ *   end
  *
- * Examples:
- *   mask = context.get_mask
- *   mask = context.mask
+ *   Imlib2::batch_thumbnail [{ 'src'     => 'in.png',
+ *                              'dst'     => 'out.jpg',
+ *                              'crop'    => [10, 10, 200, 200],
+ *                              'w'       => 64,
+ *                              'h'       => 64,
+ *                              'quality' => 85 }]
+ *
+ *   plan = Imlib2::ScalePlan.new 1600, 1200, 320, 240
+ *   Imlib2::batch_thumbnail paths.map { |path|
+ *     { 'src' => path, 'dst' => path.sub(/\.jpg$/, '_t.jpg'), 'plan' => plan }
+ *   }
  *
  */
-static VALUE ctx_mask(VALUE self) {
-  Imlib_Context *ctx;
-  Pixmap *pmap;
-  VALUE mask;
 
-  Data_Get_Struct(self, Imlib_Context, ctx);
-  pmap = malloc(sizeof(Pixmap));
+static VALUE imlib2_batch_thumbnail(int argc, VALUE *argv, VALUE klass) {
+  VALUE jobs, opts, threads, processes;
+  BatchArgs args;
+  long num_jobs;
+  int num_threads, num_procs;
 
-  imlib_context_push(*ctx);
-  *pmap = imlib_context_get_mask();
-  mask = Data_Wrap_Struct(cPixmap, NULL, pmap_free, pmap);
-  imlib_context_pop();
+  rb_scan_args(argc, argv, "1:", &jobs, &opts);
+  Check_Type(jobs, T_ARRAY);
+  threads = hash_opt(opts, KEY_THREADS);
+  processes = hash_opt(opts, KEY_PROCESSES);
 
-  return mask;
+  /* default to one thread per CPU, up to MAX_BATCH_WORKERS */
+  if (NIL_P(threads)) {
+#ifdef _SC_NPROCESSORS_ONLN
+    num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    num_threads = 1;
+#endif /* _SC_NPROCESSORS_ONLN */
+    if (num_threads > MAX_BATCH_WORKERS)
+      num_threads = MAX_BATCH_WORKERS;
+  } else {
+    num_threads = NUM2INT(threads);
+  }
+  num_procs = NIL_P(processes) ? 1 : NUM2INT(processes);
+
+  num_jobs = RARRAY_LEN(jobs);
+  num_threads = batch_workers(num_threads, num_jobs);
+  num_procs = batch_workers(num_procs, num_jobs);
+#ifndef HAVE_FORK
+  num_procs = 1;
+#endif /* !HAVE_FORK */
+
+  args.jobs = jobs;
+  args.num_jobs = num_jobs;
+  args.shared = num_procs > 1;
+  args.batch = batch_alloc(num_jobs, args.shared, &args.size);
+  if (num_procs > 1) {
+    /* forked workers run single-threaded */
+    args.batch->num_procs = num_procs;
+    args.batch->num_threads = 1;
+    args.batch->pids = (pid_t*) calloc(num_procs, sizeof(pid_t));
+    if (!args.batch->pids) {
+      batch_free(args.batch, args.shared, args.size);
+      rb_raise(rb_eNoMemError, "couldn't allocate worker list");
+    }
+    if (rb_cloexec_pipe(args.batch->done) == -1 ||
+        rb_cloexec_pipe(args.batch->wake) == -1) {
+      int e = errno;
+      batch_free(args.batch, args.shared, args.size);
+      rb_syserr_fail(e, "pipe");
+    }
+    /* batch_thumbnail_ubf() mustn't block */
+    fcntl(args.batch->wake[1], F_SETFL, O_NONBLOCK);
+  } else {
+    args.batch->num_procs = 1;
+    args.batch->num_threads = num_threads;
+  }
+
+  UNUSED(klass);
+  return rb_ensure(batch_thumbnail_run, (VALUE) &args,
+                   batch_thumbnail_free, (VALUE) &args);
 }
-#endif /* !X_DISPLAY_MISSING */
 
 /******************/
 /* INIT FUNCTIONS */
@@ -7472,12 +14208,39 @@ void Init_imlib2() {
   mImlib2 = rb_define_module("Imlib2");
   rb_define_const(mImlib2, "VERSION", rb_str_new2(VERSION));
 
+  /* hash argument keys */
+  init_hash_keys();
+
 #ifdef X_DISPLAY_MISSING
   rb_define_const(mImlib2, "X11_SUPPORT", Qfalse);
 #else
   rb_define_const(mImlib2, "X11_SUPPORT", Qtrue);
 #endif /* X_DISPLAY_MISSING */
 
+  /* GVL release */
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_nativethread_lock_initialize(&imlib_lock);
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+  rb_define_singleton_method(mImlib2, "release_gvl?", imlib2_release_gvl, 0);
+  rb_define_singleton_method(mImlib2, "release_gvl", imlib2_release_gvl, 0);
+  rb_define_singleton_method(mImlib2, "release_gvl=", imlib2_set_release_gvl, 1);
+
+  /* batch thumbnails */
+  rb_define_singleton_method(mImlib2, "batch_thumbnail", imlib2_batch_thumbnail, -1);
+
+  /* streamed pipelines */
+  rb_define_singleton_method(mImlib2, "stream", imlib2_stream, -1);
+
+  /* operation statistics */
+  rb_define_singleton_method(mImlib2, "collect_stats?", imlib2_collect_stats, 0);
+  rb_define_singleton_method(mImlib2, "collect_stats=", imlib2_set_collect_stats, 1);
+  rb_define_singleton_method(mImlib2, "stats", imlib2_stats, 0);
+  rb_define_singleton_method(mImlib2, "reset_stats", imlib2_reset_stats, 0);
+
+  /* parallel pixel kernels */
+  rb_define_singleton_method(mImlib2, "threads", imlib2_threads, 0);
+  rb_define_singleton_method(mImlib2, "threads=", imlib2_set_threads, 1);
+
   /************************/
   /* define Context class */
   /************************/
@@ -7491,6 +14254,12 @@ void Init_imlib2() {
   rb_define_singleton_method(cContext, "get", ctx_get, 0);
   rb_define_singleton_method(cContext, "current", ctx_get, 0);
 
+  /* per-thread context methods */
+  id_context_stack = rb_intern("__imlib2_context_stack__");
+  rb_define_singleton_method(cContext, "per_thread?", ctx_per_thread, 0);
+  rb_define_singleton_method(cContext, "per_thread", ctx_per_thread, 0);
+  rb_define_singleton_method(cContext, "per_thread=", ctx_set_per_thread, 1);
+
   rb_define_method(cContext, "set_dither", ctx_set_dither, 1);
   rb_define_method(cContext, "dither=", ctx_set_dither, 1);
   rb_define_method(cContext, "get_dither", ctx_dither, 0);
@@ -7834,8 +14603,8 @@ void Init_imlib2() {
   /* define ColorMod class */
   /*************************/
   cColorMod = rb_define_class_under(mImlib2, "ColorModifier", rb_cObject);
-  rb_define_singleton_method(cColorMod, "new", cmod_new, -1);
-  rb_define_method(cColorMod, "initialize", cmod_init, -1);
+  rb_define_singleton_method(cColorMod, "new", cmod_new, 0);
+  rb_define_method(cColorMod, "initialize", cmod_init, 0);
   rb_define_method(cColorMod, "gamma=", cmod_gamma, 1);
   rb_define_method(cColorMod, "brightness=", cmod_brightness, 1);
   rb_define_method(cColorMod, "contrast=", cmod_contrast, 1);
@@ -7885,11 +14654,23 @@ void Init_imlib2() {
   rb_define_singleton_method(cImage, "load_without_cache", image_load_without_cache, 1);
   rb_define_singleton_method(cImage, "load_immediately_without_cache", image_load_immediately_without_cache, 1);
   rb_define_singleton_method(cImage, "load_with_error_return", image_load_with_error_return, 1);
+  rb_define_singleton_method(cImage, "load_from_memory", image_load_from_memory, -1);
+  rb_define_singleton_method(cImage, "load_from_io", image_load_from_io, -1);
+  rb_define_singleton_method(cImage, "load_scaled", image_load_scaled, 3);
+
+  /* header-only probe methods */
+  cImageInfo = rb_struct_define_under(cImage, "Info", "width", "height",
+                                      "format", "has_alpha", NULL);
+  rb_define_singleton_method(cImage, "probe", image_probe, 1);
+  rb_define_singleton_method(cImage, "probe_from_memory", image_probe_from_memory, -1);
+  rb_define_singleton_method(cImage, "probe_from_io", image_probe_from_io, -1);
 
   /* save methods */
   rb_define_method(cImage, "save", image_save, 1);
   rb_define_method(cImage, "save_image", image_save_image, 1);
   rb_define_method(cImage, "save_with_error_return", image_save_with_error_return, 1);
+  rb_define_method(cImage, "to_blob", image_to_blob, -1);
+  rb_define_method(cImage, "save_to_memory", image_to_blob, -1);
 
   /* delete method */
   rb_define_method(cImage, "delete!", image_delete, -1);
@@ -7907,6 +14688,16 @@ void Init_imlib2() {
   rb_define_method(cImage, "data=", image_put_data, 1);
   rb_define_method(cImage, "put_back_data", image_put_data, 1);
 
+  /* zero-copy data view */
+  id_data_view = rb_intern("__imlib2_data_view__");
+  id_data_view_image = rb_intern("__imlib2_data_view_image__");
+  rb_define_method(cImage, "data_view", image_data_view, -1);
+
+#ifdef HAVE_RB_MEMORY_VIEW_REGISTER
+  /* export pixel data to MemoryView consumers (Numo, Arrow, Fiddle) */
+  rb_memory_view_register(cImage, &image_memory_view_entry);
+#endif /* HAVE_RB_MEMORY_VIEW_REGISTER */
+
   rb_define_method(cImage, "has_alpha", image_has_alpha, 0);
   rb_define_method(cImage, "has_alpha?", image_has_alpha, 0);
   rb_define_method(cImage, "has_alpha=", image_set_has_alpha, 1);
@@ -7942,6 +14733,12 @@ void Init_imlib2() {
   rb_define_method(cImage, "query_pixel_hlsa", image_query_pixel_hlsa, 2);
   rb_define_method(cImage, "pixel_cmya", image_query_pixel_cmya, 2);
   rb_define_method(cImage, "query_pixel_cmya", image_query_pixel_cmya, 2);
+  rb_define_method(cImage, "pixels", image_pixels, -1);
+
+  /* statistics */
+  rb_define_method(cImage, "histogram", image_histogram, -1);
+  rb_define_method(cImage, "mean_color", image_mean_color, -1);
+  rb_define_method(cImage, "percentiles", image_percentiles, -1);
 
   /* more create methods */
   rb_define_method(cImage, "crop", image_crop, -1);
@@ -7952,6 +14749,8 @@ void Init_imlib2() {
   rb_define_method(cImage, "create_cropped_scaled", image_crop_scaled, -1);
   rb_define_method(cImage, "crop_scaled!", image_crop_scaled_inline, -1);
   rb_define_method(cImage, "create_cropped_scaled!", image_crop_scaled_inline, -1);
+  rb_define_method(cImage, "pyramid", image_pyramid, -1);
+  rb_define_method(cImage, "lazy", image_lazy, -1);
 
   /* image modification methods */
   rb_define_method(cImage, "flip_horizontal", image_flip_horizontal, 0);
@@ -7977,12 +14776,15 @@ void Init_imlib2() {
 
   /* image drawing methods */
   rb_define_method(cImage, "draw_pixel", image_draw_pixel, -1);
+  rb_define_method(cImage, "draw_pixels", image_draw_pixels, -1);
   rb_define_method(cImage, "draw_line", image_draw_line, -1);
+  rb_define_method(cImage, "draw_lines", image_draw_lines, -1);
   /* FIXME: rb_define_method(cImage, "clip_line", image_clip_line, -1);*/
   rb_define_method(cImage, "draw_rect", image_draw_rect, -1);
   rb_define_method(cImage, "draw_rectangle", image_draw_rect, -1);
   rb_define_method(cImage, "fill_rect", image_fill_rect, -1);
   rb_define_method(cImage, "fill_rectangle", image_fill_rect, -1);
+  rb_define_method(cImage, "fill_rects", image_fill_rects, -1);
   rb_define_method(cImage, "copy_alpha", image_copy_alpha, -1);
   rb_define_method(cImage, "copy_alpha_rect", image_copy_alpha_rect, -1);
   rb_define_method(cImage, "scroll_rect", image_scroll_rect, -1);
@@ -8029,8 +14831,8 @@ void Init_imlib2() {
   rb_define_method(cImage, "clear_color!", image_clear_color_inline, 1);
 
   /* polymorphic (implicit) filter methods */
-  rb_define_method(cImage, "filter", image_filter, 1);
-  rb_define_method(cImage, "apply_filter", image_filter, 1);
+  rb_define_method(cImage, "filter", image_filter, -1);
+  rb_define_method(cImage, "apply_filter", image_filter, -1);
 
   /* explicit filter methods */
   rb_define_method(cImage, "static_filter", image_static_filter, 1);
@@ -8091,6 +14893,60 @@ void Init_imlib2() {
   rb_define_method(cFilter, "constants", filter_constants, 1);
   rb_define_method(cFilter, "divisors", filter_divisors, 1);
 
+  /**************************/
+  /* define ScalePlan class */
+  /**************************/
+  cScalePlan = rb_define_class_under(mImlib2, "ScalePlan", rb_cObject);
+  rb_undef_alloc_func(cScalePlan);
+  rb_define_singleton_method(cScalePlan, "new", scale_plan_new, -1);
+  rb_define_method(cScalePlan, "initialize", scale_plan_init_m, -1);
+
+  rb_define_method(cScalePlan, "apply", scale_plan_apply, 1);
+  rb_define_method(cScalePlan, "call", scale_plan_apply, 1);
+  rb_define_method(cScalePlan, "src_size", scale_plan_src_size, 0);
+  rb_define_method(cScalePlan, "dst_size", scale_plan_dst_size, 0);
+  rb_define_method(cScalePlan, "filter", scale_plan_filter, 0);
+
+  /*************************/
+  /* define Pipeline class */
+  /*************************/
+  cPipeline = rb_define_class_under(mImlib2, "Pipeline", rb_cObject);
+  rb_undef_alloc_func(cPipeline);
+  rb_define_singleton_method(cPipeline, "new", pipeline_new, -1);
+  rb_define_method(cPipeline, "initialize", pipeline_init, -1);
+
+  rb_define_method(cPipeline, "crop", pipeline_crop, -1);
+  rb_define_method(cPipeline, "crop_scaled", pipeline_crop_scaled, -1);
+  rb_define_method(cPipeline, "scale", pipeline_scale, -1);
+  rb_define_method(cPipeline, "flip_horizontal", pipeline_flip_horizontal, 0);
+  rb_define_method(cPipeline, "flip_vertical", pipeline_flip_vertical, 0);
+  rb_define_method(cPipeline, "blur", pipeline_blur, 1);
+  rb_define_method(cPipeline, "sharpen", pipeline_sharpen, 1);
+  rb_define_method(cPipeline, "apply_color_modifier", pipeline_apply_cmod, 1);
+  rb_define_method(cPipeline, "apply_cmod", pipeline_apply_cmod, 1);
+  rb_define_method(cPipeline, "filter", pipeline_filter, 1);
+
+  rb_define_method(cPipeline, "width", pipeline_width, 0);
+  rb_define_method(cPipeline, "w", pipeline_width, 0);
+  rb_define_method(cPipeline, "height", pipeline_height, 0);
+  rb_define_method(cPipeline, "h", pipeline_height, 0);
+  rb_define_method(cPipeline, "image", pipeline_image, 0);
+
+  rb_define_method(cPipeline, "render", pipeline_render, 0);
+  rb_define_method(cPipeline, "save", pipeline_save, 1);
+
+  /*****************************/
+  /* define ScriptFilter class */
+  /*****************************/
+  cScriptFilter = rb_define_class_under(mImlib2, "ScriptFilter", rb_cObject);
+  rb_undef_alloc_func(cScriptFilter);
+  rb_define_singleton_method(cScriptFilter, "compile", script_filter_compile, 1);
+  rb_define_singleton_method(cScriptFilter, "new", script_filter_compile, 1);
+
+  rb_define_method(cScriptFilter, "apply", script_filter_apply, -1);
+  rb_define_method(cScriptFilter, "to_s", script_filter_to_s, 0);
+  rb_define_method(cScriptFilter, "arity", script_filter_arity, 0);
+
   /*********************/
   /* define Font class */
   /*********************/